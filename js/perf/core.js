@@ -47,6 +47,21 @@ let METRICS = {
     leakedAfterOverview:
     { description: "Additional malloc'ed bytes the second time the overview is shown",
       units: "B" },
+    leakedThemeNodesAfterOverview:
+    { description: "Additional bytes used by theme nodes the second time the overview is shown",
+      units: "B" },
+    leakedPaintStatesAfterOverview:
+    { description: "Additional bytes used by theme node paint states the second time the overview is shown",
+      units: "B" },
+    leakedTextureCacheAfterOverview:
+    { description: "Additional bytes held by the texture cache the second time the overview is shown",
+      units: "B" },
+    leakedAppsAfterOverview:
+    { description: "Additional bytes used by application objects the second time the overview is shown",
+      units: "B" },
+    leakedJSObjectsAfterOverview:
+    { description: "Additional GObjects of Javascript-defined types the second time the overview is shown",
+      units: "objects" },
     applicationsShowTimeFirst:
     { description: "Time to switch to applications view, first time",
       units: "us" },
@@ -55,6 +70,16 @@ let METRICS = {
       units: "us"}
 };
 
+// Per-subsystem statistics from the shell, and the metric that reports
+// how much each grew between the first and later overview show/hide cycles
+let ALLOCATION_METRICS = {
+    'st.themeNodesSize': 'leakedThemeNodesAfterOverview',
+    'st.paintStatesSize': 'leakedPaintStatesAfterOverview',
+    'st.textureCacheSize': 'leakedTextureCacheAfterOverview',
+    'shell.appsSize': 'leakedAppsAfterOverview',
+    'gjs.wrappedObjects': 'leakedJSObjectsAfterOverview'
+};
+
 let WINDOW_CONFIGS = [
     { width: 640, height: 480, alpha: false, maximized: false, count: 1,  metric: 'overviewFpsSubsequent' },
     { width: 640, height: 480, alpha: false, maximized: false, count: 5,  metric: 'overviewFps5Windows'  },
@@ -138,6 +163,8 @@ let firstOverviewUsedSize;
 let haveSwapComplete = false;
 let applicationsShowStart;
 let applicationsShowCount = 0;
+let allocationSizes = {};
+let firstAllocationSizes = {};
 
 function script_overviewShowStart(time) {
     showingOverview = true;
@@ -171,12 +198,42 @@ function script_afterShowHide(time) {
     } else {
         METRICS.leakedAfterOverview.value = mallocUsedSize - METRICS.usedAfterOverview.value;
     }
+
+    for (let name in ALLOCATION_METRICS) {
+        if (!(name in allocationSizes))
+            continue;
+
+        if (overviewShowCount == 1)
+            firstAllocationSizes[name] = allocationSizes[name];
+        else
+            METRICS[ALLOCATION_METRICS[name]].value = allocationSizes[name] - firstAllocationSizes[name];
+    }
 }
 
 function malloc_usedSize(time, bytes) {
     mallocUsedSize = bytes;
 }
 
+function st_themeNodesSize(time, bytes) {
+    allocationSizes['st.themeNodesSize'] = bytes;
+}
+
+function st_paintStatesSize(time, bytes) {
+    allocationSizes['st.paintStatesSize'] = bytes;
+}
+
+function st_textureCacheSize(time, bytes) {
+    allocationSizes['st.textureCacheSize'] = bytes;
+}
+
+function shell_appsSize(time, bytes) {
+    allocationSizes['shell.appsSize'] = bytes;
+}
+
+function gjs_wrappedObjects(time, count) {
+    allocationSizes['gjs.wrappedObjects'] = count;
+}
+
 function _frameDone(time) {
     if (showingOverview) {
         if (overviewFrames == 0)
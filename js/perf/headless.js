@@ -0,0 +1,306 @@
+// -*- mode: js; js-indent-level: 4; indent-tabs-mode: nil -*-
+
+const System = imports.system;
+
+const Main = imports.ui.main;
+const MessageTray = imports.ui.messageTray;
+const Scripting = imports.ui.scripting;
+
+// This performance script is meant to be run with
+// 'gnome-shell-perf-tool --headless', where the shell runs against a
+// virtual X server with a software GL renderer. Unlike core.js it doesn't
+// need gnome-shell-perf-helper windows, so it only exercises the shell's
+// own user interface: the overview, the app grid, search and notifications.
+// Absolute numbers on a software renderer say little about real hardware;
+// they are meant to be compared across revisions on the same machine.
+
+var METRICS = {
+    overviewLatency:
+    { description: "Time to first frame after triggering overview",
+      units: "us" },
+    overviewFps:
+    { description: "Frame rate when going to the overview",
+      units: "frames / s" },
+    appGridPageTime:
+    { description: "Average time to switch between app grid pages",
+      units: "us" },
+    appGridPageFps:
+    { description: "Frame rate while switching between app grid pages",
+      units: "frames / s" },
+    searchKeystrokeTime:
+    { description: "Average time from typing a character to updated search results",
+      units: "us" },
+    searchKeystrokeMax:
+    { description: "Longest time from typing a character to updated search results",
+      units: "us" },
+    notificationBurstTime:
+    { description: "Time to process a burst of notifications until the shell is idle",
+      units: "us" },
+    notificationBurstFps:
+    { description: "Frame rate while processing a burst of notifications",
+      units: "frames / s" },
+    damagedPixelsPerFrame:
+    { description: "Average number of pixels repainted per frame",
+      units: "pixels" },
+    usedAfterScenarios:
+    { description: "Malloc'ed bytes after running all the scenarios",
+      units: "B" }
+};
+
+const APP_GRID_PAGE_SWITCHES = 6;
+const SEARCH_STRINGS = ['settings', 'terminal', 'files'];
+const NOTIFICATION_BURST_SIZE = 20;
+
+function _hideOverview() {
+    if (!Main.overview.visible)
+        return Scripting.sleep(0);
+
+    Main.overview.hide();
+    return Scripting.waitLeisure();
+}
+
+function run() {
+    Scripting.defineScriptEvent("overviewShowStart", "Starting to show the overview");
+    Scripting.defineScriptEvent("overviewShowDone", "Overview finished showing");
+    Scripting.defineScriptEvent("pageSwitchStart", "Starting to switch app grid page");
+    Scripting.defineScriptEvent("pageSwitchDone", "Done switching app grid page");
+    Scripting.defineScriptEvent("keystrokeStart", "Typed a character into the search entry");
+    Scripting.defineScriptEvent("keystrokeDone", "Search results updated after a keystroke");
+    Scripting.defineScriptEvent("notificationBurstStart", "Starting a burst of notifications");
+    Scripting.defineScriptEvent("notificationBurstDone", "Done with a burst of notifications");
+    Scripting.defineScriptEvent("scenariosDone", "Done running all the scenarios");
+
+    // Enable recording of timestamps for different points in the frame cycle
+    global.frame_timestamps = true;
+    // And of how much of the stage each frame repaints
+    global.frame_damage = true;
+
+    Main.overview.connect('shown', function() {
+                              Scripting.scriptEvent('overviewShowDone');
+                          });
+
+    yield Scripting.sleep(1000);
+    yield _hideOverview();
+
+    // Show the overview twice; the first time to load icons and
+    // textures, the second time to get a clean set of numbers.
+    for (let i = 0; i < 2; i++) {
+        Scripting.scriptEvent('overviewShowStart');
+        Main.overview.show();
+        yield Scripting.waitLeisure();
+
+        if (i == 0) {
+            yield _hideOverview();
+            System.gc();
+            yield Scripting.sleep(1000);
+        }
+    }
+
+    // Walk forward through the app grid pages and back again
+    let appDisplay = Main.overview.viewSelector.appDisplay;
+    let nPages = appDisplay.nPages;
+    let pages = [];
+    for (let page = 1; page < nPages; page++)
+        pages.push(page);
+    for (let page = nPages - 2; page >= 0; page--)
+        pages.push(page);
+    if (pages.length == 0)
+        pages.push(0);
+
+    for (let i = 0; i < APP_GRID_PAGE_SWITCHES; i++) {
+        Scripting.scriptEvent('pageSwitchStart');
+        appDisplay.goToPage(pages[i % pages.length]);
+        yield Scripting.waitLeisure();
+        Scripting.scriptEvent('pageSwitchDone');
+    }
+    appDisplay.goToPage(0);
+    yield Scripting.waitLeisure();
+
+    let entry = Main.overview.viewSelector.searchEntry;
+    for (let i = 0; i < SEARCH_STRINGS.length; i++) {
+        let text = SEARCH_STRINGS[i];
+        Main.overview.focusSearch();
+
+        for (let k = 1; k <= text.length; k++) {
+            Scripting.scriptEvent('keystrokeStart');
+            entry.clutter_text.set_text(text.slice(0, k));
+            yield Scripting.waitLeisure();
+            Scripting.scriptEvent('keystrokeDone');
+        }
+
+        entry.resetSearch();
+        yield Scripting.waitLeisure();
+    }
+
+    yield _hideOverview();
+    yield Scripting.sleep(1000);
+
+    let source = new MessageTray.SystemNotificationSource();
+    Main.messageTray.add(source);
+
+    Scripting.scriptEvent('notificationBurstStart');
+    for (let i = 0; i < NOTIFICATION_BURST_SIZE; i++) {
+        let notification = new MessageTray.Notification(source,
+                                                        "Notification %d".format(i),
+                                                        "Body of notification %d".format(i));
+        notification.setTransient(true);
+        source.notify(notification);
+    }
+    yield Scripting.waitLeisure();
+    Scripting.scriptEvent('notificationBurstDone');
+
+    source.destroy();
+
+    System.gc();
+    yield Scripting.sleep(1000);
+    Scripting.collectStatistics();
+    Scripting.scriptEvent('scenariosDone');
+}
+
+let mallocUsedSize = 0;
+
+// The scenario currently counting frames, if any, and the time it started
+let currentScenario = null;
+let scenarioStart = 0;
+let scenarioFrames = 0;
+let scenarioLatency = -1;
+
+let overviewShowCount = 0;
+let finishedShowingOverview = false;
+
+let pageSwitchCount = 0;
+let pageSwitchTotalTime = 0;
+let pageSwitchTotalFrames = 0;
+
+let keystrokeCount = 0;
+let keystrokeTotalTime = 0;
+let keystrokeMaxTime = 0;
+
+let haveSwapComplete = false;
+
+let damagedFrames = 0;
+let damagedPixels = 0;
+
+function _startScenario(name, time) {
+    currentScenario = name;
+    scenarioStart = time;
+    scenarioFrames = 0;
+    scenarioLatency = -1;
+}
+
+function _endScenario(time) {
+    currentScenario = null;
+
+    // If we see a start frame and an end frame, that would
+    // be 1 frame for a FPS computation, hence the '- 1'
+    let dt = (time - (scenarioStart + Math.max(scenarioLatency, 0))) / 1000000;
+    return dt > 0 ? Math.max(scenarioFrames - 1, 0) / dt : 0;
+}
+
+function script_overviewShowStart(time) {
+    _startScenario('overview', time);
+    finishedShowingOverview = false;
+}
+
+function script_overviewShowDone(time) {
+    // We've set up the state at the end of the zoom out, but we
+    // need to wait for one more frame to paint before we count
+    // ourselves as done.
+    finishedShowingOverview = true;
+}
+
+function script_pageSwitchStart(time) {
+    _startScenario('pageSwitch', time);
+}
+
+function script_pageSwitchDone(time) {
+    pageSwitchCount++;
+    pageSwitchTotalTime += time - scenarioStart;
+    pageSwitchTotalFrames += scenarioFrames;
+    currentScenario = null;
+}
+
+function script_keystrokeStart(time) {
+    _startScenario('keystroke', time);
+}
+
+function script_keystrokeDone(time) {
+    let elapsed = time - scenarioStart;
+
+    keystrokeCount++;
+    keystrokeTotalTime += elapsed;
+    keystrokeMaxTime = Math.max(keystrokeMaxTime, elapsed);
+    currentScenario = null;
+}
+
+function script_notificationBurstStart(time) {
+    _startScenario('notificationBurst', time);
+}
+
+function script_notificationBurstDone(time) {
+    METRICS.notificationBurstTime.value = time - scenarioStart;
+    METRICS.notificationBurstFps.value = _endScenario(time);
+}
+
+function script_scenariosDone(time) {
+    METRICS.usedAfterScenarios.value = mallocUsedSize;
+}
+
+function malloc_usedSize(time, bytes) {
+    mallocUsedSize = bytes;
+}
+
+function clutter_stageDamage(time, pixels) {
+    damagedFrames++;
+    damagedPixels += pixels;
+}
+
+function _frameDone(time) {
+    if (currentScenario == null)
+        return;
+
+    if (scenarioFrames == 0)
+        scenarioLatency = time - scenarioStart;
+    scenarioFrames++;
+
+    if (currentScenario == 'overview' && finishedShowingOverview) {
+        finishedShowingOverview = false;
+        overviewShowCount++;
+
+        let latency = scenarioLatency;
+        let fps = _endScenario(time);
+        if (overviewShowCount == 2) {
+            METRICS.overviewLatency.value = latency;
+            METRICS.overviewFps.value = fps;
+        }
+    }
+}
+
+function glx_swapComplete(time, swapTime) {
+    haveSwapComplete = true;
+
+    _frameDone(swapTime);
+}
+
+function clutter_stagePaintDone(time) {
+    // Software renderers on a virtual X server usually don't send
+    // GLXBufferSwapComplete events, so this is the common case here;
+    // see the comment in core.js.
+    if (!haveSwapComplete)
+        _frameDone(time);
+}
+
+function finish() {
+    if (pageSwitchCount > 0) {
+        METRICS.appGridPageTime.value = pageSwitchTotalTime / pageSwitchCount;
+        METRICS.appGridPageFps.value = pageSwitchTotalFrames / (pageSwitchTotalTime / 1000000);
+    }
+
+    if (damagedFrames > 0)
+        METRICS.damagedPixelsPerFrame.value = damagedPixels / damagedFrames;
+
+    if (keystrokeCount > 0) {
+        METRICS.searchKeystrokeTime.value = keystrokeTotalTime / keystrokeCount;
+        METRICS.searchKeystrokeMax.value = keystrokeMaxTime;
+    }
+}
@@ -45,6 +45,34 @@ function _createWindowClone(window, size) {
                                y_expand: true });
 };
 
+function _createThumbnailActor(content) {
+    let [, width, height] = content.get_preferred_size();
+    return new Clutter.Actor({ content: content,
+                               width: width,
+                               height: height,
+                               x_align: Clutter.ActorAlign.CENTER,
+                               y_align: Clutter.ActorAlign.CENTER,
+                               x_expand: true,
+                               y_expand: true });
+};
+
+// Takes the previews of all windows at once, straight from their
+// textures, so opening the switcher doesn't repaint every window the
+// way clones do. Returns a map from windows to preview actors; clones
+// stand in where thumbnails can't be taken.
+function _createWindowThumbnails(windows, size) {
+    let windowActors = windows.map(w => w.get_compositor_private()).filter(a => a);
+    let contents = windowActors.length > 0 ? Shell.util_get_window_thumbnails(windowActors, size) : [];
+
+    let thumbnails = new Map();
+    windowActors.forEach((windowActor, i) => {
+        let thumbnail = i < contents.length ? _createThumbnailActor(contents[i])
+                                            : _createWindowClone(windowActor, size);
+        thumbnails.set(windowActor.get_meta_window(), thumbnail);
+    });
+    return thumbnails;
+};
+
 function getWindows(workspace) {
     // We ignore skip-taskbar windows in switchers, but if they are attached
     // to their parent, their position in the MRU list may be more appropriate
@@ -834,12 +862,12 @@ var ThumbnailList = new Lang.Class({
         let binHeight = availHeight + this._items[0].get_theme_node().get_vertical_padding() + this.actor.get_theme_node().get_vertical_padding() - spacing;
         binHeight = Math.min(thumbnailSize, binHeight);
 
+        let thumbnails = _createWindowThumbnails(this._windows, thumbnailSize);
         for (let i = 0; i < this._thumbnailBins.length; i++) {
-            let mutterWindow = this._windows[i].get_compositor_private();
-            if (!mutterWindow)
+            let clone = thumbnails.get(this._windows[i]);
+            if (!clone)
                 continue;
 
-            let clone = _createWindowClone(mutterWindow, thumbnailSize);
             this._thumbnailBins[i].set_height(binHeight);
             this._thumbnailBins[i].add_actor(clone);
             this._clones.push(clone);
@@ -853,7 +881,7 @@ var ThumbnailList = new Lang.Class({
 var WindowIcon = new Lang.Class({
     Name: 'WindowIcon',
 
-    _init: function(window, mode) {
+    _init: function(window, mode, thumbnail) {
         this.window = window;
 
         this.actor = new St.BoxLayout({ style_class: 'alt-tab-app',
@@ -876,12 +904,12 @@ var WindowIcon = new Lang.Class({
         switch (mode) {
             case AppIconMode.THUMBNAIL_ONLY:
                 size = WINDOW_PREVIEW_SIZE;
-                this._icon.add_actor(_createWindowClone(mutterWindow, size * scaleFactor));
+                this._icon.add_actor(thumbnail || _createWindowClone(mutterWindow, size * scaleFactor));
                 break;
 
             case AppIconMode.BOTH:
                 size = WINDOW_PREVIEW_SIZE;
-                this._icon.add_actor(_createWindowClone(mutterWindow, size * scaleFactor));
+                this._icon.add_actor(thumbnail || _createWindowClone(mutterWindow, size * scaleFactor));
 
                 if (this.app)
                     this._icon.add_actor(this._createAppIcon(this.app,
@@ -921,9 +949,15 @@ var WindowList = new Lang.Class({
         this.windows = windows;
         this.icons = [];
 
+        let thumbnails = new Map();
+        if (mode != AppIconMode.APP_ICON_ONLY) {
+            let scaleFactor = St.ThemeContext.get_for_stage(global.stage).scale_factor;
+            thumbnails = _createWindowThumbnails(windows, WINDOW_PREVIEW_SIZE * scaleFactor);
+        }
+
         for (let i = 0; i < windows.length; i++) {
             let win = windows[i];
-            let icon = new WindowIcon(win, mode);
+            let icon = new WindowIcon(win, mode, thumbnails.get(win));
 
             this.addItem(icon.actor, icon.label);
             this.icons.push(icon);
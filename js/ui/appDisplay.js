@@ -52,6 +52,9 @@ var FOLDER_SUBICON_FRACTION = .4;
 
 var MIN_FREQUENT_APPS_COUNT = 3;
 
+// Number of most used apps to read ahead when the app grid is shown
+var PRELAUNCH_APPS_COUNT = 2;
+
 var INDICATORS_BASE_TIME = 0.25;
 var INDICATORS_ANIMATION_DELAY = 0.125;
 var INDICATORS_ANIMATION_MAX_TIME = 0.75;
@@ -713,6 +716,7 @@ var AllView = new Lang.Class({
                     this._keyPressEventId =
                         global.stage.connect('key-press-event',
                                              Lang.bind(this, this._onKeyPressEvent));
+                    this._prelaunchMostUsed();
                 } else {
                     if (this._keyPressEventId)
                         global.stage.disconnect(this._keyPressEventId);
@@ -893,6 +897,10 @@ var AllView = new Lang.Class({
         return this._grid.getPageY(this._grid.currentPage);
     },
 
+    get nPages() {
+        return this._grid.nPages();
+    },
+
     goToPage: function(pageNumber) {
         pageNumber = clamp(pageNumber, 0, this._grid.nPages() - 1);
 
@@ -999,6 +1007,21 @@ var AllView = new Lang.Class({
         this._panning = false;
     },
 
+    _prelaunchMostUsed: function() {
+        // The app the user is about to launch is likely among the ones
+        // they use the most, so have those start warm
+        let mostUsed = Shell.AppUsage.get_default().get_most_used('');
+        let count = 0;
+
+        for (let i = 0; i < mostUsed.length && count < PRELAUNCH_APPS_COUNT; i++) {
+            if (mostUsed[i].state != Shell.AppState.STOPPED)
+                continue;
+
+            mostUsed[i].prelaunch();
+            count++;
+        }
+    },
+
     _onKeyPressEvent: function(actor, event) {
         if (this._displayingPopup)
             return Clutter.EVENT_STOP;
@@ -1404,13 +1427,9 @@ var FrequentView = new Lang.Class({
         }));
     },
 
-    hasUsefulData: function() {
-        return this._usage.get_most_used("").length >= MIN_FREQUENT_APPS_COUNT;
-    },
-
     _loadApps: function() {
         let mostUsed = this._usage.get_most_used ("");
-        let hasUsefulData = this.hasUsefulData();
+        let hasUsefulData = mostUsed.length >= MIN_FREQUENT_APPS_COUNT;
         this._noFrequentAppsLabel.visible = !hasUsefulData;
         if(!hasUsefulData)
             return;
@@ -1497,6 +1516,14 @@ var AppDisplay = new Lang.Class({
         this._allView.selectApp(id);
     },
 
+    goToPage: function(pageNumber) {
+        this._allView.goToPage(pageNumber);
+    },
+
+    get nPages() {
+        return this._allView.nPages;
+    },
+
     adaptToSize: function(width, height) {
         return this._allView.adaptToSize(width, height);
     },
@@ -2639,6 +2666,10 @@ var AppIcon = new Lang.Class({
         this._iconContainer.add_child(this._dot);
 
         this.actor.connect('destroy', Lang.bind(this, this._onDestroy));
+        this.actor.connect('notify::hover', Lang.bind(this, function() {
+            if (this.actor.hover)
+                this.app.prelaunch();
+        }));
 
         this._stateChangedId = this.app.connect('notify::state', Lang.bind(this,
             function () {
@@ -361,6 +361,46 @@ var WindowList = new Lang.Class({
 });
 Signals.addSignalMethods(WindowList.prototype);
 
+var Memory = new Lang.Class({
+    Name: 'Memory',
+
+    _init: function(lookingGlass) {
+        this._lookingGlass = lookingGlass;
+        this.actor = new St.BoxLayout({ vertical: true,
+                                        name: 'lookingGlassMemory' });
+
+        let refreshButton = new St.Button({ style_class: 'lg-memory-refresh',
+                                            label: 'Refresh',
+                                            x_align: St.Align.START });
+        refreshButton.connect('clicked', Lang.bind(this, this._updateStatistics));
+        this.actor.add(refreshButton, { x_fill: false });
+
+        this._statisticsList = new St.BoxLayout({ vertical: true,
+                                                  style_class: 'lg-memory-list' });
+        this.actor.add(this._statisticsList);
+
+        // Refresh whenever the tab is shown
+        this.actor.connect('notify::mapped', Lang.bind(this, function() {
+            if (this.actor.mapped)
+                this._updateStatistics();
+        }));
+    },
+
+    _updateStatistics: function() {
+        this._statisticsList.destroy_all_children();
+
+        let statistics = Shell.PerfLog.get_default().get_statistics().deep_unpack();
+        let names = Object.keys(statistics).sort();
+        for (let i = 0; i < names.length; i++) {
+            let box = new St.BoxLayout({ style_class: 'lg-memory-statistic' });
+            this._statisticsList.add(box);
+            box.add(new St.Label({ style_class: 'lg-memory-name',
+                                   text: names[i] }), { expand: true });
+            box.add(new St.Label({ text: statistics[names[i]].toString() }));
+        }
+    }
+});
+
 var ObjInspector = new Lang.Class({
     Name: 'ObjInspector',
 
@@ -880,6 +920,9 @@ var LookingGlass = new Lang.Class({
         this._extensions = new Extensions(this);
         notebook.appendPage('Extensions', this._extensions.actor);
 
+        this._memory = new Memory(this);
+        notebook.appendPage('Memory', this._memory.actor);
+
         this._entry.clutter_text.connect('activate', Lang.bind(this, function (o, e) {
             // Hide any completions we are currently showing
             this._hideCompletions();
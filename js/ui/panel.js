@@ -347,7 +347,7 @@ var AppMenuButton = new Lang.Class({
 
             menu = new RemoteMenu.RemoteMenu(this.actor, this._targetApp.menu, this._targetApp.action_group);
             menu.connect('activate', Lang.bind(this, function() {
-                let win = this._targetApp.get_windows()[0];
+                let win = this._targetApp.get_window(0);
                 win.check_alive(global.get_current_time());
             }));
 
@@ -1,5 +1,6 @@
 // -*- mode: js; js-indent-level: 4; indent-tabs-mode: nil -*-
 
+const Gdk = imports.gi.Gdk;
 const Gio = imports.gi.Gio;
 const GLib = imports.gi.GLib;
 const Lang = imports.lang;
@@ -26,9 +27,19 @@ const ScreencastIface = '<node> \
     <arg type="b" direction="out" name="success"/> \
     <arg type="s" direction="out" name="filename_used"/> \
 </method> \
+<method name="ScreencastMonitors"> \
+    <arg type="s" direction="in" name="file_template"/> \
+    <arg type="a{sv}" direction="in" name="options"/> \
+    <arg type="b" direction="out" name="success"/> \
+    <arg type="as" direction="out" name="filenames_used"/> \
+</method> \
 <method name="StopScreencast"> \
     <arg type="b" direction="out" name="success"/> \
 </method> \
+<signal name="QualityChanged"> \
+    <arg type="i" name="level"/> \
+    <arg type="i" name="framerate"/> \
+</signal> \
 </interface> \
 </node>';
 
@@ -52,18 +63,45 @@ var ScreencastService = new Lang.Class({
         return this._recorders.size > 0;
     },
 
-    _ensureRecorderForSender: function(sender) {
-        let recorder = this._recorders.get(sender);
-        if (!recorder) {
-            recorder = new Shell.Recorder({ stage: global.stage,
-                                            screen: global.screen });
-            recorder._watchNameId =
-                Gio.bus_watch_name(Gio.BusType.SESSION, sender, 0, null,
-                                   Lang.bind(this, this._onNameVanished));
-            this._recorders.set(sender, recorder);
-            this.emit('updated');
+    get isDegraded() {
+        for (let recording of this._recorders.values())
+            if (recording.recorders.some(r => r.quality_level > 0))
+                return true;
+        return false;
+    },
+
+    // Returns the recorders for a new recording by @sender, or null
+    // if it is recording already
+    _createRecordersForSender: function(sender, nRecorders) {
+        let recording = this._recorders.get(sender);
+        if (recording) {
+            // Pipelines that stopped on their own, on an error or at
+            // the end of the stream, don't keep the sender from
+            // recording again
+            if (recording.recorders.some(r => r.is_recording()))
+                return null;
+            this._stopRecordingForSender(sender);
         }
-        return recorder;
+
+        let recorders = [];
+        for (let i = 0; i < nRecorders; i++) {
+            let recorder = new Shell.Recorder({ stage: global.stage,
+                                                screen: global.screen });
+            recorder._qualityChangedId =
+                recorder.connect('notify::quality-level', Lang.bind(this, function() {
+                    this._onQualityChanged(sender);
+                }));
+            recorders.push(recorder);
+        }
+
+        let watchNameId =
+            Gio.bus_watch_name(Gio.BusType.SESSION, sender, 0, null,
+                               Lang.bind(this, this._onNameVanished));
+        this._recorders.set(sender, { recorders: recorders,
+                                      watchNameId: watchNameId });
+        this.emit('updated');
+
+        return recorders;
     },
 
     _sessionUpdated: function() {
@@ -74,17 +112,42 @@ var ScreencastService = new Lang.Class({
             this._stopRecordingForSender(sender);
     },
 
+    _onQualityChanged: function(sender) {
+        let recording = this._recorders.get(sender);
+        if (!recording)
+            return;
+
+        // With a recorder per monitor, report the one that fell
+        // furthest behind
+        let recorder = recording.recorders.reduce(function(worst, r) {
+            return r.quality_level > worst.quality_level ? r : worst;
+        });
+
+        // Only the client that started the recording is interested
+        Gio.DBus.session.emit_signal(sender,
+                                     '/org/gnome/Shell/Screencast',
+                                     'org.gnome.Shell.Screencast',
+                                     'QualityChanged',
+                                     GLib.Variant.new('(ii)', [recorder.quality_level,
+                                                               recorder.capture_framerate]));
+        this.emit('updated');
+    },
+
     _onNameVanished: function(connection, name) {
         this._stopRecordingForSender(name);
     },
 
     _stopRecordingForSender: function(sender) {
-        let recorder = this._recorders.get(sender);
-        if (!recorder)
+        let recording = this._recorders.get(sender);
+        if (!recording)
             return false;
 
-        Gio.bus_unwatch_name(recorder._watchNameId);
-        recorder.close();
+        Gio.bus_unwatch_name(recording.watchNameId);
+        for (let recorder of recording.recorders) {
+            recorder.disconnect(recorder._qualityChangedId);
+            if (recorder.is_recording())
+                recorder.close();
+        }
         this._recorders.delete(sender);
         this.emit('updated');
 
@@ -92,15 +155,18 @@ var ScreencastService = new Lang.Class({
     },
 
     _applyOptionalParameters: function(recorder, options) {
+        let params = {};
         for (let option in options)
-            options[option] = options[option].deep_unpack();
-
-        if (options['pipeline'])
-            recorder.set_pipeline(options['pipeline']);
-        if (options['framerate'])
-            recorder.set_framerate(options['framerate']);
-        if ('draw-cursor' in options)
-            recorder.set_draw_cursor(options['draw-cursor']);
+            params[option] = options[option].deep_unpack();
+
+        if (params['pipeline'])
+            recorder.set_pipeline(params['pipeline']);
+        if (params['framerate'])
+            recorder.set_framerate(params['framerate']);
+        if ('draw-cursor' in params)
+            recorder.set_draw_cursor(params['draw-cursor']);
+        if ('gpu-convert' in params)
+            recorder.set_gpu_convert(params['gpu-convert']);
     },
 
     ScreencastAsync: function(params, invocation) {
@@ -112,8 +178,9 @@ var ScreencastService = new Lang.Class({
         }
 
         let sender = invocation.get_sender();
-        let recorder = this._ensureRecorderForSender(sender);
-        if (!recorder.is_recording()) {
+        let recorders = this._createRecordersForSender(sender, 1);
+        if (recorders) {
+            let recorder = recorders[0];
             let [fileTemplate, options] = params;
 
             recorder.set_file_template(fileTemplate);
@@ -136,20 +203,21 @@ var ScreencastService = new Lang.Class({
         }
 
         let sender = invocation.get_sender();
-        let recorder = this._ensureRecorderForSender(sender);
-
-        if (!recorder.is_recording()) {
-            let [x, y, width, height, fileTemplate, options] = params;
-
-            if (x < 0 || y < 0 ||
-                width <= 0 || height <= 0 ||
-                x + width > global.screen_width ||
-                y + height > global.screen_height) {
-                invocation.return_error_literal(Gio.IOErrorEnum,
-                                                Gio.IOErrorEnum.CANCELLED,
-                                                "Invalid params");
-                return;
-            }
+        let [x, y, width, height, fileTemplate, options] = params;
+
+        if (x < 0 || y < 0 ||
+            width <= 0 || height <= 0 ||
+            x + width > global.screen_width ||
+            y + height > global.screen_height) {
+            invocation.return_error_literal(Gio.IOErrorEnum,
+                                            Gio.IOErrorEnum.CANCELLED,
+                                            "Invalid params");
+            return;
+        }
+
+        let recorders = this._createRecordersForSender(sender, 1);
+        if (recorders) {
+            let recorder = recorders[0];
 
             recorder.set_file_template(fileTemplate);
             recorder.set_area(x, y, width, height);
@@ -163,6 +231,82 @@ var ScreencastService = new Lang.Class({
         invocation.return_value(GLib.Variant.new('(bs)', returnValue));
     },
 
+    _getMonitorFramerate: function(monitor) {
+        let display = Gdk.Display.get_default();
+        let gdkMonitor = display.get_monitor_at_point(monitor.x + monitor.width / 2,
+                                                      monitor.y + monitor.height / 2);
+        let refreshRate = gdkMonitor ? gdkMonitor.get_refresh_rate() : 0;
+
+        // In millihertz, or 0 if unknown
+        return refreshRate > 0 ? Math.round(refreshRate / 1000) : 0;
+    },
+
+    // Gives each monitor its own file, replacing %m in the template
+    // with the monitor number, or adding it before the extension
+    _getMonitorFileTemplate: function(fileTemplate, index) {
+        let found = false;
+        let result = fileTemplate.replace(/%(.)/g, function(escape, c) {
+            if (c != 'm')
+                return escape;
+            found = true;
+            return String(index);
+        });
+        if (found)
+            return result;
+
+        let dot = fileTemplate.lastIndexOf('.');
+        if (dot <= fileTemplate.lastIndexOf('/'))
+            return '%s-%d'.format(fileTemplate, index);
+        return '%s-%d%s'.format(fileTemplate.slice(0, dot), index, fileTemplate.slice(dot));
+    },
+
+    ScreencastMonitorsAsync: function(params, invocation) {
+        let returnValue = [false, []];
+        if (!Main.sessionMode.allowScreencast ||
+            this._lockdownSettings.get_boolean('disable-save-to-disk')) {
+            invocation.return_value(GLib.Variant.new('(bas)', returnValue));
+            return;
+        }
+
+        let sender = invocation.get_sender();
+        let monitors = Main.layoutManager.monitors;
+        let recorders = this._createRecordersForSender(sender, monitors.length);
+        if (recorders) {
+            let [fileTemplate, options] = params;
+            let startTime = GLib.get_monotonic_time();
+            let fileNames = [];
+
+            for (let i = 0; i < monitors.length; i++) {
+                let monitor = monitors[i];
+                let recorder = recorders[i];
+
+                recorder.set_file_template(this._getMonitorFileTemplate(fileTemplate, i));
+                recorder.set_area(monitor.x, monitor.y, monitor.width, monitor.height);
+                recorder.set_native_scale(true);
+                recorder.set_start_time(startTime);
+
+                let framerate = this._getMonitorFramerate(monitor);
+                if (framerate > 0)
+                    recorder.set_framerate(framerate);
+
+                // An explicit framerate option wins over the refresh rate
+                this._applyOptionalParameters(recorder, options);
+
+                let [success, fileName] = recorder.record();
+                if (!success)
+                    break;
+                fileNames.push(fileName ? fileName : '');
+            }
+
+            if (fileNames.length == monitors.length)
+                returnValue = [true, fileNames];
+            else
+                this._stopRecordingForSender(sender);
+        }
+
+        invocation.return_value(GLib.Variant.new('(bas)', returnValue));
+    },
+
     StopScreencastAsync: function(params, invocation) {
         let success = this._stopRecordingForSender(invocation.get_sender());
         invocation.return_value(GLib.Variant.new('(b)', [success]));
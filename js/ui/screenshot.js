@@ -16,6 +16,12 @@ const Lightbox = imports.ui.lightbox;
 const Main = imports.ui.main;
 const Tweener = imports.ui.tweener;
 
+// zlib level for Shell.Screenshot's fast mode
+const FAST_COMPRESSION_LEVEL = 1;
+
+// Largest thumbnail ScreenThumbnailer allows
+const MAX_THUMBNAIL_SIZE = 4096;
+
 const ScreenshotIface = '<node> \
 <interface name="org.gnome.Shell.Screenshot"> \
 <method name="ScreenshotArea"> \
@@ -43,6 +49,21 @@ const ScreenshotIface = '<node> \
     <arg type="b" direction="out" name="success"/> \
     <arg type="s" direction="out" name="filename_used"/> \
 </method> \
+<method name="ScreenshotToFd"> \
+    <arg type="a(iiii)" direction="in" name="regions"/> \
+    <arg type="u" direction="in" name="downscale"/> \
+    <arg type="b" direction="in" name="include_cursor"/> \
+    <arg type="h" direction="out" name="fd"/> \
+    <arg type="u" direction="out" name="format"/> \
+    <arg type="a(uuut)" direction="out" name="frames"/> \
+</method> \
+<method name="StartThumbnails"> \
+    <arg type="u" direction="in" name="interval"/> \
+    <arg type="u" direction="in" name="max_size"/> \
+    <arg type="h" direction="out" name="fd"/> \
+</method> \
+<method name="StopThumbnails"/> \
+<signal name="ThumbnailUpdated"/> \
 <method name="SelectArea"> \
     <arg type="i" direction="out" name="x"/> \
     <arg type="i" direction="out" name="y"/> \
@@ -66,21 +87,46 @@ var ScreenshotService = new Lang.Class({
         this._dbusImpl.export(Gio.DBus.session, '/org/gnome/Shell/Screenshot');
 
         this._screenShooter = new Map();
+        this._thumbnailers = new Map();
 
         this._lockdownSettings = new Gio.Settings({ schema_id: 'org.gnome.desktop.lockdown' });
 
         Gio.DBus.session.own_name('org.gnome.Shell.Screenshot', Gio.BusNameOwnerFlags.REPLACE, null, null);
     },
 
-    _createScreenshot: function(invocation) {
+    // Files in the temporary or cache directories are only passed on,
+    // like the clipboard captures of gnome-screenshot; speed matters
+    // more for those than size.
+    _compressionLevelFor: function(filename) {
+        if (!GLib.path_is_absolute(filename))
+            return -1;
+
+        let file = Gio.File.new_for_path(filename);
+        let transientDirs = [GLib.get_tmp_dir(), GLib.get_user_cache_dir()];
+        if (transientDirs.some(dir => file.has_prefix(Gio.File.new_for_path(dir))))
+            return FAST_COMPRESSION_LEVEL;
+
+        return -1;
+    },
+
+    // Screenshots to memory pass a null filename, and get an error
+    // instead of the (bs) reply when refused
+    _createScreenshot: function(invocation, filename) {
         let sender = invocation.get_sender();
         if (this._screenShooter.has(sender) ||
             this._lockdownSettings.get_boolean('disable-save-to-disk')) {
-            invocation.return_value(GLib.Variant.new('(bs)', [false, '']));
+            if (filename === null)
+                invocation.return_error_literal(Gio.IOErrorEnum,
+                                                Gio.IOErrorEnum.PERMISSION_DENIED,
+                                                "Screenshot not allowed");
+            else
+                invocation.return_value(GLib.Variant.new('(bs)', [false, '']));
             return null;
         }
 
         let shooter = new Shell.Screenshot();
+        if (filename)
+            shooter.compression_level = this._compressionLevelFor(filename);
         shooter._watchNameId =
                         Gio.bus_watch_name(Gio.BusType.SESSION, sender, 0, null,
                                            Lang.bind(this, this._onNameVanished));
@@ -153,7 +199,7 @@ var ScreenshotService = new Lang.Class({
                                             "Invalid params");
             return;
         }
-        let screenshot = this._createScreenshot(invocation);
+        let screenshot = this._createScreenshot(invocation, filename);
         if (!screenshot)
             return;
         screenshot.screenshot_area (x, y, width, height, filename,
@@ -163,7 +209,7 @@ var ScreenshotService = new Lang.Class({
 
     ScreenshotWindowAsync : function (params, invocation) {
         let [include_frame, include_cursor, flash, filename] = params;
-        let screenshot = this._createScreenshot(invocation);
+        let screenshot = this._createScreenshot(invocation, filename);
         if (!screenshot)
             return;
         screenshot.screenshot_window (include_frame, include_cursor, filename,
@@ -173,7 +219,7 @@ var ScreenshotService = new Lang.Class({
 
     ScreenshotAsync : function (params, invocation) {
         let [include_cursor, flash, filename] = params;
-        let screenshot = this._createScreenshot(invocation);
+        let screenshot = this._createScreenshot(invocation, filename);
         if (!screenshot)
             return;
         screenshot.screenshot(include_cursor, filename,
@@ -181,6 +227,101 @@ var ScreenshotService = new Lang.Class({
                                     flash, invocation));
     },
 
+    _onFramesComplete: function(obj, result, fdList, frames, invocation) {
+        this._removeShooterForSender(invocation.get_sender());
+
+        if (!result) {
+            invocation.return_error_literal(Gio.IOErrorEnum,
+                                            Gio.IOErrorEnum.FAILED,
+                                            "Screenshot failed");
+            return;
+        }
+
+        invocation.return_value_with_unix_fd_list(frames, fdList);
+    },
+
+    ScreenshotToFdAsync: function(params, invocation) {
+        let [regions, downscale, includeCursor] = params;
+        regions = regions.map(r => this._scaleArea(...r));
+        if (!regions.every(r => this._checkArea(...r)) || downscale < 1) {
+            invocation.return_error_literal(Gio.IOErrorEnum,
+                                            Gio.IOErrorEnum.CANCELLED,
+                                            "Invalid params");
+            return;
+        }
+        let screenshot = this._createScreenshot(invocation, null);
+        if (!screenshot)
+            return;
+        screenshot.screenshot_to_fd(GLib.Variant.new('a(iiii)', regions),
+                                    downscale, includeCursor,
+                                    Lang.bind(this, this._onFramesComplete,
+                                              invocation));
+    },
+
+    _stopThumbnails: function(sender) {
+        let thumbnailer = this._thumbnailers.get(sender);
+        if (!thumbnailer)
+            return;
+
+        Gio.bus_unwatch_name(thumbnailer._watchNameId);
+        thumbnailer.stop();
+        this._thumbnailers.delete(sender);
+    },
+
+    StartThumbnailsAsync: function(params, invocation) {
+        let [interval, maxSize] = params;
+        let sender = invocation.get_sender();
+
+        if (interval < 1 || maxSize < 1 || maxSize > MAX_THUMBNAIL_SIZE) {
+            invocation.return_error_literal(Gio.IOErrorEnum,
+                                            Gio.IOErrorEnum.CANCELLED,
+                                            "Invalid params");
+            return;
+        }
+
+        if (this._lockdownSettings.get_boolean('disable-save-to-disk')) {
+            invocation.return_error_literal(Gio.IOErrorEnum,
+                                            Gio.IOErrorEnum.PERMISSION_DENIED,
+                                            "Screenshot not allowed");
+            return;
+        }
+
+        // Restarting with other parameters gives a new shared memory
+        this._stopThumbnails(sender);
+
+        let thumbnailer = new Shell.ScreenThumbnailer({ stage: global.stage,
+                                                        interval: interval,
+                                                        max_size: maxSize });
+        try {
+            thumbnailer.start();
+        } catch(e) {
+            invocation.return_gerror(e);
+            return;
+        }
+
+        // Only the client that asked for thumbnails gets woken up
+        thumbnailer.connect('updated', () => {
+            Gio.DBus.session.emit_signal(sender,
+                                         '/org/gnome/Shell/Screenshot',
+                                         'org.gnome.Shell.Screenshot',
+                                         'ThumbnailUpdated', null);
+        });
+        thumbnailer._watchNameId =
+            Gio.bus_watch_name(Gio.BusType.SESSION, sender, 0, null,
+                               () => { this._stopThumbnails(sender); });
+        this._thumbnailers.set(sender, thumbnailer);
+
+        let fdList = new Gio.UnixFDList();
+        fdList.append(thumbnailer.get_fd());
+        invocation.return_value_with_unix_fd_list(GLib.Variant.new('(h)', [0]),
+                                                  fdList);
+    },
+
+    StopThumbnailsAsync: function(params, invocation) {
+        this._stopThumbnails(invocation.get_sender());
+        invocation.return_value(null);
+    },
+
     SelectAreaAsync: function (params, invocation) {
         let selectArea = new SelectArea();
         selectArea.show();
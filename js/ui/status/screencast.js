@@ -22,5 +22,11 @@ var Indicator = new Lang.Class({
 
     _sync: function() {
         this._indicator.visible = Main.screencastService.isRecording;
+
+        // Recording quality was lowered to keep up with encoding
+        if (Main.screencastService.isDegraded)
+            this._indicator.add_style_pseudo_class('degraded');
+        else
+            this._indicator.remove_style_pseudo_class('degraded');
     },
 });
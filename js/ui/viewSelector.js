@@ -777,6 +777,10 @@ var ViewSelector = new Lang.Class({
             this._entry.grab_key_focus();
     },
 
+    get searchEntry() {
+        return this._entry;
+    },
+
     _addPage: function(actor, name, a11yIcon, params) {
         params = Params.parse(params, { a11yFocus: null });
 
@@ -46,8 +46,7 @@ var WorkspaceMonitor = new Lang.Class({
             if (apps.length > 1)
                 return false;
 
-            let windows = apps[0].get_windows();
-            return (windows.length == 1) && (windows[0] == win);
+            return (apps[0].get_n_windows() == 1) && (apps[0].get_window(0) == win);
         };
 
         let visibleApps = this._getVisibleApps();
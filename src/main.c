@@ -46,6 +46,7 @@ static int caught_signal = 0;
 enum {
   SHELL_DEBUG_BACKTRACE_WARNINGS = 1,
   SHELL_DEBUG_BACKTRACE_SEGFAULTS = 2,
+  SHELL_DEBUG_NOOP_REDRAWS = 4,
 };
 static int _shell_debug;
 static gboolean _tracked_signals[NSIG] = { 0 };
@@ -295,6 +296,7 @@ shell_init_debug (const char *debug_env)
   static const GDebugKey keys[] = {
     { "backtrace-warnings", SHELL_DEBUG_BACKTRACE_WARNINGS },
     { "backtrace-segfaults", SHELL_DEBUG_BACKTRACE_SEGFAULTS },
+    { "noop-redraws", SHELL_DEBUG_NOOP_REDRAWS },
   };
 
   _shell_debug = g_parse_debug_string (debug_env, keys,
@@ -512,7 +514,9 @@ main (int argc, char **argv)
   if (session_mode == NULL)
     session_mode = is_gdm_mode ? (char *)"gdm" : (char *)"user";
 
-  _shell_global_init ("session-mode", session_mode, NULL);
+  _shell_global_init ("session-mode", session_mode,
+                      "report-noop-redraws", (_shell_debug & SHELL_DEBUG_NOOP_REDRAWS) != 0,
+                      NULL);
 
   shell_prefs_init ();
 
@@ -0,0 +1,1095 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+
+#include "config.h"
+
+#include <string.h>
+#include <sys/stat.h>
+
+#include <glib/gstdio.h>
+
+#include "shell-app-index.h"
+
+/* Additional key used to map a renamed desktop file to its previous name;
+ * for instance, org.gnome.Totem.desktop would use this key to point to
+ * 'totem.desktop'
+ */
+#define X_ENDLESS_ALIAS_KEY     "X-Endless-Alias"
+
+/* Bump when the snapshot format or what goes into it changes */
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_TYPE "(usaaya(ayayxxxtbssa(su)))"
+
+/* Where a search term matched; results are grouped by these, in this
+ * order, like g_desktop_app_info_search() does.
+ */
+typedef enum
+{
+  MATCH_NAME,
+  MATCH_EXEC,
+  MATCH_KEYWORDS,
+  MATCH_GENERIC_NAME,
+  MATCH_ALIAS,
+  N_MATCHES
+} MatchCategory;
+
+typedef struct _AppIndexEntry AppIndexEntry;
+
+/* A folded word of an app, as found under its last byte in the trie */
+typedef struct
+{
+  char *text;
+  MatchCategory category;
+  AppIndexEntry *entry;
+} SearchToken;
+
+/* Byte-wise prefix trie of the search tokens of all apps; the children
+ * of a node are a linked list, as most nodes have only one.
+ */
+typedef struct _TrieNode TrieNode;
+struct _TrieNode
+{
+  TrieNode *children;
+  TrieNode *next;
+  GPtrArray *tokens; /* SearchToken ending here, or NULL */
+  guchar byte;
+};
+
+struct _AppIndexEntry
+{
+  const char *id; /* owned by the entries table */
+  char *filename;
+
+  /* What the file looked like when it was parsed; if any of this
+   * changes, it is parsed again.
+   */
+  gint64 mtime;
+  gint64 ctime;
+  gint64 size;
+  guint64 inode;
+
+  gboolean is_app; /* FALSE for hidden or broken files */
+  char *alias; /* the X-Endless-Alias, as a desktop ID */
+  char *startup_wm_class;
+  GPtrArray *tokens; /* SearchToken */
+};
+
+struct _ShellAppIndex
+{
+  GHashTable *entries; /* desktop ID -> AppIndexEntry */
+  GHashTable *alias_to_id;
+  GHashTable *startup_wm_class_to_id;
+  guint n_apps;
+
+  TrieNode search_root;
+
+  /* The last search, which a longer query can start from */
+  char **last_terms;
+  GHashTable *last_matches; /* AppIndexEntry -> MatchCategory */
+};
+
+static void
+search_token_free (SearchToken *token)
+{
+  g_free (token->text);
+  g_slice_free (SearchToken, token);
+}
+
+static void
+app_index_entry_free (AppIndexEntry *entry)
+{
+  g_free (entry->filename);
+  g_free (entry->alias);
+  g_free (entry->startup_wm_class);
+  if (entry->tokens != NULL)
+    g_ptr_array_unref (entry->tokens);
+  g_free (entry);
+}
+
+static gboolean
+app_index_entry_equal (AppIndexEntry *a,
+                       AppIndexEntry *b)
+{
+  return (a->mtime == b->mtime &&
+          a->ctime == b->ctime &&
+          a->size == b->size &&
+          a->inode == b->inode &&
+          strcmp (a->filename, b->filename) == 0);
+}
+
+static void
+unref_if_set (gpointer data)
+{
+  if (data != NULL)
+    g_object_unref (data);
+}
+
+/**
+ * shell_app_index_new:
+ *
+ * Creates an empty index; shell_app_index_update() fills it.
+ *
+ * Return value: the new #ShellAppIndex
+ */
+ShellAppIndex *
+shell_app_index_new (void)
+{
+  ShellAppIndex *index = g_new0 (ShellAppIndex, 1);
+
+  index->entries = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                          (GDestroyNotify) app_index_entry_free);
+  index->alias_to_id = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  index->startup_wm_class_to_id = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+  return index;
+}
+
+static void
+trie_node_free_children (TrieNode *node)
+{
+  TrieNode *child, *next;
+
+  for (child = node->children; child != NULL; child = next)
+    {
+      next = child->next;
+      trie_node_free_children (child);
+      if (child->tokens != NULL)
+        g_ptr_array_unref (child->tokens);
+      g_slice_free (TrieNode, child);
+    }
+
+  node->children = NULL;
+}
+
+static void
+app_index_forget_search (ShellAppIndex *index)
+{
+  g_clear_pointer (&index->last_terms, g_strfreev);
+  g_clear_pointer (&index->last_matches, g_hash_table_destroy);
+}
+
+void
+shell_app_index_free (ShellAppIndex *index)
+{
+  app_index_forget_search (index);
+  trie_node_free_children (&index->search_root);
+  if (index->search_root.tokens != NULL)
+    g_ptr_array_unref (index->search_root.tokens);
+  g_hash_table_destroy (index->entries);
+  g_hash_table_destroy (index->alias_to_id);
+  g_hash_table_destroy (index->startup_wm_class_to_id);
+  g_free (index);
+}
+
+/* Collects the .desktop files in an application directory, the way
+ * GIO assigns desktop IDs: files in subdirectories get the names of
+ * the subdirectories as prefix, and directories scanned earlier take
+ * precedence over later ones.
+ */
+static void
+scan_dir (GHashTable *found,
+          const char *path,
+          const char *prefix)
+{
+  GDir *dir;
+  const char *name;
+
+  dir = g_dir_open (path, 0, NULL);
+  if (dir == NULL)
+    return;
+
+  while ((name = g_dir_read_name (dir)) != NULL)
+    {
+      g_autofree char *filename = g_build_filename (path, name, NULL);
+      AppIndexEntry *entry;
+      GStatBuf buf;
+      char *id;
+
+      if (g_stat (filename, &buf) != 0)
+        continue;
+
+      if (S_ISDIR (buf.st_mode))
+        {
+          g_autofree char *subprefix = g_strconcat (prefix, name, "-", NULL);
+
+          scan_dir (found, filename, subprefix);
+          continue;
+        }
+
+      if (!S_ISREG (buf.st_mode) || !g_str_has_suffix (name, ".desktop"))
+        continue;
+
+      id = g_strconcat (prefix, name, NULL);
+      if (g_hash_table_contains (found, id))
+        {
+          g_free (id);
+          continue;
+        }
+
+      entry = g_new0 (AppIndexEntry, 1);
+      entry->filename = g_steal_pointer (&filename);
+      entry->mtime = buf.st_mtime;
+      entry->ctime = buf.st_ctime;
+      entry->size = buf.st_size;
+      entry->inode = buf.st_ino;
+
+      g_hash_table_insert (found, id, entry);
+    }
+
+  g_dir_close (dir);
+}
+
+/* The application directories, in order of precedence */
+static GPtrArray *
+get_app_dirs (void)
+{
+  GPtrArray *app_dirs = g_ptr_array_new_with_free_func (g_free);
+  const char * const *dirs;
+
+  g_ptr_array_add (app_dirs, g_build_filename (g_get_user_data_dir (), "applications", NULL));
+  for (dirs = g_get_system_data_dirs (); *dirs != NULL; dirs++)
+    g_ptr_array_add (app_dirs, g_build_filename (*dirs, "applications", NULL));
+
+  return app_dirs;
+}
+
+static GHashTable *
+scan_desktop_files (void)
+{
+  g_autoptr(GPtrArray) app_dirs = get_app_dirs ();
+  GHashTable *found;
+  guint i;
+
+  found = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                 (GDestroyNotify) app_index_entry_free);
+
+  for (i = 0; i < app_dirs->len; i++)
+    scan_dir (found, g_ptr_array_index (app_dirs, i), "");
+
+  return found;
+}
+
+/* Names and keywords are read in the language of the session */
+static char *
+get_languages (void)
+{
+  return g_strjoinv (":", (char **) g_get_language_names ());
+}
+
+static void
+add_search_tokens (GHashTable    *tokens,
+                   const char    *string,
+                   MatchCategory  category)
+{
+  g_auto(GStrv) folded = NULL;
+  g_auto(GStrv) alternates = NULL;
+  char **t;
+
+  if (string == NULL)
+    return;
+
+  /* The alternates are the ASCII forms of the tokens with accents, so
+   * "cafe" finds "Café"
+   */
+  folded = g_str_tokenize_and_fold (string, NULL, &alternates);
+
+  for (t = folded; *t != NULL; t++)
+    if (!g_hash_table_contains (tokens, *t))
+      g_hash_table_insert (tokens, g_strdup (*t), GUINT_TO_POINTER (category));
+
+  for (t = alternates; *t != NULL; t++)
+    if (!g_hash_table_contains (tokens, *t))
+      g_hash_table_insert (tokens, g_strdup (*t), GUINT_TO_POINTER (category));
+}
+
+/* Splits the searchable keys of the app into folded words. Categories
+ * are added best first, so a word keeps the best place it appears in.
+ */
+static void
+app_index_entry_tokenize (AppIndexEntry   *entry,
+                          GDesktopAppInfo *info)
+{
+  g_autoptr(GHashTable) tokens = NULL;
+  const char * const *keywords;
+  const char *executable;
+  GHashTableIter iter;
+  gpointer text, category;
+
+  tokens = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  add_search_tokens (tokens, g_app_info_get_name (G_APP_INFO (info)), MATCH_NAME);
+
+  executable = g_app_info_get_executable (G_APP_INFO (info));
+  if (executable != NULL)
+    {
+      g_autofree char *basename = g_path_get_basename (executable);
+
+      add_search_tokens (tokens, basename, MATCH_EXEC);
+    }
+
+  keywords = g_desktop_app_info_get_keywords (info);
+  for (; keywords != NULL && *keywords != NULL; keywords++)
+    add_search_tokens (tokens, *keywords, MATCH_KEYWORDS);
+
+  add_search_tokens (tokens, g_desktop_app_info_get_generic_name (info), MATCH_GENERIC_NAME);
+
+  if (entry->alias != NULL)
+    {
+      g_autofree char *alias = g_strndup (entry->alias,
+                                          strlen (entry->alias) - strlen (".desktop"));
+
+      add_search_tokens (tokens, alias, MATCH_ALIAS);
+    }
+
+  entry->tokens = g_ptr_array_new_full (g_hash_table_size (tokens),
+                                        (GDestroyNotify) search_token_free);
+
+  g_hash_table_iter_init (&iter, tokens);
+  while (g_hash_table_iter_next (&iter, &text, &category))
+    {
+      SearchToken *token = g_slice_new (SearchToken);
+
+      token->text = text;
+      token->category = GPOINTER_TO_UINT (category);
+      token->entry = entry;
+      g_hash_table_iter_steal (&iter);
+
+      g_ptr_array_add (entry->tokens, token);
+    }
+}
+
+/* Loads the app the way the rest of the shell will see it, and picks
+ * out the keys we index.
+ */
+static GDesktopAppInfo *
+app_index_entry_load (AppIndexEntry *entry,
+                      const char    *id)
+{
+  GDesktopAppInfo *info;
+  g_autofree char *alias = NULL;
+
+  info = g_desktop_app_info_new (id);
+  if (info != NULL && g_desktop_app_info_get_is_hidden (info))
+    g_clear_object (&info);
+
+  if (info == NULL)
+    return NULL;
+
+  entry->is_app = TRUE;
+
+  alias = g_desktop_app_info_get_string (info, X_ENDLESS_ALIAS_KEY);
+  if (alias != NULL)
+    entry->alias = g_strconcat (alias, ".desktop", NULL);
+
+  entry->startup_wm_class = g_strdup (g_desktop_app_info_get_startup_wm_class (info));
+
+  /* Results with invalid IDs can't be passed on to JavaScript */
+  if (g_utf8_validate (id, -1, NULL))
+    app_index_entry_tokenize (entry, info);
+
+  return info;
+}
+
+static void
+trie_insert (TrieNode    *root,
+             SearchToken *token)
+{
+  TrieNode *node = root, *child;
+  const guchar *p;
+
+  for (p = (const guchar *) token->text; *p != '\0'; p++)
+    {
+      for (child = node->children; child != NULL; child = child->next)
+        if (child->byte == *p)
+          break;
+
+      if (child == NULL)
+        {
+          child = g_slice_new0 (TrieNode);
+          child->byte = *p;
+          child->next = node->children;
+          node->children = child;
+        }
+
+      node = child;
+    }
+
+  if (node->tokens == NULL)
+    node->tokens = g_ptr_array_new ();
+  g_ptr_array_add (node->tokens, token);
+}
+
+/* Removes @token, found under @p below @node, and prunes the nodes
+ * left empty. Returns whether @node itself is empty now.
+ */
+static gboolean
+trie_remove (TrieNode     *node,
+             const guchar *p,
+             SearchToken  *token)
+{
+  TrieNode **link;
+
+  if (*p == '\0')
+    {
+      if (node->tokens != NULL)
+        {
+          g_ptr_array_remove_fast (node->tokens, token);
+          if (node->tokens->len == 0)
+            g_clear_pointer (&node->tokens, g_ptr_array_unref);
+        }
+    }
+  else
+    {
+      for (link = &node->children; *link != NULL; link = &(*link)->next)
+        if ((*link)->byte == *p)
+          break;
+
+      if (*link != NULL && trie_remove (*link, p + 1, token))
+        {
+          TrieNode *child = *link;
+
+          *link = child->next;
+          g_slice_free (TrieNode, child);
+        }
+    }
+
+  return node->children == NULL && node->tokens == NULL;
+}
+
+static TrieNode *
+trie_lookup (TrieNode   *root,
+             const char *prefix)
+{
+  TrieNode *node = root;
+  const guchar *p;
+
+  for (p = (const guchar *) prefix; node != NULL && *p != '\0'; p++)
+    {
+      for (node = node->children; node != NULL; node = node->next)
+        if (node->byte == *p)
+          break;
+    }
+
+  return node;
+}
+
+/* Adds the apps with a token below @node to @matches, with the best
+ * category they match in.
+ */
+static void
+trie_collect (TrieNode   *node,
+              GHashTable *matches)
+{
+  TrieNode *child;
+  guint i;
+
+  if (node->tokens != NULL)
+    {
+      for (i = 0; i < node->tokens->len; i++)
+        {
+          SearchToken *token = g_ptr_array_index (node->tokens, i);
+          gpointer category;
+
+          if (!g_hash_table_lookup_extended (matches, token->entry, NULL, &category) ||
+              GPOINTER_TO_UINT (category) > token->category)
+            g_hash_table_insert (matches, token->entry, GUINT_TO_POINTER (token->category));
+        }
+    }
+
+  for (child = node->children; child != NULL; child = child->next)
+    trie_collect (child, matches);
+}
+
+static void
+app_index_add_search_tokens (ShellAppIndex *index,
+                             AppIndexEntry *entry)
+{
+  guint i;
+
+  if (entry->tokens == NULL)
+    return;
+
+  for (i = 0; i < entry->tokens->len; i++)
+    trie_insert (&index->search_root, g_ptr_array_index (entry->tokens, i));
+}
+
+static void
+app_index_remove_search_tokens (ShellAppIndex *index,
+                                AppIndexEntry *entry)
+{
+  guint i;
+
+  if (entry->tokens == NULL)
+    return;
+
+  for (i = 0; i < entry->tokens->len; i++)
+    {
+      SearchToken *token = g_ptr_array_index (entry->tokens, i);
+
+      trie_remove (&index->search_root, (const guchar *) token->text, token);
+    }
+}
+
+/* In case multiple .desktop files set the same StartupWMClass, prefer
+ * the one where ID and StartupWMClass match; otherwise, as with
+ * aliases, the first one stays.
+ */
+static void
+app_index_add_keys (ShellAppIndex *index,
+                    const char    *id,
+                    AppIndexEntry *entry)
+{
+  const char *old_id;
+
+  if (entry->alias != NULL &&
+      !g_hash_table_contains (index->alias_to_id, entry->alias))
+    g_hash_table_insert (index->alias_to_id, g_strdup (entry->alias), g_strdup (id));
+
+  if (entry->startup_wm_class != NULL)
+    {
+      old_id = g_hash_table_lookup (index->startup_wm_class_to_id, entry->startup_wm_class);
+      if (old_id == NULL || strcmp (id, entry->startup_wm_class) == 0)
+        g_hash_table_insert (index->startup_wm_class_to_id,
+                             g_strdup (entry->startup_wm_class), g_strdup (id));
+    }
+}
+
+/* Removes the entry for @id; keys that pointed to it are added to
+ * @orphans, so another app with the same key can take them over.
+ */
+static void
+app_index_remove_entry (ShellAppIndex *index,
+                        const char    *id,
+                        GHashTable    *orphans)
+{
+  AppIndexEntry *entry;
+
+  entry = g_hash_table_lookup (index->entries, id);
+  if (entry == NULL)
+    return;
+
+  if (entry->alias != NULL &&
+      g_strcmp0 (g_hash_table_lookup (index->alias_to_id, entry->alias), id) == 0)
+    {
+      g_hash_table_remove (index->alias_to_id, entry->alias);
+      g_hash_table_add (orphans, g_strdup (entry->alias));
+    }
+
+  if (entry->startup_wm_class != NULL &&
+      g_strcmp0 (g_hash_table_lookup (index->startup_wm_class_to_id, entry->startup_wm_class), id) == 0)
+    {
+      g_hash_table_remove (index->startup_wm_class_to_id, entry->startup_wm_class);
+      g_hash_table_add (orphans, g_strdup (entry->startup_wm_class));
+    }
+
+  if (entry->is_app)
+    index->n_apps--;
+
+  app_index_remove_search_tokens (index, entry);
+  g_hash_table_remove (index->entries, id);
+}
+
+/* Takes ownership of @id and @entry */
+static void
+app_index_add_entry (ShellAppIndex *index,
+                     char          *id,
+                     AppIndexEntry *entry)
+{
+  if (entry->is_app)
+    index->n_apps++;
+
+  g_hash_table_insert (index->entries, id, entry);
+  entry->id = id;
+  app_index_add_keys (index, id, entry);
+  app_index_add_search_tokens (index, entry);
+}
+
+/**
+ * shell_app_index_update:
+ * @index: a #ShellAppIndex
+ *
+ * Brings the index up to date with the .desktop files on disk. Only
+ * the files that were added or changed since the last update are
+ * parsed; the others are just compared with what they looked like
+ * then. A burst of installations and removals then costs one pass
+ * over the application directories, and parsing the new files.
+ *
+ * Return value: (transfer full): a table from the desktop IDs that
+ *   changed to their new #GDesktopAppInfo, or to %NULL for apps that
+ *   went away
+ */
+GHashTable *
+shell_app_index_update (ShellAppIndex *index)
+{
+  GHashTable *found, *changes, *orphans;
+  GHashTableIter iter;
+  AppIndexEntry *entry, *old;
+  const char *id;
+
+  found = scan_desktop_files ();
+  changes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, unref_if_set);
+  orphans = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  /* Files that went away */
+  g_hash_table_iter_init (&iter, index->entries);
+  while (g_hash_table_iter_next (&iter, (gpointer *) &id, NULL))
+    if (!g_hash_table_contains (found, id))
+      g_hash_table_insert (changes, g_strdup (id), NULL);
+
+  g_hash_table_iter_init (&iter, changes);
+  while (g_hash_table_iter_next (&iter, (gpointer *) &id, NULL))
+    app_index_remove_entry (index, id, orphans);
+
+  /* Files that are new or changed */
+  g_hash_table_iter_init (&iter, found);
+  while (g_hash_table_iter_next (&iter, (gpointer *) &id, (gpointer *) &entry))
+    {
+      GDesktopAppInfo *info;
+
+      old = g_hash_table_lookup (index->entries, id);
+      if (old != NULL && app_index_entry_equal (old, entry))
+        continue;
+
+      app_index_remove_entry (index, id, orphans);
+
+      info = app_index_entry_load (entry, id);
+
+      g_hash_table_iter_steal (&iter);
+      app_index_add_entry (index, (char *) id, entry);
+
+      g_hash_table_insert (changes, g_strdup (id), info);
+    }
+
+  /* Hand keys of apps that went away to other apps with the same keys */
+  if (g_hash_table_size (orphans) > 0)
+    {
+      g_hash_table_iter_init (&iter, index->entries);
+      while (g_hash_table_iter_next (&iter, (gpointer *) &id, (gpointer *) &entry))
+        if ((entry->alias != NULL &&
+             g_hash_table_contains (orphans, entry->alias)) ||
+            (entry->startup_wm_class != NULL &&
+             g_hash_table_contains (orphans, entry->startup_wm_class)))
+          app_index_add_keys (index, id, entry);
+    }
+
+  /* The last search may point to entries that are gone */
+  if (g_hash_table_size (changes) > 0)
+    app_index_forget_search (index);
+
+  g_hash_table_destroy (orphans);
+  g_hash_table_destroy (found);
+
+  return changes;
+}
+
+/**
+ * shell_app_index_load:
+ * @index: an empty #ShellAppIndex
+ * @filename: the snapshot to load
+ *
+ * Fills the index from a snapshot written by shell_app_index_save()
+ * in an earlier session, so it doesn't have to parse all the .desktop
+ * files again. The snapshot is only used if it was made for the same
+ * application directories and languages; the next
+ * shell_app_index_update() then parses only the files that changed
+ * since it was written.
+ *
+ * Return value: %TRUE if the snapshot was loaded
+ */
+gboolean
+shell_app_index_load (ShellAppIndex *index,
+                      const char    *filename)
+{
+  g_autoptr(GMappedFile) file = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GVariant) snapshot = NULL;
+  g_autoptr(GVariant) dirs = NULL;
+  g_autoptr(GVariant) entries = NULL;
+  g_autoptr(GPtrArray) app_dirs = NULL;
+  g_autofree char *languages = NULL;
+  const char *snapshot_languages;
+  GVariantIter iter;
+  GVariant *tokens;
+  guint32 version;
+  gsize i;
+
+  g_return_val_if_fail (g_hash_table_size (index->entries) == 0, FALSE);
+
+  file = g_mapped_file_new (filename, FALSE, NULL);
+  if (file == NULL)
+    return FALSE;
+
+  bytes = g_mapped_file_get_bytes (file);
+  snapshot = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (SNAPSHOT_TYPE),
+                                                           bytes, FALSE));
+
+  g_variant_get (snapshot, "(u&s@aay@a(ayayxxxtbssa(su)))",
+                 &version, &snapshot_languages, &dirs, &entries);
+
+  languages = get_languages ();
+  if (version != SNAPSHOT_VERSION || strcmp (languages, snapshot_languages) != 0)
+    return FALSE;
+
+  app_dirs = get_app_dirs ();
+  if (g_variant_n_children (dirs) != app_dirs->len)
+    return FALSE;
+
+  for (i = 0; i < app_dirs->len; i++)
+    {
+      g_autoptr(GVariant) dir = g_variant_get_child_value (dirs, i);
+
+      if (strcmp (g_variant_get_bytestring (dir), g_ptr_array_index (app_dirs, i)) != 0)
+        return FALSE;
+    }
+
+  g_variant_iter_init (&iter, entries);
+  while (TRUE)
+    {
+      AppIndexEntry *entry;
+      const char *id, *path, *alias, *startup_wm_class;
+      gint64 mtime, ctime, size;
+      guint64 inode;
+      gboolean is_app;
+
+      if (!g_variant_iter_next (&iter, "(^&ay^&ayxxxtb&s&s@a(su))",
+                                &id, &path, &mtime, &ctime, &size, &inode,
+                                &is_app, &alias, &startup_wm_class, &tokens))
+        break;
+
+      if (g_hash_table_contains (index->entries, id))
+        {
+          g_variant_unref (tokens);
+          continue;
+        }
+
+      entry = g_new0 (AppIndexEntry, 1);
+      entry->filename = g_strdup (path);
+      entry->mtime = mtime;
+      entry->ctime = ctime;
+      entry->size = size;
+      entry->inode = inode;
+      entry->is_app = is_app;
+      if (*alias != '\0')
+        entry->alias = g_strdup (alias);
+      if (*startup_wm_class != '\0')
+        entry->startup_wm_class = g_strdup (startup_wm_class);
+
+      if (g_variant_n_children (tokens) > 0)
+        {
+          GVariantIter token_iter;
+          const char *text;
+          guint32 category;
+
+          entry->tokens = g_ptr_array_new_full (g_variant_n_children (tokens),
+                                                (GDestroyNotify) search_token_free);
+
+          g_variant_iter_init (&token_iter, tokens);
+          while (g_variant_iter_next (&token_iter, "(&su)", &text, &category))
+            {
+              SearchToken *token;
+
+              if (category >= N_MATCHES)
+                continue;
+
+              token = g_slice_new (SearchToken);
+              token->text = g_strdup (text);
+              token->category = category;
+              token->entry = entry;
+              g_ptr_array_add (entry->tokens, token);
+            }
+        }
+      g_variant_unref (tokens);
+
+      app_index_add_entry (index, g_strdup (id), entry);
+    }
+
+  return TRUE;
+}
+
+/**
+ * shell_app_index_save:
+ * @index: a #ShellAppIndex
+ * @filename: where to save the snapshot
+ * @error: return location for a #GError
+ *
+ * Writes what the index knows about each .desktop file to @filename,
+ * for shell_app_index_load() to pick up in the next session.
+ *
+ * Return value: %TRUE on success
+ */
+gboolean
+shell_app_index_save (ShellAppIndex  *index,
+                      const char     *filename,
+                      GError        **error)
+{
+  g_autoptr(GPtrArray) app_dirs = get_app_dirs ();
+  g_autoptr(GVariant) snapshot = NULL;
+  g_autofree char *languages = get_languages ();
+  GVariantBuilder builder;
+  GHashTableIter iter;
+  AppIndexEntry *entry;
+  const char *id;
+  guint i;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE (SNAPSHOT_TYPE));
+  g_variant_builder_add (&builder, "u", SNAPSHOT_VERSION);
+  g_variant_builder_add (&builder, "s", languages);
+
+  g_variant_builder_open (&builder, G_VARIANT_TYPE ("aay"));
+  for (i = 0; i < app_dirs->len; i++)
+    g_variant_builder_add (&builder, "^ay", g_ptr_array_index (app_dirs, i));
+  g_variant_builder_close (&builder);
+
+  g_variant_builder_open (&builder, G_VARIANT_TYPE ("a(ayayxxxtbssa(su))"));
+  g_hash_table_iter_init (&iter, index->entries);
+  while (g_hash_table_iter_next (&iter, (gpointer *) &id, (gpointer *) &entry))
+    {
+      g_variant_builder_open (&builder, G_VARIANT_TYPE ("(ayayxxxtbssa(su))"));
+      g_variant_builder_add (&builder, "^ay", id);
+      g_variant_builder_add (&builder, "^ay", entry->filename);
+      g_variant_builder_add (&builder, "x", entry->mtime);
+      g_variant_builder_add (&builder, "x", entry->ctime);
+      g_variant_builder_add (&builder, "x", entry->size);
+      g_variant_builder_add (&builder, "t", entry->inode);
+      g_variant_builder_add (&builder, "b", entry->is_app);
+      g_variant_builder_add (&builder, "s", entry->alias ? entry->alias : "");
+      g_variant_builder_add (&builder, "s", entry->startup_wm_class ? entry->startup_wm_class : "");
+
+      g_variant_builder_open (&builder, G_VARIANT_TYPE ("a(su)"));
+      for (i = 0; entry->tokens != NULL && i < entry->tokens->len; i++)
+        {
+          SearchToken *token = g_ptr_array_index (entry->tokens, i);
+
+          g_variant_builder_add (&builder, "(su)", token->text, (guint32) token->category);
+        }
+      g_variant_builder_close (&builder);
+
+      g_variant_builder_close (&builder);
+    }
+  g_variant_builder_close (&builder);
+
+  snapshot = g_variant_ref_sink (g_variant_builder_end (&builder));
+
+  return g_file_set_contents (filename,
+                              g_variant_get_data (snapshot),
+                              g_variant_get_size (snapshot),
+                              error);
+}
+
+/**
+ * shell_app_index_get_n_apps:
+ * @index: a #ShellAppIndex
+ *
+ * Return value: the number of apps in the index
+ */
+guint
+shell_app_index_get_n_apps (ShellAppIndex *index)
+{
+  return index->n_apps;
+}
+
+/**
+ * shell_app_index_lookup_alias:
+ * @index: a #ShellAppIndex
+ * @alias: a desktop ID an app was known by before
+ *
+ * Return value: (nullable): the desktop ID of the app with @alias as
+ *   its X-Endless-Alias, or %NULL
+ */
+const char *
+shell_app_index_lookup_alias (ShellAppIndex *index,
+                              const char    *alias)
+{
+  return g_hash_table_lookup (index->alias_to_id, alias);
+}
+
+/**
+ * shell_app_index_lookup_startup_wm_class:
+ * @index: a #ShellAppIndex
+ * @wmclass: a WM_CLASS value
+ *
+ * Return value: (nullable): the desktop ID of the app with @wmclass
+ *   as its StartupWMClass, or %NULL
+ */
+const char *
+shell_app_index_lookup_startup_wm_class (ShellAppIndex *index,
+                                         const char    *wmclass)
+{
+  return g_hash_table_lookup (index->startup_wm_class_to_id, wmclass);
+}
+
+/* Returns the best category @entry matches @term or @alternate in, or
+ * N_MATCHES if it doesn't match.
+ */
+static MatchCategory
+app_index_entry_match (AppIndexEntry *entry,
+                       const char    *term,
+                       const char    *alternate)
+{
+  MatchCategory best = N_MATCHES;
+  guint i;
+
+  for (i = 0; i < entry->tokens->len; i++)
+    {
+      SearchToken *token = g_ptr_array_index (entry->tokens, i);
+
+      if (token->category < best &&
+          (g_str_has_prefix (token->text, term) ||
+           (alternate != NULL && g_str_has_prefix (token->text, alternate))))
+        best = token->category;
+    }
+
+  return best;
+}
+
+/* Whether the apps matching @terms are a subset of those matching
+ * @previous, because each of the previous terms only got longer.
+ */
+static gboolean
+terms_refine (char **terms,
+              char **previous)
+{
+  guint i;
+
+  if (previous == NULL || g_strv_length (terms) < g_strv_length (previous))
+    return FALSE;
+
+  for (i = 0; previous[i] != NULL; i++)
+    if (!g_str_has_prefix (terms[i], previous[i]))
+      return FALSE;
+
+  return TRUE;
+}
+
+/* Keeps the apps of @matches that also match @term, in the worse
+ * category of the two, as all terms need to match.
+ */
+static void
+filter_matches (GHashTable *matches,
+                const char *term)
+{
+  g_autofree char *alternate = g_str_to_ascii (term, NULL);
+  GHashTableIter iter;
+  gpointer entry, category;
+
+  if (strcmp (alternate, term) == 0)
+    g_clear_pointer (&alternate, g_free);
+
+  g_hash_table_iter_init (&iter, matches);
+  while (g_hash_table_iter_next (&iter, &entry, &category))
+    {
+      MatchCategory match = app_index_entry_match (entry, term, alternate);
+
+      if (match == N_MATCHES)
+        g_hash_table_iter_remove (&iter);
+      else if (match > GPOINTER_TO_UINT (category))
+        g_hash_table_iter_replace (&iter, GUINT_TO_POINTER (match));
+    }
+}
+
+static GHashTable *
+lookup_matches (ShellAppIndex *index,
+                const char    *term)
+{
+  g_autofree char *alternate = g_str_to_ascii (term, NULL);
+  GHashTable *matches;
+  TrieNode *node;
+
+  matches = g_hash_table_new (NULL, NULL);
+
+  node = trie_lookup (&index->search_root, term);
+  if (node != NULL)
+    trie_collect (node, matches);
+
+  if (strcmp (alternate, term) != 0)
+    {
+      node = trie_lookup (&index->search_root, alternate);
+      if (node != NULL)
+        trie_collect (node, matches);
+    }
+
+  return matches;
+}
+
+static int
+compare_ids (gconstpointer a,
+             gconstpointer b)
+{
+  return strcmp (*(const char **) a, *(const char **) b);
+}
+
+/**
+ * shell_app_index_search:
+ * @index: a #ShellAppIndex
+ * @search_string: the search string to use
+ *
+ * Searches the apps by prefixes of the words in their name, executable,
+ * keywords, generic name and X-Endless-Alias, ignoring case and
+ * accents. Every word of @search_string has to match. When the search
+ * only extends the previous one, as it does while the user is typing,
+ * the apps that matched then are filtered instead of looking the words
+ * up again.
+ *
+ * Return value: (transfer full): the desktop IDs of the matching apps,
+ *   as with g_desktop_app_info_search(): a %NULL-terminated list of
+ *   strvs, grouped by where the search matched, best matches first
+ */
+char ***
+shell_app_index_search (ShellAppIndex *index,
+                        const char    *search_string)
+{
+  g_auto(GStrv) terms = NULL;
+  GHashTable *matches;
+  GPtrArray *groups[N_MATCHES] = { NULL, };
+  GPtrArray *results;
+  GHashTableIter iter;
+  gpointer key, value;
+  guint i;
+
+  terms = g_str_tokenize_and_fold (search_string, NULL, NULL);
+  if (terms[0] == NULL)
+    return g_new0 (char **, 1);
+
+  if (terms_refine (terms, index->last_terms))
+    {
+      matches = g_steal_pointer (&index->last_matches);
+      i = 0;
+    }
+  else
+    {
+      g_clear_pointer (&index->last_matches, g_hash_table_destroy);
+      matches = lookup_matches (index, terms[0]);
+      i = 1;
+    }
+
+  for (; terms[i] != NULL; i++)
+    filter_matches (matches, terms[i]);
+
+  g_strfreev (index->last_terms);
+  index->last_terms = g_steal_pointer (&terms);
+  index->last_matches = matches;
+
+  g_hash_table_iter_init (&iter, matches);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      AppIndexEntry *entry = key;
+      MatchCategory category = GPOINTER_TO_UINT (value);
+
+      if (groups[category] == NULL)
+        groups[category] = g_ptr_array_new ();
+      g_ptr_array_add (groups[category], g_strdup (entry->id));
+    }
+
+  results = g_ptr_array_new ();
+  for (i = 0; i < N_MATCHES; i++)
+    {
+      if (groups[i] == NULL)
+        continue;
+
+      g_ptr_array_sort (groups[i], compare_ids);
+      g_ptr_array_add (groups[i], NULL);
+      g_ptr_array_add (results, g_ptr_array_free (groups[i], FALSE));
+    }
+  g_ptr_array_add (results, NULL);
+
+  return (char ***) g_ptr_array_free (results, FALSE);
+}
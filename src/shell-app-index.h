@@ -0,0 +1,42 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+#ifndef __SHELL_APP_INDEX_H__
+#define __SHELL_APP_INDEX_H__
+
+#include <gio/gdesktopappinfo.h>
+
+G_BEGIN_DECLS
+
+/**
+ * ShellAppIndex:
+ *
+ * Keeps track of the installed .desktop files, along with the
+ * X-Endless-Alias and StartupWMClass keys of each and a search index
+ * of their names and keywords. Updating the index only stats the
+ * application directories; only files that were added or changed
+ * since the last update are parsed again.
+ */
+typedef struct _ShellAppIndex ShellAppIndex;
+
+ShellAppIndex *shell_app_index_new    (void);
+void           shell_app_index_free   (ShellAppIndex *index);
+
+GHashTable    *shell_app_index_update (ShellAppIndex *index);
+
+gboolean       shell_app_index_load   (ShellAppIndex  *index,
+                                       const char     *filename);
+gboolean       shell_app_index_save   (ShellAppIndex  *index,
+                                       const char     *filename,
+                                       GError        **error);
+
+guint          shell_app_index_get_n_apps                (ShellAppIndex *index);
+const char    *shell_app_index_lookup_alias              (ShellAppIndex *index,
+                                                          const char    *alias);
+const char    *shell_app_index_lookup_startup_wm_class   (ShellAppIndex *index,
+                                                          const char    *wmclass);
+
+char        ***shell_app_index_search                    (ShellAppIndex *index,
+                                                          const char    *search_string);
+
+G_END_DECLS
+
+#endif /* __SHELL_APP_INDEX_H__ */
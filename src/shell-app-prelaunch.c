@@ -0,0 +1,287 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+
+#include "config.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <glib/gstdio.h>
+
+#include "shell-app-prelaunch.h"
+
+/* The files an app has mapped by the time its first window shows up
+ * are recorded in the cache directory, one path per line, and read
+ * ahead into the page cache the next time the app is likely to be
+ * launched. Apps are only recorded when they share the mount namespace
+ * of the shell, since the paths seen inside a sandbox mean nothing
+ * outside of it; sandboxed apps only get their executable read ahead.
+ *
+ * All file access happens in a single worker thread, as reading ahead
+ * on a cold disk is exactly when opening files is slow. Hints that
+ * piled up behind newer ones while the disk was busy are dropped
+ * rather than competing with the launches that are actually coming.
+ */
+#define PRELAUNCH_DIR "prelaunch"
+
+#define MAX_FILES 512
+/* Don't let one large file, or one app, flush the page cache */
+#define MAX_READ_AHEAD (32 * 1024 * 1024)
+#define MAX_HINT_READ_AHEAD (64 * 1024 * 1024)
+/* Read-aheads with more than this many newer ones queued are stale */
+#define MAX_PENDING_READ_AHEADS 2
+
+typedef struct _PrelaunchData PrelaunchData;
+
+typedef void (*PrelaunchFunc) (PrelaunchData *data);
+
+struct _PrelaunchData {
+  PrelaunchFunc func;
+  char *app_id;
+  char *executable;
+  GPid pid;
+  guint generation;
+};
+
+static GThreadPool *prelaunch_pool;
+static volatile gint read_ahead_generation;
+
+static void
+prelaunch_data_free (PrelaunchData *data)
+{
+  g_free (data->app_id);
+  g_free (data->executable);
+  g_slice_free (PrelaunchData, data);
+}
+
+static char *
+get_record_path (const char *app_id)
+{
+  return g_build_filename (g_get_user_cache_dir (), "gnome-shell",
+                           PRELAUNCH_DIR, app_id, NULL);
+}
+
+static gboolean
+read_ahead_is_stale (PrelaunchData *data)
+{
+  guint newest = g_atomic_int_get (&read_ahead_generation);
+
+  return newest - data->generation > MAX_PENDING_READ_AHEADS;
+}
+
+/* Reads ahead at most @budget bytes of @path, and takes what was read
+ * from @budget.
+ */
+static void
+read_ahead (const char *path,
+            gsize      *budget)
+{
+  struct stat st;
+  gsize length;
+  int fd;
+
+  fd = open (path, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+  if (fd < 0)
+    return;
+
+  if (fstat (fd, &st) == 0 && S_ISREG (st.st_mode))
+    {
+      length = MIN ((gsize) st.st_size, MIN ((gsize) MAX_READ_AHEAD, *budget));
+
+      /* Only starts the reads; the pages come in while the thread moves on */
+      if (length > 0)
+        posix_fadvise (fd, 0, length, POSIX_FADV_WILLNEED);
+      *budget -= length;
+    }
+
+  close (fd);
+}
+
+static void
+read_ahead_thread (PrelaunchData *data)
+{
+  gsize budget = MAX_HINT_READ_AHEAD;
+  char *record_path, *contents;
+  char **paths;
+  int i;
+
+  if (read_ahead_is_stale (data))
+    return;
+
+  if (data->executable != NULL)
+    {
+      char *path = g_find_program_in_path (data->executable);
+
+      if (path != NULL)
+        read_ahead (path, &budget);
+      g_free (path);
+    }
+
+  record_path = get_record_path (data->app_id);
+  if (g_file_get_contents (record_path, &contents, NULL, NULL))
+    {
+      paths = g_strsplit (contents, "\n", MAX_FILES + 1);
+      for (i = 0; paths[i] != NULL && i < MAX_FILES && budget > 0; i++)
+        {
+          /* Opening files is what's slow here, so newer hints can
+           * overtake this one between files.
+           */
+          if (read_ahead_is_stale (data))
+            break;
+
+          if (paths[i][0] == '/')
+            read_ahead (paths[i], &budget);
+        }
+
+      g_strfreev (paths);
+      g_free (contents);
+    }
+  g_free (record_path);
+}
+
+static gboolean
+same_mount_namespace (GPid pid)
+{
+  char *path, *ours, *theirs;
+  gboolean same;
+
+  path = g_strdup_printf ("/proc/%d/ns/mnt", (int) pid);
+  ours = g_file_read_link ("/proc/self/ns/mnt", NULL);
+  theirs = g_file_read_link (path, NULL);
+
+  same = ours != NULL && theirs != NULL && strcmp (ours, theirs) == 0;
+
+  g_free (path);
+  g_free (ours);
+  g_free (theirs);
+  return same;
+}
+
+static void
+record_thread (PrelaunchData *data)
+{
+  GHashTable *seen;
+  GString *record;
+  char *maps_path, *contents, *record_path, *dir;
+  char **lines;
+  int i;
+
+  if (!same_mount_namespace (data->pid))
+    return;
+
+  maps_path = g_strdup_printf ("/proc/%d/maps", (int) data->pid);
+  if (!g_file_get_contents (maps_path, &contents, NULL, NULL))
+    {
+      g_free (maps_path);
+      return;
+    }
+  g_free (maps_path);
+
+  /* Each line is "address perms offset dev inode path"; the path is
+   * the only field that can hold a slash.
+   */
+  seen = g_hash_table_new (g_str_hash, g_str_equal);
+  record = g_string_new (NULL);
+  lines = g_strsplit (contents, "\n", -1);
+
+  for (i = 0; lines[i] != NULL && g_hash_table_size (seen) < MAX_FILES; i++)
+    {
+      char *path = strchr (lines[i], '/');
+      struct stat st;
+
+      if (path == NULL ||
+          g_str_has_suffix (path, " (deleted)") ||
+          g_hash_table_contains (seen, path))
+        continue;
+
+      if (stat (path, &st) != 0 || !S_ISREG (st.st_mode))
+        continue;
+
+      g_hash_table_add (seen, path);
+      g_string_append (record, path);
+      g_string_append_c (record, '\n');
+    }
+
+  record_path = get_record_path (data->app_id);
+  dir = g_path_get_dirname (record_path);
+  if (g_mkdir_with_parents (dir, 0700) == 0)
+    g_file_set_contents (record_path, record->str, record->len, NULL);
+
+  g_free (dir);
+  g_free (record_path);
+  g_strfreev (lines);
+  g_string_free (record, TRUE);
+  g_hash_table_destroy (seen);
+  g_free (contents);
+}
+
+static void
+prelaunch_thread (gpointer task_data,
+                  gpointer user_data)
+{
+  PrelaunchData *data = task_data;
+
+  data->func (data);
+  prelaunch_data_free (data);
+}
+
+static void
+run_in_thread (PrelaunchData *data,
+               PrelaunchFunc  func)
+{
+  /* One worker, so hints never race each other for the disk */
+  if (prelaunch_pool == NULL)
+    prelaunch_pool = g_thread_pool_new (prelaunch_thread, NULL, 1, FALSE, NULL);
+
+  data->func = func;
+  g_thread_pool_push (prelaunch_pool, data, NULL);
+}
+
+/**
+ * shell_app_prelaunch_read_ahead:
+ * @app_id: the id of the app
+ * @executable: (nullable): the executable of the app, as found in its
+ *   .desktop file
+ *
+ * Starts reading the executable and the recorded files of @app_id into
+ * the page cache, from a thread. This is dropped if enough newer
+ * read-aheads are requested before it gets to run.
+ */
+void
+shell_app_prelaunch_read_ahead (const char *app_id,
+                                const char *executable)
+{
+  PrelaunchData *data;
+
+  data = g_slice_new0 (PrelaunchData);
+  data->app_id = g_strdup (app_id);
+  data->executable = g_strdup (executable);
+  data->generation = g_atomic_int_add (&read_ahead_generation, 1) + 1;
+
+  run_in_thread (data, read_ahead_thread);
+}
+
+/**
+ * shell_app_prelaunch_record:
+ * @app_id: the id of the app
+ * @pid: the process that showed the first window of @app_id
+ *
+ * Records the files mapped by @pid as the ones to read ahead for
+ * @app_id, from a thread.
+ */
+void
+shell_app_prelaunch_record (const char *app_id,
+                            GPid        pid)
+{
+  PrelaunchData *data;
+
+  if (pid <= 0)
+    return;
+
+  data = g_slice_new0 (PrelaunchData);
+  data->app_id = g_strdup (app_id);
+  data->pid = pid;
+
+  run_in_thread (data, record_thread);
+}
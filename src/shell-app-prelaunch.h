@@ -0,0 +1,16 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+#ifndef __SHELL_APP_PRELAUNCH_H__
+#define __SHELL_APP_PRELAUNCH_H__
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+void shell_app_prelaunch_read_ahead (const char *app_id,
+                                     const char *executable);
+void shell_app_prelaunch_record     (const char *app_id,
+                                     GPid        pid);
+
+G_END_DECLS
+
+#endif /* __SHELL_APP_PRELAUNCH_H__ */
@@ -22,6 +22,8 @@ void _shell_app_add_window (ShellApp *app, MetaWindow *window);
 
 void _shell_app_remove_window (ShellApp *app, MetaWindow *window);
 
+void _shell_app_get_allocation_counts (int *n_apps, int *n_bytes);
+
 G_END_DECLS
 
 #endif /* __SHELL_APP_PRIVATE_H__ */
@@ -6,4 +6,7 @@
 
 void _shell_app_system_notify_app_state_changed (ShellAppSystem *self, ShellApp *app);
 
+void _shell_app_system_begin_batch (ShellAppSystem *self);
+void _shell_app_system_end_batch   (ShellAppSystem *self);
+
 #endif
@@ -4,6 +4,7 @@
 
 #include "shell-app-system.h"
 #include "shell-app-usage.h"
+#include <errno.h>
 #include <string.h>
 
 #include <gio/gio.h>
@@ -11,6 +12,7 @@
 
 #include <eosmetrics/eosmetrics.h>
 
+#include "shell-app-index.h"
 #include "shell-app-private.h"
 #include "shell-window-tracker-private.h"
 #include "shell-app-system-private.h"
@@ -25,11 +27,16 @@
  */
 #define SHELL_APP_IS_OPEN_EVENT "b5e11a3d-13f8-4219-84fd-c9ba0bf3d1f0"
 
-/* Additional key used to map a renamed desktop file to its previous name;
- * for instance, org.gnome.Totem.desktop would use this key to point to
- * 'totem.desktop'
+/* Time (in milliseconds) to collect changes to installed apps before
+ * we look at them; installing a bunch of apps at once changes the
+ * application directories many times in a row.
  */
-#define X_ENDLESS_ALIAS_KEY     "X-Endless-Alias"
+#define INSTALLED_CHANGED_DELAY 500
+
+/* Snapshot of the app index in the user cache directory, which saves
+ * parsing every .desktop file again at login
+ */
+#define APP_INDEX_SNAPSHOT "app-index"
 
 /* Vendor prefixes are something that can be preprended to a .desktop
  * file name.  Undo this.
@@ -67,8 +74,14 @@ struct _ShellAppSystemPrivate {
   GHashTable *running_apps;
   GHashTable *starting_apps;
   GHashTable *id_to_app;
-  GHashTable *startup_wm_class_to_id;
-  GHashTable *alias_to_id;
+  ShellAppIndex *app_index;
+  char *snapshot_path;
+  guint installed_changed_id;
+  guint save_snapshot_id;
+
+  /* Apps whose state changed while a batch is open */
+  guint batch_depth;
+  GList *batched_apps;
 };
 
 static void shell_app_system_finalize (GObject *object);
@@ -107,75 +120,17 @@ static void shell_app_system_class_init(ShellAppSystemClass *klass)
 }
 
 
-static void
-scan_alias_to_id (ShellAppSystem *self)
-{
-  ShellAppSystemPrivate *priv = self->priv;
-  GList *apps, *l;
-
-  g_hash_table_remove_all (priv->alias_to_id);
-
-  apps = g_app_info_get_all ();
-  for (l = apps; l != NULL; l = l->next)
-    {
-      GAppInfo *info = l->data;
-      const char *alias, *id;
-      g_autofree char *desktop_alias = NULL;
-
-      id = g_app_info_get_id (info);
-      alias = g_desktop_app_info_get_string (G_DESKTOP_APP_INFO (info), X_ENDLESS_ALIAS_KEY);
-      if (alias == NULL)
-        continue;
-
-      desktop_alias = g_strconcat (alias, ".desktop", NULL);
-      g_hash_table_insert (priv->alias_to_id, g_strdup (desktop_alias), g_strdup (id));
-    }
-
-  g_list_free_full (apps, g_object_unref);
-}
-
-static void
-scan_startup_wm_class_to_id (ShellAppSystem *self)
-{
-  ShellAppSystemPrivate *priv = self->priv;
-  GList *apps, *l;
-
-  g_hash_table_remove_all (priv->startup_wm_class_to_id);
-
-  apps = g_app_info_get_all ();
-  for (l = apps; l != NULL; l = l->next)
-    {
-      GAppInfo *info = l->data;
-      const char *startup_wm_class, *id, *old_id;
-
-      id = g_app_info_get_id (info);
-      startup_wm_class = g_desktop_app_info_get_startup_wm_class (G_DESKTOP_APP_INFO (info));
-
-      if (startup_wm_class == NULL)
-        continue;
-
-      /* In case multiple .desktop files set the same StartupWMClass, prefer
-       * the one where ID and StartupWMClass match */
-      old_id = g_hash_table_lookup (priv->startup_wm_class_to_id, startup_wm_class);
-      if (old_id == NULL || strcmp (id, startup_wm_class) == 0)
-        g_hash_table_insert (priv->startup_wm_class_to_id,
-                             g_strdup (startup_wm_class), g_strdup (id));
-    }
-
-  g_list_free_full (apps, g_object_unref);
-}
-
 static gboolean
-app_is_stale (ShellApp *app)
+app_is_stale (ShellApp        *app,
+              GDesktopAppInfo *info)
 {
-  GDesktopAppInfo *info, *old;
+  GDesktopAppInfo *old;
   GAppInfo *old_info, *new_info;
   gboolean is_unchanged;
 
   if (shell_app_is_window_backed (app))
     return FALSE;
 
-  info = g_desktop_app_info_new (shell_app_get_id (app));
   if (!info)
     return TRUE;
 
@@ -200,31 +155,9 @@ app_is_stale (ShellApp *app)
     g_icon_equal (g_app_info_get_icon (old_info),
                   g_app_info_get_icon (new_info));
 
-  g_object_unref (info);
   return !is_unchanged;
 }
 
-static GDesktopAppInfo *
-get_new_desktop_app_info_from_app (ShellApp *app)
-{
-  const char *id;
-
-  if (shell_app_is_window_backed (app))
-    return NULL;
-
-  /* If g_app_info_delete() was called, such as when a custom desktop
-   * icon is removed, the desktop ID of the underlying GDesktopAppInfo
-   * will be set to NULL.
-   * So we explicitly check for that case and mark the app as stale.
-   * See https://git.gnome.org/browse/glib/tree/gio/gdesktopappinfo.c?h=glib-2-44&id=2.44.0#n3682
-   */
-  id = shell_app_get_id (app);
-  if (id == NULL)
-    return NULL;
-
-  return g_desktop_app_info_new (id);
-}
-
 static gboolean
 app_info_changed (ShellApp *app, GDesktopAppInfo *desk_new_info)
 {
@@ -257,8 +190,12 @@ app_info_changed (ShellApp *app, GDesktopAppInfo *desk_new_info)
                       g_app_info_get_description (new_info)) == 0);
 }
 
+/* Goes over the apps we know about with the desktop files that
+ * changed; only those apps need a look.
+ */
 static void
-remove_or_update_app_from_info (ShellAppSystem *self)
+remove_or_update_app_from_info (ShellAppSystem *self,
+                                GHashTable     *changes)
 {
   GHashTableIter iter;
   ShellApp *app;
@@ -266,16 +203,35 @@ remove_or_update_app_from_info (ShellAppSystem *self)
   g_hash_table_iter_init (&iter, self->priv->id_to_app);
   while (g_hash_table_iter_next (&iter, NULL, (gpointer) &app))
     {
-      g_autoptr(GDesktopAppInfo) app_info = NULL;
+      GDesktopAppInfo *app_info;
+      const char *id;
 
-      if (app_is_stale (app))
+      if (shell_app_is_window_backed (app))
+        continue;
+
+      /* If g_app_info_delete() was called, such as when a custom desktop
+       * icon is removed, the desktop ID of the underlying GDesktopAppInfo
+       * will be set to NULL.
+       * So we explicitly check for that case and mark the app as stale.
+       * See https://git.gnome.org/browse/glib/tree/gio/gdesktopappinfo.c?h=glib-2-44&id=2.44.0#n3682
+       */
+      id = shell_app_get_id (app);
+      if (id == NULL)
+        {
+          g_hash_table_iter_remove (&iter);
+          continue;
+        }
+
+      if (!g_hash_table_lookup_extended (changes, id, NULL, (gpointer) &app_info))
+        continue;
+
+      if (app_is_stale (app, app_info))
         {
           /* App is stale, we remove it */
           g_hash_table_iter_remove (&iter);
           continue;
         }
 
-      app_info = get_new_desktop_app_info_from_app (app);
       if (app_info_changed (app, app_info))
         {
           _shell_app_set_app_info (app, app_info);
@@ -284,19 +240,79 @@ remove_or_update_app_from_info (ShellAppSystem *self)
     }
 }
 
+static gboolean
+save_snapshot (gpointer user_data)
+{
+  ShellAppSystem *self = user_data;
+  g_autofree char *dir = g_path_get_dirname (self->priv->snapshot_path);
+  g_autoptr(GError) error = NULL;
+
+  self->priv->save_snapshot_id = 0;
+
+  if (g_mkdir_with_parents (dir, 0700) != 0 ||
+      !shell_app_index_save (self->priv->app_index, self->priv->snapshot_path, &error))
+    g_debug ("Could not save the app index: %s",
+             error ? error->message : g_strerror (errno));
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+queue_save_snapshot (ShellAppSystem *self)
+{
+  if (self->priv->save_snapshot_id != 0)
+    return;
+
+  self->priv->save_snapshot_id =
+    g_idle_add_full (G_PRIORITY_LOW, save_snapshot, self, NULL);
+  g_source_set_name_by_id (self->priv->save_snapshot_id,
+                           "[gnome-shell] save_snapshot");
+}
+
+static void
+update_installed (ShellAppSystem *self)
+{
+  GHashTable *changes;
+
+  changes = shell_app_index_update (self->priv->app_index);
+
+  /* The monitor also fires for changes to MIME associations and
+   * such, which don't concern us */
+  if (g_hash_table_size (changes) > 0)
+    {
+      remove_or_update_app_from_info (self, changes);
+      g_signal_emit (self, signals[INSTALLED_CHANGED], 0, NULL);
+      queue_save_snapshot (self);
+    }
+
+  g_hash_table_destroy (changes);
+}
+
+static gboolean
+installed_changed_timeout (gpointer user_data)
+{
+  ShellAppSystem *self = user_data;
+
+  self->priv->installed_changed_id = 0;
+  update_installed (self);
+
+  return G_SOURCE_REMOVE;
+}
+
 static void
 installed_changed (GAppInfoMonitor *monitor,
                    gpointer         user_data)
 {
   ShellAppSystem *self = user_data;
 
-  scan_alias_to_id (self);
+  /* Changes until the timeout are taken in with this one */
+  if (self->priv->installed_changed_id != 0)
+    return;
 
-  scan_startup_wm_class_to_id (self);
-
-  remove_or_update_app_from_info (self);
-
-  g_signal_emit (self, signals[INSTALLED_CHANGED], 0, NULL);
+  self->priv->installed_changed_id =
+    g_timeout_add (INSTALLED_CHANGED_DELAY, installed_changed_timeout, self);
+  g_source_set_name_by_id (self->priv->installed_changed_id,
+                           "[gnome-shell] installed_changed_timeout");
 }
 
 static void
@@ -313,12 +329,30 @@ shell_app_system_init (ShellAppSystem *self)
                                            NULL,
                                            (GDestroyNotify)g_object_unref);
 
-  priv->startup_wm_class_to_id = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
-  priv->alias_to_id = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  priv->app_index = shell_app_index_new ();
+  priv->snapshot_path = g_build_filename (g_get_user_cache_dir (), "gnome-shell",
+                                          APP_INDEX_SNAPSHOT, NULL);
 
   monitor = g_app_info_monitor_get ();
   g_signal_connect (monitor, "changed", G_CALLBACK (installed_changed), self);
-  installed_changed (monitor, self);
+
+  /* With a snapshot, aliases, WM classes and search work right away,
+   * so the app grid and the rest of startup don't wait for the index to
+   * be checked against the installed files; that happens once the main
+   * loop is idle, and whatever changed since the snapshot comes in
+   * through ::installed-changed like any other change.
+   */
+  if (shell_app_index_load (priv->app_index, priv->snapshot_path))
+    {
+      priv->installed_changed_id =
+        g_idle_add_full (G_PRIORITY_LOW, installed_changed_timeout, self, NULL);
+      g_source_set_name_by_id (priv->installed_changed_id,
+                               "[gnome-shell] installed_changed_timeout");
+    }
+  else
+    {
+      update_installed (self);
+    }
 }
 
 static void
@@ -330,8 +364,13 @@ shell_app_system_finalize (GObject *object)
   g_hash_table_destroy (priv->running_apps);
   g_hash_table_destroy (priv->starting_apps);
   g_hash_table_destroy (priv->id_to_app);
-  g_hash_table_destroy (priv->startup_wm_class_to_id);
-  g_hash_table_destroy (priv->alias_to_id);
+  shell_app_index_free (priv->app_index);
+  g_free (priv->snapshot_path);
+
+  if (priv->installed_changed_id != 0)
+    g_source_remove (priv->installed_changed_id);
+  if (priv->save_snapshot_id != 0)
+    g_source_remove (priv->save_snapshot_id);
 
   G_OBJECT_CLASS (shell_app_system_parent_class)->finalize (object);
 }
@@ -366,7 +405,6 @@ shell_app_system_lookup_app (ShellAppSystem   *self,
   ShellAppSystemPrivate *priv = self->priv;
   ShellApp *app;
   GDesktopAppInfo *info;
-  g_autofree char *alias = NULL;
 
   app = g_hash_table_lookup (priv->id_to_app, id);
   if (app)
@@ -380,13 +418,6 @@ shell_app_system_lookup_app (ShellAppSystem   *self,
   g_hash_table_insert (priv->id_to_app, (char *) shell_app_get_id (app), app);
   g_object_unref (info);
 
-  alias = g_desktop_app_info_get_string (info, X_ENDLESS_ALIAS_KEY);
-  if (alias != NULL && g_hash_table_lookup (priv->alias_to_id, alias) == NULL)
-    {
-      g_autofree char *desktop_alias = g_strconcat (alias, ".desktop", NULL);
-      g_hash_table_insert (priv->alias_to_id, g_strdup (desktop_alias), g_strdup (id));
-    }
-
   return app;
 }
 
@@ -447,7 +478,7 @@ shell_app_system_lookup_alias (ShellAppSystem *system,
   if (result != NULL)
     return result;
 
-  id = g_hash_table_lookup (system->priv->alias_to_id, alias);
+  id = shell_app_index_lookup_alias (system->priv->app_index, alias);
   if (id == NULL)
     return NULL;
 
@@ -533,7 +564,7 @@ shell_app_system_lookup_startup_wmclass (ShellAppSystem *system,
   if (wmclass == NULL)
     return NULL;
 
-  id = g_hash_table_lookup (system->priv->startup_wm_class_to_id, wmclass);
+  id = shell_app_index_lookup_startup_wm_class (system->priv->app_index, wmclass);
   if (id == NULL)
     return NULL;
 
@@ -601,9 +632,60 @@ _shell_app_system_notify_app_state_changed (ShellAppSystem *self,
       g_warn_if_reached();
       break;
     }
+
+  if (self->priv->batch_depth > 0)
+    {
+      if (g_list_find (self->priv->batched_apps, app) == NULL)
+        self->priv->batched_apps = g_list_prepend (self->priv->batched_apps,
+                                                   g_object_ref (app));
+      return;
+    }
+
   g_signal_emit (self, signals[APP_STATE_CHANGED], 0, app);
 }
 
+/**
+ * _shell_app_system_begin_batch:
+ * @self: a #ShellAppSystem
+ *
+ * Holds back #ShellAppSystem::app-state-changed until the matching
+ * _shell_app_system_end_batch(). The running and starting apps are
+ * still kept up to date in the meantime. Batches can be nested.
+ */
+void
+_shell_app_system_begin_batch (ShellAppSystem *self)
+{
+  self->priv->batch_depth++;
+}
+
+/**
+ * _shell_app_system_end_batch:
+ * @self: a #ShellAppSystem
+ *
+ * Ends a batch started with _shell_app_system_begin_batch(). Once the
+ * outermost batch ends, #ShellAppSystem::app-state-changed is emitted
+ * once for each app whose state changed, in the order they first
+ * changed, and with the state they ended up in.
+ */
+void
+_shell_app_system_end_batch (ShellAppSystem *self)
+{
+  GList *apps, *l;
+
+  g_return_if_fail (self->priv->batch_depth > 0);
+
+  if (--self->priv->batch_depth > 0)
+    return;
+
+  apps = g_list_reverse (self->priv->batched_apps);
+  self->priv->batched_apps = NULL;
+
+  for (l = apps; l; l = l->next)
+    g_signal_emit (self, signals[APP_STATE_CHANGED], 0, l->data);
+
+  g_list_free_full (apps, g_object_unref);
+}
+
 /**
  * shell_app_system_get_running:
  * @self: A #ShellAppSystem
@@ -648,8 +730,12 @@ shell_app_system_get_running (ShellAppSystem *self)
  * shell_app_system_search:
  * @search_string: the search string to use
  *
- * Wrapper around g_desktop_app_info_search() that replaces results that
- * don't validate as UTF-8 with the empty string.
+ * Searches the installed apps by prefixes of the words in their name,
+ * executable, keywords, generic name and X-Endless-Alias, ignoring
+ * case and accents. The results are grouped like those of
+ * g_desktop_app_info_search(), but come from an index that is kept up
+ * to date as apps are installed and removed. Apps with desktop IDs
+ * that aren't valid UTF-8 are not found.
  *
  * Returns: (array zero-terminated=1) (element-type GStrv) (transfer full): a
  *   list of strvs.  Free each item with g_strfreev() and free the outer
@@ -658,15 +744,9 @@ shell_app_system_get_running (ShellAppSystem *self)
 char ***
 shell_app_system_search (const char *search_string)
 {
-  char ***results = g_desktop_app_info_search (search_string);
-  char ***groups, **ids;
-
-  for (groups = results; *groups; groups++)
-    for (ids = *groups; *ids; ids++)
-      if (!g_utf8_validate (*ids, -1, NULL))
-        **ids = '\0';
+  ShellAppSystem *self = shell_app_system_get_default ();
 
-  return results;
+  return shell_app_index_search (self->priv->app_index, search_string);
 }
 
 gboolean
@@ -2,20 +2,25 @@
 
 #include "config.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include <X11/Xlib.h>
 #include <X11/Xatom.h>
 #include <gdk/gdk.h>
 #include <gdk/gdkx.h>
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <gio/gio.h>
 #include <meta/display.h>
 #include <meta/group.h>
 #include <meta/window.h>
 
 #include "shell-app-usage.h"
+#include "shell-usage-log.h"
 #include "shell-window-tracker.h"
 #include "shell-global.h"
 
@@ -46,8 +51,21 @@
 
 #define USAGE_CLEAN_DAYS 7 /* If after 7 days we haven't seen an app, purge it */
 
-/* Data is saved to file SHELL_CONFIG_DIR/DATA_FILENAME */
-#define DATA_FILENAME "application_state"
+/* Data is saved to files in SHELL_CONFIG_DIR: a snapshot, and a log of
+ * changes since then, as described above ShellUsageLogHeader. Earlier
+ * versions used an XML file, which is read once if there is no
+ * snapshot yet.
+ */
+#define SNAPSHOT_FILENAME "application_usage"
+#define LOG_FILENAME "application_usage.log"
+#define LEGACY_DATA_FILENAME "application_state"
+
+#define USAGE_VERSION 1
+#define USAGE_SNAPSHOT_TYPE "(uta(ssdx))"
+#define USAGE_RECORD_TYPE "(ssdx)" /* context, app ID, score, last seen */
+
+/* Log size past which we write a new snapshot instead */
+#define USAGE_LOG_MAX_SIZE (64 * 1024)
 
 #define IDLE_TIME_TRANSITION_SECONDS 30 /* If we transition to idle, only count
                                          * this many seconds of usage */
@@ -56,6 +74,8 @@
  * divide all scores by 2. Scores are raised by 1 unit every SAVE_APPS_TIMEOUT
  * seconds. This mechanism allows the list to update relatively fast when
  * a new app is used intensively.
+ * Rather than halving every score, the unit is doubled; scores are kept in
+ * terms of the unit, and only divided by it when they are written out.
  * To keep the list clean, and avoid being Big Brother, apps that have not been
  * seen for a week and whose score is below SCORE_MIN are removed.
  */
@@ -80,7 +100,12 @@ struct _ShellAppUsage
 {
   GObject parent;
 
-  GFile *configfile;
+  char *snapshot_path;
+  char *log_path;
+  int log_fd;
+  gsize log_size;
+  guint64 generation; /* of the snapshot, and the log that goes with it */
+  gboolean needs_compaction;
   GDBusProxy *session_proxy;
   GdkDisplay *display;
   GSettings *privacy_settings;
@@ -90,13 +115,17 @@ struct _ShellAppUsage
   gboolean currently_idle;
   gboolean enable_monitoring;
 
-  GSList *previously_running;
-
   long watch_start_time;
   ShellApp *watched_app;
 
   /* <char *context, GHashTable<char *appid, UsageData *usage>> */
   GHashTable *app_usages_for_context;
+
+  /* <char *context, GPtrArray<UsageData *usage>>, by decreasing score */
+  GHashTable *rankings_for_context;
+
+  /* What one unit of usage adds to a score */
+  gdouble score_unit;
 };
 
 G_DEFINE_TYPE (ShellAppUsage, shell_app_usage, G_TYPE_OBJECT);
@@ -111,6 +140,12 @@ struct UsageData
 
   gdouble score; /* Based on the number of times we'e seen the app and normalized */
   long last_seen; /* Used to clear old apps we've only seen a few times */
+
+  gboolean dirty; /* Changed since it was last saved */
+
+  const char *id; /* Owned by the usage table */
+  GPtrArray *ranking; /* The ranking of the context */
+  guint rank; /* Position in the ranking */
 };
 
 static void shell_app_usage_finalize (GObject *object);
@@ -124,7 +159,8 @@ static UsageData * get_app_usage_for_context_and_id (ShellAppUsage  *self,
 
 static gboolean idle_save_application_usage (gpointer data);
 
-static void restore_from_file (ShellAppUsage *self);
+static void restore_from_file (ShellAppUsage *self,
+                               const char    *dir);
 
 static void update_enable_monitoring (ShellAppUsage *self);
 
@@ -160,10 +196,60 @@ get_usages_for_context (ShellAppUsage *self,
       context_usages = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
       g_hash_table_insert (self->app_usages_for_context, g_strdup (context),
                            context_usages);
+      g_hash_table_insert (self->rankings_for_context, g_strdup (context),
+                           g_ptr_array_new ());
     }
   return context_usages;
 }
 
+/* Moves @usage to its place in the ranking after its score changed;
+ * as scores mostly go up by a bit, that's usually a step or none.
+ */
+static void
+update_rank (UsageData *usage)
+{
+  GPtrArray *ranking = usage->ranking;
+  guint rank = usage->rank;
+
+  while (rank > 0)
+    {
+      UsageData *above = g_ptr_array_index (ranking, rank - 1);
+
+      if (above->score >= usage->score)
+        break;
+
+      ranking->pdata[rank] = above;
+      above->rank = rank;
+      rank--;
+    }
+
+  while (rank + 1 < ranking->len)
+    {
+      UsageData *below = g_ptr_array_index (ranking, rank + 1);
+
+      if (below->score <= usage->score)
+        break;
+
+      ranking->pdata[rank] = below;
+      below->rank = rank;
+      rank++;
+    }
+
+  ranking->pdata[rank] = usage;
+  usage->rank = rank;
+}
+
+static void
+remove_rank (UsageData *usage)
+{
+  GPtrArray *ranking = usage->ranking;
+  guint i;
+
+  g_ptr_array_remove_index (ranking, usage->rank);
+  for (i = usage->rank; i < ranking->len; i++)
+    ((UsageData *) g_ptr_array_index (ranking, i))->rank = i;
+}
+
 static UsageData *
 get_app_usage_for_context_and_id (ShellAppUsage *self,
                                   const char    *context,
@@ -179,7 +265,13 @@ get_app_usage_for_context_and_id (ShellAppUsage *self,
     return usage;
 
   usage = g_new0 (UsageData, 1);
-  g_hash_table_insert (context_usages, g_strdup (appid), usage);
+  usage->id = g_strdup (appid);
+  g_hash_table_insert (context_usages, (char *) usage->id, usage);
+
+  /* With no score yet, it goes last */
+  usage->ranking = g_hash_table_lookup (self->rankings_for_context, context);
+  usage->rank = usage->ranking->len;
+  g_ptr_array_add (usage->ranking, usage);
 
   return usage;
 }
@@ -200,6 +292,7 @@ typedef struct {
   GHashTableIter context_iter;
   const char *context_id;
   GHashTableIter usage_iter;
+  UsageData *usage;
 } UsageIterator;
 
 static void
@@ -243,7 +336,7 @@ usage_iterator_next (ShellAppUsage   *self,
 
   *context = iter->context_id;
   *id = key;
-  *usage = value;
+  *usage = iter->usage = value;
 
   return TRUE;
 }
@@ -254,24 +347,42 @@ usage_iterator_remove (ShellAppUsage *self,
 {
   g_assert (iter->in_context);
 
+  remove_rank (iter->usage);
   g_hash_table_iter_remove (&(iter->usage_iter));
 }
 
-/* Limit the score to a certain level so that most used apps can change */
+/* Limit the score to a certain level so that most used apps can change;
+ * halving all scores is the same as doubling the unit, and keeps the
+ * ranking as it is.
+ */
 static void
 normalize_usage (ShellAppUsage *self)
+{
+  self->score_unit *= 2;
+
+  /* The next snapshot has the scores divided again */
+  self->needs_compaction = TRUE;
+}
+
+/* Scores as they were before the unit changed; done when all scores
+ * are walked through anyway.
+ */
+static void
+rebase_usage (ShellAppUsage *self)
 {
   UsageIterator iter;
   const char *context;
   const char *id;
   UsageData *usage;
 
-  usage_iterator_init (self, &iter);
+  if (self->score_unit == 1.0)
+    return;
 
+  usage_iterator_init (self, &iter);
   while (usage_iterator_next (self, &iter, &context, &id, &usage))
-    {
-      usage->score /= 2;
-    }
+    usage->score /= self->score_unit;
+
+  self->score_unit = 1.0;
 }
 
 static void
@@ -286,13 +397,15 @@ increment_usage_for_app_at_time (ShellAppUsage *self,
   usage = get_usage_for_app (self, app);
 
   usage->last_seen = time;
+  usage->dirty = TRUE;
 
   elapsed = time - self->watch_start_time;
   usage_count = elapsed / FOCUS_TIME_MIN_SECONDS;
   if (usage_count > 0)
     {
-      usage->score += usage_count;
-      if (usage->score > SCORE_MAX)
+      usage->score += usage_count * self->score_unit;
+      update_rank (usage);
+      if (usage->score > SCORE_MAX * self->score_unit)
         normalize_usage (self);
       ensure_queued_save (self);
     }
@@ -323,7 +436,10 @@ on_app_state_changed (ShellAppSystem *app_system,
   running = shell_app_get_state (app) == SHELL_APP_STATE_RUNNING;
 
   if (running)
-    usage->last_seen = get_time ();
+    {
+      usage->last_seen = get_time ();
+      usage->dirty = TRUE;
+    }
 }
 
 static void
@@ -388,7 +504,7 @@ static void
 shell_app_usage_init (ShellAppUsage *self)
 {
   ShellGlobal *global;
-  char *shell_userdata_dir, *path;
+  char *shell_userdata_dir;
   GDBusConnection *session_bus;
   ShellWindowTracker *tracker;
   ShellAppSystem *app_system;
@@ -396,6 +512,8 @@ shell_app_usage_init (ShellAppUsage *self)
   global = shell_global_get ();
 
   self->app_usages_for_context = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) g_hash_table_destroy);
+  self->rankings_for_context = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) g_ptr_array_unref);
+  self->score_unit = 1.0;
 
   tracker = shell_window_tracker_get_default ();
   g_signal_connect (tracker, "notify::focus-app", G_CALLBACK (on_focus_app_changed), self);
@@ -419,12 +537,13 @@ shell_app_usage_init (ShellAppUsage *self)
   self->currently_idle = FALSE;
   self->enable_monitoring = FALSE;
 
+  self->log_fd = -1;
+
   g_object_get (global, "userdatadir", &shell_userdata_dir, NULL),
-  path = g_build_filename (shell_userdata_dir, DATA_FILENAME, NULL);
+  self->snapshot_path = g_build_filename (shell_userdata_dir, SNAPSHOT_FILENAME, NULL);
+  self->log_path = g_build_filename (shell_userdata_dir, LOG_FILENAME, NULL);
+  restore_from_file (self, shell_userdata_dir);
   g_free (shell_userdata_dir);
-  self->configfile = g_file_new_for_path (path);
-  g_free (path);
-  restore_from_file (self);
 
   self->privacy_settings = g_settings_new(PRIVACY_SCHEMA);
   g_signal_connect (self->privacy_settings,
@@ -444,42 +563,23 @@ shell_app_usage_finalize (GObject *object)
 
   g_object_unref (self->privacy_settings);
 
-  g_object_unref (self->configfile);
+  if (self->log_fd >= 0)
+    close (self->log_fd);
+  g_free (self->snapshot_path);
+  g_free (self->log_path);
 
   g_object_unref (self->session_proxy);
 
   G_OBJECT_CLASS (shell_app_usage_parent_class)->finalize(object);
 }
 
-typedef struct {
-  ShellAppUsage *usage;
-  GHashTable *context_usages;
-} SortAppsByUsageData;
-
-static int
-sort_apps_by_usage (gconstpointer a,
-                    gconstpointer b,
-                    gpointer      datap)
-{
-  SortAppsByUsageData *data = datap;
-  ShellApp *app_a, *app_b;
-  UsageData *usage_a, *usage_b;
-
-  app_a = (ShellApp*)a;
-  app_b = (ShellApp*)b;
-
-  usage_a = g_hash_table_lookup (data->context_usages, shell_app_get_id (app_a));
-  usage_b = g_hash_table_lookup (data->context_usages, shell_app_get_id (app_b));
-
-  return usage_b->score - usage_a->score;
-}
-
 /**
  * shell_app_usage_get_most_used:
  * @usage: the usage instance to request
  * @context: Activity identifier
  *
- * Get a list of most popular applications for a given context.
+ * Get a list of most popular applications for a given context. The
+ * ranking is kept up to date as usage changes, so this doesn't sort.
  *
  * Returns: (element-type ShellApp) (transfer full): List of applications
  */
@@ -488,37 +588,30 @@ shell_app_usage_get_most_used (ShellAppUsage   *self,
                                const char      *context)
 {
   GSList *apps;
-  GList *appids, *iter;
-  GHashTable *usages;
+  GPtrArray *ranking;
   ShellAppSystem *appsys;
-  SortAppsByUsageData data;
+  guint i;
 
-  usages = g_hash_table_lookup (self->app_usages_for_context, context);
-  if (usages == NULL)
+  ranking = g_hash_table_lookup (self->rankings_for_context, context);
+  if (ranking == NULL)
     return NULL;
 
   appsys = shell_app_system_get_default ();
 
-  appids = g_hash_table_get_keys (usages);
+  /* Prepending from the bottom, so the list starts at the top */
   apps = NULL;
-  for (iter = appids; iter; iter = iter->next)
+  for (i = ranking->len; i > 0; i--)
     {
-      const char *appid = iter->data;
+      UsageData *usage = g_ptr_array_index (ranking, i - 1);
       ShellApp *app;
 
-      app = shell_app_system_lookup_app (appsys, appid);
+      app = shell_app_system_lookup_app (appsys, usage->id);
       if (!app)
         continue;
 
       apps = g_slist_prepend (apps, g_object_ref (app));
     }
 
-  g_list_free (appids);
-
-  data.usage = self;
-  data.context_usages = usages;
-  apps = g_slist_sort_with_data (apps, sort_apps_by_usage, &data);
-
   return apps;
 }
 
@@ -591,7 +684,7 @@ idle_clean_usage (ShellAppUsage *self)
 
   while (usage_iterator_next (self, &iter, &context, &id, &usage))
     {
-      if ((usage->score < SCORE_MIN) &&
+      if ((usage->score < SCORE_MIN * self->score_unit) &&
           (usage->last_seen < week_ago))
         usage_iterator_remove (self, &iter);
     }
@@ -599,168 +692,350 @@ idle_clean_usage (ShellAppUsage *self)
   return FALSE;
 }
 
+/* Usage data is kept in a snapshot, and changes since then in a log.
+ *
+ * The snapshot is a serialized USAGE_SNAPSHOT_TYPE GVariant that is
+ * mapped at startup. The log holds USAGE_RECORD_TYPE records, framed
+ * as described in shell-usage-log.h.
+ *
+ * Saving appends the apps that changed to the log. Once the log grows
+ * too big, or all scores were halved, a new snapshot is written in its
+ * place. Both files are replaced atomically and synced, and the log is
+ * only replayed over the snapshot of the same generation. A record cut
+ * short by a crash fails its CRC, and replaying stops there.
+ */
 static gboolean
-write_escaped (GDataOutputStream   *stream,
-               const char          *str,
-               GError             **error)
+set_error_from_errno (GError     **error,
+                      int          saved_errno,
+                      const char  *path)
 {
-  gboolean ret;
-  char *quoted = g_markup_escape_text (str, -1);
-  ret = g_data_output_stream_put_string (stream, quoted, NULL, error);
-  g_free (quoted);
-  return ret;
+  g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+               "%s: %s", path, g_strerror (saved_errno));
+  return FALSE;
 }
 
 static gboolean
-write_attribute_string (GDataOutputStream *stream,
-                        const char        *elt_name,
-                        const char        *str,
-                        GError           **error)
+write_all (int           fd,
+           const guint8 *data,
+           gsize         size)
+{
+  while (size > 0)
+    {
+      gssize written = write (fd, data, size);
+
+      if (written < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return FALSE;
+        }
+
+      data += written;
+      size -= written;
+    }
+
+  return TRUE;
+}
+
+/* Replaces @path with @data such that after a power loss, it holds
+ * either the old or the new contents.
+ */
+static gboolean
+write_file_durably (const char    *path,
+                    gconstpointer  data,
+                    gsize          size,
+                    GError       **error)
+{
+  g_autofree char *tmp_path = g_strconcat (path, ".tmp", NULL);
+  g_autofree char *dir = g_path_get_dirname (path);
+  int fd, dir_fd, saved_errno;
+
+  fd = open (tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0)
+    return set_error_from_errno (error, errno, tmp_path);
+
+  if (!write_all (fd, data, size) || fsync (fd) != 0)
+    {
+      saved_errno = errno;
+      close (fd);
+      g_unlink (tmp_path);
+      return set_error_from_errno (error, saved_errno, tmp_path);
+    }
+  close (fd);
+
+  if (g_rename (tmp_path, path) != 0)
+    {
+      saved_errno = errno;
+      g_unlink (tmp_path);
+      return set_error_from_errno (error, saved_errno, path);
+    }
+
+  /* And the rename itself */
+  dir_fd = open (dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd >= 0)
+    {
+      fsync (dir_fd);
+      close (dir_fd);
+    }
+
+  return TRUE;
+}
+
+static void
+append_record (GByteArray *log,
+               const char *context,
+               const char *id,
+               UsageData  *usage)
 {
-  gboolean ret = FALSE;
-  char *elt;
+  g_autoptr(GVariant) record = NULL;
 
-  elt = g_strdup_printf (" %s=\"", elt_name);
-  ret = g_data_output_stream_put_string (stream, elt, NULL, error);
-  g_free (elt);
-  if (!ret)
-    goto out;
+  record = g_variant_ref_sink (g_variant_new (USAGE_RECORD_TYPE, context, id,
+                                              usage->score, (gint64) usage->last_seen));
+  shell_usage_log_append_record (log, record);
+}
 
-  ret = write_escaped (stream, str, error);
-  if (!ret)
-    goto out;
+static void
+apply_record (GVariant *record,
+              gpointer  user_data)
+{
+  ShellAppUsage *self = user_data;
+  const char *context, *id;
+  UsageData *usage;
+  gdouble score;
+  gint64 last_seen;
 
-  ret = g_data_output_stream_put_string (stream, "\"", NULL, error);
+  g_variant_get (record, "(&s&sdx)", &context, &id, &score, &last_seen);
 
-out:
-  return ret;
+  usage = get_app_usage_for_context_and_id (self, context, id);
+  usage->score = score;
+  usage->last_seen = last_seen;
+  update_rank (usage);
 }
 
 static gboolean
-write_attribute_uint (GDataOutputStream *stream,
-                      const char        *elt_name,
-                      guint              value,
-                      GError           **error)
+open_log (ShellAppUsage  *self,
+          gsize           size,
+          GError        **error)
 {
-  gboolean ret;
-  char *buf;
+  self->log_fd = open (self->log_path, O_WRONLY | O_APPEND | O_CLOEXEC);
+  if (self->log_fd < 0)
+    return set_error_from_errno (error, errno, self->log_path);
 
-  buf = g_strdup_printf ("%u", value);
-  ret = write_attribute_string (stream, elt_name, buf, error);
-  g_free (buf);
+  self->log_size = size;
 
-  return ret;
+  return TRUE;
 }
 
+/* Starts an empty log for the current generation */
 static gboolean
-write_attribute_double (GDataOutputStream *stream,
-                        const char        *elt_name,
-                        double             value,
-                        GError           **error)
+reset_log (ShellAppUsage  *self,
+           GError        **error)
 {
-  gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
-  gboolean ret;
+  ShellUsageLogHeader header;
 
-  g_ascii_dtostr (buf, sizeof (buf), value);
-  ret = write_attribute_string (stream, elt_name, buf, error);
+  if (self->log_fd >= 0)
+    {
+      close (self->log_fd);
+      self->log_fd = -1;
+    }
+
+  shell_usage_log_header_init (&header, self->generation);
+
+  if (!write_file_durably (self->log_path, &header, sizeof (header), error))
+    return FALSE;
 
-  return ret;
+  return open_log (self, sizeof (header), error);
 }
 
-/* Save app data lists to file */
+static void
+clear_dirty (ShellAppUsage *self)
+{
+  UsageIterator iter;
+  const char *context;
+  const char *id;
+  UsageData *usage;
+
+  usage_iterator_init (self, &iter);
+  while (usage_iterator_next (self, &iter, &context, &id, &usage))
+    usage->dirty = FALSE;
+}
+
+/* Writes all usage data to a new snapshot, and empties the log */
 static gboolean
-idle_save_application_usage (gpointer data)
+compact_usage (ShellAppUsage  *self,
+               GError        **error)
 {
-  ShellAppUsage *self = SHELL_APP_USAGE (data);
+  g_autoptr(GVariant) snapshot = NULL;
+  GVariantBuilder builder;
   UsageIterator iter;
-  const char *current_context;
   const char *context;
   const char *id;
   UsageData *usage;
-  GFileOutputStream *output;
-  GOutputStream *buffered_output;
-  GDataOutputStream *data_output;
-  GError *error = NULL;
 
-  self->save_id = 0;
+  rebase_usage (self);
 
-  /* Parent directory is already created by shell-global */
-  output = g_file_replace (self->configfile, NULL, FALSE, G_FILE_CREATE_NONE, NULL, &error);
-  if (!output)
+  g_variant_builder_init (&builder, G_VARIANT_TYPE (USAGE_SNAPSHOT_TYPE));
+  g_variant_builder_add (&builder, "u", USAGE_VERSION);
+  g_variant_builder_add (&builder, "t", self->generation + 1);
+
+  g_variant_builder_open (&builder, G_VARIANT_TYPE ("a(ssdx)"));
+  usage_iterator_init (self, &iter);
+  while (usage_iterator_next (self, &iter, &context, &id, &usage))
     {
-      g_debug ("Could not save applications usage data: %s", error->message);
-      g_error_free (error);
-      return FALSE;
+      if (!shell_app_system_lookup_app (shell_app_system_get_default (), id))
+        continue;
+
+      g_variant_builder_add (&builder, "(ssdx)", context, id,
+                             usage->score, (gint64) usage->last_seen);
     }
-  buffered_output = g_buffered_output_stream_new (G_OUTPUT_STREAM (output));
-  g_object_unref (output);
-  data_output = g_data_output_stream_new (G_OUTPUT_STREAM (buffered_output));
-  g_object_unref (buffered_output);
+  g_variant_builder_close (&builder);
 
-  if (!g_data_output_stream_put_string (data_output, "<?xml version=\"1.0\"?>\n<application-state>\n", NULL, &error))
-    goto out;
+  snapshot = g_variant_ref_sink (g_variant_builder_end (&builder));
 
-  usage_iterator_init (self, &iter);
+  if (!write_file_durably (self->snapshot_path,
+                           g_variant_get_data (snapshot),
+                           g_variant_get_size (snapshot),
+                           error))
+    return FALSE;
+
+  /* A crash before the log is reset leaves the old log behind, which
+   * is ignored for not being of this generation.
+   */
+  self->generation++;
+  self->needs_compaction = FALSE;
+  clear_dirty (self);
+
+  return reset_log (self, error);
+}
+
+/* Appends the records of apps that changed since the last save */
+static gboolean
+append_to_log (ShellAppUsage  *self,
+               GError        **error)
+{
+  g_autoptr(GByteArray) records = g_byte_array_new ();
+  UsageIterator iter;
+  const char *context;
+  const char *id;
+  UsageData *usage;
 
-  current_context = NULL;
+  usage_iterator_init (self, &iter);
   while (usage_iterator_next (self, &iter, &context, &id, &usage))
     {
-      ShellApp *app;
+      if (!usage->dirty)
+        continue;
 
-      app = shell_app_system_lookup_app (shell_app_system_get_default(), id);
+      append_record (records, context, id, usage);
+      usage->dirty = FALSE;
+    }
 
-      if (!app)
-        continue;
+  if (records->len == 0)
+    return TRUE;
 
-      if (context != current_context)
-        {
-          if (current_context != NULL)
-            {
-              if (!g_data_output_stream_put_string (data_output, "  </context>", NULL, &error))
-                goto out;
-            }
-          current_context = context;
-          if (!g_data_output_stream_put_string (data_output, "  <context", NULL, &error))
-            goto out;
-          if (!write_attribute_string (data_output, "id", context, &error))
-            goto out;
-          if (!g_data_output_stream_put_string (data_output, ">\n", NULL, &error))
-            goto out;
-        }
-      if (!g_data_output_stream_put_string (data_output, "    <application", NULL, &error))
-        goto out;
-      if (!write_attribute_string (data_output, "id", id, &error))
-        goto out;
-      if (!write_attribute_uint (data_output, "open-window-count", shell_app_get_n_windows (app), &error))
-        goto out;
-
-      if (!write_attribute_double (data_output, "score", usage->score, &error))
-        goto out;
-      if (!write_attribute_uint (data_output, "last-seen", usage->last_seen, &error))
-        goto out;
-      if (!g_data_output_stream_put_string (data_output, "/>\n", NULL, &error))
-        goto out;
-    }
-  if (current_context != NULL)
-    {
-      if (!g_data_output_stream_put_string (data_output, "  </context>\n", NULL, &error))
-        goto out;
-    }
-  if (!g_data_output_stream_put_string (data_output, "</application-state>\n", NULL, &error))
-    goto out;
-
-out:
-  if (!error)
-    g_output_stream_close_async (G_OUTPUT_STREAM (data_output), 0, NULL, NULL, NULL);
-  g_object_unref (data_output);
-  if (error)
+  if (!write_all (self->log_fd, records->data, records->len) ||
+      fdatasync (self->log_fd) != 0)
+    {
+      /* The log may end with part of a record now, so we can't append
+       * after it anymore.
+       */
+      self->needs_compaction = TRUE;
+      return set_error_from_errno (error, errno, self->log_path);
+    }
+
+  self->log_size += records->len;
+
+  return TRUE;
+}
+
+/* Save app data to file */
+static gboolean
+idle_save_application_usage (gpointer data)
+{
+  ShellAppUsage *self = SHELL_APP_USAGE (data);
+  g_autoptr(GError) error = NULL;
+  gboolean saved;
+
+  self->save_id = 0;
+
+  if (self->needs_compaction || self->log_fd < 0 || self->log_size > USAGE_LOG_MAX_SIZE)
+    saved = compact_usage (self, &error);
+  else
+    saved = append_to_log (self, &error);
+
+  if (!saved)
     {
       g_debug ("Could not save applications usage data: %s", error->message);
-      g_error_free (error);
+      self->needs_compaction = TRUE;
     }
+
   return FALSE;
 }
 
+static gboolean
+load_snapshot (ShellAppUsage  *self,
+               GError        **error)
+{
+  g_autoptr(GMappedFile) file = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GVariant) snapshot = NULL;
+  g_autoptr(GVariant) records = NULL;
+  GVariantIter iter;
+  const char *context, *id;
+  gdouble score;
+  gint64 last_seen;
+  guint32 version;
+  guint64 generation;
+
+  file = g_mapped_file_new (self->snapshot_path, FALSE, error);
+  if (file == NULL)
+    return FALSE;
+
+  bytes = g_mapped_file_get_bytes (file);
+  snapshot = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (USAGE_SNAPSHOT_TYPE),
+                                                           bytes, FALSE));
+
+  g_variant_get (snapshot, "(ut@a(ssdx))", &version, &generation, &records);
+  if (version != USAGE_VERSION)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "%s: unknown version %u", self->snapshot_path, version);
+      return FALSE;
+    }
+
+  self->generation = generation;
+
+  g_variant_iter_init (&iter, records);
+  while (g_variant_iter_next (&iter, "(&s&sdx)", &context, &id, &score, &last_seen))
+    {
+      UsageData *usage = get_app_usage_for_context_and_id (self, context, id);
+
+      usage->score = score;
+      usage->last_seen = last_seen;
+      update_rank (usage);
+    }
+
+  return TRUE;
+}
+
+/* Replays the log over the snapshot. Returns the size of the part of
+ * the log that was intact, or 0 if the log can't be used.
+ */
+static gsize
+replay_log (ShellAppUsage *self)
+{
+  g_autoptr(GMappedFile) file = NULL;
+
+  file = g_mapped_file_new (self->log_path, FALSE, NULL);
+  if (file == NULL)
+    return 0;
+
+  return shell_usage_log_replay ((const guint8 *) g_mapped_file_get_contents (file),
+                                 g_mapped_file_get_length (file),
+                                 self->generation,
+                                 G_VARIANT_TYPE (USAGE_RECORD_TYPE),
+                                 apply_record, self);
+}
+
 typedef struct {
   ShellAppUsage *self;
   char *context;
@@ -810,7 +1085,6 @@ shell_app_usage_start_element_handler  (GMarkupParseContext *context,
       const char **value;
       UsageData *usage;
       char *appid = NULL;
-      GHashTable *usage_table;
 
       for (attribute = attribute_names, value = attribute_values; *attribute; attribute++, value++)
         {
@@ -831,21 +1105,12 @@ shell_app_usage_start_element_handler  (GMarkupParseContext *context,
           return;
         }
 
-      usage_table = get_usages_for_context (data->self, data->context);
-
-      usage = g_new0 (UsageData, 1);
-      g_hash_table_insert (usage_table, appid, usage);
+      usage = get_app_usage_for_context_and_id (data->self, data->context, appid);
+      g_free (appid);
 
       for (attribute = attribute_names, value = attribute_values; *attribute; attribute++, value++)
         {
-          if (strcmp (*attribute, "open-window-count") == 0)
-            {
-              guint count = strtoul (*value, NULL, 10);
-              if (count > 0)
-                 data->self->previously_running = g_slist_prepend (data->self->previously_running,
-                                                                   g_strdup (appid));
-            }
-          else if (strcmp (*attribute, "score") == 0)
+          if (strcmp (*attribute, "score") == 0)
             {
               usage->score = g_ascii_strtod (*value, NULL);
             }
@@ -854,6 +1119,8 @@ shell_app_usage_start_element_handler  (GMarkupParseContext *context,
               usage->last_seen = (guint) g_ascii_strtoull (*value, NULL, 10);
             }
         }
+
+      update_rank (usage);
     }
   else
     {
@@ -899,24 +1166,22 @@ static GMarkupParser app_state_parse_funcs =
   NULL
 };
 
-/* Load data about apps usage from file */
-static void
-restore_from_file (ShellAppUsage *self)
+/* Load data about apps usage from the XML file of earlier versions */
+static gboolean
+restore_from_legacy_file (ShellAppUsage *self,
+                          const char    *path)
 {
-  GFileInputStream *input;
   ParseData parse_data;
   GMarkupParseContext *parse_context;
-  GError *error = NULL;
-  char buf[1024];
+  g_autofree char *contents = NULL;
+  g_autoptr(GError) error = NULL;
+  gsize length;
 
-  input = g_file_read (self->configfile, NULL, &error);
-  if (error)
+  if (!g_file_get_contents (path, &contents, &length, &error))
     {
-      if (error->code != G_IO_ERROR_NOT_FOUND)
+      if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
         g_warning ("Could not load applications usage data: %s", error->message);
-
-      g_error_free (error);
-      return;
+      return FALSE;
     }
 
   memset (&parse_data, 0, sizeof (ParseData));
@@ -924,27 +1189,60 @@ restore_from_file (ShellAppUsage *self)
   parse_data.context = NULL;
   parse_context = g_markup_parse_context_new (&app_state_parse_funcs, 0, &parse_data, NULL);
 
-  while (TRUE)
-    {
-      gssize count = g_input_stream_read ((GInputStream*) input, buf, sizeof(buf), NULL, &error);
-      if (count <= 0)
-        goto out;
-      if (!g_markup_parse_context_parse (parse_context, buf, count, &error))
-        goto out;
-     }
+  if (!g_markup_parse_context_parse (parse_context, contents, length, &error))
+    g_warning ("Could not load applications usage data: %s", error->message);
 
-out:
   g_free (parse_data.context);
   g_markup_parse_context_free (parse_context);
-  g_input_stream_close ((GInputStream*)input, NULL, NULL);
-  g_object_unref (input);
+
+  return TRUE;
+}
+
+/* Load data about apps usage from file */
+static void
+restore_from_file (ShellAppUsage *self,
+                   const char    *dir)
+{
+  g_autofree char *legacy_path = g_build_filename (dir, LEGACY_DATA_FILENAME, NULL);
+  g_autoptr(GError) error = NULL;
+  gboolean migrated = FALSE;
+  gsize log_size = 0;
+
+  if (load_snapshot (self, &error))
+    {
+      log_size = replay_log (self);
+    }
+  else
+    {
+      if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        g_warning ("Could not load applications usage data: %s", error->message);
+      g_clear_error (&error);
+
+      migrated = restore_from_legacy_file (self, legacy_path);
+      self->needs_compaction = TRUE;
+    }
 
   idle_clean_usage (self);
 
-  if (error)
+  if (!self->needs_compaction)
+    {
+      /* Drop what a crash left of the last record, if anything, so
+       * new records don't end up behind it. */
+      if (log_size == 0)
+        reset_log (self, &error);
+      else if (truncate (self->log_path, log_size) != 0)
+        set_error_from_errno (&error, errno, self->log_path);
+      else
+        open_log (self, log_size, &error);
+    }
+
+  if (self->needs_compaction || error != NULL)
     {
-      g_warning ("Could not load applications usage data: %s", error->message);
-      g_error_free (error);
+      g_clear_error (&error);
+      if (!compact_usage (self, &error))
+        g_warning ("Could not save applications usage data: %s", error->message);
+      else if (migrated)
+        g_unlink (legacy_path);
     }
 }
 
@@ -9,8 +9,10 @@
 #include <meta/display.h>
 
 #include "shell-app-private.h"
+#include "shell-app-prelaunch.h"
 #include "shell-enum-types.h"
 #include "shell-global.h"
+#include "shell-perf-log.h"
 #include "shell-util.h"
 #include "shell-app-system-private.h"
 #include "shell-window-tracker-private.h"
@@ -30,6 +32,12 @@ typedef enum {
   MATCH_PREFIX, /* Strict prefix */
 } ShellAppSearchMatch;
 
+/* Files read ahead for an app are likely still cached this long after */
+#define PRELAUNCH_INTERVAL (60 * G_USEC_PER_SEC)
+
+/* A window showing up later than this is not the result of a launch */
+#define LAUNCH_TIMEOUT (60 * G_USEC_PER_SEC)
+
 /* This is mainly a memory usage optimization - the user is going to
  * be running far fewer of the applications at one time than they have
  * installed.  But it also just helps keep the code more logically
@@ -41,7 +49,13 @@ typedef struct {
   /* Signal connection to dirty window sort list on workspace changes */
   guint workspace_switch_id;
 
+  /* Kept sorted as described in shell_app_get_windows(); windows are
+   * moved into place as their user time changes, while the whole list
+   * is only sorted again after a workspace switch, a window moving to
+   * another workspace, or a window being minimized or unminimized.
+   */
   GSList *windows;
+  guint n_windows;
 
   guint interesting_windows;
   guint speedwagon_windows;
@@ -86,6 +100,14 @@ struct _ShellApp
 
   ShellAppRunningState *running_state;
 
+  /* When the app was last launched, until its first window shows up,
+   * and whether it was stopped then.
+   */
+  gint64 launch_time;
+  gboolean launch_was_cold;
+
+  gint64 prelaunch_time;
+
   char *window_id_string;
   char *name_collation_key;
 };
@@ -108,6 +130,10 @@ enum {
 
 static guint shell_app_signals[LAST_SIGNAL] = { 0 };
 
+/* Live objects, for the perf log statistics */
+static int n_apps_alive = 0;
+static int n_running_states_alive = 0;
+
 static void create_running_state (ShellApp *app);
 static void unref_running_state (ShellAppRunningState *state);
 
@@ -734,12 +760,109 @@ shell_app_get_windows (ShellApp *app)
   return app->running_state->windows;
 }
 
+/**
+ * shell_app_window_iter_init: (skip)
+ * @iter: an uninitialized #ShellAppWindowIter
+ * @app: a #ShellApp
+ *
+ * Initializes @iter to go through the windows of @app in the order
+ * given by shell_app_get_windows(), without allocating anything.
+ * The windows of @app must not change while @iter is in use.
+ */
+void
+shell_app_window_iter_init (ShellAppWindowIter *iter,
+                            ShellApp           *app)
+{
+  iter->dummy = shell_app_get_windows (app);
+}
+
+/**
+ * shell_app_window_iter_next: (skip)
+ * @iter: a #ShellAppWindowIter
+ * @window: (out) (transfer none): the next window
+ *
+ * Advances @iter to the next window.
+ *
+ * Returns: %FALSE once there are no more windows
+ */
+gboolean
+shell_app_window_iter_next (ShellAppWindowIter  *iter,
+                            MetaWindow         **window)
+{
+  GSList *link = iter->dummy;
+
+  if (link == NULL)
+    return FALSE;
+
+  *window = link->data;
+  iter->dummy = link->next;
+  return TRUE;
+}
+
+/* Moves @window to its place in the window list after its sort key
+ * changed, and returns whether the order of the windows changed. This
+ * costs a walk of the list rather than the sort shell_app_get_windows()
+ * would do.
+ */
+static gboolean
+shell_app_place_window (ShellApp   *app,
+                        MetaWindow *window)
+{
+  ShellAppRunningState *state = app->running_state;
+  CompareWindowsData data;
+  GSList *link, *prev, *next;
+
+  /* The whole list is sorted again on the next query anyway */
+  if (state->window_sort_stale)
+    return TRUE;
+
+  link = g_slist_find (state->windows, window);
+  g_return_val_if_fail (link != NULL, FALSE);
+
+  prev = NULL;
+  if (link != state->windows)
+    for (prev = state->windows; prev->next != link; prev = prev->next)
+      ;
+  next = link->next;
+
+  state->windows = g_slist_delete_link (state->windows, link);
+
+  data.app = app;
+  data.active_workspace = meta_screen_get_active_workspace (shell_global_get_screen (shell_global_get ()));
+  state->windows = g_slist_insert_sorted_with_data (state->windows, window,
+                                                    shell_app_compare_windows, &data);
+
+  link = g_slist_find (state->windows, window);
+  if (prev == NULL)
+    return link != state->windows;
+  else
+    return prev->next != link || link->next != next;
+}
+
 guint
 shell_app_get_n_windows (ShellApp *app)
 {
   if (app->running_state == NULL)
     return 0;
-  return g_slist_length (app->running_state->windows);
+  return app->running_state->n_windows;
+}
+
+/**
+ * shell_app_get_window:
+ * @app: a #ShellApp
+ * @index: the position of the window, from 0 to shell_app_get_n_windows() - 1
+ *
+ * Gets a window of @app without building the array of windows
+ * shell_app_get_windows() would from JavaScript. Windows come in
+ * the order described there.
+ *
+ * Returns: (transfer none) (nullable): the window at @index, or %NULL
+ */
+MetaWindow *
+shell_app_get_window (ShellApp *app,
+                      guint     index)
+{
+  return g_slist_nth_data (shell_app_get_windows (app), index);
 }
 
 gboolean
@@ -917,14 +1040,32 @@ shell_app_on_user_time_changed (MetaWindow *window,
 {
   g_assert (app->running_state != NULL);
 
-  /* Ideally we don't want to emit windows-changed if the sort order
-   * isn't actually changing. This check catches most of those.
+  /* Focusing a window bumps its user time, so this is also how focus
+   * changes reach the window order. Only emit windows-changed if the
+   * order actually changed.
    */
-  if (window != app->running_state->windows->data)
-    {
-      app->running_state->window_sort_stale = TRUE;
-      g_signal_emit (app, shell_app_signals[WINDOWS_CHANGED], 0);
-    }
+  if (shell_app_place_window (app, window))
+    g_signal_emit (app, shell_app_signals[WINDOWS_CHANGED], 0);
+}
+
+static void
+shell_app_on_minimized_changed (MetaWindow *window,
+                                GParamSpec *pspec,
+                                ShellApp   *app)
+{
+  g_assert (app->running_state != NULL);
+
+  /* Showing or hiding a window can move it past any of the others */
+  app->running_state->window_sort_stale = TRUE;
+}
+
+/* Connected swapped, since only the app matters here */
+static void
+shell_app_on_window_workspace_changed (ShellApp *app)
+{
+  g_assert (app->running_state != NULL);
+
+  app->running_state->window_sort_stale = TRUE;
 }
 
 static void
@@ -1072,6 +1213,29 @@ shell_app_is_interesting_window (MetaWindow *window)
   return shell_window_tracker_is_window_interesting (window);
 }
 
+/* Reports how long @app took to show @window since it was launched,
+ * and records what it used to get there for the next launch.
+ */
+static void
+shell_app_finish_launch (ShellApp   *app,
+                         MetaWindow *window)
+{
+  ShellPerfLog *perf_log = shell_perf_log_get_default ();
+  gint64 latency;
+
+  latency = g_get_monotonic_time () - app->launch_time;
+  app->launch_time = 0;
+
+  if (latency > LAUNCH_TIMEOUT)
+    return;
+
+  shell_perf_log_event_s (perf_log, "app.firstWindow", shell_app_get_id (app));
+  shell_perf_log_event_x (perf_log, "app.launchLatency", latency);
+
+  if (app->launch_was_cold)
+    shell_app_prelaunch_record (shell_app_get_id (app), meta_window_get_pid (window));
+}
+
 void
 _shell_app_add_window (ShellApp        *app,
                        MetaWindow      *window)
@@ -1084,10 +1248,14 @@ _shell_app_add_window (ShellApp        *app,
   if (!app->running_state)
       create_running_state (app);
 
-  app->running_state->window_sort_stale = TRUE;
   app->running_state->windows = g_slist_prepend (app->running_state->windows, g_object_ref (window));
+  app->running_state->n_windows++;
+  shell_app_place_window (app, window);
+  _shell_window_tracker_add_app_window (app, window);
   g_signal_connect (window, "unmanaged", G_CALLBACK(shell_app_on_unmanaged), app);
   g_signal_connect (window, "notify::user-time", G_CALLBACK(shell_app_on_user_time_changed), app);
+  g_signal_connect (window, "notify::minimized", G_CALLBACK(shell_app_on_minimized_changed), app);
+  g_signal_connect_swapped (window, "workspace-changed", G_CALLBACK(shell_app_on_window_workspace_changed), app);
   g_signal_connect (window, "notify::skip-taskbar", G_CALLBACK(shell_app_on_skip_taskbar_changed), app);
 
   shell_app_update_app_menu (app, window);
@@ -1100,6 +1268,9 @@ _shell_app_add_window (ShellApp        *app,
 
   shell_app_sync_running_state (app);
 
+  if (app->launch_time != 0 && shell_app_is_interesting_window (window))
+    shell_app_finish_launch (app, window);
+
   g_object_thaw_notify (G_OBJECT (app));
 
   g_signal_emit (app, shell_app_signals[WINDOWS_CHANGED], 0);
@@ -1114,11 +1285,15 @@ _shell_app_remove_window (ShellApp   *app,
   if (!g_slist_find (app->running_state->windows, window))
     return;
 
+  _shell_window_tracker_remove_app_window (app, window);
   g_signal_handlers_disconnect_by_func (window, G_CALLBACK(shell_app_on_unmanaged), app);
   g_signal_handlers_disconnect_by_func (window, G_CALLBACK(shell_app_on_user_time_changed), app);
+  g_signal_handlers_disconnect_by_func (window, G_CALLBACK(shell_app_on_minimized_changed), app);
+  g_signal_handlers_disconnect_by_func (window, G_CALLBACK(shell_app_on_window_workspace_changed), app);
   g_signal_handlers_disconnect_by_func (window, G_CALLBACK(shell_app_on_skip_taskbar_changed), app);
   g_object_unref (window);
   app->running_state->windows = g_slist_remove (app->running_state->windows, window);
+  app->running_state->n_windows--;
 
   if (shell_app_is_interesting_window (window))
     app->running_state->interesting_windows--;
@@ -1148,12 +1323,13 @@ GSList *
 shell_app_get_pids (ShellApp *app)
 {
   GSList *result;
-  GSList *iter;
+  ShellAppWindowIter iter;
+  MetaWindow *window;
 
   result = NULL;
-  for (iter = shell_app_get_windows (app); iter; iter = iter->next)
+  shell_app_window_iter_init (&iter, app);
+  while (shell_app_window_iter_next (&iter, &window))
     {
-      MetaWindow *window = iter->data;
       int pid = meta_window_get_pid (window);
       /* Note in the (by far) common case, app will only have one pid, so
        * we'll hit the first element, so don't worry about O(N^2) here.
@@ -1277,6 +1453,8 @@ shell_app_launch (ShellApp     *app,
 {
   ShellGlobal *global;
   GAppLaunchContext *context;
+  gint64 launch_time;
+  gboolean launch_was_cold;
   gboolean ret;
 
   if (app->info == NULL)
@@ -1297,6 +1475,10 @@ shell_app_launch (ShellApp     *app,
   if (discrete_gpu)
     g_app_launch_context_setenv (context, "DRI_PRIME", "1");
 
+  /* Spawning takes part of the latency the user sees */
+  launch_time = g_get_monotonic_time ();
+  launch_was_cold = app->state == SHELL_APP_STATE_STOPPED;
+
   ret = g_desktop_app_info_launch_uris_as_manager (app->info, NULL,
                                                    context,
                                                    G_SPAWN_SEARCH_PATH | G_SPAWN_DO_NOT_REAP_CHILD,
@@ -1309,9 +1491,48 @@ shell_app_launch (ShellApp     *app,
                                                    error);
   g_object_unref (context);
 
+  if (ret)
+    {
+      app->launch_time = launch_time;
+      app->launch_was_cold = launch_was_cold;
+      shell_perf_log_event_s (shell_perf_log_get_default (),
+                              "app.launch", shell_app_get_id (app));
+    }
+
   return ret;
 }
 
+/**
+ * shell_app_prelaunch:
+ * @app: a #ShellApp
+ *
+ * Hints that @app is likely to be launched soon, for instance because
+ * the pointer is over its icon. Its executable, and the files it had
+ * used by the time its first window showed up the last time it was
+ * launched, are read into the page cache from a thread, so that
+ * launching it starts warm.
+ *
+ * Nothing happens if @app is running, or was hinted at shortly before.
+ */
+void
+shell_app_prelaunch (ShellApp *app)
+{
+  gint64 now;
+
+  if (app->info == NULL || app->state != SHELL_APP_STATE_STOPPED)
+    return;
+
+  now = g_get_monotonic_time ();
+  if (app->prelaunch_time != 0 && now - app->prelaunch_time < PRELAUNCH_INTERVAL)
+    return;
+  app->prelaunch_time = now;
+
+  shell_perf_log_event_s (shell_perf_log_get_default (),
+                          "app.prelaunch", shell_app_get_id (app));
+  shell_app_prelaunch_read_ahead (shell_app_get_id (app),
+                                  g_app_info_get_executable (G_APP_INFO (app->info)));
+}
+
 /**
  * shell_app_launch_action:
  * @app: the #ShellApp
@@ -1360,6 +1581,7 @@ create_running_state (ShellApp *app)
   screen = shell_global_get_screen (shell_global_get ());
   app->running_state = g_slice_new0 (ShellAppRunningState);
   app->running_state->refcount = 1;
+  n_running_states_alive++;
   app->running_state->workspace_switch_id =
     g_signal_connect (screen, "workspace-switched", G_CALLBACK(shell_app_on_ws_switch), app);
 
@@ -1438,6 +1660,7 @@ unref_running_state (ShellAppRunningState *state)
   g_clear_pointer (&state->remote_menu, g_free);
 
   g_slice_free (ShellAppRunningState, state);
+  n_running_states_alive--;
 }
 
 /**
@@ -1460,6 +1683,7 @@ static void
 shell_app_init (ShellApp *self)
 {
   self->state = SHELL_APP_STATE_STOPPED;
+  n_apps_alive++;
 }
 
 static void
@@ -1488,9 +1712,39 @@ shell_app_finalize (GObject *object)
 
   g_free (app->name_collation_key);
 
+  n_apps_alive--;
+
   G_OBJECT_CLASS(shell_app_parent_class)->finalize (object);
 }
 
+void
+_shell_app_get_allocation_counts (int *n_apps,
+                                  int *n_bytes)
+{
+  *n_apps = n_apps_alive;
+  *n_bytes = n_apps_alive * sizeof (ShellApp) +
+             n_running_states_alive * sizeof (ShellAppRunningState);
+}
+
+static void
+shell_app_define_launch_events (void)
+{
+  ShellPerfLog *perf_log = shell_perf_log_get_default ();
+
+  shell_perf_log_define_event (perf_log, "app.launch",
+                               "An app was launched",
+                               "s");
+  shell_perf_log_define_event (perf_log, "app.firstWindow",
+                               "A launched app showed its first window",
+                               "s");
+  shell_perf_log_define_event (perf_log, "app.launchLatency",
+                               "Microseconds the app of the preceding app.firstWindow took to show it",
+                               "x");
+  shell_perf_log_define_event (perf_log, "app.prelaunch",
+                               "An app was read ahead as likely to be launched",
+                               "s");
+}
+
 static void
 shell_app_class_init(ShellAppClass *klass)
 {
@@ -1501,6 +1755,8 @@ shell_app_class_init(ShellAppClass *klass)
   gobject_class->dispose = shell_app_dispose;
   gobject_class->finalize = shell_app_finalize;
 
+  shell_app_define_launch_events ();
+
   shell_app_signals[WINDOWS_CHANGED] = g_signal_new ("windows-changed",
                                      SHELL_TYPE_APP,
                                      G_SIGNAL_RUN_LAST,
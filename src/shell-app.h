@@ -49,13 +49,27 @@ ShellAppState shell_app_get_state (ShellApp *app);
 gboolean shell_app_request_quit (ShellApp *app);
 
 guint shell_app_get_n_windows (ShellApp *app);
+MetaWindow *shell_app_get_window (ShellApp *app,
+                                  guint     index);
 
 GSList *shell_app_get_windows (ShellApp *app);
 
+typedef struct {
+  /*< private >*/
+  gpointer dummy;
+} ShellAppWindowIter;
+
+void     shell_app_window_iter_init (ShellAppWindowIter  *iter,
+                                     ShellApp            *app);
+gboolean shell_app_window_iter_next (ShellAppWindowIter  *iter,
+                                     MetaWindow         **window);
+
 GSList *shell_app_get_pids (ShellApp *app);
 
 gboolean shell_app_is_on_workspace (ShellApp *app, MetaWorkspace *workspace);
 
+void shell_app_prelaunch (ShellApp *app);
+
 gboolean shell_app_launch (ShellApp     *app,
                            guint         timestamp,
                            int           workspace,
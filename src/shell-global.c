@@ -44,10 +44,11 @@
 #include <sys/sysctl.h>
 #endif
 
+#include "shell-app-private.h"
 #include "shell-enum-types.h"
 #include "shell-global-private.h"
 #include "shell-perf-log.h"
-#include "shell-window-tracker.h"
+#include "shell-window-tracker-private.h"
 #include "shell-wm.h"
 #include "st.h"
 
@@ -83,8 +84,15 @@ struct _ShellGlobal {
   StFocusManager *focus_manager;
 
   guint work_count;
-  GSList *leisure_closures;
+  GQueue leisure_queues[SHELL_N_LEISURE_PRIORITIES];
+  guint leisure_last_id;
   guint leisure_function_id;
+  guint leisure_frame_timeout_id;
+  gint64 leisure_frame_time_used;
+  gpointer leisure_running_task;
+  gint64 leisure_latency_max;
+  gint64 leisure_latency_total;
+  guint leisure_n_started;
 
   /* For sound notifications */
   ca_context *sound_context;
@@ -92,6 +100,19 @@ struct _ShellGlobal {
   gboolean has_modal;
   gboolean frame_timestamps;
   gboolean frame_finish_timestamp;
+
+  /* Redraw accounting */
+  gboolean frame_damage;
+  gboolean report_noop_redraws;
+  gulong queue_redraw_id;
+  GHashTable *redraw_origins;
+  gboolean frame_painted;
+  gboolean checking_redraws;
+  cairo_rectangle_int_t frame_clip;
+  gint64 frame_damage_area;
+  int n_painted_frames;
+  int n_full_stage_frames;
+  gint64 damaged_pixels;
 };
 
 enum {
@@ -114,6 +135,8 @@ enum {
   PROP_FOCUS_MANAGER,
   PROP_FRAME_TIMESTAMPS,
   PROP_FRAME_FINISH_TIMESTAMP,
+  PROP_FRAME_DAMAGE,
+  PROP_REPORT_NOOP_REDRAWS,
 };
 
 /* Signals */
@@ -127,6 +150,10 @@ G_DEFINE_TYPE(ShellGlobal, shell_global, G_TYPE_OBJECT);
 
 static guint shell_global_signals [LAST_SIGNAL] = { 0 };
 
+static void leisure_frame_done (ShellGlobal *global);
+static void update_redraw_tracking (ShellGlobal *global);
+static void define_leisure_statistics (ShellGlobal *global);
+
 static void
 shell_global_set_property(GObject         *object,
                           guint            prop_id,
@@ -147,6 +174,14 @@ shell_global_set_property(GObject         *object,
     case PROP_FRAME_FINISH_TIMESTAMP:
       global->frame_finish_timestamp = g_value_get_boolean (value);
       break;
+    case PROP_FRAME_DAMAGE:
+      global->frame_damage = g_value_get_boolean (value);
+      update_redraw_tracking (global);
+      break;
+    case PROP_REPORT_NOOP_REDRAWS:
+      global->report_noop_redraws = g_value_get_boolean (value);
+      update_redraw_tracking (global);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -224,6 +259,12 @@ shell_global_get_property(GObject         *object,
     case PROP_FRAME_FINISH_TIMESTAMP:
       g_value_set_boolean (value, global->frame_finish_timestamp);
       break;
+    case PROP_FRAME_DAMAGE:
+      g_value_set_boolean (value, global->frame_damage);
+      break;
+    case PROP_REPORT_NOOP_REDRAWS:
+      g_value_set_boolean (value, global->report_noop_redraws);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -490,6 +531,20 @@ shell_global_class_init (ShellGlobalClass *klass)
                                                          "Whether at the end of a frame to call glFinish and log paintCompletedTimestamp",
                                                          FALSE,
                                                          G_PARAM_READWRITE));
+  g_object_class_install_property (gobject_class,
+                                   PROP_FRAME_DAMAGE,
+                                   g_param_spec_boolean ("frame-damage",
+                                                         "Frame Damage",
+                                                         "Whether to log the repainted area and the actors that queued redraws for each frame in the performance log",
+                                                         FALSE,
+                                                         G_PARAM_READWRITE));
+  g_object_class_install_property (gobject_class,
+                                   PROP_REPORT_NOOP_REDRAWS,
+                                   g_param_spec_boolean ("report-noop-redraws",
+                                                         "Report No-op Redraws",
+                                                         "Whether to report actors that keep queuing redraws without any visible change",
+                                                         FALSE,
+                                                         G_PARAM_READWRITE));
 }
 
 /*
@@ -787,6 +842,299 @@ load_gl_symbol (const char  *name,
   return TRUE;
 }
 
+/* Number of frames in a row an actor needs to queue a redraw without
+ * changing what's on screen before we complain about it */
+#define NOOP_REDRAW_THRESHOLD 60
+
+typedef struct
+{
+  ClutterActor *actor;
+  gboolean queued;
+  guint n_noop_frames;
+  gboolean reported;
+  char *checksum;
+} RedrawOrigin;
+
+static void
+redraw_origin_free (RedrawOrigin *origin)
+{
+  g_free (origin->checksum);
+  g_slice_free (RedrawOrigin, origin);
+}
+
+static void
+redraw_origin_actor_finalized (gpointer  data,
+                               GObject  *where_the_object_was)
+{
+  ShellGlobal *global = data;
+  RedrawOrigin *origin;
+
+  origin = g_hash_table_lookup (global->redraw_origins, where_the_object_was);
+  g_hash_table_steal (global->redraw_origins, where_the_object_was);
+  redraw_origin_free (origin);
+}
+
+static void
+redraw_origin_destroy (gpointer data)
+{
+  RedrawOrigin *origin = data;
+
+  g_object_weak_unref (G_OBJECT (origin->actor),
+                       redraw_origin_actor_finalized,
+                       shell_global_get ());
+  redraw_origin_free (origin);
+}
+
+static void
+global_stage_queue_redraw (ClutterActor *stage,
+                           ClutterActor *actor,
+                           ShellGlobal  *global)
+{
+  RedrawOrigin *origin;
+
+  /* Clutter only signals the first redraw an actor queues per frame */
+  origin = g_hash_table_lookup (global->redraw_origins, actor);
+  if (origin == NULL)
+    {
+      origin = g_slice_new0 (RedrawOrigin);
+      origin->actor = actor;
+      g_object_weak_ref (G_OBJECT (actor), redraw_origin_actor_finalized, global);
+      g_hash_table_insert (global->redraw_origins, actor, origin);
+    }
+
+  origin->queued = TRUE;
+}
+
+static void
+update_redraw_tracking (ShellGlobal *global)
+{
+  gboolean track = global->frame_damage || global->report_noop_redraws;
+
+  if (global->stage == NULL)
+    return;
+
+  if (track && !global->queue_redraw_id)
+    {
+      global->redraw_origins = g_hash_table_new_full (NULL, NULL, NULL,
+                                                      redraw_origin_destroy);
+      global->queue_redraw_id =
+        g_signal_connect (global->stage, "queue-redraw",
+                          G_CALLBACK (global_stage_queue_redraw), global);
+    }
+  else if (!track && global->queue_redraw_id)
+    {
+      g_signal_handler_disconnect (global->stage, global->queue_redraw_id);
+      global->queue_redraw_id = 0;
+      g_clear_pointer (&global->redraw_origins, g_hash_table_destroy);
+    }
+}
+
+/* Checksums the pixels of @area, which is in stage coordinates. The
+ * area can span several stage views, each with its own offset and
+ * scale; clutter_stage_capture() reads the right pixels from each.
+ * Views are swapped as soon as they are painted, so no point of the
+ * frame has all of them painted; the area is painted again instead.
+ */
+static char *
+checksum_stage_area (ClutterStage          *stage,
+                     cairo_rectangle_int_t *area)
+{
+  ClutterCapture *captures;
+  GChecksum *checksum;
+  char *result;
+  int n_captures, i, y;
+
+  clutter_stage_capture (stage, TRUE, area, &captures, &n_captures);
+
+  checksum = g_checksum_new (G_CHECKSUM_MD5);
+  for (i = 0; i < n_captures; i++)
+    {
+      cairo_surface_t *image = captures[i].image;
+      const guint8 *data;
+      int stride, width, height;
+
+      cairo_surface_flush (image);
+      data = cairo_image_surface_get_data (image);
+      stride = cairo_image_surface_get_stride (image);
+      width = cairo_image_surface_get_width (image);
+      height = cairo_image_surface_get_height (image);
+
+      /* Row by row, since the padding at the end of rows is undefined */
+      for (y = 0; y < height; y++)
+        g_checksum_update (checksum, data + y * stride, width * 4);
+
+      cairo_surface_destroy (image);
+    }
+  g_free (captures);
+
+  result = g_strdup (g_checksum_get_string (checksum));
+  g_checksum_free (checksum);
+
+  return result;
+}
+
+/* Whether the actor changed what ends up on screen this frame. Hidden
+ * and fully clipped actors never do; otherwise we compare the painted
+ * pixels under the actor with the last frame it queued a redraw for.
+ */
+static gboolean
+redraw_origin_changed (ClutterStage          *stage,
+                       RedrawOrigin          *origin,
+                       cairo_rectangle_int_t *clip)
+{
+  ClutterActorBox box;
+  cairo_rectangle_int_t area;
+  char *checksum;
+  gboolean changed;
+
+  if (!clutter_actor_is_mapped (origin->actor) ||
+      clutter_actor_get_paint_opacity (origin->actor) == 0)
+    return FALSE;
+
+  /* Without a paint volume we can't tell; give it the benefit of the doubt */
+  if (!clutter_actor_get_paint_box (origin->actor, &box))
+    return TRUE;
+
+  area.x = MAX (clip->x, (int) floorf (box.x1));
+  area.y = MAX (clip->y, (int) floorf (box.y1));
+  area.width = MIN (clip->x + clip->width, (int) ceilf (box.x2)) - area.x;
+  area.height = MIN (clip->y + clip->height, (int) ceilf (box.y2)) - area.y;
+
+  if (area.width <= 0 || area.height <= 0)
+    return FALSE;
+
+  checksum = checksum_stage_area (stage, &area);
+  changed = g_strcmp0 (checksum, origin->checksum) != 0;
+  g_free (origin->checksum);
+  origin->checksum = checksum;
+
+  return changed;
+}
+
+static void
+check_noop_redraws (ShellGlobal           *global,
+                    cairo_rectangle_int_t *clip)
+{
+  GHashTableIter iter;
+  RedrawOrigin *origin;
+
+  /* Capturing paints the stage again; that is not a frame */
+  global->checking_redraws = TRUE;
+
+  g_hash_table_iter_init (&iter, global->redraw_origins);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &origin))
+    {
+      if (!origin->queued)
+        continue;
+
+      if (redraw_origin_changed (global->stage, origin, clip))
+        {
+          origin->n_noop_frames = 0;
+          continue;
+        }
+
+      origin->n_noop_frames++;
+      if (origin->n_noop_frames == NOOP_REDRAW_THRESHOLD && !origin->reported)
+        {
+          char *description = st_describe_actor (origin->actor);
+
+          g_message ("%s queued redraws for %d frames without visible change",
+                     description, NOOP_REDRAW_THRESHOLD);
+          g_free (description);
+          origin->reported = TRUE;
+        }
+    }
+
+  global->checking_redraws = FALSE;
+}
+
+/* Called once per frame after all stage views have been painted */
+static void
+finish_frame_damage (ShellGlobal *global)
+{
+  ShellPerfLog *perf_log = shell_perf_log_get_default ();
+  gfloat stage_width, stage_height;
+
+  if (!global->frame_painted)
+    return;
+
+  if (global->report_noop_redraws)
+    check_noop_redraws (global, &global->frame_clip);
+
+  clutter_actor_get_size (CLUTTER_ACTOR (global->stage), &stage_width, &stage_height);
+
+  global->n_painted_frames++;
+  global->damaged_pixels += global->frame_damage_area;
+  if (global->frame_damage_area >= (gint64) stage_width * stage_height)
+    global->n_full_stage_frames++;
+
+  if (global->frame_damage)
+    shell_perf_log_event_x (perf_log, "clutter.stageDamage",
+                            global->frame_damage_area);
+
+  if (global->redraw_origins)
+    {
+      GHashTableIter iter;
+      RedrawOrigin *origin;
+
+      g_hash_table_iter_init (&iter, global->redraw_origins);
+      while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &origin))
+        {
+          if (origin->queued && global->frame_damage)
+            {
+              char *description = st_describe_actor (origin->actor);
+              shell_perf_log_event_s (perf_log, "clutter.redrawOrigin", description);
+              g_free (description);
+            }
+
+          origin->queued = FALSE;
+        }
+    }
+
+  global->frame_painted = FALSE;
+  global->frame_damage_area = 0;
+}
+
+static void
+damage_statistics_callback (ShellPerfLog *perf_log,
+                            gpointer      data)
+{
+  ShellGlobal *global = data;
+
+  shell_perf_log_update_statistic_i (perf_log, "clutter.paintedFrames",
+                                     global->n_painted_frames);
+  shell_perf_log_update_statistic_i (perf_log, "clutter.fullStageFrames",
+                                     global->n_full_stage_frames);
+  shell_perf_log_update_statistic_x (perf_log, "clutter.damagedPixels",
+                                     global->damaged_pixels);
+}
+
+static void
+define_damage_events (ShellGlobal *global)
+{
+  ShellPerfLog *perf_log = shell_perf_log_get_default ();
+
+  shell_perf_log_define_event (perf_log,
+                               "clutter.stageDamage",
+                               "Number of pixels repainted in a frame",
+                               "x");
+  shell_perf_log_define_event (perf_log,
+                               "clutter.redrawOrigin",
+                               "An actor that queued a redraw for the frame",
+                               "s");
+
+  shell_perf_log_define_statistic (perf_log, "clutter.paintedFrames",
+                                   "Number of frames painted", "i");
+  shell_perf_log_define_statistic (perf_log, "clutter.fullStageFrames",
+                                   "Number of frames that repainted the whole stage", "i");
+  shell_perf_log_define_statistic (perf_log, "clutter.damagedPixels",
+                                   "Number of pixels repainted over all frames", "x");
+
+  shell_perf_log_add_statistics_callback (perf_log,
+                                          damage_statistics_callback,
+                                          global, NULL);
+}
+
 static void
 global_stage_after_paint (ClutterStage *stage,
                           ShellGlobal  *global)
@@ -794,6 +1142,20 @@ global_stage_after_paint (ClutterStage *stage,
   /* At this point, we've finished all layout and painting, but haven't
    * actually flushed or swapped */
 
+  if (global->checking_redraws)
+    return;
+
+  /* With several stage views, this is called for each of them, while
+   * the redraw clip covers the whole stage; only count it once.
+   */
+  if (!global->frame_painted)
+    {
+      clutter_stage_get_redraw_clip_bounds (stage, &global->frame_clip);
+      global->frame_damage_area += (gint64) global->frame_clip.width * global->frame_clip.height;
+    }
+
+  global->frame_painted = TRUE;
+
   if (global->frame_timestamps && global->frame_finish_timestamp)
     {
       /* It's interesting to find out when the paint actually finishes
@@ -832,6 +1194,9 @@ global_stage_after_swap (gpointer data)
     shell_perf_log_event (shell_perf_log_get_default (),
                           "clutter.stagePaintDone");
 
+  finish_frame_damage (global);
+  leisure_frame_done (global);
+
   return TRUE;
 }
 
@@ -953,6 +1318,95 @@ entry_cursor_func (StEntry  *entry,
   meta_screen_set_cursor (global->meta_screen, use_ibeam ? META_CURSOR_IBEAM : META_CURSOR_DEFAULT);
 }
 
+/* Objects created from Javascript subclasses, which GJS registers
+ * with a Gjs_ type name prefix. Instance counts are only kept by
+ * GObject when running with GOBJECT_DEBUG=instance-count.
+ */
+static int
+count_js_instances (GType type)
+{
+  GType *children;
+  guint n_children, i;
+  int count = 0;
+
+  if (g_str_has_prefix (g_type_name (type), "Gjs_"))
+    count += g_type_get_instance_count (type);
+
+  children = g_type_children (type, &n_children);
+  for (i = 0; i < n_children; i++)
+    count += count_js_instances (children[i]);
+  g_free (children);
+
+  return count;
+}
+
+static void
+update_allocation_statistic (ShellPerfLog        *perf_log,
+                             StAllocationCounter  counter,
+                             const char          *name,
+                             const char          *size_name)
+{
+  int n_objects, n_bytes;
+
+  st_get_allocation_counter (counter, &n_objects, &n_bytes);
+  shell_perf_log_update_statistic_i (perf_log, name, n_objects);
+  shell_perf_log_update_statistic_i (perf_log, size_name, n_bytes);
+}
+
+static void
+allocation_statistics_callback (ShellPerfLog *perf_log,
+                                gpointer      data)
+{
+  int n_apps, n_bytes;
+
+  update_allocation_statistic (perf_log, ST_ALLOCATION_COUNTER_THEME_NODES,
+                               "st.themeNodes", "st.themeNodesSize");
+  update_allocation_statistic (perf_log, ST_ALLOCATION_COUNTER_PAINT_STATES,
+                               "st.paintStates", "st.paintStatesSize");
+  update_allocation_statistic (perf_log, ST_ALLOCATION_COUNTER_TEXTURE_CACHE,
+                               "st.textureCacheEntries", "st.textureCacheSize");
+
+  _shell_app_get_allocation_counts (&n_apps, &n_bytes);
+  shell_perf_log_update_statistic_i (perf_log, "shell.apps", n_apps);
+  shell_perf_log_update_statistic_i (perf_log, "shell.appsSize", n_bytes);
+  shell_perf_log_update_statistic_i (perf_log, "shell.trackedWindows",
+                                     _shell_window_tracker_get_n_tracked_windows (shell_window_tracker_get_default ()));
+
+  shell_perf_log_update_statistic_i (perf_log, "gjs.wrappedObjects",
+                                     count_js_instances (G_TYPE_OBJECT));
+}
+
+static void
+define_allocation_statistics (void)
+{
+  ShellPerfLog *perf_log = shell_perf_log_get_default ();
+
+  shell_perf_log_define_statistic (perf_log, "st.themeNodes",
+                                   "Number of StThemeNode objects alive", "i");
+  shell_perf_log_define_statistic (perf_log, "st.themeNodesSize",
+                                   "Memory used by StThemeNode objects, in bytes", "i");
+  shell_perf_log_define_statistic (perf_log, "st.paintStates",
+                                   "Number of theme node paint states in use", "i");
+  shell_perf_log_define_statistic (perf_log, "st.paintStatesSize",
+                                   "Memory used by theme node paint states, in bytes", "i");
+  shell_perf_log_define_statistic (perf_log, "st.textureCacheEntries",
+                                   "Number of entries in the texture cache", "i");
+  shell_perf_log_define_statistic (perf_log, "st.textureCacheSize",
+                                   "Pixel data held by the texture cache, in bytes", "i");
+  shell_perf_log_define_statistic (perf_log, "shell.apps",
+                                   "Number of ShellApp objects alive", "i");
+  shell_perf_log_define_statistic (perf_log, "shell.appsSize",
+                                   "Memory used by ShellApp objects and their running state, in bytes", "i");
+  shell_perf_log_define_statistic (perf_log, "shell.trackedWindows",
+                                   "Number of windows tracked by the window tracker", "i");
+  shell_perf_log_define_statistic (perf_log, "gjs.wrappedObjects",
+                                   "Number of GObjects of Javascript-defined types alive", "i");
+
+  shell_perf_log_add_statistics_callback (perf_log,
+                                          allocation_statistics_callback,
+                                          NULL, NULL);
+}
+
 void
 _shell_global_set_plugin (ShellGlobal *global,
                           MetaPlugin  *plugin)
@@ -1035,6 +1489,11 @@ _shell_global_set_plugin (ShellGlobal *global,
                                "End of frame, possibly including swap time",
                                "");
 
+  define_allocation_statistics ();
+  define_leisure_statistics (global);
+  define_damage_events (global);
+  update_redraw_tracking (global);
+
   g_signal_connect (global->stage, "notify::key-focus",
                     G_CALLBACK (focus_actor_changed), global);
   g_signal_connect (global->meta_display, "notify::focus-window",
@@ -1573,6 +2032,24 @@ shell_global_create_app_launch_context (ShellGlobal *global,
   return (GAppLaunchContext *)context;
 }
 
+/* Time leisure tasks may take per frame, a quarter of a frame at 60Hz */
+#define LEISURE_FRAME_BUDGET_US 4000
+/* How long to wait for a frame before assuming the stage went idle */
+#define LEISURE_FRAME_TIMEOUT_MS 16
+
+typedef struct
+{
+  guint id;
+  ShellLeisurePriority priority;
+  ShellLeisureTaskFunc func;
+  gpointer user_data;
+  GDestroyNotify notify;
+
+  /* Time the task was queued, or 0 once it has started running */
+  gint64 queue_time;
+  gboolean removed;
+} LeisureTask;
+
 typedef struct
 {
   ShellLeisureFunction func;
@@ -1580,60 +2057,164 @@ typedef struct
   GDestroyNotify notify;
 } LeisureClosure;
 
-static gboolean
-run_leisure_functions (gpointer data)
+static void
+leisure_task_free (LeisureTask *task)
 {
-  ShellGlobal *global = data;
-  GSList *closures;
-  GSList *iter;
+  if (task->notify)
+    task->notify (task->user_data);
 
-  global->leisure_function_id = 0;
-
-  /* We started more work since we scheduled the idle */
-  if (global->work_count > 0)
-    return FALSE;
-
-  /* No leisure closures, so we are done */
-  if (global->leisure_closures == NULL)
-    return FALSE;
+  g_slice_free (LeisureTask, task);
+}
 
-  closures = global->leisure_closures;
-  global->leisure_closures = NULL;
+/* Tasks of default and low priority wait for ongoing work, such as
+ * animations, to finish. High priority tasks only wait for their share
+ * of the frame.
+ */
+static GQueue *
+get_next_leisure_queue (ShellGlobal *global)
+{
+  ShellLeisurePriority priority;
 
-  for (iter = closures; iter; iter = iter->next)
+  for (priority = 0; priority < SHELL_N_LEISURE_PRIORITIES; priority++)
     {
-      LeisureClosure *closure = closures->data;
-      closure->func (closure->user_data);
+      if (priority != SHELL_LEISURE_PRIORITY_HIGH && global->work_count > 0)
+        break;
 
-      if (closure->notify)
-        closure->notify (closure->user_data);
-
-      g_slice_free (LeisureClosure, closure);
+      if (!g_queue_is_empty (&global->leisure_queues[priority]))
+        return &global->leisure_queues[priority];
     }
 
-  g_slist_free (closures);
-
-  return FALSE;
+  return NULL;
 }
 
+static gboolean run_leisure_functions (gpointer data);
+
 static void
 schedule_leisure_functions (ShellGlobal *global)
 {
   /* This is called when we think we are ready to run leisure functions
    * by our own accounting. We try to handle other types of business
-   * (like ClutterAnimation) by adding a low priority idle function.
+   * (like ClutterAnimation) by adding a low priority idle function,
+   * which runs after any pending redraw.
    *
    * This won't work properly if the mainloop goes idle waiting for
    * the vertical blanking interval or waiting for work being done
-   * in another thread.
+   * in another thread; the per-frame budget keeps the damage small
+   * in that case.
    */
-  if (!global->leisure_function_id)
+  if (global->leisure_function_id || global->leisure_frame_timeout_id)
+    return;
+
+  if (get_next_leisure_queue (global) == NULL)
+    return;
+
+  global->leisure_function_id = g_idle_add_full (G_PRIORITY_LOW,
+                                                 run_leisure_functions,
+                                                 global, NULL);
+  g_source_set_name_by_id (global->leisure_function_id, "[gnome-shell] run_leisure_functions");
+}
+
+static void
+leisure_frame_done (ShellGlobal *global)
+{
+  global->leisure_frame_time_used = 0;
+
+  if (global->leisure_frame_timeout_id)
+    {
+      g_source_remove (global->leisure_frame_timeout_id);
+      global->leisure_frame_timeout_id = 0;
+      schedule_leisure_functions (global);
+    }
+}
+
+static gboolean
+leisure_frame_timeout (gpointer data)
+{
+  ShellGlobal *global = data;
+
+  /* No frame was drawn, so nothing is competing with us for time */
+  global->leisure_frame_timeout_id = 0;
+  global->leisure_frame_time_used = 0;
+  schedule_leisure_functions (global);
+
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean
+run_leisure_functions (gpointer data)
+{
+  ShellGlobal *global = data;
+  GQueue *queue;
+
+  global->leisure_function_id = 0;
+
+  while ((queue = get_next_leisure_queue (global)) != NULL)
     {
-      global->leisure_function_id = g_idle_add_full (G_PRIORITY_LOW,
-                                                     run_leisure_functions,
-                                                     global, NULL);
-      g_source_set_name_by_id (global->leisure_function_id, "[gnome-shell] run_leisure_functions");
+      LeisureTask *task;
+      gboolean again;
+      gint64 start;
+
+      /* Out of time for this frame; continue after the next one */
+      if (global->leisure_frame_time_used >= LEISURE_FRAME_BUDGET_US)
+        {
+          if (!global->leisure_frame_timeout_id)
+            {
+              global->leisure_frame_timeout_id =
+                g_timeout_add (LEISURE_FRAME_TIMEOUT_MS, leisure_frame_timeout, global);
+              g_source_set_name_by_id (global->leisure_frame_timeout_id,
+                                       "[gnome-shell] leisure_frame_timeout");
+            }
+          break;
+        }
+
+      task = g_queue_pop_head (queue);
+      start = g_get_monotonic_time ();
+
+      if (task->queue_time)
+        {
+          gint64 latency = start - task->queue_time;
+
+          global->leisure_latency_max = MAX (global->leisure_latency_max, latency);
+          global->leisure_latency_total += latency;
+          global->leisure_n_started++;
+          task->queue_time = 0;
+        }
+
+      global->leisure_running_task = task;
+      again = task->func (task->user_data);
+      global->leisure_running_task = NULL;
+
+      global->leisure_frame_time_used += g_get_monotonic_time () - start;
+
+      /* Round-robin between the incremental tasks of one priority */
+      if (again && !task->removed)
+        g_queue_push_tail (queue, task);
+      else
+        leisure_task_free (task);
     }
+
+  return FALSE;
+}
+
+static gboolean
+run_leisure_closure (gpointer data)
+{
+  LeisureClosure *closure = data;
+
+  closure->func (closure->user_data);
+
+  return FALSE;
+}
+
+static void
+leisure_closure_free (gpointer data)
+{
+  LeisureClosure *closure = data;
+
+  if (closure->notify)
+    closure->notify (closure->user_data);
+
+  g_slice_free (LeisureClosure, closure);
 }
 
 /**
@@ -1671,6 +2252,96 @@ shell_global_end_work (ShellGlobal *global)
 
 }
 
+/**
+ * shell_global_add_leisure_task:
+ * @global: the #ShellGlobal
+ * @priority: the #ShellLeisurePriority of the task
+ * @func: (scope notified) (closure user_data) (destroy notify): function
+ *   doing a piece of the work
+ * @user_data: data to pass to @func
+ * @notify: function to call to free @user_data
+ *
+ * Queues deferred work that should not get in the way of drawing.
+ * Tasks run from the main loop after frames have been drawn, in order
+ * of @priority, and only for a few milliseconds per frame. A task that
+ * doesn't fit is resumed after the next frame.
+ *
+ * @func is called repeatedly for as long as it returns %TRUE, so long
+ * running work should be split into small steps that each return %TRUE
+ * until the work is done. Tasks of the same priority take turns.
+ *
+ * Tasks of %SHELL_LEISURE_PRIORITY_DEFAULT and %SHELL_LEISURE_PRIORITY_LOW
+ * additionally wait until no work is marked with
+ * shell_global_begin_work(), which covers animations done through the
+ * shell's Tweener module.
+ *
+ * Return value: an ID for shell_global_remove_leisure_task()
+ */
+guint
+shell_global_add_leisure_task (ShellGlobal          *global,
+                               ShellLeisurePriority  priority,
+                               ShellLeisureTaskFunc  func,
+                               gpointer              user_data,
+                               GDestroyNotify        notify)
+{
+  LeisureTask *task;
+
+  g_return_val_if_fail (priority < SHELL_N_LEISURE_PRIORITIES, 0);
+
+  task = g_slice_new0 (LeisureTask);
+  task->id = ++global->leisure_last_id;
+  task->priority = priority;
+  task->func = func;
+  task->user_data = user_data;
+  task->notify = notify;
+  task->queue_time = g_get_monotonic_time ();
+
+  g_queue_push_tail (&global->leisure_queues[priority], task);
+  schedule_leisure_functions (global);
+
+  return task->id;
+}
+
+/**
+ * shell_global_remove_leisure_task:
+ * @global: the #ShellGlobal
+ * @id: an ID returned by shell_global_add_leisure_task()
+ *
+ * Removes a task queued with shell_global_add_leisure_task() before it
+ * is done. This may be called from the task itself.
+ */
+void
+shell_global_remove_leisure_task (ShellGlobal *global,
+                                  guint        id)
+{
+  LeisureTask *running = global->leisure_running_task;
+  ShellLeisurePriority priority;
+  GList *l;
+
+  if (running && running->id == id)
+    {
+      running->removed = TRUE;
+      return;
+    }
+
+  for (priority = 0; priority < SHELL_N_LEISURE_PRIORITIES; priority++)
+    {
+      GQueue *queue = &global->leisure_queues[priority];
+
+      for (l = queue->head; l; l = l->next)
+        {
+          LeisureTask *task = l->data;
+
+          if (task->id == id)
+            {
+              g_queue_delete_link (queue, l);
+              leisure_task_free (task);
+              return;
+            }
+        }
+    }
+}
+
 /**
  * shell_global_run_at_leisure:
  * @global: the #ShellGlobal
@@ -1687,11 +2358,15 @@ shell_global_end_work (ShellGlobal *global)
  * early if they can be drawn fast enough so that the event loop goes idle
  * between frames.
  *
+ * The function is queued as a task of %SHELL_LEISURE_PRIORITY_LOW, so
+ * it also waits for deferred work added with
+ * shell_global_add_leisure_task() that was queued before it.
+ *
  * The intent of this function is for performance measurement runs
  * where a number of actions should be run serially and each action is
  * timed individually. Using this function for other purposes will
  * interfere with the ability to use it for performance measurement so
- * should be avoided.
+ * should be avoided; use shell_global_add_leisure_task() instead.
  */
 void
 shell_global_run_at_leisure (ShellGlobal         *global,
@@ -1704,11 +2379,50 @@ shell_global_run_at_leisure (ShellGlobal         *global,
   closure->user_data = user_data;
   closure->notify = notify;
 
-  global->leisure_closures = g_slist_append (global->leisure_closures,
-                                             closure);
+  shell_global_add_leisure_task (global, SHELL_LEISURE_PRIORITY_LOW,
+                                 run_leisure_closure, closure,
+                                 leisure_closure_free);
+}
 
-  if (global->work_count == 0)
-    schedule_leisure_functions (global);
+static void
+leisure_statistics_callback (ShellPerfLog *perf_log,
+                             gpointer      data)
+{
+  ShellGlobal *global = data;
+  ShellLeisurePriority priority;
+  int length = 0;
+
+  for (priority = 0; priority < SHELL_N_LEISURE_PRIORITIES; priority++)
+    length += g_queue_get_length (&global->leisure_queues[priority]);
+
+  shell_perf_log_update_statistic_i (perf_log, "leisure.queueLength", length);
+  shell_perf_log_update_statistic_x (perf_log, "leisure.maxLatency",
+                                     global->leisure_latency_max);
+  shell_perf_log_update_statistic_x (perf_log, "leisure.meanLatency",
+                                     global->leisure_n_started > 0 ?
+                                     global->leisure_latency_total / global->leisure_n_started : 0);
+
+  /* Latencies are reported per collection interval */
+  global->leisure_latency_max = 0;
+  global->leisure_latency_total = 0;
+  global->leisure_n_started = 0;
+}
+
+static void
+define_leisure_statistics (ShellGlobal *global)
+{
+  ShellPerfLog *perf_log = shell_perf_log_get_default ();
+
+  shell_perf_log_define_statistic (perf_log, "leisure.queueLength",
+                                   "Number of queued leisure tasks", "i");
+  shell_perf_log_define_statistic (perf_log, "leisure.maxLatency",
+                                   "Longest wait of a leisure task before it first ran, in microseconds", "x");
+  shell_perf_log_define_statistic (perf_log, "leisure.meanLatency",
+                                   "Average wait of a leisure task before it first ran, in microseconds", "x");
+
+  shell_perf_log_add_statistics_callback (perf_log,
+                                          leisure_statistics_callback,
+                                          global, NULL);
 }
 
 static void
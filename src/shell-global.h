@@ -65,6 +65,34 @@ void shell_global_run_at_leisure (ShellGlobal          *global,
                                   gpointer              user_data,
                                   GDestroyNotify        notify);
 
+/**
+ * ShellLeisurePriority:
+ * @SHELL_LEISURE_PRIORITY_HIGH: runs after the next frame, even while
+ *   animations are ongoing
+ * @SHELL_LEISURE_PRIORITY_DEFAULT: runs once animations are done
+ * @SHELL_LEISURE_PRIORITY_LOW: runs once animations and all default
+ *   priority tasks are done
+ *
+ * Priority classes for shell_global_add_leisure_task().
+ */
+typedef enum {
+  SHELL_LEISURE_PRIORITY_HIGH,
+  SHELL_LEISURE_PRIORITY_DEFAULT,
+  SHELL_LEISURE_PRIORITY_LOW
+} ShellLeisurePriority;
+
+#define SHELL_N_LEISURE_PRIORITIES (SHELL_LEISURE_PRIORITY_LOW + 1)
+
+typedef gboolean (*ShellLeisureTaskFunc) (gpointer data);
+
+guint shell_global_add_leisure_task    (ShellGlobal          *global,
+                                        ShellLeisurePriority  priority,
+                                        ShellLeisureTaskFunc  func,
+                                        gpointer              user_data,
+                                        GDestroyNotify        notify);
+void  shell_global_remove_leisure_task (ShellGlobal          *global,
+                                        guint                 id);
+
 
 /* Misc utilities / Shell API */
 void     shell_global_sync_pointer              (ShellGlobal  *global);
@@ -0,0 +1,233 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+
+#include "config.h"
+
+#include "shell-i420-converter.h"
+
+enum {
+  PLANE_Y,
+  PLANE_U,
+  PLANE_V,
+  N_PLANES
+};
+
+struct _ShellI420Converter
+{
+  int width;
+  int height;
+
+  CoglTexture *texture;
+  CoglFramebuffer *framebuffer;
+  CoglPipeline *pipelines[N_PLANES];
+};
+
+/* Each output pixel packs four consecutive samples of a plane. A
+ * chroma row is half as wide as a luma row, so an output row holds
+ * two of them, just like in a tightly packed I420 frame. Chroma is
+ * sampled between four source pixels, which linear filtering averages.
+ */
+static const char plane_declarations[] =
+  "uniform sampler2D source;\n"
+  "uniform vec2 source_size;\n"
+  "uniform vec2 plane_size;\n"
+  "uniform vec4 coefficients;\n"
+  "uniform float subsample;\n"
+  "\n"
+  "float sample_plane (float col, float row)\n"
+  "{\n"
+  "  vec2 pos = (vec2 (col, row) + 0.5) * subsample / source_size;\n"
+  "  vec3 rgb = texture2D (source, pos).rgb;\n"
+  "  return dot (rgb, coefficients.rgb) + coefficients.a;\n"
+  "}\n";
+
+static const char plane_code[] =
+  "vec2 p = floor (cogl_tex_coord_in[0].st * plane_size);\n"
+  "float plane_width = source_size.x / subsample;\n"
+  "float x = p.x * 4.0;\n"
+  "float row = p.y * subsample + floor (x / plane_width);\n"
+  "float col = mod (x, plane_width);\n"
+  "\n"
+  "cogl_color_out = vec4 (sample_plane (col, row),\n"
+  "                       sample_plane (col + 1.0, row),\n"
+  "                       sample_plane (col + 2.0, row),\n"
+  "                       sample_plane (col + 3.0, row));\n";
+
+/* BT.709 to limited range YCbCr, as weights for R, G and B plus an offset */
+static const float plane_coefficients[N_PLANES][4] = {
+  {  0.1826,  0.6142,  0.0620, 16. / 255. },
+  { -0.1006, -0.3386,  0.4392, 128. / 255. },
+  {  0.4392, -0.3989, -0.0403, 128. / 255. },
+};
+
+/**
+ * shell_i420_converter_is_supported:
+ * @width: width of the frames
+ * @height: height of the frames
+ *
+ * Checks whether frames of the given size can be converted; the
+ * width has to be a multiple of 8 and the height a multiple of 4, so
+ * that the planes line up with whole pixels of the output.
+ *
+ * Return value: %TRUE if frames of this size can be converted
+ */
+gboolean
+shell_i420_converter_is_supported (int width,
+                                   int height)
+{
+  return width > 0 && height > 0 && width % 8 == 0 && height % 4 == 0;
+}
+
+static CoglPipeline *
+create_plane_pipeline (CoglContext        *context,
+                       ShellI420Converter *converter,
+                       int                 plane)
+{
+  CoglPipeline *pipeline;
+  CoglSnippet *snippet;
+  float source_size[2], plane_size[2];
+
+  pipeline = cogl_pipeline_new (context);
+
+  snippet = cogl_snippet_new (COGL_SNIPPET_HOOK_FRAGMENT, plane_declarations, NULL);
+  cogl_snippet_set_replace (snippet, plane_code);
+  cogl_pipeline_add_snippet (pipeline, snippet);
+  cogl_object_unref (snippet);
+
+  cogl_pipeline_set_layer_filters (pipeline, 0,
+                                   COGL_PIPELINE_FILTER_LINEAR,
+                                   COGL_PIPELINE_FILTER_LINEAR);
+  cogl_pipeline_set_layer_wrap_mode (pipeline, 0,
+                                     COGL_PIPELINE_WRAP_MODE_CLAMP_TO_EDGE);
+  cogl_pipeline_set_blend (pipeline, "RGBA = ADD (SRC_COLOR, 0)", NULL);
+
+  source_size[0] = converter->width;
+  source_size[1] = converter->height;
+  plane_size[0] = converter->width / 4;
+  plane_size[1] = plane == PLANE_Y ? converter->height : converter->height / 4;
+
+  cogl_pipeline_set_uniform_1i (pipeline,
+                                cogl_pipeline_get_uniform_location (pipeline, "source"),
+                                0);
+  cogl_pipeline_set_uniform_float (pipeline,
+                                   cogl_pipeline_get_uniform_location (pipeline, "source_size"),
+                                   2, 1, source_size);
+  cogl_pipeline_set_uniform_float (pipeline,
+                                   cogl_pipeline_get_uniform_location (pipeline, "plane_size"),
+                                   2, 1, plane_size);
+  cogl_pipeline_set_uniform_float (pipeline,
+                                   cogl_pipeline_get_uniform_location (pipeline, "coefficients"),
+                                   4, 1, plane_coefficients[plane]);
+  cogl_pipeline_set_uniform_1f (pipeline,
+                                cogl_pipeline_get_uniform_location (pipeline, "subsample"),
+                                plane == PLANE_Y ? 1.0 : 2.0);
+
+  return pipeline;
+}
+
+/**
+ * shell_i420_converter_new:
+ * @context: a #CoglContext
+ * @width: width of the frames to convert
+ * @height: height of the frames to convert
+ *
+ * Creates a converter for frames of the given size, which must be
+ * supported according to shell_i420_converter_is_supported().
+ *
+ * Return value: the new converter, or %NULL if the GPU can't render
+ *  to the output
+ */
+ShellI420Converter *
+shell_i420_converter_new (CoglContext *context,
+                          int          width,
+                          int          height)
+{
+  ShellI420Converter *converter;
+  CoglError *error = NULL;
+  int i;
+
+  g_return_val_if_fail (shell_i420_converter_is_supported (width, height), NULL);
+
+  if (!cogl_has_feature (context, COGL_FEATURE_ID_GLSL) ||
+      !cogl_has_feature (context, COGL_FEATURE_ID_OFFSCREEN))
+    return NULL;
+
+  converter = g_new0 (ShellI420Converter, 1);
+  converter->width = width;
+  converter->height = height;
+
+  /* Values are written as they are, not as premultiplied colors */
+  converter->texture = COGL_TEXTURE (cogl_texture_2d_new_with_size (context,
+                                                                    width / 4,
+                                                                    height * 3 / 2));
+  cogl_texture_set_components (converter->texture, COGL_TEXTURE_COMPONENTS_RGBA);
+  cogl_texture_set_premultiplied (converter->texture, FALSE);
+
+  converter->framebuffer = COGL_FRAMEBUFFER (cogl_offscreen_new_with_texture (converter->texture));
+  if (!cogl_framebuffer_allocate (converter->framebuffer, &error))
+    {
+      g_warning ("Can't create framebuffer for I420 conversion: %s", error->message);
+      cogl_error_free (error);
+      shell_i420_converter_free (converter);
+      return NULL;
+    }
+
+  cogl_framebuffer_orthographic (converter->framebuffer,
+                                 0, 0, width / 4, height * 3 / 2, -1, 1);
+
+  for (i = 0; i < N_PLANES; i++)
+    converter->pipelines[i] = create_plane_pipeline (context, converter, i);
+
+  return converter;
+}
+
+void
+shell_i420_converter_free (ShellI420Converter *converter)
+{
+  int i;
+
+  for (i = 0; i < N_PLANES; i++)
+    g_clear_pointer (&converter->pipelines[i], cogl_object_unref);
+
+  g_clear_pointer (&converter->framebuffer, cogl_object_unref);
+  g_clear_pointer (&converter->texture, cogl_object_unref);
+
+  g_free (converter);
+}
+
+/**
+ * shell_i420_converter_convert:
+ * @converter: a #ShellI420Converter
+ * @source: texture of the size the converter was created for
+ *
+ * Queues drawing @source as I420 into the converter's framebuffer.
+ * Reading the whole framebuffer back in %COGL_PIXEL_FORMAT_RGBA_8888
+ * gives the Y, U and V planes one after another.
+ *
+ * Return value: (transfer none): the framebuffer holding the frame
+ */
+CoglFramebuffer *
+shell_i420_converter_convert (ShellI420Converter *converter,
+                              CoglTexture        *source)
+{
+  float width = converter->width / 4;
+  float height = converter->height;
+  int i;
+
+  g_return_val_if_fail (cogl_texture_get_width (source) == (unsigned) converter->width, NULL);
+  g_return_val_if_fail (cogl_texture_get_height (source) == (unsigned) converter->height, NULL);
+
+  for (i = 0; i < N_PLANES; i++)
+    cogl_pipeline_set_layer_texture (converter->pipelines[i], 0, source);
+
+  cogl_framebuffer_draw_rectangle (converter->framebuffer,
+                                   converter->pipelines[PLANE_Y],
+                                   0, 0, width, height);
+  cogl_framebuffer_draw_rectangle (converter->framebuffer,
+                                   converter->pipelines[PLANE_U],
+                                   0, height, width, height * 5 / 4);
+  cogl_framebuffer_draw_rectangle (converter->framebuffer,
+                                   converter->pipelines[PLANE_V],
+                                   0, height * 5 / 4, width, height * 3 / 2);
+
+  return converter->framebuffer;
+}
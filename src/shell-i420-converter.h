@@ -0,0 +1,33 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+#ifndef __SHELL_I420_CONVERTER_H__
+#define __SHELL_I420_CONVERTER_H__
+
+#include <clutter/clutter.h>
+
+G_BEGIN_DECLS
+
+/**
+ * ShellI420Converter:
+ *
+ * Converts RGB textures to planar I420 (BT.709, limited range) on the
+ * GPU. The planes are drawn into an RGBA framebuffer a quarter as wide
+ * and one and a half times as high as the source, laid out exactly as
+ * GStreamer expects I420 frames without padding, so reading it back
+ * gives a complete frame at 1.5 bytes per pixel.
+ */
+typedef struct _ShellI420Converter ShellI420Converter;
+
+gboolean            shell_i420_converter_is_supported (int width,
+                                                       int height);
+
+ShellI420Converter *shell_i420_converter_new      (CoglContext        *context,
+                                                   int                 width,
+                                                   int                 height);
+void                shell_i420_converter_free     (ShellI420Converter *converter);
+
+CoglFramebuffer    *shell_i420_converter_convert  (ShellI420Converter *converter,
+                                                   CoglTexture        *source);
+
+G_END_DECLS
+
+#endif /* __SHELL_I420_CONVERTER_H__ */
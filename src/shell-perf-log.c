@@ -616,16 +616,11 @@ shell_perf_log_add_statistics_callback (ShellPerfLog               *perf_log,
  * shell_perf_log_add_statistics_callback() and then records events
  * for all statistics, followed by a perf.statisticsCollected event.
  */
-void
-shell_perf_log_collect_statistics (ShellPerfLog *perf_log)
+static void
+run_statistics_callbacks (ShellPerfLog *perf_log)
 {
-  gint64 event_time = get_time ();
-  gint64 collection_time;
   guint i;
 
-  if (!perf_log->enabled)
-    return;
-
   for (i = 0; i < perf_log->statistics_closures->len; i++)
     {
       ShellPerfStatisticsClosure *closure;
@@ -633,6 +628,19 @@ shell_perf_log_collect_statistics (ShellPerfLog *perf_log)
       closure = g_ptr_array_index (perf_log->statistics_closures, i);
       closure->callback (perf_log, closure->user_data);
     }
+}
+
+void
+shell_perf_log_collect_statistics (ShellPerfLog *perf_log)
+{
+  gint64 event_time = get_time ();
+  gint64 collection_time;
+  guint i;
+
+  if (!perf_log->enabled)
+    return;
+
+  run_statistics_callbacks (perf_log);
 
   collection_time = get_time() - event_time;
 
@@ -678,6 +686,47 @@ shell_perf_log_collect_statistics (ShellPerfLog *perf_log)
                 (const guchar *)&collection_time, sizeof (gint64));
 }
 
+/**
+ * shell_perf_log_get_statistics:
+ * @perf_log: a #ShellPerfLog
+ *
+ * Updates all statistics, like shell_perf_log_collect_statistics(),
+ * but returns their current values instead of recording them in the
+ * log. This works whether or not the log is enabled, for interactive
+ * inspection.
+ *
+ * Return value: (transfer full): a #GVariant of type "a{sx}" mapping
+ *   statistic names to their current values
+ */
+GVariant *
+shell_perf_log_get_statistics (ShellPerfLog *perf_log)
+{
+  GVariantBuilder builder;
+  guint i;
+
+  run_statistics_callbacks (perf_log);
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sx}"));
+
+  for (i = 0; i < perf_log->statistics->len; i++)
+    {
+      ShellPerfStatistic *statistic = g_ptr_array_index (perf_log->statistics, i);
+      gint64 value;
+
+      if (!statistic->initialized)
+        continue;
+
+      if (statistic->event->signature[0] == 'i')
+        value = statistic->current_value.i;
+      else
+        value = statistic->current_value.x;
+
+      g_variant_builder_add (&builder, "{sx}", statistic->event->name, value);
+    }
+
+  return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
 /**
  * shell_perf_log_replay:
  * @perf_log: a #ShellPerfLog
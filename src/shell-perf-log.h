@@ -53,6 +53,8 @@ void shell_perf_log_add_statistics_callback (ShellPerfLog               *perf_lo
 
 void shell_perf_log_collect_statistics (ShellPerfLog *perf_log);
 
+GVariant *shell_perf_log_get_statistics (ShellPerfLog *perf_log);
+
 typedef void (*ShellPerfReplayFunction) (gint64      time,
 					 const char *name,
 					 const char *signature,
@@ -0,0 +1,547 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+
+#include "config.h"
+
+#include <string.h>
+#include <zlib.h>
+
+#include "shell-png-encoder.h"
+
+/* The image is cut into strips of rows that are filtered and deflated
+ * in parallel. Each strip ends on a byte boundary with a sync flush, so
+ * the strips concatenate into the single zlib stream PNG requires; only
+ * the window is reset between strips. Strips are kept tall enough for
+ * that to cost little.
+ */
+#define STRIP_ROWS_MIN 32
+#define STRIPS_PER_THREAD 4
+
+#define OUTPUT_STEP 65536
+
+enum {
+  FILTER_NONE,
+  FILTER_SUB,
+  FILTER_UP,
+  FILTER_AVERAGE,
+  FILTER_PAETH,
+  N_FILTERS
+};
+
+typedef struct {
+  const guint8 *pixels;
+  int stride;
+  int width;
+  int level;
+} Image;
+
+typedef struct {
+  int first_row;
+  int n_rows;
+  gboolean last;
+
+  /* Results, valid once done is set */
+  GByteArray *chunk;
+  uLong adler;
+  gsize length;
+  gboolean done;
+  gboolean failed;
+} Strip;
+
+typedef struct {
+  Image image;
+
+  GMutex mutex;
+  GCond cond;
+} Encoder;
+
+static void
+put_uint32 (guint8 *data,
+            guint32 value)
+{
+  data[0] = value >> 24;
+  data[1] = value >> 16;
+  data[2] = value >> 8;
+  data[3] = value;
+}
+
+/* Cairo stores premultiplied native-endian ARGB; PNG wants straight
+ * RGBA bytes. Rounds the same way gdk_pixbuf_get_from_surface() does.
+ */
+static void
+unpremultiply_row (const Image *image,
+                   int          row,
+                   guint8      *out)
+{
+  const guint32 *src = (const guint32 *) (image->pixels + row * image->stride);
+  int x;
+
+  for (x = 0; x < image->width; x++, out += 4)
+    {
+      guint32 pixel = src[x];
+      guint alpha = pixel >> 24;
+
+      if (alpha == 0)
+        {
+          out[0] = out[1] = out[2] = 0;
+        }
+      else
+        {
+          out[0] = (((pixel >> 16) & 0xff) * 255 + alpha / 2) / alpha;
+          out[1] = (((pixel >> 8) & 0xff) * 255 + alpha / 2) / alpha;
+          out[2] = ((pixel & 0xff) * 255 + alpha / 2) / alpha;
+        }
+
+      out[3] = alpha;
+    }
+}
+
+static inline guint8
+paeth_predictor (int a,
+                 int b,
+                 int c)
+{
+  int p = a + b - c;
+  int pa = ABS (p - a);
+  int pb = ABS (p - b);
+  int pc = ABS (p - c);
+
+  if (pa <= pb && pa <= pc)
+    return a;
+  else if (pb <= pc)
+    return b;
+  else
+    return c;
+}
+
+/* Writes the filter type followed by the filtered row to out; prev is
+ * the unfiltered previous row, or zeros for the first row.
+ */
+static void
+filter_row (int           filter,
+            const guint8 *row,
+            const guint8 *prev,
+            gsize         length,
+            guint8       *out)
+{
+  gsize i;
+
+  out[0] = filter;
+  out++;
+
+  switch (filter)
+    {
+    case FILTER_NONE:
+      memcpy (out, row, length);
+      break;
+    case FILTER_SUB:
+      for (i = 0; i < length; i++)
+        out[i] = row[i] - (i >= 4 ? row[i - 4] : 0);
+      break;
+    case FILTER_UP:
+      for (i = 0; i < length; i++)
+        out[i] = row[i] - prev[i];
+      break;
+    case FILTER_AVERAGE:
+      for (i = 0; i < length; i++)
+        out[i] = row[i] - (((i >= 4 ? row[i - 4] : 0) + prev[i]) >> 1);
+      break;
+    case FILTER_PAETH:
+      for (i = 0; i < length; i++)
+        out[i] = row[i] - paeth_predictor (i >= 4 ? row[i - 4] : 0,
+                                           prev[i],
+                                           i >= 4 ? prev[i - 4] : 0);
+      break;
+    default:
+      g_assert_not_reached ();
+    }
+}
+
+/* The usual heuristic: the filter whose output, read as signed bytes,
+ * has the smallest sum of magnitudes usually compresses best.
+ */
+static guint64
+filtered_cost (const guint8 *out,
+               gsize         length)
+{
+  guint64 cost = 0;
+  gsize i;
+
+  for (i = 1; i <= length; i++)
+    cost += ABS ((gint8) out[i]);
+
+  return cost;
+}
+
+/* Returns the buffer holding the filtered row, one of candidates */
+static guint8 *
+filter_row_adaptive (const Image  *image,
+                     const guint8 *row,
+                     const guint8 *prev,
+                     guint8       *candidates[2])
+{
+  gsize length = image->width * 4;
+  guint8 *best = candidates[0];
+  guint64 best_cost;
+  int filter;
+
+  /* Fast mode doesn't search; Up alone removes most of the redundancy
+   * in screen content, where rows often repeat.
+   */
+  if (image->level <= 1)
+    {
+      filter_row (image->level == 0 ? FILTER_NONE : FILTER_UP,
+                  row, prev, length, best);
+      return best;
+    }
+
+  filter_row (FILTER_NONE, row, prev, length, best);
+  best_cost = filtered_cost (best, length);
+
+  for (filter = FILTER_SUB; filter < N_FILTERS; filter++)
+    {
+      guint8 *out = best == candidates[0] ? candidates[1] : candidates[0];
+      guint64 cost;
+
+      filter_row (filter, row, prev, length, out);
+      cost = filtered_cost (out, length);
+
+      if (cost < best_cost)
+        {
+          best = out;
+          best_cost = cost;
+        }
+    }
+
+  return best;
+}
+
+static gboolean
+deflate_into (z_stream   *zstream,
+              GByteArray *chunk,
+              int         flush)
+{
+  int ret;
+
+  do
+    {
+      gsize used = chunk->len;
+
+      g_byte_array_set_size (chunk, used + OUTPUT_STEP);
+      zstream->next_out = chunk->data + used;
+      zstream->avail_out = OUTPUT_STEP;
+
+      ret = deflate (zstream, flush);
+
+      g_byte_array_set_size (chunk, chunk->len - zstream->avail_out);
+
+      if (ret == Z_STREAM_ERROR)
+        return FALSE;
+    }
+  while (zstream->avail_out == 0 ||
+         (flush == Z_FINISH && ret != Z_STREAM_END));
+
+  return TRUE;
+}
+
+/* Builds a complete IDAT chunk for the strip, length and CRC included */
+static gboolean
+encode_strip_data (const Image *image,
+                   Strip       *strip)
+{
+  z_stream zstream = { 0 };
+  gsize length = image->width * 4;
+  guint8 *rows, *row, *prev, *candidates[2];
+  gboolean success = TRUE;
+  int strategy, y;
+
+  /* Runs are what filtered screen content is mostly made of, and
+   * matching only those is much faster than a full search.
+   */
+  strategy = image->level == 1 ? Z_RLE : Z_DEFAULT_STRATEGY;
+
+  if (deflateInit2 (&zstream, image->level, Z_DEFLATED,
+                    -MAX_WBITS, 8, strategy) != Z_OK)
+    return FALSE;
+
+  rows = g_malloc0 (length * 2 + (length + 1) * 2);
+  row = rows;
+  prev = rows + length;
+  candidates[0] = rows + length * 2;
+  candidates[1] = candidates[0] + length + 1;
+
+  /* Room for the chunk length and type, filled in at the end */
+  strip->chunk = g_byte_array_sized_new (OUTPUT_STEP);
+  g_byte_array_set_size (strip->chunk, 8);
+
+  /* The zlib header goes in front of the first strip */
+  if (strip->first_row == 0)
+    {
+      guint8 header[2] = { 0x78, 0x9c };
+
+      if (image->level <= 1)
+        header[1] = 0x01;
+      else if (image->level <= 5)
+        header[1] = 0x5e;
+      else if (image->level >= 7)
+        header[1] = 0xda;
+
+      g_byte_array_append (strip->chunk, header, sizeof (header));
+    }
+  else
+    {
+      unpremultiply_row (image, strip->first_row - 1, prev);
+    }
+
+  strip->adler = adler32 (0L, Z_NULL, 0);
+
+  for (y = strip->first_row; y < strip->first_row + strip->n_rows && success; y++)
+    {
+      guint8 *filtered, *tmp;
+
+      unpremultiply_row (image, y, row);
+      filtered = filter_row_adaptive (image, row, prev, candidates);
+
+      strip->adler = adler32 (strip->adler, filtered, length + 1);
+
+      zstream.next_in = filtered;
+      zstream.avail_in = length + 1;
+      success = deflate_into (&zstream, strip->chunk, Z_NO_FLUSH);
+
+      tmp = prev;
+      prev = row;
+      row = tmp;
+    }
+
+  if (success)
+    success = deflate_into (&zstream, strip->chunk,
+                            strip->last ? Z_FINISH : Z_SYNC_FLUSH);
+
+  deflateEnd (&zstream);
+  g_free (rows);
+
+  if (success)
+    {
+      guint8 crc[4];
+
+      strip->length = (gsize) strip->n_rows * (length + 1);
+
+      put_uint32 (strip->chunk->data, strip->chunk->len - 8);
+      memcpy (strip->chunk->data + 4, "IDAT", 4);
+      put_uint32 (crc, crc32 (crc32 (0L, Z_NULL, 0),
+                              strip->chunk->data + 4, strip->chunk->len - 4));
+      g_byte_array_append (strip->chunk, crc, sizeof (crc));
+    }
+
+  return success;
+}
+
+static void
+encode_strip (gpointer data,
+              gpointer user_data)
+{
+  Strip *strip = data;
+  Encoder *encoder = user_data;
+  gboolean success;
+
+  success = encode_strip_data (&encoder->image, strip);
+
+  g_mutex_lock (&encoder->mutex);
+  strip->failed = !success;
+  strip->done = TRUE;
+  g_cond_broadcast (&encoder->cond);
+  g_mutex_unlock (&encoder->mutex);
+}
+
+static gboolean
+write_chunk (GOutputStream  *stream,
+             const char     *type,
+             const guint8   *data,
+             gsize           length,
+             GCancellable   *cancellable,
+             GError        **error)
+{
+  guint8 header[8], footer[4];
+  uLong crc;
+
+  put_uint32 (header, length);
+  memcpy (header + 4, type, 4);
+
+  /* crc32() ignores the running value when given no data */
+  crc = crc32 (crc32 (0L, Z_NULL, 0), header + 4, 4);
+  if (length > 0)
+    crc = crc32 (crc, data, length);
+  put_uint32 (footer, crc);
+
+  return (g_output_stream_write_all (stream, header, sizeof (header),
+                                     NULL, cancellable, error) &&
+          (length == 0 ||
+           g_output_stream_write_all (stream, data, length,
+                                      NULL, cancellable, error)) &&
+          g_output_stream_write_all (stream, footer, sizeof (footer),
+                                     NULL, cancellable, error));
+}
+
+static gboolean
+write_header (cairo_surface_t  *image,
+              GOutputStream    *stream,
+              const char       *software,
+              GCancellable     *cancellable,
+              GError          **error)
+{
+  static const guint8 signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+  guint8 ihdr[13];
+
+  put_uint32 (ihdr, cairo_image_surface_get_width (image));
+  put_uint32 (ihdr + 4, cairo_image_surface_get_height (image));
+  ihdr[8] = 8;  /* bit depth */
+  ihdr[9] = 6;  /* RGBA */
+  ihdr[10] = 0; /* deflate */
+  ihdr[11] = 0; /* adaptive filtering */
+  ihdr[12] = 0; /* not interlaced */
+
+  if (!g_output_stream_write_all (stream, signature, sizeof (signature),
+                                  NULL, cancellable, error) ||
+      !write_chunk (stream, "IHDR", ihdr, sizeof (ihdr), cancellable, error))
+    return FALSE;
+
+  if (software != NULL)
+    {
+      /* Keyword and text, separated by a nul byte */
+      GByteArray *text = g_byte_array_new ();
+      gboolean success;
+
+      g_byte_array_append (text, (const guint8 *) "Software", sizeof ("Software"));
+      g_byte_array_append (text, (const guint8 *) software, strlen (software));
+
+      success = write_chunk (stream, "tEXt", text->data, text->len,
+                             cancellable, error);
+      g_byte_array_unref (text);
+
+      if (!success)
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * shell_png_encoder_write:
+ * @image: an image surface in %CAIRO_FORMAT_ARGB32
+ * @stream: the stream to write to
+ * @level: zlib compression level from 0 to 9, or -1 for the default
+ * @software: (nullable): value of the Software text chunk
+ * @cancellable: (nullable): a #GCancellable
+ * @error: return location for a #GError
+ *
+ * Writes @image as an RGBA PNG to @stream. Rows are read straight from
+ * the surface and filtered and compressed on as many threads as there
+ * are processors, while the finished parts are written out in order.
+ *
+ * Level 1 is a fast mode for screenshots that don't stay around, like
+ * those for the clipboard: it skips the search for the best filter and
+ * only matches runs. Level 0 stores the rows unfiltered.
+ *
+ * Return value: %TRUE on success
+ */
+gboolean
+shell_png_encoder_write (cairo_surface_t  *image,
+                         GOutputStream    *stream,
+                         int               level,
+                         const char       *software,
+                         GCancellable     *cancellable,
+                         GError          **error)
+{
+  Encoder encoder;
+  GThreadPool *pool;
+  Strip *strips;
+  int height, n_threads, n_strips, strip_rows, i;
+  uLong adler;
+  guint8 trailer[4];
+  gboolean success = TRUE;
+
+  g_return_val_if_fail (cairo_image_surface_get_format (image) == CAIRO_FORMAT_ARGB32, FALSE);
+  g_return_val_if_fail (level >= -1 && level <= 9, FALSE);
+
+  cairo_surface_flush (image);
+
+  encoder.image.pixels = cairo_image_surface_get_data (image);
+  encoder.image.stride = cairo_image_surface_get_stride (image);
+  encoder.image.width = cairo_image_surface_get_width (image);
+  encoder.image.level = level < 0 ? 6 : level;
+  height = cairo_image_surface_get_height (image);
+
+  if (!write_header (image, stream, software, cancellable, error))
+    return FALSE;
+
+  n_threads = g_get_num_processors ();
+  strip_rows = MAX (STRIP_ROWS_MIN, height / (n_threads * STRIPS_PER_THREAD));
+  n_strips = MAX (1, (height + strip_rows - 1) / strip_rows);
+
+  strips = g_new0 (Strip, n_strips);
+  for (i = 0; i < n_strips; i++)
+    {
+      strips[i].first_row = i * strip_rows;
+      strips[i].n_rows = MIN (strip_rows, height - strips[i].first_row);
+      strips[i].last = i == n_strips - 1;
+    }
+
+  g_mutex_init (&encoder.mutex);
+  g_cond_init (&encoder.cond);
+
+  pool = g_thread_pool_new (encode_strip, &encoder, n_threads, FALSE, NULL);
+  for (i = 0; i < n_strips; i++)
+    g_thread_pool_push (pool, &strips[i], NULL);
+
+  /* Write strips out as they finish, in order, and free them right
+   * away so that the compressed image never has to be held at once.
+   */
+  adler = adler32 (0L, Z_NULL, 0);
+
+  for (i = 0; i < n_strips && success; i++)
+    {
+      Strip *strip = &strips[i];
+
+      g_mutex_lock (&encoder.mutex);
+      while (!strip->done)
+        g_cond_wait (&encoder.cond, &encoder.mutex);
+      g_mutex_unlock (&encoder.mutex);
+
+      if (strip->failed)
+        {
+          g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                               "Compressing the image failed");
+          success = FALSE;
+        }
+      else
+        {
+          success = g_output_stream_write_all (stream,
+                                               strip->chunk->data,
+                                               strip->chunk->len,
+                                               NULL, cancellable, error);
+          adler = adler32_combine (adler, strip->adler, strip->length);
+        }
+
+      g_clear_pointer (&strip->chunk, g_byte_array_unref);
+    }
+
+  /* Drop strips that haven't started and wait for the others */
+  g_thread_pool_free (pool, TRUE, TRUE);
+
+  for (i = 0; i < n_strips; i++)
+    g_clear_pointer (&strips[i].chunk, g_byte_array_unref);
+  g_free (strips);
+
+  g_cond_clear (&encoder.cond);
+  g_mutex_clear (&encoder.mutex);
+
+  if (!success)
+    return FALSE;
+
+  /* The zlib stream ends with the checksum of all the strips, which may
+   * sit in an IDAT chunk of its own.
+   */
+  put_uint32 (trailer, adler);
+
+  return (write_chunk (stream, "IDAT", trailer, sizeof (trailer), cancellable, error) &&
+          write_chunk (stream, "IEND", NULL, 0, cancellable, error));
+}
@@ -0,0 +1,19 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+#ifndef __SHELL_PNG_ENCODER_H__
+#define __SHELL_PNG_ENCODER_H__
+
+#include <cairo.h>
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+gboolean shell_png_encoder_write (cairo_surface_t  *image,
+                                  GOutputStream    *stream,
+                                  int               level,
+                                  const char       *software,
+                                  GCancellable     *cancellable,
+                                  GError          **error);
+
+G_END_DECLS
+
+#endif /* __SHELL_PNG_ENCODER_H__ */
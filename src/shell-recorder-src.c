@@ -14,9 +14,11 @@ struct _ShellRecorderSrc
   GMutex mutex;
 
   GstCaps *caps;
+  GstBufferPool *pool;
   GMutex queue_lock;
   GCond queue_cond;
   GQueue *queue;
+  guint buffers_pushed;
 
   gboolean eos;
   gboolean flushing;
@@ -191,8 +193,10 @@ shell_recorder_src_create (GstPushSrc  *push_src,
     buffer = g_queue_pop_head (src->queue);
 
     /* we have a buffer, exit the loop to handle it */
-    if (buffer != NULL)
+    if (buffer != NULL) {
+      src->buffers_pushed++;
       break;
+    }
 
     /* no buffer, check EOS */
     if (src->eos) {
@@ -212,6 +216,18 @@ shell_recorder_src_create (GstPushSrc  *push_src,
   return GST_FLOW_OK;
 }
 
+static void
+shell_recorder_src_clear_pool (ShellRecorderSrc *src)
+{
+  if (src->pool == NULL)
+    return;
+
+  /* Buffers still in the pipeline are freed when they come back */
+  gst_buffer_pool_set_active (src->pool, FALSE);
+  gst_object_unref (src->pool);
+  src->pool = NULL;
+}
+
 static void
 shell_recorder_src_set_caps (ShellRecorderSrc *src,
 			     const GstCaps    *caps)
@@ -219,6 +235,8 @@ shell_recorder_src_set_caps (ShellRecorderSrc *src,
   if (caps == src->caps)
     return;
 
+  shell_recorder_src_clear_pool (src);
+
   if (src->caps != NULL)
     {
       gst_caps_unref (src->caps);
@@ -373,6 +391,91 @@ shell_recorder_src_add_buffer (ShellRecorderSrc *src,
   g_mutex_unlock (&src->queue_lock);
 }
 
+/**
+ * shell_recorder_src_acquire_buffer:
+ *
+ * Gets a buffer for a frame matching the #GstCaps set in the :caps
+ * property. Buffers come from a pool and go back to it once the
+ * pipeline is done with them, so their contents are whatever was last
+ * written to them. Frames are assumed to be without padding, as
+ * ShellRecorder produces them: I420, or otherwise 32 bits per pixel.
+ *
+ * Return value: (transfer full): a buffer, or %NULL if the caps don't
+ *  describe a frame size
+ */
+GstBuffer *
+shell_recorder_src_acquire_buffer (ShellRecorderSrc *src)
+{
+  GstBuffer *buffer = NULL;
+
+  g_return_val_if_fail (SHELL_IS_RECORDER_SRC (src), NULL);
+  g_return_val_if_fail (src->caps != NULL, NULL);
+
+  if (src->pool == NULL)
+    {
+      GstStructure *structure = gst_caps_get_structure (src->caps, 0);
+      GstStructure *config;
+      const char *format;
+      int width, height;
+      guint size;
+
+      if (!gst_structure_get_int (structure, "width", &width) ||
+          !gst_structure_get_int (structure, "height", &height))
+        return NULL;
+
+      format = gst_structure_get_string (structure, "format");
+      if (g_strcmp0 (format, "I420") == 0)
+        size = width * height * 3 / 2;
+      else
+        size = width * height * 4;
+
+      /* No maximum; like the queue, the pool doesn't do flow control */
+      src->pool = gst_buffer_pool_new ();
+      config = gst_buffer_pool_get_config (src->pool);
+      gst_buffer_pool_config_set_params (config, src->caps, size, 0, 0);
+
+      if (!gst_buffer_pool_set_config (src->pool, config) ||
+          !gst_buffer_pool_set_active (src->pool, TRUE))
+        {
+          gst_object_unref (src->pool);
+          src->pool = NULL;
+          return NULL;
+        }
+    }
+
+  if (gst_buffer_pool_acquire_buffer (src->pool, &buffer, NULL) != GST_FLOW_OK)
+    return NULL;
+
+  return buffer;
+}
+
+/**
+ * shell_recorder_src_get_queue_stats:
+ * @src: a #ShellRecorderSrc
+ * @queue_length: (out) (allow-none): number of buffers waiting to be
+ *  pushed into the pipeline
+ * @buffers_pushed: (out) (allow-none): number of buffers pushed into
+ *  the pipeline so far
+ *
+ * Gets how far the pipeline is keeping up with the buffers added to
+ * the source; comparing @buffers_pushed over time with the number of
+ * buffers added gives the throughput of the elements downstream.
+ */
+void
+shell_recorder_src_get_queue_stats (ShellRecorderSrc *src,
+                                    guint            *queue_length,
+                                    guint            *buffers_pushed)
+{
+  g_return_if_fail (SHELL_IS_RECORDER_SRC (src));
+
+  g_mutex_lock (&src->queue_lock);
+  if (queue_length)
+    *queue_length = g_queue_get_length (src->queue);
+  if (buffers_pushed)
+    *buffers_pushed = src->buffers_pushed;
+  g_mutex_unlock (&src->queue_lock);
+}
+
 /**
  * shell_recorder_src_close:
  *
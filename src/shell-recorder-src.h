@@ -33,6 +33,10 @@ void shell_recorder_src_register (void);
 
 void shell_recorder_src_add_buffer (ShellRecorderSrc *src,
 				    GstBuffer        *buffer);
+GstBuffer *shell_recorder_src_acquire_buffer (ShellRecorderSrc *src);
+void shell_recorder_src_get_queue_stats (ShellRecorderSrc *src,
+                                         guint            *queue_length,
+                                         guint            *buffers_pushed);
 void shell_recorder_src_close      (ShellRecorderSrc *src);
 
 G_END_DECLS
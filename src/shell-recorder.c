@@ -20,9 +20,10 @@
 #include <meta/compositor-mutter.h>
 
 #include "shell-global.h"
+#include "shell-i420-converter.h"
+#include "shell-perf-log.h"
 #include "shell-recorder-src.h"
 #include "shell-recorder.h"
-#include "shell-util.h"
 
 #define A11Y_APPS_SCHEMA "org.gnome.desktop.a11y.applications"
 #define MAGNIFIER_ACTIVE_KEY "screen-magnifier-enabled"
@@ -34,6 +35,38 @@ typedef enum {
 
 typedef struct _RecorderPipeline RecorderPipeline;
 
+/* Number of frames we read back from the GPU asynchronously at once;
+ * the pixels of one frame are handed to the pipeline while the next
+ * ones render.
+ */
+#define N_READBACKS 3
+
+typedef struct
+{
+  ShellRecorder *recorder;
+  CoglPixelBuffer *buffer;
+  CoglFramebuffer *framebuffer;
+  CoglFenceClosure *fence; /* non-NULL while the readback is in flight */
+  GstClockTime pts;
+  cairo_rectangle_int_t rect; /* part of the stage being read back */
+  gboolean i420; /* reading back a whole converted frame instead */
+} RecorderReadback;
+
+/* Number of emitted frames we remember the changes for; a pooled
+ * buffer that last held an older frame is filled in completely.
+ */
+#define N_FRAME_CHANGES 8
+
+/* Attached to buffers from the source's pool, so when one comes back
+ * we know which frame it still holds.
+ */
+typedef struct
+{
+  guint generation;
+  guint serial;
+  cairo_rectangle_int_t cursor; /* where the cursor was drawn over it */
+} RecorderBufferState;
+
 struct _ShellRecorder {
   GObject parent;
 
@@ -52,6 +85,17 @@ struct _ShellRecorder {
   int stage_width;
   int stage_height;
 
+  /* Frame pixels per stage pixel; with native_scale, the scale the
+   * stage is painted at within the area, otherwise 1.
+   */
+  gboolean native_scale;
+  int scale;
+
+  /* Monotonic time (in microseconds) that frame timestamps count
+   * from, so several recorders can share it; 0 to start at zero.
+   */
+  gint64 start_time;
+
   GdkScreen *gdk_screen;
 
   int pointer_x;
@@ -77,12 +121,55 @@ struct _ShellRecorder {
 
   GstClockTime last_frame_time; /* Timestamp for the last frame */
 
+  /* Adaptive quality; see quality_levels[] */
+  int quality_level;
+  int calm_intervals;
+  guint frames_emitted;
+  guint last_frames_emitted;
+  guint last_buffers_pushed;
+
+  gboolean async_readback;
+  RecorderReadback readbacks[N_READBACKS];
+  guint next_readback;
+
+  /* With gpu_convert, frames are converted to I420 on the GPU if the
+   * recorded area allows it. The stage is then read back into
+   * stage_texture rather than frame_data, and composite_texture is
+   * where the cursor is drawn over it for each frame.
+   */
+  gboolean gpu_convert;
+  ShellI420Converter *converter;
+  CoglPixelBuffer *stage_buffer;
+  CoglTexture *stage_texture;
+  CoglTexture *composite_texture;
+  CoglFramebuffer *composite_framebuffer;
+
+  /* The recorded area as of the last captured frame. Only the parts
+   * of the stage that were repainted are read back into it; damage
+   * holds the parts that changed but haven't been read back yet.
+   */
+  guint8 *frame_data;
+  int frame_width;
+  int frame_height;
+  gboolean frame_i420;
+  cairo_region_t *damage;
+  GstBuffer *last_buffer; /* for repeating static frames */
+
+  /* Parts of the frame that changed since the last emitted frame, and
+   * for each of the last N_FRAME_CHANGES emitted frames, indexed by
+   * serial. The generation changes whenever frame_data is replaced.
+   */
+  cairo_region_t *changes;
+  cairo_region_t *frame_changes[N_FRAME_CHANGES];
+  guint frame_serial;
+  guint frame_generation;
+
   /* GSource IDs for different timeouts and idles */
   guint redraw_timeout;
-  guint redraw_idle;
+  guint emit_timeout;
   guint update_memory_used_timeout;
   guint update_pointer_timeout;
-  guint repaint_hook_id;
+  guint adapt_timeout;
 };
 
 struct _RecorderPipeline
@@ -90,6 +177,8 @@ struct _RecorderPipeline
   ShellRecorder *recorder;
   GstElement *pipeline;
   GstElement *src;
+  GstElement *encoder; /* element with a cpu-used property, if any */
+  int encoder_speed;   /* its cpu-used as configured in the pipeline */
   int outfile;
   char *filename;
 };
@@ -109,6 +198,12 @@ static void recorder_pipeline_set_caps (RecorderPipeline *pipeline);
 static void recorder_pipeline_closed   (RecorderPipeline *pipeline);
 
 static void recorder_remove_redraw_timeout (ShellRecorder *recorder);
+static void recorder_flush_readbacks       (ShellRecorder *recorder);
+static void recorder_free_readbacks        (ShellRecorder *recorder);
+static void recorder_free_frame            (ShellRecorder *recorder);
+static void recorder_emit_duplicate        (ShellRecorder *recorder);
+static void recorder_schedule_emit         (ShellRecorder *recorder,
+                                            GstClockTime   delay);
 
 enum {
   PROP_0,
@@ -117,7 +212,12 @@ enum {
   PROP_FRAMERATE,
   PROP_PIPELINE,
   PROP_FILE_TEMPLATE,
-  PROP_DRAW_CURSOR
+  PROP_DRAW_CURSOR,
+  PROP_GPU_CONVERT,
+  PROP_NATIVE_SCALE,
+  PROP_START_TIME,
+  PROP_QUALITY_LEVEL,
+  PROP_CAPTURE_FRAMERATE
 };
 
 G_DEFINE_TYPE(ShellRecorder, shell_recorder, G_TYPE_OBJECT);
@@ -141,8 +241,8 @@ G_DEFINE_TYPE(ShellRecorder, shell_recorder, G_TYPE_OBJECT);
 
 /* Maximum time between frames, in milliseconds. If we don't send data
  * for a long period of time, then when we send the next frame, a lot
- * of work can be created for the encoder to do, so we want to force a
- * periodic redraw when nothing happen.
+ * of work can be created for the encoder to do, so we want to repeat
+ * the last frame periodically when nothing happens.
  */
 #define MAXIMUM_PAUSE_TIME 1000
 
@@ -155,6 +255,65 @@ G_DEFINE_TYPE(ShellRecorder, shell_recorder, G_TYPE_OBJECT);
  */
 #define DEFAULT_MEMORY_TARGET (512*1024)
 
+/* How often (in milliseconds) we check whether the encoder keeps up
+ * with the frames we capture.
+ */
+#define ADAPT_INTERVAL 1000
+
+/* Number of consecutive checks without a backlog before we go back
+ * up one quality level.
+ */
+#define ADAPT_RECOVER_INTERVALS 5
+
+/* The fastest cpu-used value libvpx accepts for all codecs */
+#define MAX_ENCODER_SPEED 8
+
+/* The steps taken, in order, while the encoder can't keep up with
+ * the frames we capture: first the encoder is asked to trade quality
+ * for speed, then frames are captured less often. Dropping frames
+ * when memory_target fills up remains the last resort.
+ */
+static const struct {
+  int encoder_speedup;   /* added to the encoder's cpu-used */
+  int framerate_divisor;
+} quality_levels[] = {
+  { 0, 1 },
+  { 3, 1 },
+  { 3, 2 },
+  { 6, 2 },
+  { 6, 4 },
+};
+
+/* Time the main thread spends capturing frames, for the perf log;
+ * shared between recorders since statistics can't be removed again.
+ */
+static gint64 capture_stall_total;
+static gint64 capture_stall_max;
+static int capture_n_frames;
+
+static void
+recorder_add_capture_stall (gint64 stall)
+{
+  capture_stall_total += stall;
+  capture_stall_max = MAX (capture_stall_max, stall);
+}
+
+static void
+recorder_statistics_callback (ShellPerfLog *perf_log,
+                              gpointer      data)
+{
+  shell_perf_log_update_statistic_i (perf_log, "recorder.capturedFrames",
+                                     capture_n_frames);
+  shell_perf_log_update_statistic_x (perf_log, "recorder.captureStall",
+                                     capture_n_frames > 0 ? capture_stall_total / capture_n_frames : 0);
+  shell_perf_log_update_statistic_x (perf_log, "recorder.captureStallMax",
+                                     capture_stall_max);
+
+  capture_stall_total = 0;
+  capture_stall_max = 0;
+  capture_n_frames = 0;
+}
+
 static guint
 get_memory_target (void)
 {
@@ -186,30 +345,19 @@ get_memory_target (void)
   return DEFAULT_MEMORY_TARGET;
 }
 
-/*
- * Used to force full stage redraws during recording to avoid artifacts
- *
- * Note: That this will cause the stage to be repainted on
- * every animation frame even if the frame wouldn't normally cause any new
- * drawing
- */
-static gboolean
-recorder_repaint_hook (gpointer data)
-{
-  ClutterActor *stage = data;
-  clutter_actor_queue_redraw (stage);
-
-  return TRUE;
-}
-
 static void
 shell_recorder_init (ShellRecorder *recorder)
 {
+  int i;
+
   /* Calling gst_init() is a no-op if GStreamer was previously initialized */
   gst_init (NULL, NULL);
 
   shell_recorder_src_register ();
 
+  for (i = 0; i < N_READBACKS; i++)
+    recorder->readbacks[i].recorder = recorder;
+
   recorder->gdk_screen = gdk_screen_get_default ();
 
   recorder->memory_target = get_memory_target();
@@ -219,6 +367,7 @@ shell_recorder_init (ShellRecorder *recorder)
   recorder->state = RECORDER_STATE_CLOSED;
   recorder->framerate = DEFAULT_FRAMES_PER_SECOND;
   recorder->draw_cursor = TRUE;
+  recorder->scale = 1;
 }
 
 static void
@@ -239,6 +388,9 @@ shell_recorder_finalize (GObject  *object)
   recorder_set_file_template (recorder, NULL);
 
   recorder_remove_redraw_timeout (recorder);
+  recorder_free_readbacks (recorder);
+  recorder_free_frame (recorder);
+  g_clear_pointer (&recorder->converter, shell_i420_converter_free);
 
   g_clear_object (&recorder->a11y_settings);
 
@@ -278,7 +430,121 @@ recorder_update_memory_used (ShellRecorder *recorder,
     recorder->memory_used = memory_used;
 }
 
-/* Timeout used to avoid not drawing for more than MAXIMUM_PAUSE_TIME
+/* The frame rate we actually capture at, at the current quality level
+ */
+static int
+recorder_get_capture_framerate (ShellRecorder *recorder)
+{
+  return MAX (1, recorder->framerate / quality_levels[recorder->quality_level].framerate_divisor);
+}
+
+static void
+recorder_set_quality_level (ShellRecorder *recorder,
+                            int            quality_level)
+{
+  RecorderPipeline *pipeline = recorder->current_pipeline;
+
+  if (quality_level == recorder->quality_level)
+    return;
+
+  recorder->quality_level = quality_level;
+  recorder->calm_intervals = 0;
+
+  if (pipeline && pipeline->encoder)
+    {
+      int speed = pipeline->encoder_speed;
+
+      /* libvpx only looks at the magnitude of cpu-used */
+      if (quality_level > 0)
+        speed = MIN (ABS (speed) + quality_levels[quality_level].encoder_speedup,
+                     MAX (ABS (speed), MAX_ENCODER_SPEED));
+
+      g_object_set (pipeline->encoder, "cpu-used", speed, NULL);
+    }
+
+  g_object_freeze_notify (G_OBJECT (recorder));
+  g_object_notify (G_OBJECT (recorder), "quality-level");
+  g_object_notify (G_OBJECT (recorder), "capture-framerate");
+  g_object_thaw_notify (G_OBJECT (recorder));
+}
+
+/* Compares how many frames the pipeline took from the source since
+ * the last check with how many we gave it. If it took fewer and a
+ * backlog is building up, step down a quality level; once the queue
+ * has stayed empty for a while, step back up.
+ */
+static gboolean
+recorder_adapt_timeout (gpointer data)
+{
+  ShellRecorder *recorder = data;
+  guint queue_length, buffers_pushed;
+  guint consumed, produced;
+  gboolean behind;
+
+  if (recorder->current_pipeline == NULL)
+    return G_SOURCE_CONTINUE;
+
+  shell_recorder_src_get_queue_stats (SHELL_RECORDER_SRC (recorder->current_pipeline->src),
+                                      &queue_length, &buffers_pushed);
+
+  consumed = buffers_pushed - recorder->last_buffers_pushed;
+  produced = recorder->frames_emitted - recorder->last_frames_emitted;
+  recorder->last_buffers_pushed = buffers_pushed;
+  recorder->last_frames_emitted = recorder->frames_emitted;
+
+  /* More than half a second of frames waiting, or memory filling up
+   * well before the point where we start dropping frames */
+  behind = ((queue_length > (guint) recorder_get_capture_framerate (recorder) / 2 &&
+             consumed < produced) ||
+            recorder->memory_used > recorder->memory_target / 2);
+
+  if (behind)
+    {
+      if (recorder->quality_level < (int) G_N_ELEMENTS (quality_levels) - 1)
+        recorder_set_quality_level (recorder, recorder->quality_level + 1);
+      recorder->calm_intervals = 0;
+    }
+  else if (queue_length <= 1)
+    {
+      if (++recorder->calm_intervals >= ADAPT_RECOVER_INTERVALS &&
+          recorder->quality_level > 0)
+        recorder_set_quality_level (recorder, recorder->quality_level - 1);
+    }
+  else
+    {
+      recorder->calm_intervals = 0;
+    }
+
+  return G_SOURCE_CONTINUE;
+}
+
+static void
+recorder_add_adapt_timeout (ShellRecorder *recorder)
+{
+  recorder->frames_emitted = 0;
+  recorder->last_frames_emitted = 0;
+  recorder->last_buffers_pushed = 0;
+  recorder->calm_intervals = 0;
+
+  recorder->adapt_timeout = g_timeout_add (ADAPT_INTERVAL,
+                                           recorder_adapt_timeout,
+                                           recorder);
+  g_source_set_name_by_id (recorder->adapt_timeout, "[gnome-shell] recorder_adapt_timeout");
+}
+
+static void
+recorder_remove_adapt_timeout (ShellRecorder *recorder)
+{
+  if (recorder->adapt_timeout != 0)
+    {
+      g_source_remove (recorder->adapt_timeout);
+      recorder->adapt_timeout = 0;
+    }
+
+  recorder_set_quality_level (recorder, 0);
+}
+
+/* Timeout used to avoid not sending a frame for more than MAXIMUM_PAUSE_TIME
  */
 static gboolean
 recorder_redraw_timeout (gpointer data)
@@ -286,7 +552,7 @@ recorder_redraw_timeout (gpointer data)
   ShellRecorder *recorder = data;
 
   recorder->redraw_timeout = 0;
-  clutter_actor_queue_redraw (CLUTTER_ACTOR (recorder->stage));
+  recorder_emit_duplicate (recorder);
 
   return FALSE;
 }
@@ -313,167 +579,1020 @@ recorder_remove_redraw_timeout (ShellRecorder *recorder)
     }
 }
 
-static void
-recorder_fetch_cursor_image (ShellRecorder *recorder)
-{
-  CoglTexture *texture;
-  int width, height;
-  int stride;
-  guint8 *data;
+static void
+recorder_fetch_cursor_image (ShellRecorder *recorder)
+{
+  CoglTexture *texture;
+  int width, height;
+  int stride;
+  guint8 *data;
+
+  texture = meta_cursor_tracker_get_sprite (recorder->cursor_tracker);
+  if (!texture)
+    return;
+
+  width = cogl_texture_get_width (texture);
+  height = cogl_texture_get_height (texture);
+  stride = 4 * width;
+  data = g_new (guint8, stride * height);
+  cogl_texture_get_data (texture, CLUTTER_CAIRO_FORMAT_ARGB32, stride, data);
+
+  /* FIXME: cairo-gl? */
+  recorder->cursor_image = cairo_image_surface_create_for_data (data,
+                                                                CAIRO_FORMAT_ARGB32,
+                                                                width, height,
+                                                                stride);
+  recorder->cursor_memory = data;
+}
+
+/* Overlay the cursor image on the frame. We draw the cursor image
+ * into the host-memory buffer after  we've captured the frame. An
+ * alternate approach would be to turn off the cursor while recording
+ * and draw the cursor ourselves with GL, but then we'd need to figure
+ * out what the cursor looks like, or hard-code a non-system cursor.
+ */
+/* We don't show a cursor unless the hot spot is in the frame; this
+ * means that sometimes we aren't going to draw a cursor even when
+ * there is a little bit overlapping within the stage */
+static gboolean
+recorder_pointer_in_area (ShellRecorder *recorder)
+{
+  return (recorder->pointer_x >= recorder->area.x &&
+          recorder->pointer_y >= recorder->area.y &&
+          recorder->pointer_x < recorder->area.x + recorder->area.width &&
+          recorder->pointer_y < recorder->area.y + recorder->area.height);
+}
+
+/* Draws the cursor over frame-sized pixel data; @drawn is set to the
+ * part of the frame that was drawn over, relative to the frame.
+ */
+static void
+recorder_draw_cursor (ShellRecorder         *recorder,
+                      guint8                *data,
+                      cairo_rectangle_int_t *drawn)
+{
+  cairo_surface_t *surface;
+  cairo_t *cr;
+  int x, y;
+
+  if (!recorder_pointer_in_area (recorder))
+    return;
+
+  if (!recorder->cursor_image)
+    recorder_fetch_cursor_image (recorder);
+
+  if (!recorder->cursor_image)
+    return;
+
+  x = (recorder->pointer_x - recorder->area.x) * recorder->scale - recorder->cursor_hot_x;
+  y = (recorder->pointer_y - recorder->area.y) * recorder->scale - recorder->cursor_hot_y;
+
+  surface = cairo_image_surface_create_for_data (data,
+                                                 CAIRO_FORMAT_ARGB32,
+                                                 recorder->frame_width,
+                                                 recorder->frame_height,
+                                                 recorder->frame_width * 4);
+
+  cr = cairo_create (surface);
+  cairo_set_source_surface (cr, recorder->cursor_image, x, y);
+  cairo_paint (cr);
+
+  cairo_destroy (cr);
+  cairo_surface_destroy (surface);
+
+  drawn->x = x;
+  drawn->y = y;
+  drawn->width = cairo_image_surface_get_width (recorder->cursor_image);
+  drawn->height = cairo_image_surface_get_height (recorder->cursor_image);
+}
+
+/* Make sure frame_data matches the recorded area. A new frame has
+ * nothing in it yet, so all of it is damaged.
+ */
+static gsize
+recorder_get_frame_size (ShellRecorder *recorder)
+{
+  if (recorder->frame_i420)
+    return recorder->frame_width * recorder->frame_height * 3 / 2;
+  else
+    return recorder->frame_width * recorder->frame_height * 4;
+}
+
+/* For frames converted on the GPU, the stage is kept in a texture;
+ * the cursor is drawn over a copy of it for each frame.
+ */
+static void
+recorder_create_stage_textures (ShellRecorder *recorder)
+{
+  CoglContext *context =
+    clutter_backend_get_cogl_context (clutter_get_default_backend ());
+  CoglError *error = NULL;
+
+  recorder->stage_texture = COGL_TEXTURE (cogl_texture_2d_new_with_size (context,
+                                                                         recorder->frame_width,
+                                                                         recorder->frame_height));
+  recorder->composite_texture = COGL_TEXTURE (cogl_texture_2d_new_with_size (context,
+                                                                             recorder->frame_width,
+                                                                             recorder->frame_height));
+  recorder->composite_framebuffer =
+    COGL_FRAMEBUFFER (cogl_offscreen_new_with_texture (recorder->composite_texture));
+
+  if (!cogl_texture_allocate (recorder->stage_texture, &error) ||
+      !cogl_framebuffer_allocate (recorder->composite_framebuffer, &error))
+    {
+      g_warning ("ShellRecorder: can't create textures for the frame: %s", error->message);
+      cogl_error_free (error);
+      g_clear_pointer (&recorder->composite_framebuffer, cogl_object_unref);
+      g_clear_pointer (&recorder->composite_texture, cogl_object_unref);
+      g_clear_pointer (&recorder->stage_texture, cogl_object_unref);
+      return;
+    }
+
+  cogl_framebuffer_orthographic (recorder->composite_framebuffer,
+                                 0, 0, recorder->frame_width, recorder->frame_height,
+                                 -1, 1);
+}
+
+static void
+recorder_ensure_frame (ShellRecorder *recorder)
+{
+  gboolean i420 = recorder->converter != NULL;
+
+  if (recorder->frame_data &&
+      recorder->frame_width == recorder->area.width * recorder->scale &&
+      recorder->frame_height == recorder->area.height * recorder->scale &&
+      recorder->frame_i420 == i420)
+    return;
+
+  /* Readbacks in flight are for the old frame */
+  recorder_flush_readbacks (recorder);
+  recorder_free_frame (recorder);
+
+  recorder->frame_width = recorder->area.width * recorder->scale;
+  recorder->frame_height = recorder->area.height * recorder->scale;
+  recorder->frame_i420 = i420;
+  recorder->frame_data = g_malloc0 (recorder_get_frame_size (recorder));
+  recorder->damage = cairo_region_create_rectangle (&recorder->area);
+  recorder->changes = cairo_region_create ();
+
+  if (i420)
+    recorder_create_stage_textures (recorder);
+}
+
+static void
+recorder_free_frame (ShellRecorder *recorder)
+{
+  int i;
+
+  g_clear_pointer (&recorder->frame_data, g_free);
+  g_clear_pointer (&recorder->stage_buffer, cogl_object_unref);
+  g_clear_pointer (&recorder->composite_framebuffer, cogl_object_unref);
+  g_clear_pointer (&recorder->composite_texture, cogl_object_unref);
+  g_clear_pointer (&recorder->stage_texture, cogl_object_unref);
+  g_clear_pointer (&recorder->damage, cairo_region_destroy);
+  g_clear_pointer (&recorder->last_buffer, gst_buffer_unref);
+  g_clear_pointer (&recorder->changes, cairo_region_destroy);
+  for (i = 0; i < N_FRAME_CHANGES; i++)
+    g_clear_pointer (&recorder->frame_changes[i], cairo_region_destroy);
+
+  /* Pooled buffers no longer hold any frame we know about */
+  recorder->frame_generation++;
+  recorder->frame_width = 0;
+  recorder->frame_height = 0;
+}
+
+/* Translates a rectangle of the stage to the part of the frame that
+ * shows it.
+ */
+static void
+recorder_get_frame_rect (ShellRecorder         *recorder,
+                         cairo_rectangle_int_t *rect,
+                         cairo_rectangle_int_t *frame_rect)
+{
+  frame_rect->x = (rect->x - recorder->area.x) * recorder->scale;
+  frame_rect->y = (rect->y - recorder->area.y) * recorder->scale;
+  frame_rect->width = rect->width * recorder->scale;
+  frame_rect->height = rect->height * recorder->scale;
+}
+
+/* Notes that a rectangle of the stage was updated in the frame
+ */
+static void
+recorder_frame_changed (ShellRecorder         *recorder,
+                        cairo_rectangle_int_t *rect)
+{
+  cairo_rectangle_int_t changed;
+
+  recorder_get_frame_rect (recorder, rect, &changed);
+  cairo_region_union_rectangle (recorder->changes, &changed);
+}
+
+/* Copies the pixels for a rectangle of the stage into the frame
+ */
+static void
+recorder_update_frame (ShellRecorder         *recorder,
+                       cairo_rectangle_int_t *rect,
+                       const guint8          *data,
+                       int                    stride)
+{
+  int frame_stride = recorder->frame_width * 4;
+  guint8 *dest;
+  int y;
+
+  dest = (recorder->frame_data +
+          (rect->y - recorder->area.y) * frame_stride +
+          (rect->x - recorder->area.x) * 4);
+
+  for (y = 0; y < rect->height; y++)
+    memcpy (dest + y * frame_stride, data + y * stride, rect->width * 4);
+
+  recorder_frame_changed (recorder, rect);
+}
+
+static GQuark
+recorder_buffer_state_quark (void)
+{
+  return g_quark_from_static_string ("shell-recorder-buffer-state");
+}
+
+/* Works out which parts of a pooled buffer are out of date with
+ * respect to the frame about to be emitted.
+ */
+static cairo_region_t *
+recorder_get_stale_region (ShellRecorder       *recorder,
+                           RecorderBufferState *state)
+{
+  cairo_rectangle_int_t frame = { 0, 0, recorder->frame_width, recorder->frame_height };
+  cairo_region_t *stale;
+  guint serial;
+
+  if (state == NULL ||
+      state->generation != recorder->frame_generation ||
+      recorder->frame_serial - state->serial > N_FRAME_CHANGES)
+    return cairo_region_create_rectangle (&frame);
+
+  stale = cairo_region_create_rectangle (&state->cursor);
+  for (serial = state->serial + 1; serial != recorder->frame_serial + 1; serial++)
+    {
+      cairo_region_t *changes = recorder->frame_changes[serial % N_FRAME_CHANGES];
+
+      if (changes)
+        cairo_region_union (stale, changes);
+    }
+
+  cairo_region_intersect_rectangle (stale, &frame);
+  return stale;
+}
+
+/* Brings a buffer from the source's pool up to date with the frame.
+ * Such buffers usually still hold a recent frame, so only the parts
+ * that changed since then are copied into them.
+ */
+static void
+recorder_fill_buffer (ShellRecorder *recorder,
+                      GstBuffer     *buffer)
+{
+  RecorderBufferState *state;
+  cairo_region_t *stale;
+  GstMapInfo info;
+  int frame_stride, n_rects, i, y;
+
+  frame_stride = recorder->frame_width * 4;
+
+  state = gst_mini_object_get_qdata (GST_MINI_OBJECT (buffer),
+                                     recorder_buffer_state_quark ());
+  stale = recorder_get_stale_region (recorder, state);
+
+  if (state == NULL)
+    {
+      state = g_new0 (RecorderBufferState, 1);
+      gst_mini_object_set_qdata (GST_MINI_OBJECT (buffer),
+                                 recorder_buffer_state_quark (),
+                                 state, g_free);
+    }
+
+  gst_buffer_map (buffer, &info, GST_MAP_WRITE);
+
+  n_rects = cairo_region_num_rectangles (stale);
+  for (i = 0; i < n_rects; i++)
+    {
+      cairo_rectangle_int_t rect;
+      gsize offset;
+
+      cairo_region_get_rectangle (stale, i, &rect);
+      offset = rect.y * frame_stride + rect.x * 4;
+
+      for (y = 0; y < rect.height; y++)
+        memcpy (info.data + offset + y * frame_stride,
+                recorder->frame_data + offset + y * frame_stride,
+                rect.width * 4);
+    }
+  cairo_region_destroy (stale);
+
+  state->generation = recorder->frame_generation;
+  state->serial = recorder->frame_serial;
+  state->cursor.width = state->cursor.height = 0;
+
+  if (recorder->draw_cursor &&
+      !g_settings_get_boolean (recorder->a11y_settings, MAGNIFIER_ACTIVE_KEY))
+    recorder_draw_cursor (recorder, info.data, &state->cursor);
+
+  gst_buffer_unmap (buffer, &info);
+}
+
+/* Hand the current frame to the pipeline
+ */
+static void
+recorder_emit_frame (ShellRecorder *recorder,
+                     GstClockTime   pts)
+{
+  ShellRecorderSrc *src;
+  GstBuffer *buffer;
+  int slot;
+
+  if (recorder->current_pipeline == NULL || recorder->frame_data == NULL)
+    return;
+
+  src = SHELL_RECORDER_SRC (recorder->current_pipeline->src);
+
+  recorder->frame_serial++;
+  slot = recorder->frame_serial % N_FRAME_CHANGES;
+  g_clear_pointer (&recorder->frame_changes[slot], cairo_region_destroy);
+  recorder->frame_changes[slot] = recorder->changes;
+  recorder->changes = cairo_region_create ();
+
+  buffer = shell_recorder_src_acquire_buffer (src);
+  if (buffer == NULL)
+    buffer = gst_buffer_new_allocate (NULL, recorder_get_frame_size (recorder), NULL);
+
+  /* Frames converted on the GPU come back whole, cursor included */
+  if (recorder->frame_i420)
+    gst_buffer_fill (buffer, 0, recorder->frame_data, recorder_get_frame_size (recorder));
+  else
+    recorder_fill_buffer (recorder, buffer);
+
+  GST_BUFFER_PTS(buffer) = pts;
+
+  shell_recorder_src_add_buffer (src, buffer);
+
+  g_clear_pointer (&recorder->last_buffer, gst_buffer_unref);
+  recorder->last_buffer = buffer;
+}
+
+/* Gets the stream time for a new frame; returns %FALSE if no frame
+ * should be recorded at all right now.
+ */
+static gboolean
+recorder_get_frame_time (ShellRecorder *recorder,
+                         GstClockTime  *now)
+{
+  GstClock *clock;
+
+  if (recorder->current_pipeline == NULL)
+    return FALSE;
+
+  /* If we get into the red zone, stop buffering new frames; 13/16 is
+  * a bit more than the 3/4 threshold for a red indicator to keep the
+  * indicator from flashing between red and yellow. */
+  if (recorder->memory_used > (recorder->memory_target * 13) / 16)
+    return FALSE;
+
+  clock = gst_element_get_clock (recorder->current_pipeline->src);
+
+  /* If we have no clock yet, the pipeline is not yet in PLAYING */
+  if (!clock)
+    return FALSE;
+
+  *now = gst_clock_get_time (clock) - gst_element_get_base_time (recorder->current_pipeline->src);
+  gst_object_unref (clock);
+
+  return TRUE;
+}
+
+/* Drop frames to get down to something like the target frame rate; since frames
+ * are generated with VBlank sync, we don't have full control anyways, so we just
+ * drop frames if the interval since the last frame is less than 75% of the
+ * desired inter-frame interval. Returns how long to wait before the next frame.
+ */
+static GstClockTime
+recorder_get_frame_delay (ShellRecorder *recorder,
+                          GstClockTime   now)
+{
+  GstClockTime interval = gst_util_uint64_scale_int (GST_SECOND, 3, 4 * recorder_get_capture_framerate (recorder));
+
+  if (!GST_CLOCK_TIME_IS_VALID (recorder->last_frame_time) ||
+      now - recorder->last_frame_time >= interval)
+    return 0;
+
+  return recorder->last_frame_time + interval - now;
+}
+
+static void
+recorder_frame_recorded (ShellRecorder *recorder,
+                         GstClockTime   now)
+{
+  recorder->last_frame_time = now;
+  recorder->frames_emitted++;
+
+  /* Reset the timeout that we used to avoid an overlong pause in the stream */
+  recorder_remove_redraw_timeout (recorder);
+  recorder_add_redraw_timeout (recorder);
+}
+
+/* Nothing changed for a while; repeat the last frame with a new
+ * timestamp. The copy shares the pixels of the original.
+ */
+static void
+recorder_emit_duplicate (ShellRecorder *recorder)
+{
+  GstBuffer *buffer;
+  GstClockTime now;
+
+  recorder_flush_readbacks (recorder);
+
+  if (recorder->last_buffer == NULL ||
+      !recorder_get_frame_time (recorder, &now))
+    {
+      recorder_add_redraw_timeout (recorder);
+      return;
+    }
+
+  /* The copy only shares the GstMemory of the original; the original
+   * still goes back to the pool once last_buffer is released. The pool
+   * then finds its memory isn't writable while the copy holds it, and
+   * drops the buffer rather than handing out memory still in flight. */
+  buffer = gst_buffer_copy (recorder->last_buffer);
+  GST_BUFFER_PTS(buffer) = now;
+  shell_recorder_src_add_buffer (SHELL_RECORDER_SRC (recorder->current_pipeline->src), buffer);
+  gst_buffer_unref (buffer);
+
+  recorder_frame_recorded (recorder, now);
+}
+
+/* Copies pixels of the readback into the frame and sends the frame
+ * on. When called from the fence callback the GPU is done, so mapping
+ * the pixel buffer doesn't block; otherwise this waits for the
+ * readback to finish.
+ */
+static void
+recorder_readback_finish (RecorderReadback *readback)
+{
+  ShellRecorder *recorder = readback->recorder;
+  gint64 start;
+  guint8 *data;
+
+  start = g_get_monotonic_time ();
+
+  if (readback->fence)
+    {
+      cogl_framebuffer_cancel_fence_callback (readback->framebuffer,
+                                              readback->fence);
+      readback->fence = NULL;
+    }
+
+  /* The recording was closed under us */
+  if (recorder->current_pipeline == NULL)
+    return;
+
+  data = cogl_buffer_map (COGL_BUFFER (readback->buffer),
+                          COGL_BUFFER_ACCESS_READ, 0);
+  if (data == NULL)
+    {
+      g_warning ("ShellRecorder: can't map the readback buffer");
+      return;
+    }
+
+  if (readback->i420)
+    memcpy (recorder->frame_data, data, recorder_get_frame_size (recorder));
+  else
+    recorder_update_frame (recorder, &readback->rect, data, readback->rect.width * 4);
+  cogl_buffer_unmap (COGL_BUFFER (readback->buffer));
+
+  recorder_add_capture_stall (g_get_monotonic_time () - start);
+
+  recorder_emit_frame (recorder, readback->pts);
+}
+
+static void
+recorder_readback_fence_done (CoglFence *fence,
+                              gpointer   data)
+{
+  RecorderReadback *readback = data;
+
+  /* Cogl frees the closure after calling us */
+  readback->fence = NULL;
+  recorder_readback_finish (readback);
+}
+
+/* Finish outstanding readbacks, oldest first */
+static void
+recorder_flush_readbacks (ShellRecorder *recorder)
+{
+  int i;
+
+  for (i = 0; i < N_READBACKS; i++)
+    {
+      RecorderReadback *readback;
+
+      readback = &recorder->readbacks[(recorder->next_readback + i) % N_READBACKS];
+      if (readback->fence)
+        recorder_readback_finish (readback);
+    }
+}
+
+static void
+recorder_free_readbacks (ShellRecorder *recorder)
+{
+  int i;
+
+  recorder_flush_readbacks (recorder);
+
+  for (i = 0; i < N_READBACKS; i++)
+    {
+      RecorderReadback *readback = &recorder->readbacks[i];
+
+      if (readback->buffer)
+        {
+          cogl_object_unref (readback->buffer);
+          readback->buffer = NULL;
+        }
+    }
+}
+
+/* Whether we can read pixels of the stage from @framebuffer directly;
+ * with several stage views, clutter_stage_capture() knows how to
+ * stitch the frame together, but we only handle a single view.
+ */
+static gboolean
+recorder_can_read_framebuffer (ShellRecorder   *recorder,
+                               CoglFramebuffer *framebuffer)
+{
+  return (recorder->async_readback &&
+          recorder->scale == 1 &&
+          cogl_is_onscreen (framebuffer) &&
+          cogl_framebuffer_get_width (framebuffer) == recorder->stage_width &&
+          cogl_framebuffer_get_height (framebuffer) == recorder->stage_height);
+}
+
+/* Gets the next readback to use, with a pixel buffer big enough for
+ * any readback of the frame.
+ */
+static RecorderReadback *
+recorder_get_next_readback (ShellRecorder *recorder)
+{
+  RecorderReadback *readback = &recorder->readbacks[recorder->next_readback];
+
+  /* The GPU is more than N_READBACKS frames behind; wait for the oldest */
+  if (readback->fence)
+    recorder_readback_finish (readback);
+
+  if (readback->buffer == NULL ||
+      cogl_buffer_get_size (COGL_BUFFER (readback->buffer)) < recorder_get_frame_size (recorder))
+    {
+      CoglContext *context =
+        clutter_backend_get_cogl_context (clutter_get_default_backend ());
+
+      if (readback->buffer)
+        cogl_object_unref (readback->buffer);
+
+      readback->buffer = cogl_pixel_buffer_new (context,
+                                                recorder_get_frame_size (recorder),
+                                                NULL);
+      cogl_buffer_set_update_hint (COGL_BUFFER (readback->buffer),
+                                   COGL_BUFFER_UPDATE_HINT_STREAM);
+    }
+
+  return readback;
+}
+
+/* Called once pixels from @framebuffer are on their way into the
+ * readback's pixel buffer; a fence tells us when they are there.
+ */
+static void
+recorder_queue_readback (ShellRecorder    *recorder,
+                         RecorderReadback *readback,
+                         CoglFramebuffer  *framebuffer,
+                         GstClockTime      now)
+{
+  recorder->next_readback = (recorder->next_readback + 1) % N_READBACKS;
+
+  readback->framebuffer = framebuffer;
+  readback->pts = now;
+  readback->fence = cogl_framebuffer_add_fence_callback (framebuffer,
+                                                         recorder_readback_fence_done,
+                                                         readback);
+  if (readback->fence == NULL)
+    recorder_readback_finish (readback);
+}
+
+/* Starts reading back part of the frame that was just painted into a
+ * pixel buffer, without waiting for the GPU to get there; a fence tells
+ * us when the pixels are ready. Returns %FALSE if this isn't possible
+ * and the frame needs to be captured synchronously.
+ *
+ * Note that unless the driver supports MESA_pack_invert, Cogl maps the
+ * buffer to flip the image after reading, which brings the stall back.
+ */
+static gboolean
+recorder_start_readback (ShellRecorder         *recorder,
+                         cairo_rectangle_int_t *rect,
+                         GstClockTime           now)
+{
+  CoglFramebuffer *framebuffer = cogl_get_draw_framebuffer ();
+  RecorderReadback *readback;
+  CoglBitmap *bitmap;
+  CoglError *error = NULL;
+  gboolean result;
+
+  if (!recorder_can_read_framebuffer (recorder, framebuffer))
+    return FALSE;
+
+  readback = recorder_get_next_readback (recorder);
+
+  bitmap = cogl_bitmap_new_from_buffer (COGL_BUFFER (readback->buffer),
+                                        CLUTTER_CAIRO_FORMAT_ARGB32,
+                                        rect->width, rect->height,
+                                        rect->width * 4, 0);
+  result = cogl_framebuffer_read_pixels_into_bitmap (framebuffer,
+                                                     rect->x, rect->y,
+                                                     COGL_READ_PIXELS_COLOR_BUFFER,
+                                                     bitmap,
+                                                     &error);
+  cogl_object_unref (bitmap);
+
+  if (!result)
+    {
+      g_warning ("ShellRecorder: asynchronous readback failed: %s", error->message);
+      cogl_error_free (error);
+      recorder->async_readback = FALSE;
+      return FALSE;
+    }
+
+  readback->rect = *rect;
+  readback->i420 = FALSE;
+  recorder_queue_readback (recorder, readback, framebuffer, now);
+
+  return TRUE;
+}
+
+/* Captures a rectangle of the stage into the frame, waiting for the GPU
+ */
+static void
+recorder_capture_sync (ShellRecorder         *recorder,
+                       cairo_rectangle_int_t *rect,
+                       gboolean               paint)
+{
+  ClutterCapture *captures;
+  int n_captures;
+  cairo_surface_t *frame;
+  cairo_t *cr;
+  int i;
+
+  clutter_stage_capture (recorder->stage, paint, rect,
+                         &captures, &n_captures);
+
+  if (n_captures == 0)
+    return;
+
+  /* Each capture (one per monitor the rectangle spans) is painted
+   * straight into the frame, rather than being composited into an
+   * intermediate image first. Captures carry the scale of their
+   * monitor, so cairo scales them to the scale of the frame.
+   */
+  frame = cairo_image_surface_create_for_data (recorder->frame_data,
+                                               CAIRO_FORMAT_ARGB32,
+                                               recorder->frame_width,
+                                               recorder->frame_height,
+                                               recorder->frame_width * 4);
+  cr = cairo_create (frame);
+  cairo_scale (cr, recorder->scale, recorder->scale);
+  cairo_translate (cr, - recorder->area.x, - recorder->area.y);
+  cairo_rectangle (cr, rect->x, rect->y, rect->width, rect->height);
+  cairo_clip (cr);
+  cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
+
+  for (i = 0; i < n_captures; i++)
+    {
+      ClutterCapture *capture = &captures[i];
+
+      cairo_save (cr);
+      cairo_rectangle (cr,
+                       capture->rect.x, capture->rect.y,
+                       capture->rect.width, capture->rect.height);
+      cairo_clip (cr);
+      cairo_set_source_surface (cr, capture->image,
+                                capture->rect.x, capture->rect.y);
+      cairo_paint (cr);
+      cairo_restore (cr);
+
+      cairo_surface_destroy (capture->image);
+    }
+  g_free (captures);
+
+  cairo_destroy (cr);
+  cairo_surface_destroy (frame);
+
+  recorder_frame_changed (recorder, rect);
+}
+
+/* Copies a rectangle of the stage into stage_texture. Read straight
+ * from the framebuffer that was just painted, the pixels go through a
+ * pixel buffer and never leave the GPU; otherwise they come from a
+ * capture.
+ */
+static void
+recorder_update_stage_texture (ShellRecorder         *recorder,
+                               cairo_rectangle_int_t *rect,
+                               gboolean               paint)
+{
+  CoglFramebuffer *framebuffer = cogl_get_draw_framebuffer ();
+  gboolean result;
+
+  if (!paint && recorder_can_read_framebuffer (recorder, framebuffer))
+    {
+      CoglBitmap *bitmap;
+
+      if (recorder->stage_buffer == NULL)
+        {
+          CoglContext *context =
+            clutter_backend_get_cogl_context (clutter_get_default_backend ());
+
+          recorder->stage_buffer = cogl_pixel_buffer_new (context,
+                                                          recorder->frame_width * recorder->frame_height * 4,
+                                                          NULL);
+          cogl_buffer_set_update_hint (COGL_BUFFER (recorder->stage_buffer),
+                                       COGL_BUFFER_UPDATE_HINT_STREAM);
+        }
+
+      bitmap = cogl_bitmap_new_from_buffer (COGL_BUFFER (recorder->stage_buffer),
+                                            CLUTTER_CAIRO_FORMAT_ARGB32,
+                                            rect->width, rect->height,
+                                            rect->width * 4, 0);
+      result = (cogl_framebuffer_read_pixels_into_bitmap (framebuffer,
+                                                          rect->x, rect->y,
+                                                          COGL_READ_PIXELS_COLOR_BUFFER,
+                                                          bitmap,
+                                                          NULL) &&
+                cogl_texture_set_region_from_bitmap (recorder->stage_texture,
+                                                     0, 0,
+                                                     rect->x - recorder->area.x,
+                                                     rect->y - recorder->area.y,
+                                                     rect->width, rect->height,
+                                                     bitmap));
+      cogl_object_unref (bitmap);
+    }
+  else
+    {
+      ClutterCapture *captures;
+      int n_captures;
+      cairo_rectangle_int_t frame_rect;
+      cairo_surface_t *image;
+      double capture_scale = 1.0;
+      int i;
+
+      clutter_stage_capture (recorder->stage, paint, rect,
+                             &captures, &n_captures);
+
+      if (n_captures == 0)
+        return;
+
+      recorder_get_frame_rect (recorder, rect, &frame_rect);
+      cairo_surface_get_device_scale (captures[0].image, &capture_scale, NULL);
+
+      if (n_captures == 1 && capture_scale == recorder->scale)
+        {
+          image = cairo_surface_reference (captures[0].image);
+        }
+      else
+        {
+          cairo_t *cr;
+
+          /* Bring the captures to the scale of the frame, rather than
+           * to that of the monitor with the largest scale.
+           */
+          image = cairo_image_surface_create (CAIRO_FORMAT_ARGB32,
+                                              frame_rect.width,
+                                              frame_rect.height);
+          cr = cairo_create (image);
+          cairo_scale (cr, recorder->scale, recorder->scale);
+          cairo_translate (cr, - rect->x, - rect->y);
+          cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
+
+          for (i = 0; i < n_captures; i++)
+            {
+              cairo_set_source_surface (cr, captures[i].image,
+                                        captures[i].rect.x, captures[i].rect.y);
+              cairo_paint (cr);
+            }
+
+          cairo_destroy (cr);
+        }
 
-  texture = meta_cursor_tracker_get_sprite (recorder->cursor_tracker);
-  if (!texture)
-    return;
+      for (i = 0; i < n_captures; i++)
+        cairo_surface_destroy (captures[i].image);
+      g_free (captures);
+
+      cairo_surface_flush (image);
+      result = cogl_texture_set_region (recorder->stage_texture,
+                                        0, 0,
+                                        frame_rect.x,
+                                        frame_rect.y,
+                                        frame_rect.width, frame_rect.height,
+                                        cairo_image_surface_get_width (image),
+                                        cairo_image_surface_get_height (image),
+                                        CLUTTER_CAIRO_FORMAT_ARGB32,
+                                        cairo_image_surface_get_stride (image),
+                                        cairo_image_surface_get_data (image));
+      cairo_surface_destroy (image);
+    }
 
-  width = cogl_texture_get_width (texture);
-  height = cogl_texture_get_height (texture);
-  stride = 4 * width;
-  data = g_new (guint8, stride * height);
-  cogl_texture_get_data (texture, CLUTTER_CAIRO_FORMAT_ARGB32, stride, data);
+  if (!result)
+    g_warning ("ShellRecorder: can't update the frame texture");
+}
 
-  /* FIXME: cairo-gl? */
-  recorder->cursor_image = cairo_image_surface_create_for_data (data,
-                                                                CAIRO_FORMAT_ARGB32,
-                                                                width, height,
-                                                                stride);
-  recorder->cursor_memory = data;
+/* Gets the texture to convert for a frame: stage_texture, or a copy
+ * of it with the cursor drawn over it.
+ */
+static CoglTexture *
+recorder_get_composite_texture (ShellRecorder *recorder)
+{
+  CoglContext *context;
+  CoglTexture *sprite;
+  CoglPipeline *pipeline;
+  int hot_x, hot_y;
+  float x, y;
+
+  if (!recorder->draw_cursor ||
+      g_settings_get_boolean (recorder->a11y_settings, MAGNIFIER_ACTIVE_KEY) ||
+      !recorder_pointer_in_area (recorder))
+    return recorder->stage_texture;
+
+  sprite = meta_cursor_tracker_get_sprite (recorder->cursor_tracker);
+  if (sprite == NULL)
+    return recorder->stage_texture;
+
+  context = clutter_backend_get_cogl_context (clutter_get_default_backend ());
+
+  pipeline = cogl_pipeline_new (context);
+  cogl_pipeline_set_layer_texture (pipeline, 0, recorder->stage_texture);
+  cogl_pipeline_set_blend (pipeline, "RGBA = ADD (SRC_COLOR, 0)", NULL);
+  cogl_framebuffer_draw_rectangle (recorder->composite_framebuffer, pipeline,
+                                   0, 0, recorder->frame_width, recorder->frame_height);
+  cogl_object_unref (pipeline);
+
+  meta_cursor_tracker_get_hot (recorder->cursor_tracker, &hot_x, &hot_y);
+  x = (recorder->pointer_x - recorder->area.x) * recorder->scale - hot_x;
+  y = (recorder->pointer_y - recorder->area.y) * recorder->scale - hot_y;
+
+  pipeline = cogl_pipeline_new (context);
+  cogl_pipeline_set_layer_texture (pipeline, 0, sprite);
+  cogl_framebuffer_draw_rectangle (recorder->composite_framebuffer, pipeline,
+                                   x, y,
+                                   x + cogl_texture_get_width (sprite),
+                                   y + cogl_texture_get_height (sprite));
+  cogl_object_unref (pipeline);
+
+  return recorder->composite_texture;
 }
 
-/* Overlay the cursor image on the frame. We draw the cursor image
- * into the host-memory buffer after  we've captured the frame. An
- * alternate approach would be to turn off the cursor while recording
- * and draw the cursor ourselves with GL, but then we'd need to figure
- * out what the cursor looks like, or hard-code a non-system cursor.
+/* Converts the frame to I420 on the GPU and reads it back, at 1.5
+ * bytes per pixel instead of 4; asynchronously if possible.
  */
 static void
-recorder_draw_cursor (ShellRecorder *recorder,
-                      GstBuffer     *buffer)
+recorder_convert_frame (ShellRecorder *recorder,
+                        GstClockTime   now)
 {
-  GstMapInfo info;
-  cairo_surface_t *surface;
-  cairo_t *cr;
-
-  /* We don't show a cursor unless the hot spot is in the frame; this
-   * means that sometimes we aren't going to draw a cursor even when
-   * there is a little bit overlapping within the stage */
-  if (recorder->pointer_x < recorder->area.x ||
-      recorder->pointer_y < recorder->area.y ||
-      recorder->pointer_x >= recorder->area.x + recorder->area.width ||
-      recorder->pointer_y >= recorder->area.y + recorder->area.height)
-    return;
+  CoglFramebuffer *framebuffer;
+  int width = recorder->frame_width / 4;
+  int height = recorder->frame_height * 3 / 2;
 
-  if (!recorder->cursor_image)
-    recorder_fetch_cursor_image (recorder);
+  framebuffer = shell_i420_converter_convert (recorder->converter,
+                                              recorder_get_composite_texture (recorder));
 
-  if (!recorder->cursor_image)
-    return;
+  if (recorder->async_readback)
+    {
+      RecorderReadback *readback = recorder_get_next_readback (recorder);
+      CoglBitmap *bitmap;
+      CoglError *error = NULL;
+      gboolean result;
+
+      bitmap = cogl_bitmap_new_from_buffer (COGL_BUFFER (readback->buffer),
+                                            COGL_PIXEL_FORMAT_RGBA_8888,
+                                            width, height,
+                                            width * 4, 0);
+      result = cogl_framebuffer_read_pixels_into_bitmap (framebuffer,
+                                                         0, 0,
+                                                         COGL_READ_PIXELS_COLOR_BUFFER,
+                                                         bitmap,
+                                                         &error);
+      cogl_object_unref (bitmap);
+
+      if (result)
+        {
+          readback->i420 = TRUE;
+          recorder_queue_readback (recorder, readback, framebuffer, now);
+          return;
+        }
 
-  gst_buffer_map (buffer, &info, GST_MAP_WRITE);
-  surface = cairo_image_surface_create_for_data (info.data,
-                                                 CAIRO_FORMAT_ARGB32,
-                                                 recorder->area.width,
-                                                 recorder->area.height,
-                                                 recorder->area.width * 4);
+      g_warning ("ShellRecorder: asynchronous readback failed: %s", error->message);
+      cogl_error_free (error);
+      recorder->async_readback = FALSE;
+    }
 
-  cr = cairo_create (surface);
-  cairo_set_source_surface (cr,
-                            recorder->cursor_image,
-                            recorder->pointer_x - recorder->cursor_hot_x - recorder->area.x,
-                            recorder->pointer_y - recorder->cursor_hot_y - recorder->area.y);
-  cairo_paint (cr);
+  /* Frames must reach the pipeline in order */
+  recorder_flush_readbacks (recorder);
 
-  cairo_destroy (cr);
-  cairo_surface_destroy (surface);
-  gst_buffer_unmap (buffer, &info);
+  cogl_framebuffer_read_pixels (framebuffer, 0, 0, width, height,
+                                COGL_PIXEL_FORMAT_RGBA_8888,
+                                recorder->frame_data);
+  recorder_emit_frame (recorder, now);
 }
 
-/* Retrieve a frame and feed it into the pipeline
+/* Retrieve a frame and feed it into the pipeline. Normally this is
+ * called right after the stage was painted, and we only read back
+ * the part of the stage that was repainted. With @paint, the stage
+ * is painted again and all of the frame is captured.
  */
 static void
 recorder_record_frame (ShellRecorder *recorder,
                        gboolean       paint)
 {
-  GstBuffer *buffer;
-  ClutterCapture *captures;
-  int n_captures;
-  cairo_surface_t *image;
-  guint size;
-  uint8_t *data;
-  GstMemory *memory;
-  int i;
-  GstClock *clock;
-  GstClockTime now, base_time;
+  cairo_rectangle_int_t clip, rect;
+  cairo_region_t *painted;
+  GstClockTime now, delay;
+  gint64 start;
 
   g_return_if_fail (recorder->current_pipeline != NULL);
 
-  /* If we get into the red zone, stop buffering new frames; 13/16 is
-  * a bit more than the 3/4 threshold for a red indicator to keep the
-  * indicator from flashing between red and yellow. */
-  if (recorder->memory_used > (recorder->memory_target * 13) / 16)
+  if (!recorder_get_frame_time (recorder, &now))
     return;
 
-  /* Drop frames to get down to something like the target frame rate; since frames
-   * are generated with VBlank sync, we don't have full control anyways, so we just
-   * drop frames if the interval since the last frame is less than 75% of the
-   * desired inter-frame interval.
-   */
-  clock = gst_element_get_clock (recorder->current_pipeline->src);
+  recorder_ensure_frame (recorder);
 
-  /* If we have no clock yet, the pipeline is not yet in PLAYING */
-  if (!clock)
-    return;
+  if (paint)
+    clip = recorder->area;
+  else
+    clutter_stage_get_redraw_clip_bounds (recorder->stage, &clip);
 
-  base_time = gst_element_get_base_time (recorder->current_pipeline->src);
-  now = gst_clock_get_time (clock) - base_time;
-  gst_object_unref (clock);
+  painted = cairo_region_create_rectangle (&clip);
+  cairo_region_intersect_rectangle (painted, &recorder->area);
 
-  if (GST_CLOCK_TIME_IS_VALID (recorder->last_frame_time) &&
-      now - recorder->last_frame_time < gst_util_uint64_scale_int (GST_SECOND, 3, 4 * recorder->framerate))
-    return;
-  recorder->last_frame_time = now;
+  /* Nothing changed within the recorded area */
+  if (cairo_region_is_empty (painted))
+    {
+      cairo_region_destroy (painted);
+      return;
+    }
 
-  clutter_stage_capture (recorder->stage, paint, &recorder->area,
-                         &captures, &n_captures);
+  delay = recorder_get_frame_delay (recorder, now);
+  if (delay > 0)
+    {
+      /* Too early for a frame; remember what changed and come back */
+      cairo_region_union (recorder->damage, painted);
+      cairo_region_destroy (painted);
+      recorder_schedule_emit (recorder, delay);
+      return;
+    }
 
-  if (n_captures == 0)
-    return;
+  /* Only what was repainted this time is valid in the framebuffer;
+   * other damage needs another (clipped) repaint.
+   */
+  cairo_region_subtract (recorder->damage, painted);
+  if (!cairo_region_is_empty (recorder->damage))
+    recorder_schedule_emit (recorder, gst_util_uint64_scale_int (GST_SECOND, 1, recorder_get_capture_framerate (recorder)));
 
-  if (n_captures == 1)
-    image = cairo_surface_reference (captures[0].image);
-  else
-    image = shell_util_composite_capture_images (captures,
-                                                 n_captures,
-                                                 recorder->area.x,
-                                                 recorder->area.y,
-                                                 recorder->area.width,
-                                                 recorder->area.height);
+  cairo_region_get_extents (painted, &rect);
+  cairo_region_destroy (painted);
 
-  data = cairo_image_surface_get_data (image);
-  size = (cairo_image_surface_get_height (image) *
-          cairo_image_surface_get_stride (image));
+  recorder_frame_recorded (recorder, now);
 
-  for (i = 0; i < n_captures; i++)
-    cairo_surface_destroy (captures[i].image);
-  g_free (captures);
+  start = g_get_monotonic_time ();
+  capture_n_frames++;
 
-  buffer = gst_buffer_new();
-  memory = gst_memory_new_wrapped (0, data, size, 0, size,
-                                   image,
-                                   (GDestroyNotify) cairo_surface_destroy);
-  gst_buffer_insert_memory (buffer, -1, memory);
+  if (recorder->converter != NULL)
+    {
+      if (recorder->stage_texture != NULL)
+        {
+          recorder_update_stage_texture (recorder, &rect, paint);
+          recorder_convert_frame (recorder, now);
+        }
+      recorder_add_capture_stall (g_get_monotonic_time () - start);
+      return;
+    }
 
-  GST_BUFFER_PTS(buffer) = now;
+  if (!paint && recorder_start_readback (recorder, &rect, now))
+    {
+      recorder_add_capture_stall (g_get_monotonic_time () - start);
+      return;
+    }
 
-  if (recorder->draw_cursor &&
-      !g_settings_get_boolean (recorder->a11y_settings, MAGNIFIER_ACTIVE_KEY))
-    recorder_draw_cursor (recorder, buffer);
+  /* Frames must reach the pipeline in order */
+  recorder_flush_readbacks (recorder);
 
-  shell_recorder_src_add_buffer (SHELL_RECORDER_SRC (recorder->current_pipeline->src), buffer);
-  gst_buffer_unref (buffer);
+  recorder_capture_sync (recorder, &rect, paint);
+  recorder_add_capture_stall (g_get_monotonic_time () - start);
 
-  /* Reset the timeout that we used to avoid an overlong pause in the stream */
-  recorder_remove_redraw_timeout (recorder);
-  recorder_add_redraw_timeout (recorder);
+  recorder_emit_frame (recorder, now);
 }
 
 /* We hook in by recording each frame right after the stage is painted
@@ -505,12 +1624,61 @@ recorder_update_size (ShellRecorder *recorder)
     }
 }
 
+/* Works out the scale to record the area at. With native_scale, that
+ * is the scale the stage is painted at in the middle of the area, so
+ * an area within one monitor is recorded pixel for pixel whatever the
+ * scale of the other monitors; we find it out from a capture of a
+ * single pixel there.
+ */
+static void
+recorder_update_scale (ShellRecorder *recorder)
+{
+  double scale = 1.0;
+  int i;
+
+  if (recorder->native_scale && recorder->stage &&
+      recorder->area.width > 0 && recorder->area.height > 0)
+    {
+      cairo_rectangle_int_t probe;
+      ClutterCapture *captures;
+      int n_captures;
+
+      probe.x = recorder->area.x + recorder->area.width / 2;
+      probe.y = recorder->area.y + recorder->area.height / 2;
+      probe.width = 1;
+      probe.height = 1;
+
+      clutter_stage_capture (recorder->stage, FALSE, &probe,
+                             &captures, &n_captures);
+
+      for (i = 0; i < n_captures; i++)
+        {
+          double capture_scale = 1.0;
+
+          cairo_surface_get_device_scale (captures[i].image, &capture_scale, NULL);
+          scale = MAX (scale, capture_scale);
+          cairo_surface_destroy (captures[i].image);
+        }
+      g_free (captures);
+    }
+
+  if ((int) ceil (scale) == recorder->scale)
+    return;
+
+  /* What we captured so far was at the old scale */
+  recorder_flush_readbacks (recorder);
+  recorder_free_frame (recorder);
+
+  recorder->scale = (int) ceil (scale);
+}
+
 static void
 recorder_on_stage_notify_size (GObject          *object,
                                GParamSpec       *pspec,
                                ShellRecorder    *recorder)
 {
   recorder_update_size (recorder);
+  recorder_update_scale (recorder);
 
   /* This breaks the recording but tweaking the GStreamer pipeline a bit
    * might make it work, at least if the codec can handle a stream where
@@ -521,31 +1689,78 @@ recorder_on_stage_notify_size (GObject          *object,
 }
 
 static gboolean
-recorder_idle_redraw (gpointer data)
+recorder_emit_timeout (gpointer data)
 {
   ShellRecorder *recorder = data;
+  GstClockTime now, delay;
 
-  recorder->redraw_idle = 0;
-  clutter_actor_queue_redraw (CLUTTER_ACTOR (recorder->stage));
+  recorder->emit_timeout = 0;
+
+  /* Have the stage repaint what changed, so we can capture it */
+  if (recorder->damage && !cairo_region_is_empty (recorder->damage))
+    {
+      cairo_rectangle_int_t extents;
+
+      cairo_region_get_extents (recorder->damage, &extents);
+      clutter_actor_queue_redraw_with_clip (CLUTTER_ACTOR (recorder->stage), &extents);
+      return FALSE;
+    }
+
+  /* Only the cursor changed; the stage part of the frame is up to date */
+  if (!recorder_get_frame_time (recorder, &now))
+    return FALSE;
+
+  delay = recorder_get_frame_delay (recorder, now);
+  if (delay > 0)
+    {
+      recorder_schedule_emit (recorder, delay);
+      return FALSE;
+    }
+
+  recorder_frame_recorded (recorder, now);
+
+  /* Converted frames have the cursor drawn in on the GPU, so they need
+   * converting again with the cursor where it is now.
+   */
+  if (recorder->converter != NULL)
+    {
+      if (recorder->stage_texture != NULL)
+        recorder_convert_frame (recorder, now);
+      return FALSE;
+    }
+
+  recorder_flush_readbacks (recorder);
+  recorder_emit_frame (recorder, now);
 
   return FALSE;
 }
 
 static void
-recorder_queue_redraw (ShellRecorder *recorder)
+recorder_schedule_emit (ShellRecorder *recorder,
+                        GstClockTime   delay)
 {
-  /* If we just queue a redraw on every mouse motion (for example), we
-   * starve Clutter, which operates at a very low priority. So
-   * we need to queue a "low priority redraw" after timeline updates
+  /* If we just did work on every mouse motion (for example), we
+   * would starve Clutter, which operates at a very low priority. So
+   * we use a priority below redraws.
    */
-  if (recorder->state == RECORDER_STATE_RECORDING && recorder->redraw_idle == 0)
+  if (recorder->state == RECORDER_STATE_RECORDING && recorder->emit_timeout == 0)
     {
-      recorder->redraw_idle = g_idle_add_full (CLUTTER_PRIORITY_REDRAW + 1,
-                                               recorder_idle_redraw, recorder, NULL);
-      g_source_set_name_by_id (recorder->redraw_idle, "[gnome-shell] recorder_idle_redraw");
+      recorder->emit_timeout = g_timeout_add_full (CLUTTER_PRIORITY_REDRAW + 1,
+                                                   GST_TIME_AS_MSECONDS (delay),
+                                                   recorder_emit_timeout, recorder, NULL);
+      g_source_set_name_by_id (recorder->emit_timeout, "[gnome-shell] recorder_emit_timeout");
     }
 }
 
+/* The cursor isn't part of the stage, so changes to it only need a new
+ * frame, not a repaint.
+ */
+static void
+recorder_queue_redraw (ShellRecorder *recorder)
+{
+  recorder_schedule_emit (recorder, 0);
+}
+
 static void
 on_cursor_changed (MetaCursorTracker *tracker,
                    ShellRecorder     *recorder)
@@ -640,10 +1855,10 @@ recorder_disconnect_stage_callbacks (ShellRecorder *recorder)
    * us the events is close to free in any case.
    */
 
-  if (recorder->redraw_idle)
+  if (recorder->emit_timeout)
     {
-      g_source_remove (recorder->redraw_idle);
-      recorder->redraw_idle = 0;
+      g_source_remove (recorder->emit_timeout);
+      recorder->emit_timeout = 0;
     }
 }
 
@@ -695,6 +1910,7 @@ recorder_set_framerate (ShellRecorder *recorder,
   recorder->framerate = framerate;
 
   g_object_notify (G_OBJECT (recorder), "framerate");
+  g_object_notify (G_OBJECT (recorder), "capture-framerate");
 }
 
 static void
@@ -747,6 +1963,42 @@ recorder_set_draw_cursor (ShellRecorder *recorder,
   g_object_notify (G_OBJECT (recorder), "draw-cursor");
 }
 
+static void
+recorder_set_gpu_convert (ShellRecorder *recorder,
+                          gboolean       gpu_convert)
+{
+  if (gpu_convert == recorder->gpu_convert)
+    return;
+
+  recorder->gpu_convert = gpu_convert;
+
+  g_object_notify (G_OBJECT (recorder), "gpu-convert");
+}
+
+static void
+recorder_set_native_scale (ShellRecorder *recorder,
+                           gboolean       native_scale)
+{
+  if (native_scale == recorder->native_scale)
+    return;
+
+  recorder->native_scale = native_scale;
+
+  g_object_notify (G_OBJECT (recorder), "native-scale");
+}
+
+static void
+recorder_set_start_time (ShellRecorder *recorder,
+                         gint64         start_time)
+{
+  if (start_time == recorder->start_time)
+    return;
+
+  recorder->start_time = start_time;
+
+  g_object_notify (G_OBJECT (recorder), "start-time");
+}
+
 static void
 shell_recorder_set_property (GObject      *object,
                              guint         prop_id,
@@ -775,6 +2027,15 @@ shell_recorder_set_property (GObject      *object,
     case PROP_DRAW_CURSOR:
       recorder_set_draw_cursor (recorder, g_value_get_boolean (value));
       break;
+    case PROP_GPU_CONVERT:
+      recorder_set_gpu_convert (recorder, g_value_get_boolean (value));
+      break;
+    case PROP_NATIVE_SCALE:
+      recorder_set_native_scale (recorder, g_value_get_boolean (value));
+      break;
+    case PROP_START_TIME:
+      recorder_set_start_time (recorder, g_value_get_int64 (value));
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -806,6 +2067,21 @@ shell_recorder_get_property (GObject         *object,
     case PROP_DRAW_CURSOR:
       g_value_set_boolean (value, recorder->draw_cursor);
       break;
+    case PROP_GPU_CONVERT:
+      g_value_set_boolean (value, recorder->gpu_convert);
+      break;
+    case PROP_NATIVE_SCALE:
+      g_value_set_boolean (value, recorder->native_scale);
+      break;
+    case PROP_START_TIME:
+      g_value_set_int64 (value, recorder->start_time);
+      break;
+    case PROP_QUALITY_LEVEL:
+      g_value_set_int (value, recorder->quality_level);
+      break;
+    case PROP_CAPTURE_FRAMERATE:
+      g_value_set_int (value, recorder_get_capture_framerate (recorder));
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -870,6 +2146,91 @@ shell_recorder_class_init (ShellRecorderClass *klass)
                                                          "Whether to record the cursor",
                                                          TRUE,
                                                          G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class,
+                                   PROP_GPU_CONVERT,
+                                   g_param_spec_boolean ("gpu-convert",
+                                                         "GPU Convert",
+                                                         "Whether to convert frames to I420 on the GPU",
+                                                         FALSE,
+                                                         G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class,
+                                   PROP_NATIVE_SCALE,
+                                   g_param_spec_boolean ("native-scale",
+                                                         "Native Scale",
+                                                         "Whether to record the area at the scale the stage is painted at there",
+                                                         FALSE,
+                                                         G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class,
+                                   PROP_START_TIME,
+                                   g_param_spec_int64 ("start-time",
+                                                       "Start Time",
+                                                       "Monotonic time in microseconds that frame timestamps count from, or 0 for the start of the recording",
+                                                       0,
+                                                       G_MAXINT64,
+                                                       0,
+                                                       G_PARAM_READWRITE));
+
+  g_object_class_install_property (gobject_class,
+                                   PROP_QUALITY_LEVEL,
+                                   g_param_spec_int ("quality-level",
+                                                     "Quality Level",
+                                                     "How far recording quality was reduced because encoding can't keep up; 0 is full quality",
+                                                     0,
+                                                     G_N_ELEMENTS (quality_levels) - 1,
+                                                     0,
+                                                     G_PARAM_READABLE));
+
+  g_object_class_install_property (gobject_class,
+                                   PROP_CAPTURE_FRAMERATE,
+                                   g_param_spec_int ("capture-framerate",
+                                                     "Capture Framerate",
+                                                     "Framerate frames are currently captured at, which may be lower than the framerate property",
+                                                     0,
+                                                     G_MAXINT,
+                                                     DEFAULT_FRAMES_PER_SECOND,
+                                                     G_PARAM_READABLE));
+
+  shell_perf_log_define_statistic (shell_perf_log_get_default (),
+                                   "recorder.capturedFrames",
+                                   "Number of frames captured for screencasts", "i");
+  shell_perf_log_define_statistic (shell_perf_log_get_default (),
+                                   "recorder.captureStall",
+                                   "Average time the shell spends capturing a screencast frame, in microseconds", "x");
+  shell_perf_log_define_statistic (shell_perf_log_get_default (),
+                                   "recorder.captureStallMax",
+                                   "Longest time the shell spent capturing a screencast frame, in microseconds", "x");
+  shell_perf_log_add_statistics_callback (shell_perf_log_get_default (),
+                                          recorder_statistics_callback,
+                                          NULL, NULL);
+}
+
+/* Sets up conversion on the GPU for the recorded area, if it was
+ * asked for and the area and GPU allow it.
+ */
+static void
+recorder_update_converter (ShellRecorder *recorder)
+{
+  if (recorder->converter)
+    {
+      /* Readbacks in flight use the converter's framebuffer */
+      recorder_flush_readbacks (recorder);
+      g_clear_pointer (&recorder->converter, shell_i420_converter_free);
+    }
+
+  if (recorder->gpu_convert &&
+      shell_i420_converter_is_supported (recorder->area.width * recorder->scale,
+                                         recorder->area.height * recorder->scale))
+    {
+      CoglContext *context =
+        clutter_backend_get_cogl_context (clutter_get_default_backend ());
+
+      recorder->converter = shell_i420_converter_new (context,
+                                                      recorder->area.width * recorder->scale,
+                                                      recorder->area.height * recorder->scale);
+    }
 }
 
 /* Sets the GstCaps (video format, in this case) on the stream
@@ -877,8 +2238,27 @@ shell_recorder_class_init (ShellRecorderClass *klass)
 static void
 recorder_pipeline_set_caps (RecorderPipeline *pipeline)
 {
+  ShellRecorder *recorder = pipeline->recorder;
   GstCaps *caps;
 
+  recorder_update_converter (recorder);
+
+  if (recorder->converter)
+    {
+      /* What ShellI420Converter produces */
+      caps = gst_caps_new_simple ("video/x-raw",
+                                  "format", G_TYPE_STRING, "I420",
+                                  "colorimetry", G_TYPE_STRING, "bt709",
+                                  "chroma-site", G_TYPE_STRING, "jpeg",
+                                  "framerate", GST_TYPE_FRACTION, recorder->framerate, 1,
+                                  "width", G_TYPE_INT, recorder->area.width * recorder->scale,
+                                  "height", G_TYPE_INT, recorder->area.height * recorder->scale,
+                                  NULL);
+      g_object_set (pipeline->src, "caps", caps, NULL);
+      gst_caps_unref (caps);
+      return;
+    }
+
   /* The data is always native-endian xRGB; videoconvert
    * doesn't support little-endian xRGB, but does support
    * big-endian BGRx.
@@ -889,9 +2269,9 @@ recorder_pipeline_set_caps (RecorderPipeline *pipeline)
 #else
                               "format", G_TYPE_STRING, "xRGB",
 #endif
-                              "framerate", GST_TYPE_FRACTION, pipeline->recorder->framerate, 1,
-                              "width", G_TYPE_INT, pipeline->recorder->area.width,
-                              "height", G_TYPE_INT, pipeline->recorder->area.height,
+                              "framerate", GST_TYPE_FRACTION, recorder->framerate, 1,
+                              "width", G_TYPE_INT, recorder->area.width * recorder->scale,
+                              "height", G_TYPE_INT, recorder->area.height * recorder->scale,
                               NULL);
   g_object_set (pipeline->src, "caps", caps, NULL);
   gst_caps_unref (caps);
@@ -1185,6 +2565,9 @@ recorder_pipeline_on_memory_used_changed (ShellRecorderSrc *src,
 static void
 recorder_pipeline_free (RecorderPipeline *pipeline)
 {
+  if (pipeline->encoder != NULL)
+    gst_object_unref (pipeline->encoder);
+
   if (pipeline->pipeline != NULL)
     gst_object_unref (pipeline->pipeline);
 
@@ -1305,6 +2688,36 @@ substitute_thread_count (const char *pipeline)
   return g_string_free (result, FALSE);
 }
 
+/* Finds the encoder whose speed we can adjust, if there is one; that
+ * is the case for the vp8enc and vp9enc elements.
+ */
+static void
+recorder_pipeline_find_encoder (RecorderPipeline *pipeline)
+{
+  GstIterator *iter;
+  GValue item = G_VALUE_INIT;
+
+  iter = gst_bin_iterate_recurse (GST_BIN (pipeline->pipeline));
+  while (pipeline->encoder == NULL &&
+         gst_iterator_next (iter, &item) == GST_ITERATOR_OK)
+    {
+      GstElement *element = g_value_get_object (&item);
+      GParamSpec *pspec;
+
+      pspec = g_object_class_find_property (G_OBJECT_GET_CLASS (element), "cpu-used");
+      if (pspec != NULL && pspec->value_type == G_TYPE_INT)
+        {
+          pipeline->encoder = gst_object_ref (element);
+          g_object_get (element, "cpu-used", &pipeline->encoder_speed, NULL);
+        }
+
+      g_value_reset (&item);
+    }
+
+  g_value_unset (&item);
+  gst_iterator_free (iter);
+}
+
 static gboolean
 recorder_open_pipeline (ShellRecorder *recorder)
 {
@@ -1342,6 +2755,25 @@ recorder_open_pipeline (ShellRecorder *recorder)
   if (!recorder_pipeline_add_sink (pipeline))
     goto error;
 
+  recorder_pipeline_find_encoder (pipeline);
+
+  /* Timestamps are the running time of the pipeline. Pinning its base
+   * time to start_time on the system clock, which is monotonic, has
+   * them count from there rather than from when the pipeline started
+   * playing; recorders sharing a start time then produce streams that
+   * line up.
+   */
+  if (recorder->start_time != 0)
+    {
+      GstClock *clock = gst_system_clock_obtain ();
+
+      gst_pipeline_use_clock (GST_PIPELINE (pipeline->pipeline), clock);
+      gst_element_set_start_time (pipeline->pipeline, GST_CLOCK_TIME_NONE);
+      gst_element_set_base_time (pipeline->pipeline,
+                                 recorder->start_time * GST_USECOND);
+      gst_object_unref (clock);
+    }
+
   gst_element_set_state (pipeline->pipeline, GST_STATE_PLAYING);
 
   bus = gst_pipeline_get_bus (GST_PIPELINE (pipeline->pipeline));
@@ -1454,6 +2886,26 @@ shell_recorder_set_draw_cursor (ShellRecorder *recorder,
   recorder_set_draw_cursor (recorder, draw_cursor);
 }
 
+/**
+ * shell_recorder_set_gpu_convert:
+ * @recorder: the #ShellRecorder
+ * @gpu_convert: %TRUE to convert frames on the GPU
+ *
+ * Sets whether frames are converted to I420 on the GPU before they
+ * are handed to the pipeline, rather than by videoconvert on the CPU.
+ * This reads back 1.5 bytes per pixel instead of 4. It is only done
+ * when the width of the recorded area is a multiple of 8 and the
+ * height a multiple of 4, and takes effect for the next recording.
+ */
+void
+shell_recorder_set_gpu_convert (ShellRecorder *recorder,
+                                gboolean       gpu_convert)
+{
+  g_return_if_fail (SHELL_IS_RECORDER (recorder));
+
+  recorder_set_gpu_convert (recorder, gpu_convert);
+}
+
 /**
  * shell_recorder_set_pipeline:
  * @recorder: the #ShellRecorder
@@ -1481,6 +2933,47 @@ shell_recorder_set_pipeline (ShellRecorder *recorder,
   recorder_set_pipeline (recorder, pipeline);
 }
 
+/**
+ * shell_recorder_set_native_scale:
+ * @recorder: the #ShellRecorder
+ * @native_scale: %TRUE to record at the scale of the stage
+ *
+ * Sets whether the area is recorded at the scale the stage is painted
+ * at, rather than one pixel per stage pixel. When the stage is painted
+ * at a different scale on each monitor, the scale in the middle of the
+ * area is used, so an area within a single monitor is recorded without
+ * any scaling. This takes effect for the next recording.
+ */
+void
+shell_recorder_set_native_scale (ShellRecorder *recorder,
+                                 gboolean       native_scale)
+{
+  g_return_if_fail (SHELL_IS_RECORDER (recorder));
+
+  recorder_set_native_scale (recorder, native_scale);
+}
+
+/**
+ * shell_recorder_set_start_time:
+ * @recorder: the #ShellRecorder
+ * @start_time: a monotonic time in microseconds, as returned by
+ *              g_get_monotonic_time(), or 0
+ *
+ * Sets the time that the timestamps of recorded frames count from.
+ * By default they count from when recording starts; giving several
+ * recorders the same start time before starting them makes their
+ * recordings line up, even though their pipelines start at slightly
+ * different times. This takes effect for the next recording.
+ */
+void
+shell_recorder_set_start_time (ShellRecorder *recorder,
+                               gint64         start_time)
+{
+  g_return_if_fail (SHELL_IS_RECORDER (recorder));
+
+  recorder_set_start_time (recorder, start_time);
+}
+
 void
 shell_recorder_set_area (ShellRecorder *recorder,
                          int            x,
@@ -1498,6 +2991,11 @@ shell_recorder_set_area (ShellRecorder *recorder,
   recorder->area.height = CLAMP (height,
                                  0, recorder->stage_height - recorder->area.y);
 
+  /* What we captured so far was for another part of the stage */
+  recorder_flush_readbacks (recorder);
+  recorder_free_frame (recorder);
+  recorder_update_scale (recorder);
+
   /* This breaks the recording but tweaking the GStreamer pipeline a bit
    * might make it work, at least if the codec can handle a stream where
    * the frame size changes in the middle.
@@ -1529,10 +3027,19 @@ gboolean
 shell_recorder_record (ShellRecorder  *recorder,
                        char          **filename_used)
 {
+  CoglContext *context;
+
   g_return_val_if_fail (SHELL_IS_RECORDER (recorder), FALSE);
   g_return_val_if_fail (recorder->stage != NULL, FALSE);
   g_return_val_if_fail (recorder->state != RECORDER_STATE_RECORDING, FALSE);
 
+  context = clutter_backend_get_cogl_context (clutter_get_default_backend ());
+  recorder->async_readback = (cogl_has_feature (context, COGL_FEATURE_ID_PBOS) &&
+                              cogl_has_feature (context, COGL_FEATURE_ID_MAP_BUFFER_FOR_READ) &&
+                              cogl_has_feature (context, COGL_FEATURE_ID_FENCE));
+
+  recorder_update_scale (recorder);
+
   if (!recorder_open_pipeline (recorder))
     return FALSE;
 
@@ -1546,13 +3053,11 @@ shell_recorder_record (ShellRecorder  *recorder,
   recorder->state = RECORDER_STATE_RECORDING;
   recorder_update_pointer (recorder);
   recorder_add_update_pointer_timeout (recorder);
+  recorder_add_adapt_timeout (recorder);
 
   /* Disable unredirection while we are recoring */
   meta_disable_unredirect_for_screen (shell_global_get_screen (shell_global_get ()));
 
-  /* Set up repaint hook */
-  recorder->repaint_hook_id = clutter_threads_add_repaint_func(recorder_repaint_hook, recorder->stage, NULL);
-
   /* Record an initial frame and also redraw with the indicator */
   clutter_actor_queue_redraw (CLUTTER_ACTOR (recorder->stage));
 
@@ -1583,19 +3088,17 @@ shell_recorder_close (ShellRecorder *recorder)
    * elapsed since the last frame
    */
   recorder_record_frame (recorder, TRUE);
+  recorder_free_readbacks (recorder);
+  recorder_free_frame (recorder);
+  g_clear_pointer (&recorder->converter, shell_i420_converter_free);
 
   recorder_remove_update_pointer_timeout (recorder);
+  recorder_remove_adapt_timeout (recorder);
   recorder_close_pipeline (recorder);
 
   /* Queue a redraw to remove the recording indicator */
   clutter_actor_queue_redraw (CLUTTER_ACTOR (recorder->stage));
 
-  if (recorder->repaint_hook_id != 0)
-    {
-      clutter_threads_remove_repaint_func (recorder->repaint_hook_id);
-      recorder->repaint_hook_id = 0;
-    }
-
   recorder->state = RECORDER_STATE_CLOSED;
 
   /* Reenable after the recording */
@@ -29,6 +29,12 @@ void               shell_recorder_set_pipeline (ShellRecorder *recorder,
 						const char    *pipeline);
 void               shell_recorder_set_draw_cursor (ShellRecorder *recorder,
                                                    gboolean       draw_cursor);
+void               shell_recorder_set_gpu_convert (ShellRecorder *recorder,
+                                                   gboolean       gpu_convert);
+void               shell_recorder_set_native_scale (ShellRecorder *recorder,
+                                                    gboolean       native_scale);
+void               shell_recorder_set_start_time (ShellRecorder *recorder,
+                                                  gint64         start_time);
 void               shell_recorder_set_area     (ShellRecorder *recorder,
                                                 int            x,
                                                 int            y,
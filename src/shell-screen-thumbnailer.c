@@ -0,0 +1,745 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <meta/util.h>
+
+#include "shell-global.h"
+#include "shell-screen-thumbnailer.h"
+#include "shell-util.h"
+
+#define FOURCC(a, b, c, d) ((guint32) (a) | ((guint32) (b) << 8) | \
+                            ((guint32) (c) << 16) | ((guint32) (d) << 24))
+
+/* The DRM fourcc of CAIRO_FORMAT_ARGB32 */
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+#define THUMBNAIL_FORMAT FOURCC ('A', 'R', '2', '4')
+#else
+#define THUMBNAIL_FORMAT FOURCC ('B', 'A', '2', '4')
+#endif
+
+/* Where the pixels start in the shared memory */
+#define HEADER_SIZE 64
+
+enum {
+  HEADER_SEQUENCE,
+  HEADER_FORMAT,
+  HEADER_WIDTH,
+  HEADER_HEIGHT,
+  HEADER_STRIDE
+};
+
+struct _ShellScreenThumbnailer
+{
+  GObject parent;
+
+  ClutterStage *stage;
+  guint interval;
+  guint max_size;
+
+  /* Shared memory for the latest thumbnail */
+  int fd;
+  guint8 *data;
+  gsize size;
+  guint32 sequence;
+
+  guint timeout_id;
+  guint capture_idle_id;
+  gulong paint_handler_id;
+
+  /* Set when part of the stage was redrawn since the last thumbnail */
+  gboolean damaged;
+  gboolean capture_pending;
+  /* Set while the stage is painted again for a capture on the CPU */
+  gboolean capturing;
+
+  /* For scaling on the GPU; a copy of the stage, mipmapped down into
+   * the thumbnail.
+   */
+  CoglPixelBuffer *stage_buffer;
+  CoglTexture *stage_texture;
+  CoglTexture *thumbnail_texture;
+  CoglFramebuffer *thumbnail_framebuffer;
+  CoglPipeline *pipeline;
+  gboolean gpu_failed;
+};
+
+enum {
+  PROP_0,
+  PROP_STAGE,
+  PROP_INTERVAL,
+  PROP_MAX_SIZE
+};
+
+enum {
+  UPDATED,
+  LAST_SIGNAL
+};
+
+static guint signals[LAST_SIGNAL] = { 0 };
+
+G_DEFINE_TYPE (ShellScreenThumbnailer, shell_screen_thumbnailer, G_TYPE_OBJECT);
+
+static void
+shell_screen_thumbnailer_init (ShellScreenThumbnailer *thumbnailer)
+{
+  thumbnailer->fd = -1;
+}
+
+static void
+thumbnailer_free_textures (ShellScreenThumbnailer *thumbnailer)
+{
+  g_clear_pointer (&thumbnailer->pipeline, cogl_object_unref);
+  g_clear_pointer (&thumbnailer->thumbnail_framebuffer, cogl_object_unref);
+  g_clear_pointer (&thumbnailer->thumbnail_texture, cogl_object_unref);
+  g_clear_pointer (&thumbnailer->stage_texture, cogl_object_unref);
+  g_clear_pointer (&thumbnailer->stage_buffer, cogl_object_unref);
+}
+
+static void
+shell_screen_thumbnailer_finalize (GObject *object)
+{
+  ShellScreenThumbnailer *thumbnailer = SHELL_SCREEN_THUMBNAILER (object);
+
+  shell_screen_thumbnailer_stop (thumbnailer);
+
+  g_clear_object (&thumbnailer->stage);
+
+  G_OBJECT_CLASS (shell_screen_thumbnailer_parent_class)->finalize (object);
+}
+
+static void
+shell_screen_thumbnailer_set_property (GObject      *object,
+                                       guint         prop_id,
+                                       const GValue *value,
+                                       GParamSpec   *pspec)
+{
+  ShellScreenThumbnailer *thumbnailer = SHELL_SCREEN_THUMBNAILER (object);
+
+  switch (prop_id)
+    {
+    case PROP_STAGE:
+      thumbnailer->stage = g_value_dup_object (value);
+      break;
+    case PROP_INTERVAL:
+      thumbnailer->interval = g_value_get_uint (value);
+      break;
+    case PROP_MAX_SIZE:
+      thumbnailer->max_size = g_value_get_uint (value);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+    }
+}
+
+static void
+shell_screen_thumbnailer_get_property (GObject    *object,
+                                       guint       prop_id,
+                                       GValue     *value,
+                                       GParamSpec *pspec)
+{
+  ShellScreenThumbnailer *thumbnailer = SHELL_SCREEN_THUMBNAILER (object);
+
+  switch (prop_id)
+    {
+    case PROP_STAGE:
+      g_value_set_object (value, thumbnailer->stage);
+      break;
+    case PROP_INTERVAL:
+      g_value_set_uint (value, thumbnailer->interval);
+      break;
+    case PROP_MAX_SIZE:
+      g_value_set_uint (value, thumbnailer->max_size);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+    }
+}
+
+static void
+shell_screen_thumbnailer_class_init (ShellScreenThumbnailerClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+
+  gobject_class->finalize = shell_screen_thumbnailer_finalize;
+  gobject_class->set_property = shell_screen_thumbnailer_set_property;
+  gobject_class->get_property = shell_screen_thumbnailer_get_property;
+
+  g_object_class_install_property (gobject_class,
+                                   PROP_STAGE,
+                                   g_param_spec_object ("stage",
+                                                        "Stage",
+                                                        "Stage to take thumbnails of",
+                                                        CLUTTER_TYPE_STAGE,
+                                                        G_PARAM_READWRITE |
+                                                        G_PARAM_CONSTRUCT_ONLY |
+                                                        G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class,
+                                   PROP_INTERVAL,
+                                   g_param_spec_uint ("interval",
+                                                      "Interval",
+                                                      "Seconds between thumbnails",
+                                                      1, G_MAXUINT, 30,
+                                                      G_PARAM_READWRITE |
+                                                      G_PARAM_CONSTRUCT_ONLY |
+                                                      G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class,
+                                   PROP_MAX_SIZE,
+                                   g_param_spec_uint ("max-size",
+                                                      "Maximum size",
+                                                      "Largest width or height of thumbnails",
+                                                      1, 4096, 256,
+                                                      G_PARAM_READWRITE |
+                                                      G_PARAM_CONSTRUCT_ONLY |
+                                                      G_PARAM_STATIC_STRINGS));
+
+  /**
+   * ShellScreenThumbnailer::updated:
+   * @thumbnailer: the #ShellScreenThumbnailer
+   *
+   * Emitted when a new thumbnail is in the shared memory.
+   */
+  signals[UPDATED] = g_signal_new ("updated",
+                                   G_TYPE_FROM_CLASS (klass),
+                                   G_SIGNAL_RUN_LAST,
+                                   0, NULL, NULL, NULL,
+                                   G_TYPE_NONE, 0);
+}
+
+static gboolean
+thumbnailer_ensure_textures (ShellScreenThumbnailer *thumbnailer,
+                             CoglContext            *context,
+                             int                     width,
+                             int                     height,
+                             int                     thumb_width,
+                             int                     thumb_height)
+{
+  CoglError *error = NULL;
+
+  if (thumbnailer->stage_texture &&
+      cogl_texture_get_width (thumbnailer->stage_texture) == (unsigned) width &&
+      cogl_texture_get_height (thumbnailer->stage_texture) == (unsigned) height &&
+      cogl_texture_get_width (thumbnailer->thumbnail_texture) == (unsigned) thumb_width &&
+      cogl_texture_get_height (thumbnailer->thumbnail_texture) == (unsigned) thumb_height)
+    return TRUE;
+
+  thumbnailer_free_textures (thumbnailer);
+
+  thumbnailer->stage_buffer = cogl_pixel_buffer_new (context, width * height * 4, NULL);
+  cogl_buffer_set_update_hint (COGL_BUFFER (thumbnailer->stage_buffer),
+                               COGL_BUFFER_UPDATE_HINT_STREAM);
+
+  thumbnailer->stage_texture =
+    COGL_TEXTURE (cogl_texture_2d_new_with_size (context, width, height));
+  thumbnailer->thumbnail_texture =
+    COGL_TEXTURE (cogl_texture_2d_new_with_size (context, thumb_width, thumb_height));
+
+  thumbnailer->thumbnail_framebuffer =
+    COGL_FRAMEBUFFER (cogl_offscreen_new_with_texture (thumbnailer->thumbnail_texture));
+  if (!cogl_framebuffer_allocate (thumbnailer->thumbnail_framebuffer, &error))
+    {
+      g_warning ("Can't create framebuffer for screen thumbnails: %s", error->message);
+      cogl_error_free (error);
+      thumbnailer_free_textures (thumbnailer);
+      return FALSE;
+    }
+
+  cogl_framebuffer_orthographic (thumbnailer->thumbnail_framebuffer,
+                                 0, 0, thumb_width, thumb_height, -1, 1);
+
+  /* Sampling from mipmaps averages all the pixels a thumbnail pixel
+   * covers, rather than picking a few of them.
+   */
+  thumbnailer->pipeline = cogl_pipeline_new (context);
+  cogl_pipeline_set_layer_texture (thumbnailer->pipeline, 0, thumbnailer->stage_texture);
+  cogl_pipeline_set_layer_filters (thumbnailer->pipeline, 0,
+                                   COGL_PIPELINE_FILTER_LINEAR_MIPMAP_LINEAR,
+                                   COGL_PIPELINE_FILTER_LINEAR);
+  cogl_pipeline_set_layer_wrap_mode (thumbnailer->pipeline, 0,
+                                     COGL_PIPELINE_WRAP_MODE_CLAMP_TO_EDGE);
+  cogl_pipeline_set_blend (thumbnailer->pipeline, "RGBA = ADD (SRC_COLOR, 0)", NULL);
+
+  return TRUE;
+}
+
+/* Whether the stage being painted is all in the current framebuffer,
+ * so it can be copied on the GPU. With several stage views, only the
+ * view being painted is; leave stitching them to clutter.
+ */
+static gboolean
+thumbnailer_can_capture_gpu (ShellScreenThumbnailer *thumbnailer,
+                             int                     width,
+                             int                     height)
+{
+  CoglContext *context = clutter_backend_get_cogl_context (clutter_get_default_backend ());
+  CoglFramebuffer *framebuffer = cogl_get_draw_framebuffer ();
+
+  return (!thumbnailer->gpu_failed &&
+          cogl_is_onscreen (framebuffer) &&
+          cogl_framebuffer_get_width (framebuffer) == width &&
+          cogl_framebuffer_get_height (framebuffer) == height &&
+          cogl_has_feature (context, COGL_FEATURE_ID_OFFSCREEN));
+}
+
+/* Copies the stage into a texture without going through the CPU, as
+ * far as the driver allows, and draws that into the thumbnail.
+ */
+static gboolean
+thumbnailer_capture_gpu (ShellScreenThumbnailer *thumbnailer,
+                         int                     width,
+                         int                     height,
+                         int                     thumb_width,
+                         int                     thumb_height,
+                         guint8                 *out)
+{
+  CoglContext *context = clutter_backend_get_cogl_context (clutter_get_default_backend ());
+  CoglFramebuffer *framebuffer = cogl_get_draw_framebuffer ();
+  CoglBitmap *bitmap;
+  CoglError *error = NULL;
+  gboolean result;
+
+  if (!thumbnailer_ensure_textures (thumbnailer, context,
+                                    width, height, thumb_width, thumb_height))
+    {
+      thumbnailer->gpu_failed = TRUE;
+      return FALSE;
+    }
+
+  bitmap = cogl_bitmap_new_from_buffer (COGL_BUFFER (thumbnailer->stage_buffer),
+                                        CLUTTER_CAIRO_FORMAT_ARGB32,
+                                        width, height, width * 4, 0);
+  result = (cogl_framebuffer_read_pixels_into_bitmap (framebuffer, 0, 0,
+                                                      COGL_READ_PIXELS_COLOR_BUFFER,
+                                                      bitmap, &error) &&
+            cogl_texture_set_region_from_bitmap (thumbnailer->stage_texture,
+                                                 0, 0, 0, 0, width, height,
+                                                 bitmap));
+  cogl_object_unref (bitmap);
+
+  if (!result)
+    {
+      if (error)
+        {
+          g_warning ("Can't copy the stage for screen thumbnails: %s", error->message);
+          cogl_error_free (error);
+        }
+      thumbnailer->gpu_failed = TRUE;
+      return FALSE;
+    }
+
+  cogl_framebuffer_draw_textured_rectangle (thumbnailer->thumbnail_framebuffer,
+                                            thumbnailer->pipeline,
+                                            0, 0, thumb_width, thumb_height,
+                                            0, 0, 1, 1);
+
+  return cogl_framebuffer_read_pixels (thumbnailer->thumbnail_framebuffer,
+                                       0, 0, thumb_width, thumb_height,
+                                       CLUTTER_CAIRO_FORMAT_ARGB32, out);
+}
+
+static gboolean
+thumbnailer_capture_cpu (ShellScreenThumbnailer *thumbnailer,
+                         int                     width,
+                         int                     height,
+                         int                     thumb_width,
+                         int                     thumb_height,
+                         guint8                 *out)
+{
+  cairo_rectangle_int_t rect = { 0, 0, width, height };
+  ClutterCapture *captures;
+  int n_captures, i;
+  cairo_surface_t *image, *thumbnail;
+  cairo_t *cr;
+
+  /* Stage views are swapped as soon as they are painted, so there's
+   * no point of a frame where all of them can be read; paint them
+   * again instead, as for screenshots.
+   */
+  thumbnailer->capturing = TRUE;
+  clutter_stage_capture (thumbnailer->stage, TRUE, &rect, &captures, &n_captures);
+  thumbnailer->capturing = FALSE;
+
+  if (n_captures == 0)
+    return FALSE;
+
+  if (n_captures == 1)
+    image = cairo_surface_reference (captures[0].image);
+  else
+    image = shell_util_composite_capture_images (captures, n_captures,
+                                                 0, 0, width, height);
+
+  for (i = 0; i < n_captures; i++)
+    cairo_surface_destroy (captures[i].image);
+  g_free (captures);
+
+  thumbnail = cairo_image_surface_create_for_data (out, CAIRO_FORMAT_ARGB32,
+                                                   thumb_width, thumb_height,
+                                                   thumb_width * 4);
+  cr = cairo_create (thumbnail);
+  cairo_scale (cr, (double) thumb_width / width, (double) thumb_height / height);
+  cairo_set_source_surface (cr, image, 0, 0);
+  cairo_pattern_set_filter (cairo_get_source (cr), CAIRO_FILTER_GOOD);
+  cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
+  cairo_paint (cr);
+  cairo_destroy (cr);
+
+  cairo_surface_finish (thumbnail);
+  cairo_surface_destroy (thumbnail);
+  cairo_surface_destroy (image);
+
+  return TRUE;
+}
+
+static void
+thumbnailer_set_sequence (ShellScreenThumbnailer *thumbnailer,
+                          guint32                 sequence)
+{
+  guint32 *header = (guint32 *) thumbnailer->data;
+
+  /* The atomic store orders the pixels written before an even number;
+   * the barrier after it keeps the pixels written after an odd number
+   * from becoming visible before it.
+   */
+  thumbnailer->sequence = sequence;
+  g_atomic_int_set ((gint *) &header[HEADER_SEQUENCE], sequence);
+  __sync_synchronize ();
+}
+
+/* Scales the stage down to fit in a square of max-size pixels, and in
+ * the shared memory once that is set up; the stage can grow after.
+ */
+static void
+thumbnailer_get_thumbnail_size (ShellScreenThumbnailer *thumbnailer,
+                                int                     width,
+                                int                     height,
+                                int                    *thumb_width,
+                                int                    *thumb_height)
+{
+  double scale;
+
+  scale = MIN (1.0, MIN ((double) thumbnailer->max_size / width,
+                         (double) thumbnailer->max_size / height));
+  *thumb_width = CLAMP ((int) (0.5 + width * scale), 1, (int) thumbnailer->max_size);
+  *thumb_height = CLAMP ((int) (0.5 + height * scale), 1, (int) thumbnailer->max_size);
+
+  if (thumbnailer->data != NULL &&
+      (gsize) *thumb_width * *thumb_height * 4 > thumbnailer->size - HEADER_SIZE)
+    {
+      double fit = sqrt ((double) (thumbnailer->size - HEADER_SIZE) / 4 /
+                         ((double) *thumb_width * *thumb_height));
+
+      *thumb_width = MAX (1, (int) (*thumb_width * fit));
+      *thumb_height = MAX (1, (int) (*thumb_height * fit));
+    }
+}
+
+static void
+thumbnailer_get_stage_size (ShellScreenThumbnailer *thumbnailer,
+                            int                    *width,
+                            int                    *height)
+{
+  float stage_width, stage_height;
+
+  clutter_actor_get_size (CLUTTER_ACTOR (thumbnailer->stage), &stage_width, &stage_height);
+  *width = (int) (0.5 + stage_width);
+  *height = (int) (0.5 + stage_height);
+}
+
+/* Takes a thumbnail; on the GPU while the stage is being painted, and
+ * on the CPU otherwise. Returns %FALSE if the stage can't be copied on
+ * the GPU, without touching the shared memory.
+ */
+static gboolean
+thumbnailer_update (ShellScreenThumbnailer *thumbnailer,
+                    gboolean                in_paint)
+{
+  guint32 *header = (guint32 *) thumbnailer->data;
+  guint8 *out = thumbnailer->data + HEADER_SIZE;
+  int width, height, thumb_width, thumb_height;
+  gboolean success;
+
+  thumbnailer_get_stage_size (thumbnailer, &width, &height);
+  if (width <= 0 || height <= 0)
+    return TRUE;
+
+  if (in_paint && !thumbnailer_can_capture_gpu (thumbnailer, width, height))
+    return FALSE;
+
+  thumbnailer_get_thumbnail_size (thumbnailer, width, height,
+                                  &thumb_width, &thumb_height);
+
+  /* Odd while writing */
+  thumbnailer_set_sequence (thumbnailer, thumbnailer->sequence + 1);
+
+  if (in_paint)
+    success = thumbnailer_capture_gpu (thumbnailer, width, height,
+                                       thumb_width, thumb_height, out);
+  else
+    success = thumbnailer_capture_cpu (thumbnailer, width, height,
+                                       thumb_width, thumb_height, out);
+
+  header[HEADER_FORMAT] = THUMBNAIL_FORMAT;
+  header[HEADER_WIDTH] = success ? thumb_width : 0;
+  header[HEADER_HEIGHT] = success ? thumb_height : 0;
+  header[HEADER_STRIDE] = thumb_width * 4;
+
+  thumbnailer_set_sequence (thumbnailer, thumbnailer->sequence + 1);
+
+  if (success)
+    g_signal_emit (thumbnailer, signals[UPDATED], 0);
+
+  /* A GPU failure leaves the thumbnail to the CPU */
+  return success || !in_paint;
+}
+
+static void
+thumbnailer_finish_capture (ShellScreenThumbnailer *thumbnailer)
+{
+  thumbnailer->capture_pending = FALSE;
+  meta_enable_unredirect_for_screen (shell_global_get_screen (shell_global_get ()));
+}
+
+static gboolean
+thumbnailer_on_capture_idle (gpointer data)
+{
+  ShellScreenThumbnailer *thumbnailer = data;
+
+  thumbnailer->capture_idle_id = 0;
+
+  thumbnailer_update (thumbnailer, FALSE);
+  thumbnailer_finish_capture (thumbnailer);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+thumbnailer_on_stage_paint (ClutterActor           *stage,
+                            ShellScreenThumbnailer *thumbnailer)
+{
+  if (thumbnailer->capturing || thumbnailer->capture_idle_id != 0)
+    return;
+
+  /* Any other paint of part of the stage means the stage changed */
+  if (!thumbnailer->capture_pending)
+    {
+      cairo_rectangle_int_t clip;
+
+      clutter_stage_get_redraw_clip_bounds (CLUTTER_STAGE (stage), &clip);
+      if (clip.width > 0 && clip.height > 0)
+        thumbnailer->damaged = TRUE;
+      return;
+    }
+
+  thumbnailer->damaged = FALSE;
+
+  if (thumbnailer_update (thumbnailer, TRUE))
+    {
+      thumbnailer_finish_capture (thumbnailer);
+      return;
+    }
+
+  /* Capture once all stage views are painted */
+  thumbnailer->capture_idle_id = g_idle_add (thumbnailer_on_capture_idle, thumbnailer);
+  g_source_set_name_by_id (thumbnailer->capture_idle_id, "[gnome-shell] thumbnailer_on_capture_idle");
+}
+
+static gboolean
+thumbnailer_on_timeout (gpointer data)
+{
+  ShellScreenThumbnailer *thumbnailer = data;
+
+  if (!thumbnailer->damaged || thumbnailer->capture_pending)
+    return G_SOURCE_CONTINUE;
+
+  /* Only a full repaint is sure to leave all of the stage in the
+   * framebuffer, as for screenshots.
+   */
+  thumbnailer->capture_pending = TRUE;
+  meta_disable_unredirect_for_screen (shell_global_get_screen (shell_global_get ()));
+  clutter_actor_queue_redraw (CLUTTER_ACTOR (thumbnailer->stage));
+
+  return G_SOURCE_CONTINUE;
+}
+
+/**
+ * shell_screen_thumbnailer_new:
+ * @stage: the #ClutterStage
+ * @interval: seconds between thumbnails
+ * @max_size: largest width or height of the thumbnails
+ *
+ * Create a new #ShellScreenThumbnailer to take thumbnails of @stage
+ * every @interval seconds, scaled to fit a square of @max_size pixels.
+ *
+ * Return value: The newly created #ShellScreenThumbnailer object
+ */
+ShellScreenThumbnailer *
+shell_screen_thumbnailer_new (ClutterStage *stage,
+                              guint         interval,
+                              guint         max_size)
+{
+  return g_object_new (SHELL_TYPE_SCREEN_THUMBNAILER,
+                       "stage", stage,
+                       "interval", interval,
+                       "max-size", max_size,
+                       NULL);
+}
+
+/**
+ * shell_screen_thumbnailer_start:
+ * @thumbnailer: the #ShellScreenThumbnailer
+ * @error: return location for a #GError
+ *
+ * Creates the shared memory and starts taking thumbnails; the first
+ * one is taken right away.
+ *
+ * Return value: %TRUE if the shared memory could be set up
+ */
+gboolean
+shell_screen_thumbnailer_start (ShellScreenThumbnailer  *thumbnailer,
+                                GError                 **error)
+{
+  int width, height, thumb_width, thumb_height;
+  char *path;
+  int fd;
+
+  g_return_val_if_fail (SHELL_IS_SCREEN_THUMBNAILER (thumbnailer), FALSE);
+
+  if (thumbnailer->fd >= 0)
+    return TRUE;
+
+  /* Only as big as the thumbnail of the stage as it is now */
+  thumbnailer_get_stage_size (thumbnailer, &width, &height);
+  thumbnailer_get_thumbnail_size (thumbnailer, MAX (width, 1), MAX (height, 1),
+                                  &thumb_width, &thumb_height);
+  thumbnailer->size = HEADER_SIZE + (gsize) thumb_width * thumb_height * 4;
+  fd = shell_util_create_memfd ("gnome-shell-thumbnail", thumbnailer->size);
+  if (fd < 0)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                           "Can't create shared memory for thumbnails");
+      return FALSE;
+    }
+
+  /* Callers get the file while the shell keeps writing to its mapping;
+   * a caller shrinking the file would crash the shell with SIGBUS. The
+   * seals prevent that, and for the unsealable fallback file, callers
+   * only get a read-only descriptor.
+   */
+#ifdef F_ADD_SEALS
+  fcntl (fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+#endif
+
+  thumbnailer->data = mmap (NULL, thumbnailer->size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, fd, 0);
+  if (thumbnailer->data == MAP_FAILED)
+    {
+      int errsv = errno;
+
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                   "Can't map shared memory for thumbnails: %s",
+                   g_strerror (errsv));
+      thumbnailer->data = NULL;
+      close (fd);
+      return FALSE;
+    }
+
+  /* The mapping stays valid without the writable descriptor */
+  path = g_strdup_printf ("/proc/self/fd/%d", fd);
+  thumbnailer->fd = open (path, O_RDONLY | O_CLOEXEC);
+  g_free (path);
+  close (fd);
+
+  if (thumbnailer->fd < 0)
+    {
+      int errsv = errno;
+
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                   "Can't reopen shared memory for thumbnails: %s",
+                   g_strerror (errsv));
+      munmap (thumbnailer->data, thumbnailer->size);
+      thumbnailer->data = NULL;
+      return FALSE;
+    }
+
+  thumbnailer->sequence = 0;
+  ((guint32 *) thumbnailer->data)[HEADER_FORMAT] = THUMBNAIL_FORMAT;
+
+  thumbnailer->paint_handler_id =
+    g_signal_connect_after (thumbnailer->stage, "paint",
+                            G_CALLBACK (thumbnailer_on_stage_paint), thumbnailer);
+  thumbnailer->timeout_id = g_timeout_add_seconds (thumbnailer->interval,
+                                                   thumbnailer_on_timeout,
+                                                   thumbnailer);
+  g_source_set_name_by_id (thumbnailer->timeout_id, "[gnome-shell] thumbnailer_on_timeout");
+
+  thumbnailer->damaged = TRUE;
+  thumbnailer_on_timeout (thumbnailer);
+
+  return TRUE;
+}
+
+/**
+ * shell_screen_thumbnailer_stop:
+ * @thumbnailer: the #ShellScreenThumbnailer
+ *
+ * Stops taking thumbnails and releases the shared memory; the file
+ * descriptor is closed, but copies passed to other processes stay
+ * valid.
+ */
+void
+shell_screen_thumbnailer_stop (ShellScreenThumbnailer *thumbnailer)
+{
+  g_return_if_fail (SHELL_IS_SCREEN_THUMBNAILER (thumbnailer));
+
+  if (thumbnailer->fd < 0)
+    return;
+
+  if (thumbnailer->capture_idle_id != 0)
+    {
+      g_source_remove (thumbnailer->capture_idle_id);
+      thumbnailer->capture_idle_id = 0;
+    }
+
+  if (thumbnailer->capture_pending)
+    thumbnailer_finish_capture (thumbnailer);
+
+  g_source_remove (thumbnailer->timeout_id);
+  thumbnailer->timeout_id = 0;
+  g_signal_handler_disconnect (thumbnailer->stage, thumbnailer->paint_handler_id);
+  thumbnailer->paint_handler_id = 0;
+
+  thumbnailer_free_textures (thumbnailer);
+  thumbnailer->gpu_failed = FALSE;
+
+  munmap (thumbnailer->data, thumbnailer->size);
+  thumbnailer->data = NULL;
+  close (thumbnailer->fd);
+  thumbnailer->fd = -1;
+}
+
+/**
+ * shell_screen_thumbnailer_get_fd:
+ * @thumbnailer: the #ShellScreenThumbnailer
+ *
+ * Gets the file descriptor of the shared memory, which stays owned by
+ * @thumbnailer.
+ *
+ * Return value: the file descriptor, or -1 if not started
+ */
+int
+shell_screen_thumbnailer_get_fd (ShellScreenThumbnailer *thumbnailer)
+{
+  g_return_val_if_fail (SHELL_IS_SCREEN_THUMBNAILER (thumbnailer), -1);
+
+  return thumbnailer->fd;
+}
@@ -0,0 +1,40 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+#ifndef __SHELL_SCREEN_THUMBNAILER_H__
+#define __SHELL_SCREEN_THUMBNAILER_H__
+
+#include <clutter/clutter.h>
+
+G_BEGIN_DECLS
+
+/**
+ * SECTION:shell-screen-thumbnailer
+ * @short_description: Keeps a small picture of the screen up to date
+ *
+ * The #ShellScreenThumbnailer object periodically scales the stage
+ * down on the GPU and keeps the latest thumbnail in shared memory, for
+ * other processes to read whenever they like. Thumbnails are only taken
+ * when the stage was repainted since the last one.
+ *
+ * The shared memory starts with a header of 32-bit words in native
+ * byte order: a sequence number, which is odd while a thumbnail is
+ * being written, then the DRM fourcc of the pixel format, the width,
+ * the height and the stride of the thumbnail. The pixels start at
+ * byte 64. Readers copy the thumbnail and check that the sequence
+ * number was the same, even number before and after.
+ */
+#define SHELL_TYPE_SCREEN_THUMBNAILER (shell_screen_thumbnailer_get_type ())
+G_DECLARE_FINAL_TYPE (ShellScreenThumbnailer, shell_screen_thumbnailer,
+                      SHELL, SCREEN_THUMBNAILER, GObject)
+
+ShellScreenThumbnailer *shell_screen_thumbnailer_new (ClutterStage *stage,
+                                                      guint         interval,
+                                                      guint         max_size);
+
+gboolean shell_screen_thumbnailer_start  (ShellScreenThumbnailer  *thumbnailer,
+                                          GError                 **error);
+void     shell_screen_thumbnailer_stop   (ShellScreenThumbnailer  *thumbnailer);
+int      shell_screen_thumbnailer_get_fd (ShellScreenThumbnailer  *thumbnailer);
+
+G_END_DECLS
+
+#endif /* __SHELL_SCREEN_THUMBNAILER_H__ */
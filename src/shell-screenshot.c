@@ -1,5 +1,15 @@
 /* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
 
+/* For file sealing */
+#define _GNU_SOURCE
+
+#include "config.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
 #include <clutter/clutter.h>
 #include <cogl/cogl.h>
 #include <meta/display.h>
@@ -9,12 +19,23 @@
 #include <meta/meta-cursor-tracker.h>
 
 #include "shell-global.h"
+#include "shell-png-encoder.h"
 #include "shell-screenshot.h"
 #include "shell-util.h"
 
 #define A11Y_APPS_SCHEMA "org.gnome.desktop.a11y.applications"
 #define MAGNIFIER_ACTIVE_KEY "screen-magnifier-enabled"
 
+#define FOURCC(a, b, c, d) ((guint32) (a) | ((guint32) (b) << 8) | \
+                            ((guint32) (c) << 16) | ((guint32) (d) << 24))
+
+/* The DRM fourcc of CAIRO_FORMAT_ARGB32, which frames are shared in */
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+#define FRAME_FORMAT FOURCC ('A', 'R', '2', '4')
+#else
+#define FRAME_FORMAT FOURCC ('B', 'A', '2', '4')
+#endif
+
 typedef struct _ShellScreenshotPrivate  ShellScreenshotPrivate;
 
 struct _ShellScreenshot
@@ -37,15 +58,88 @@ struct _ShellScreenshotPrivate
   gboolean include_cursor;
   gboolean include_frame;
 
+  int compression_level;
+
   ShellScreenshotCallback callback;
+
+  /* Grabs to memory; a cairo_rectangle_int_t and an image per region */
+  GArray *regions;
+  GPtrArray *frames;
+  guint downscale;
+  GUnixFDList *fd_list;
+  GVariant *frame_layout;
+  ShellScreenshotFrameCallback frame_callback;
+};
+
+enum {
+  PROP_0,
+
+  PROP_COMPRESSION_LEVEL
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE (ShellScreenshot, shell_screenshot, G_TYPE_OBJECT);
 
+static void
+shell_screenshot_set_property (GObject      *object,
+                               guint         prop_id,
+                               const GValue *value,
+                               GParamSpec   *pspec)
+{
+  ShellScreenshot *screenshot = SHELL_SCREENSHOT (object);
+
+  switch (prop_id)
+    {
+    case PROP_COMPRESSION_LEVEL:
+      shell_screenshot_set_compression_level (screenshot, g_value_get_int (value));
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+    }
+}
+
+static void
+shell_screenshot_get_property (GObject    *object,
+                               guint       prop_id,
+                               GValue     *value,
+                               GParamSpec *pspec)
+{
+  ShellScreenshot *screenshot = SHELL_SCREENSHOT (object);
+
+  switch (prop_id)
+    {
+    case PROP_COMPRESSION_LEVEL:
+      g_value_set_int (value, screenshot->priv->compression_level);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+    }
+}
+
 static void
 shell_screenshot_class_init (ShellScreenshotClass *screenshot_class)
 {
-  (void) screenshot_class;
+  GObjectClass *gobject_class = G_OBJECT_CLASS (screenshot_class);
+
+  gobject_class->set_property = shell_screenshot_set_property;
+  gobject_class->get_property = shell_screenshot_get_property;
+
+  /**
+   * ShellScreenshot:compression-level:
+   *
+   * The zlib compression level PNG files are written with, from 0 to
+   * 9, or -1 for the default. Level 1 is a fast mode meant for
+   * screenshots that are only passed on, like those for the clipboard.
+   */
+  g_object_class_install_property (gobject_class,
+                                   PROP_COMPRESSION_LEVEL,
+                                   g_param_spec_int ("compression-level",
+                                                     "Compression level",
+                                                     "zlib compression level of written files",
+                                                     -1, 9, -1,
+                                                     G_PARAM_READWRITE |
+                                                     G_PARAM_STATIC_STRINGS));
 }
 
 static void
@@ -53,6 +147,13 @@ shell_screenshot_init (ShellScreenshot *screenshot)
 {
   screenshot->priv = shell_screenshot_get_instance_private (screenshot);
   screenshot->priv->global = shell_global_get ();
+  screenshot->priv->compression_level = -1;
+}
+
+static gboolean
+screenshot_in_progress (ShellScreenshotPrivate *priv)
+{
+  return priv->filename != NULL || priv->regions != NULL;
 }
 
 static void
@@ -185,24 +286,13 @@ write_screenshot_thread (GTask        *result,
 
   if (stream == NULL)
     status = CAIRO_STATUS_FILE_NOT_FOUND;
+  else if (shell_png_encoder_write (priv->image, stream,
+                                    priv->compression_level,
+                                    "gnome-screenshot",
+                                    cancellable, NULL))
+    status = CAIRO_STATUS_SUCCESS;
   else
-    {
-      GdkPixbuf *pixbuf;
-
-      pixbuf = gdk_pixbuf_get_from_surface (priv->image,
-                                            0, 0,
-                                            cairo_image_surface_get_width (priv->image),
-                                            cairo_image_surface_get_height (priv->image));
-
-      if (gdk_pixbuf_save_to_stream (pixbuf, stream, "png", NULL, NULL,
-                                    "tEXt::Software", "gnome-screenshot", NULL))
-        status = CAIRO_STATUS_SUCCESS;
-      else
-        status = CAIRO_STATUS_WRITE_ERROR;
-
-      g_object_unref (pixbuf);
-    }
-
+    status = CAIRO_STATUS_WRITE_ERROR;
 
   g_task_return_boolean (result, status == CAIRO_STATUS_SUCCESS);
 
@@ -397,9 +487,11 @@ grab_area_screenshot (ClutterActor *stage,
   g_object_unref (result);
 }
 
+/* Window contents come straight from the window texture, so this
+ * doesn't have to wait for the stage to be painted.
+ */
 static void
-grab_window_screenshot (ClutterActor *stage,
-                        ShellScreenshot *screenshot)
+do_grab_window_screenshot (ShellScreenshot *screenshot)
 {
   ShellScreenshotPrivate *priv = screenshot->priv;
   GTask *result;
@@ -441,12 +533,223 @@ grab_window_screenshot (ClutterActor *stage,
     }
   g_object_unref (settings);
 
-  g_signal_handlers_disconnect_by_func (stage, (void *)grab_window_screenshot, (gpointer)screenshot);
   result = g_task_new (screenshot, NULL, on_screenshot_written, NULL);
   g_task_run_in_thread (result, write_screenshot_thread);
   g_object_unref (result);
 }
 
+static void
+grab_window_screenshot (ClutterActor *stage,
+                        ShellScreenshot *screenshot)
+{
+  g_signal_handlers_disconnect_by_func (stage, (void *)grab_window_screenshot, (gpointer)screenshot);
+  do_grab_window_screenshot (screenshot);
+}
+
+/* Averages boxes of downscale × downscale pixels; averaging
+ * premultiplied colors weighs them by coverage, as it should. Boxes at
+ * the right and bottom edges may be cut off.
+ */
+static void
+downscale_frame (cairo_surface_t *image,
+                 guint            downscale,
+                 guint8          *out,
+                 int              out_width,
+                 int              out_height)
+{
+  const guint8 *pixels = cairo_image_surface_get_data (image);
+  int stride = cairo_image_surface_get_stride (image);
+  int width = cairo_image_surface_get_width (image);
+  int height = cairo_image_surface_get_height (image);
+  int x, y;
+
+  cairo_surface_flush (image);
+
+  if (downscale == 1)
+    {
+      for (y = 0; y < height; y++)
+        memcpy (out + y * width * 4, pixels + y * stride, width * 4);
+      return;
+    }
+
+  for (y = 0; y < out_height; y++)
+    {
+      guint32 *out_row = (guint32 *) (out + y * out_width * 4);
+      int y0 = y * downscale;
+      int y1 = MIN (y0 + (int) downscale, height);
+
+      for (x = 0; x < out_width; x++)
+        {
+          int x0 = x * downscale;
+          int x1 = MIN (x0 + (int) downscale, width);
+          guint64 sum[4] = { 0, };
+          guint64 n = (guint64) (x1 - x0) * (y1 - y0);
+          int i, j, c;
+
+          for (j = y0; j < y1; j++)
+            {
+              const guint32 *row = (const guint32 *) (pixels + j * stride);
+
+              for (i = x0; i < x1; i++)
+                for (c = 0; c < 4; c++)
+                  sum[c] += (row[i] >> (c * 8)) & 0xff;
+            }
+
+          out_row[x] = 0;
+          for (c = 0; c < 4; c++)
+            out_row[x] |= (guint32) ((sum[c] + n / 2) / n) << (c * 8);
+        }
+    }
+}
+
+/* Sealing lets the receiver map the file without fearing that it
+ * changes or shrinks under it.
+ */
+static void
+seal_frame_fd (int fd)
+{
+#ifdef F_ADD_SEALS
+  /* Fails harmlessly for the unsealable fallback file */
+  fcntl (fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+#endif
+}
+
+/* called in an I/O thread */
+static void
+write_frames_thread (GTask        *result,
+                     gpointer      object,
+                     gpointer      task_data,
+                     GCancellable *cancellable)
+{
+  ShellScreenshot *screenshot = SHELL_SCREENSHOT (object);
+  ShellScreenshotPrivate *priv = screenshot->priv;
+  GVariantBuilder builder;
+  guint8 *data;
+  gsize size = 0;
+  guint i;
+  int fd;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(uuut)"));
+
+  for (i = 0; i < priv->frames->len; i++)
+    {
+      cairo_surface_t *image = g_ptr_array_index (priv->frames, i);
+      int width, height;
+
+      if (image == NULL)
+        {
+          g_variant_builder_clear (&builder);
+          g_task_return_boolean (result, FALSE);
+          return;
+        }
+
+      width = (cairo_image_surface_get_width (image) + priv->downscale - 1) / priv->downscale;
+      height = (cairo_image_surface_get_height (image) + priv->downscale - 1) / priv->downscale;
+
+      g_variant_builder_add (&builder, "(uuut)",
+                             width, height, width * 4, (guint64) size);
+      size += (gsize) width * height * 4;
+    }
+
+  fd = shell_util_create_memfd ("gnome-shell-screenshot", size);
+  if (fd < 0)
+    {
+      g_variant_builder_clear (&builder);
+      g_task_return_boolean (result, FALSE);
+      return;
+    }
+
+  data = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED)
+    {
+      close (fd);
+      g_variant_builder_clear (&builder);
+      g_task_return_boolean (result, FALSE);
+      return;
+    }
+
+  size = 0;
+  for (i = 0; i < priv->frames->len; i++)
+    {
+      cairo_surface_t *image = g_ptr_array_index (priv->frames, i);
+      int width = (cairo_image_surface_get_width (image) + priv->downscale - 1) / priv->downscale;
+      int height = (cairo_image_surface_get_height (image) + priv->downscale - 1) / priv->downscale;
+
+      downscale_frame (image, priv->downscale, data + size, width, height);
+      size += (gsize) width * height * 4;
+    }
+
+  /* Write sealing requires that no writable mapping is left */
+  munmap (data, size);
+  seal_frame_fd (fd);
+
+  priv->fd_list = g_unix_fd_list_new_from_array (&fd, 1);
+  priv->frame_layout = g_variant_ref_sink (g_variant_new ("(hua(uuut))",
+                                                          0, FRAME_FORMAT,
+                                                          &builder));
+
+  g_task_return_boolean (result, TRUE);
+}
+
+static void
+on_frames_written (GObject      *source,
+                   GAsyncResult *result,
+                   gpointer      user_data)
+{
+  ShellScreenshot *screenshot = SHELL_SCREENSHOT (source);
+  ShellScreenshotPrivate *priv = screenshot->priv;
+
+  if (priv->frame_callback)
+    priv->frame_callback (screenshot,
+                          g_task_propagate_boolean (G_TASK (result), NULL),
+                          priv->fd_list,
+                          priv->frame_layout);
+
+  g_clear_pointer (&priv->regions, g_array_unref);
+  g_clear_pointer (&priv->frames, g_ptr_array_unref);
+  g_clear_object (&priv->fd_list);
+  g_clear_pointer (&priv->frame_layout, g_variant_unref);
+
+  meta_enable_unredirect_for_screen (shell_global_get_screen (priv->global));
+}
+
+static void
+grab_frames (ClutterActor    *stage,
+             ShellScreenshot *screenshot)
+{
+  ShellScreenshotPrivate *priv = screenshot->priv;
+  MetaCursorTracker *tracker = NULL;
+  GTask *result;
+  guint i;
+
+  if (priv->include_cursor)
+    tracker = meta_cursor_tracker_get_for_screen (shell_global_get_screen (priv->global));
+
+  priv->frames = g_ptr_array_new_with_free_func ((GDestroyNotify) cairo_surface_destroy);
+
+  for (i = 0; i < priv->regions->len; i++)
+    {
+      cairo_rectangle_int_t *region = &g_array_index (priv->regions,
+                                                      cairo_rectangle_int_t, i);
+
+      do_grab_screenshot (screenshot, CLUTTER_STAGE (stage),
+                          region->x, region->y,
+                          region->width, region->height);
+
+      if (priv->image != NULL && tracker != NULL)
+        _draw_cursor_image (tracker, priv->image, *region);
+
+      /* Missing frames fail the grab in the thread */
+      g_ptr_array_add (priv->frames, priv->image);
+      priv->image = NULL;
+    }
+
+  g_signal_handlers_disconnect_by_func (stage, (void *)grab_frames, (gpointer)screenshot);
+  result = g_task_new (screenshot, NULL, on_frames_written, NULL);
+  g_task_run_in_thread (result, write_frames_thread);
+  g_object_unref (result);
+}
+
 /**
  * shell_screenshot_screenshot:
  * @screenshot: the #ShellScreenshot
@@ -468,7 +771,7 @@ shell_screenshot_screenshot (ShellScreenshot *screenshot,
   ClutterActor *stage;
   ShellScreenshotPrivate *priv = screenshot->priv;
 
-  if (priv->filename != NULL) {
+  if (screenshot_in_progress (priv)) {
     if (callback)
       callback (screenshot, FALSE, NULL, "");
     return;
@@ -514,7 +817,7 @@ shell_screenshot_screenshot_area (ShellScreenshot *screenshot,
   ClutterActor *stage;
   ShellScreenshotPrivate *priv = screenshot->priv;
 
-  if (priv->filename != NULL) {
+  if (screenshot_in_progress (priv)) {
     if (callback)
       callback (screenshot, FALSE, NULL, "");
     return;
@@ -562,7 +865,7 @@ shell_screenshot_screenshot_window (ShellScreenshot *screenshot,
   MetaDisplay *display = meta_screen_get_display (screen);
   MetaWindow *window = meta_display_get_focus_window (display);
 
-  if (priv->filename != NULL || !window) {
+  if (screenshot_in_progress (priv) || !window) {
     if (callback)
       callback (screenshot, FALSE, NULL, "");
     return;
@@ -573,17 +876,136 @@ shell_screenshot_screenshot_window (ShellScreenshot *screenshot,
   priv->include_frame = include_frame;
   priv->include_cursor = include_cursor;
 
-  stage = CLUTTER_ACTOR (shell_global_get_stage (priv->global));
-
   meta_disable_unredirect_for_screen (shell_global_get_screen (shell_global_get ()));
 
+  /* Only fullscreen windows get unredirected, and their texture is
+   * stale until the stage painted them again.
+   */
+  if (!meta_window_is_fullscreen (window))
+    {
+      do_grab_window_screenshot (screenshot);
+      return;
+    }
+
+  stage = CLUTTER_ACTOR (shell_global_get_stage (priv->global));
+
   g_signal_connect_after (stage, "paint", G_CALLBACK (grab_window_screenshot), (gpointer)screenshot);
 
   clutter_actor_queue_redraw (stage);
 }
 
+/**
+ * shell_screenshot_screenshot_to_fd:
+ * @screenshot: the #ShellScreenshot
+ * @regions: areas to grab, as a variant of type `a(iiii)` holding x,
+ *   y, width and height of each; the whole screen if empty
+ * @downscale: factor to shrink the frames by, 1 to keep their size
+ * @include_cursor: Whether to include the cursor or not
+ * @callback: (scope async): function to call with the frames
+ *
+ * Takes screenshots of @regions and passes them to @callback as raw
+ * pixels in a sealed memory file, skipping any image encoding. The
+ * file is the only one in the #GUnixFDList passed to @callback.
+ *
+ * The frames are described by a variant of type `(hua(uuut))`, ready
+ * to be returned over D-Bus along with the fd list: the handle of the
+ * file, the DRM fourcc of the pixel format (premultiplied ARGB32 in
+ * native byte order, as cairo stores it) and, for each region in
+ * order, the width, height, stride and offset of its frame.
+ */
+void
+shell_screenshot_screenshot_to_fd (ShellScreenshot *screenshot,
+                                   GVariant *regions,
+                                   guint downscale,
+                                   gboolean include_cursor,
+                                   ShellScreenshotFrameCallback callback)
+{
+  ShellScreenshotPrivate *priv = screenshot->priv;
+  MetaScreen *screen = shell_global_get_screen (priv->global);
+  cairo_rectangle_int_t screen_rect = { 0, };
+  cairo_rectangle_int_t rect;
+  ClutterActor *stage;
+  GVariantIter iter;
+  gboolean valid = TRUE;
+
+  g_return_if_fail (g_variant_is_of_type (regions, G_VARIANT_TYPE ("a(iiii)")));
+
+  if (screenshot_in_progress (priv) || downscale == 0) {
+    if (callback)
+      callback (screenshot, FALSE, NULL, NULL);
+    return;
+  }
+
+  meta_screen_get_size (screen, &screen_rect.width, &screen_rect.height);
+
+  priv->regions = g_array_new (FALSE, FALSE, sizeof (cairo_rectangle_int_t));
+
+  g_variant_iter_init (&iter, regions);
+  while (g_variant_iter_next (&iter, "(iiii)",
+                              &rect.x, &rect.y, &rect.width, &rect.height))
+    {
+      valid &= rect.width > 0 && rect.height > 0 &&
+               rect.x >= 0 && rect.y >= 0 &&
+               rect.x + rect.width <= screen_rect.width &&
+               rect.y + rect.height <= screen_rect.height;
+      g_array_append_val (priv->regions, rect);
+    }
+
+  if (!valid) {
+    g_clear_pointer (&priv->regions, g_array_unref);
+    if (callback)
+      callback (screenshot, FALSE, NULL, NULL);
+    return;
+  }
+
+  if (priv->regions->len == 0)
+    g_array_append_val (priv->regions, screen_rect);
+
+  priv->downscale = downscale;
+  priv->include_cursor = include_cursor;
+  priv->frame_callback = callback;
+
+  stage = CLUTTER_ACTOR (shell_global_get_stage (priv->global));
+
+  meta_disable_unredirect_for_screen (screen);
+
+  g_signal_connect_after (stage, "paint", G_CALLBACK (grab_frames), (gpointer)screenshot);
+
+  clutter_actor_queue_redraw (stage);
+}
+
 ShellScreenshot *
 shell_screenshot_new (void)
 {
   return g_object_new (SHELL_TYPE_SCREENSHOT, NULL);
 }
+
+/**
+ * shell_screenshot_set_compression_level:
+ * @screenshot: the #ShellScreenshot
+ * @level: zlib compression level from 0 to 9, or -1 for the default
+ *
+ * Sets how hard to compress the PNG files written for screenshots;
+ * see #ShellScreenshot:compression-level.
+ */
+void
+shell_screenshot_set_compression_level (ShellScreenshot *screenshot,
+                                        int              level)
+{
+  g_return_if_fail (SHELL_IS_SCREENSHOT (screenshot));
+  g_return_if_fail (level >= -1 && level <= 9);
+
+  if (screenshot->priv->compression_level == level)
+    return;
+
+  screenshot->priv->compression_level = level;
+  g_object_notify (G_OBJECT (screenshot), "compression-level");
+}
+
+int
+shell_screenshot_get_compression_level (ShellScreenshot *screenshot)
+{
+  g_return_val_if_fail (SHELL_IS_SCREENSHOT (screenshot), -1);
+
+  return screenshot->priv->compression_level;
+}
@@ -10,12 +10,18 @@
  * areas or windows and write them out as png files.
  *
  */
+#include <gio/gunixfdlist.h>
+
 #define SHELL_TYPE_SCREENSHOT (shell_screenshot_get_type ())
 G_DECLARE_FINAL_TYPE (ShellScreenshot, shell_screenshot,
                       SHELL, SCREENSHOT, GObject)
 
 ShellScreenshot *shell_screenshot_new (void);
 
+void shell_screenshot_set_compression_level (ShellScreenshot *screenshot,
+                                             int              level);
+int  shell_screenshot_get_compression_level (ShellScreenshot *screenshot);
+
 typedef void (*ShellScreenshotCallback)  (ShellScreenshot *screenshot,
                                           gboolean success,
                                           cairo_rectangle_int_t *screenshot_area,
@@ -40,4 +46,15 @@ void    shell_screenshot_screenshot           (ShellScreenshot *screenshot,
                                                 const char *filename,
                                                 ShellScreenshotCallback callback);
 
+typedef void (*ShellScreenshotFrameCallback) (ShellScreenshot *screenshot,
+                                              gboolean         success,
+                                              GUnixFDList     *fd_list,
+                                              GVariant        *frames);
+
+void    shell_screenshot_screenshot_to_fd     (ShellScreenshot *screenshot,
+                                                GVariant *regions,
+                                                guint downscale,
+                                                gboolean include_cursor,
+                                                ShellScreenshotFrameCallback callback);
+
 #endif /* ___SHELL_SCREENSHOT_H__ */
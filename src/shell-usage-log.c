@@ -0,0 +1,100 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+
+#include "config.h"
+
+#include <string.h>
+#include <zlib.h>
+
+#include "shell-usage-log.h"
+
+#define USAGE_LOG_MAGIC "GSUSAGE1"
+
+/* The size and the CRC-32 before each record */
+#define RECORD_HEADER_SIZE (2 * sizeof (guint32))
+
+#define PADDED_SIZE(size) ((gsize) (size) + (8 - (size) % 8) % 8)
+
+void
+shell_usage_log_header_init (ShellUsageLogHeader *header,
+                             guint64              generation)
+{
+  memcpy (header->magic, USAGE_LOG_MAGIC, sizeof (header->magic));
+  header->generation = generation;
+}
+
+void
+shell_usage_log_append_record (GByteArray *log,
+                               GVariant   *record)
+{
+  static const guint8 padding[8] = { 0, };
+  guint32 size, crc;
+
+  size = g_variant_get_size (record);
+  crc = crc32 (crc32 (0L, Z_NULL, 0), g_variant_get_data (record), size);
+
+  g_byte_array_append (log, (guint8 *) &size, sizeof (size));
+  g_byte_array_append (log, (guint8 *) &crc, sizeof (crc));
+  g_byte_array_append (log, g_variant_get_data (record), size);
+  g_byte_array_append (log, padding, PADDED_SIZE (size) - size);
+}
+
+/**
+ * shell_usage_log_replay:
+ * @contents: the log
+ * @length: the length of @contents
+ * @generation: the generation the log must belong to
+ * @record_type: the type of the records
+ * @func: called with each intact record, in order
+ * @user_data: data for @func
+ *
+ * Replays the records of a log, up to the first one that is not
+ * complete, including its padding, or fails its CRC.
+ *
+ * Returns: the size of the intact part of the log, which is where the
+ *   next record goes, or 0 if the log is not for @generation
+ */
+gsize
+shell_usage_log_replay (const guint8       *contents,
+                        gsize               length,
+                        guint64             generation,
+                        const GVariantType *record_type,
+                        ShellUsageLogFunc   func,
+                        gpointer            user_data)
+{
+  ShellUsageLogHeader header;
+  gsize offset;
+
+  if (length < sizeof (header))
+    return 0;
+
+  memcpy (&header, contents, sizeof (header));
+  if (memcmp (header.magic, USAGE_LOG_MAGIC, sizeof (header.magic)) != 0 ||
+      header.generation != generation)
+    return 0;
+
+  /* offset stays aligned, and never goes past length */
+  offset = sizeof (header);
+  while (length - offset >= RECORD_HEADER_SIZE)
+    {
+      g_autoptr(GVariant) record = NULL;
+      const guint8 *data = contents + offset + RECORD_HEADER_SIZE;
+      guint32 size, crc;
+
+      memcpy (&size, contents + offset, sizeof (size));
+      memcpy (&crc, contents + offset + sizeof (size), sizeof (crc));
+
+      if (size > length - offset - RECORD_HEADER_SIZE ||
+          PADDED_SIZE (size) > length - offset - RECORD_HEADER_SIZE ||
+          crc32 (crc32 (0L, Z_NULL, 0), data, size) != crc)
+        break;
+
+      record = g_variant_ref_sink (g_variant_new_from_data (record_type,
+                                                            data, size, FALSE,
+                                                            NULL, NULL));
+      func (record, user_data);
+
+      offset += RECORD_HEADER_SIZE + PADDED_SIZE (size);
+    }
+
+  return offset;
+}
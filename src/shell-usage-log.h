@@ -0,0 +1,39 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+#ifndef __SHELL_USAGE_LOG_H__
+#define __SHELL_USAGE_LOG_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* An append-only log of GVariant records, as used for app usage. The
+ * log starts with a ShellUsageLogHeader, followed by records: the size
+ * of a serialized variant and its CRC-32, both 32-bit, then the variant
+ * itself, padded to 8 bytes so the next one is aligned when the log is
+ * mapped. A record cut short by a crash fails its size or CRC check,
+ * and replaying stops there.
+ */
+typedef struct {
+  char magic[8];
+  guint64 generation;
+} ShellUsageLogHeader;
+
+typedef void (*ShellUsageLogFunc) (GVariant *record,
+                                   gpointer  user_data);
+
+void  shell_usage_log_header_init   (ShellUsageLogHeader *header,
+                                     guint64              generation);
+
+void  shell_usage_log_append_record (GByteArray          *log,
+                                     GVariant            *record);
+
+gsize shell_usage_log_replay        (const guint8        *contents,
+                                     gsize                length,
+                                     guint64              generation,
+                                     const GVariantType  *record_type,
+                                     ShellUsageLogFunc    func,
+                                     gpointer             user_data);
+
+G_END_DECLS
+
+#endif /* __SHELL_USAGE_LOG_H__ */
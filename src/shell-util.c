@@ -1,9 +1,14 @@
 /* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
 
+/* For memfd_create() */
+#define _GNU_SOURCE
+
 #include "config.h"
 
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <unistd.h>
 
 #include <GL/gl.h>
 #include <cogl/cogl.h>
@@ -14,6 +19,7 @@
 #include <gdk-pixbuf/gdk-pixbuf.h>
 #include <gdk/gdkx.h>
 #include <meta/meta-shaped-texture.h>
+#include <meta/window.h>
 #include <xkbcommon/xkbcommon.h>
 
 #include <locale.h>
@@ -472,6 +478,240 @@ shell_util_get_content_for_window_actor (MetaWindowActor *window_actor,
   return content;
 }
 
+/* Largest width of the texture window thumbnails are drawn into */
+#define THUMBNAIL_ATLAS_WIDTH 4096
+
+typedef struct {
+  MetaWindowActor *window_actor;
+  CoglTexture *texture;
+  cairo_rectangle_int_t clip;
+  int x, y, width, height;
+
+  /* Kept until the atlas was read back, which draws them */
+  CoglTexture *copy;
+  CoglFramebuffer *copy_framebuffer;
+} WindowThumbnail;
+
+/* The visible part of the window in its texture, without shadows or
+ * invisible borders.
+ */
+static void
+get_window_texture_clip (MetaWindowActor       *window_actor,
+                         cairo_rectangle_int_t *clip)
+{
+  MetaWindow *window = meta_window_actor_get_meta_window (window_actor);
+  MetaRectangle rect;
+  gfloat actor_x, actor_y;
+
+  clutter_actor_get_position (CLUTTER_ACTOR (window_actor), &actor_x, &actor_y);
+  meta_window_get_frame_rect (window, &rect);
+
+  clip->x = rect.x - (gint) actor_x;
+  clip->y = rect.y - (gint) actor_y;
+  clip->width = rect.width;
+  clip->height = rect.height;
+}
+
+/* Copies the window out of its texture, which may be a pixmap that
+ * can't be mipmapped cheaply, then lets mipmapping average it down.
+ */
+static void
+draw_window_thumbnail (CoglContext     *context,
+                       CoglFramebuffer *atlas,
+                       WindowThumbnail *thumbnail)
+{
+  float tex_width = cogl_texture_get_width (thumbnail->texture);
+  float tex_height = cogl_texture_get_height (thumbnail->texture);
+  CoglPipeline *pipeline;
+  CoglError *error = NULL;
+
+  thumbnail->copy = COGL_TEXTURE (cogl_texture_2d_new_with_size (context,
+                                                                 thumbnail->clip.width,
+                                                                 thumbnail->clip.height));
+  thumbnail->copy_framebuffer =
+    COGL_FRAMEBUFFER (cogl_offscreen_new_with_texture (thumbnail->copy));
+  if (!cogl_framebuffer_allocate (thumbnail->copy_framebuffer, &error))
+    {
+      g_warning ("Can't create framebuffer for window thumbnail: %s", error->message);
+      cogl_error_free (error);
+      return;
+    }
+
+  cogl_framebuffer_orthographic (thumbnail->copy_framebuffer, 0, 0,
+                                 thumbnail->clip.width, thumbnail->clip.height,
+                                 -1, 1);
+
+  pipeline = cogl_pipeline_new (context);
+  cogl_pipeline_set_layer_texture (pipeline, 0, thumbnail->texture);
+  cogl_pipeline_set_layer_filters (pipeline, 0,
+                                   COGL_PIPELINE_FILTER_NEAREST,
+                                   COGL_PIPELINE_FILTER_NEAREST);
+  cogl_pipeline_set_blend (pipeline, "RGBA = ADD (SRC_COLOR, 0)", NULL);
+  cogl_framebuffer_draw_textured_rectangle (thumbnail->copy_framebuffer, pipeline,
+                                            0, 0,
+                                            thumbnail->clip.width,
+                                            thumbnail->clip.height,
+                                            thumbnail->clip.x / tex_width,
+                                            thumbnail->clip.y / tex_height,
+                                            (thumbnail->clip.x + thumbnail->clip.width) / tex_width,
+                                            (thumbnail->clip.y + thumbnail->clip.height) / tex_height);
+  cogl_object_unref (pipeline);
+
+  pipeline = cogl_pipeline_new (context);
+  cogl_pipeline_set_layer_texture (pipeline, 0, thumbnail->copy);
+  cogl_pipeline_set_layer_filters (pipeline, 0,
+                                   COGL_PIPELINE_FILTER_LINEAR_MIPMAP_LINEAR,
+                                   COGL_PIPELINE_FILTER_LINEAR);
+  cogl_pipeline_set_layer_wrap_mode (pipeline, 0,
+                                     COGL_PIPELINE_WRAP_MODE_CLAMP_TO_EDGE);
+  cogl_pipeline_set_blend (pipeline, "RGBA = ADD (SRC_COLOR, 0)", NULL);
+  cogl_framebuffer_draw_rectangle (atlas, pipeline,
+                                   thumbnail->x, thumbnail->y,
+                                   thumbnail->x + thumbnail->width,
+                                   thumbnail->y + thumbnail->height);
+  cogl_object_unref (pipeline);
+}
+
+/**
+ * shell_util_get_window_thumbnails:
+ * @window_actors: (element-type Meta.WindowActor): the windows
+ * @max_size: the largest width or height of a thumbnail
+ *
+ * Takes thumbnails of the windows straight from their textures,
+ * without painting the stage; they are all scaled down on the GPU
+ * together and read back at once. Windows without a texture get an
+ * empty thumbnail.
+ *
+ * Returns: (transfer full) (element-type Clutter.Content): a
+ *   #ClutterImage for each window, in the same order
+ */
+GList *
+shell_util_get_window_thumbnails (GList *window_actors,
+                                  int    max_size)
+{
+  CoglContext *context = clutter_backend_get_cogl_context (clutter_get_default_backend ());
+  WindowThumbnail *thumbnails;
+  CoglTexture *atlas_texture;
+  CoglFramebuffer *atlas;
+  CoglError *error = NULL;
+  GList *contents = NULL, *l;
+  guint8 *data;
+  int n_thumbnails, atlas_width = 0, atlas_height = 0;
+  int x = 0, y = 0, row_height = 0;
+  int i;
+
+  g_return_val_if_fail (max_size > 0 && max_size <= THUMBNAIL_ATLAS_WIDTH, NULL);
+
+  if (!cogl_has_feature (context, COGL_FEATURE_ID_OFFSCREEN))
+    return NULL;
+
+  n_thumbnails = g_list_length (window_actors);
+  if (n_thumbnails == 0)
+    return NULL;
+
+  /* Lay the thumbnails out in rows of one texture */
+  thumbnails = g_new0 (WindowThumbnail, n_thumbnails);
+  for (l = window_actors, i = 0; l; l = l->next, i++)
+    {
+      WindowThumbnail *thumbnail = &thumbnails[i];
+      MetaShapedTexture *stex;
+      double scale;
+
+      thumbnail->window_actor = l->data;
+      get_window_texture_clip (thumbnail->window_actor, &thumbnail->clip);
+
+      stex = META_SHAPED_TEXTURE (meta_window_actor_get_texture (thumbnail->window_actor));
+      thumbnail->texture = meta_shaped_texture_get_texture (stex);
+
+      /* The frame may not match the buffer while a resize is going on */
+      if (thumbnail->texture)
+        {
+          cairo_rectangle_int_t bounds = { 0, 0,
+                                           cogl_texture_get_width (thumbnail->texture),
+                                           cogl_texture_get_height (thumbnail->texture) };
+          cairo_region_t *region = cairo_region_create_rectangle (&thumbnail->clip);
+
+          cairo_region_intersect_rectangle (region, &bounds);
+          cairo_region_get_extents (region, &thumbnail->clip);
+          cairo_region_destroy (region);
+        }
+
+      if (thumbnail->clip.width <= 0 || thumbnail->clip.height <= 0)
+        thumbnail->texture = NULL;
+
+      scale = MIN (1.0, MIN ((double) max_size / MAX (thumbnail->clip.width, 1),
+                             (double) max_size / MAX (thumbnail->clip.height, 1)));
+      thumbnail->width = MAX (1, (int) (thumbnail->clip.width * scale));
+      thumbnail->height = MAX (1, (int) (thumbnail->clip.height * scale));
+
+      if (x + thumbnail->width > THUMBNAIL_ATLAS_WIDTH)
+        {
+          x = 0;
+          y += row_height;
+          row_height = 0;
+        }
+
+      thumbnail->x = x;
+      thumbnail->y = y;
+      x += thumbnail->width;
+      row_height = MAX (row_height, thumbnail->height);
+      atlas_width = MAX (atlas_width, x);
+    }
+  atlas_height = y + row_height;
+
+  atlas_texture = COGL_TEXTURE (cogl_texture_2d_new_with_size (context,
+                                                               atlas_width,
+                                                               atlas_height));
+  atlas = COGL_FRAMEBUFFER (cogl_offscreen_new_with_texture (atlas_texture));
+  if (!cogl_framebuffer_allocate (atlas, &error))
+    {
+      g_warning ("Can't create framebuffer for window thumbnails: %s", error->message);
+      cogl_error_free (error);
+      cogl_object_unref (atlas);
+      cogl_object_unref (atlas_texture);
+      g_free (thumbnails);
+      return NULL;
+    }
+
+  cogl_framebuffer_orthographic (atlas, 0, 0, atlas_width, atlas_height, -1, 1);
+  cogl_framebuffer_clear4f (atlas, COGL_BUFFER_BIT_COLOR, 0, 0, 0, 0);
+
+  for (i = 0; i < n_thumbnails; i++)
+    if (thumbnails[i].texture)
+      draw_window_thumbnail (context, atlas, &thumbnails[i]);
+
+  data = g_malloc (atlas_width * atlas_height * 4);
+  cogl_framebuffer_read_pixels (atlas, 0, 0, atlas_width, atlas_height,
+                                CLUTTER_CAIRO_FORMAT_ARGB32, data);
+
+  for (i = 0; i < n_thumbnails; i++)
+    {
+      WindowThumbnail *thumbnail = &thumbnails[i];
+      ClutterContent *image = clutter_image_new ();
+
+      clutter_image_set_data (CLUTTER_IMAGE (image),
+                              data + (thumbnail->y * atlas_width + thumbnail->x) * 4,
+                              CLUTTER_CAIRO_FORMAT_ARGB32,
+                              thumbnail->width, thumbnail->height,
+                              atlas_width * 4,
+                              NULL);
+      contents = g_list_prepend (contents, image);
+    }
+
+  for (i = 0; i < n_thumbnails; i++)
+    {
+      g_clear_pointer (&thumbnails[i].copy_framebuffer, cogl_object_unref);
+      g_clear_pointer (&thumbnails[i].copy, cogl_object_unref);
+    }
+
+  g_free (data);
+  cogl_object_unref (atlas);
+  cogl_object_unref (atlas_texture);
+  g_free (thumbnails);
+
+  return g_list_reverse (contents);
+}
+
 cairo_surface_t *
 shell_util_composite_capture_images (ClutterCapture  *captures,
                                      int              n_captures,
@@ -613,3 +853,50 @@ shell_util_needs_secondary_layout (const char *layouts,
 
   return state.n_required_keysyms != 0;
 }
+
+/**
+ * shell_util_create_memfd:
+ * @name: name of the file, for debugging
+ * @size: size of the file
+ *
+ * Creates an anonymous file of @size bytes to share memory with other
+ * processes. It is a memfd that can be sealed when the system supports
+ * it, and an unlinked temporary file otherwise.
+ *
+ * Returns: the file descriptor, or -1 on failure
+ */
+int
+shell_util_create_memfd (const char *name,
+                         gsize       size)
+{
+  int fd;
+
+#ifdef HAVE_MEMFD_CREATE
+  fd = memfd_create (name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+  fd = -1;
+#endif
+
+  if (fd < 0)
+    {
+      char *template, *path;
+
+      template = g_strdup_printf ("%s-XXXXXX", name);
+      fd = g_file_open_tmp (template, &path, NULL);
+      g_free (template);
+
+      if (fd < 0)
+        return -1;
+
+      unlink (path);
+      g_free (path);
+    }
+
+  if (ftruncate (fd, size) < 0)
+    {
+      close (fd);
+      return -1;
+    }
+
+  return fd;
+}
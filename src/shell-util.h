@@ -53,6 +53,9 @@ gboolean shell_util_need_background_refresh (void);
 ClutterContent * shell_util_get_content_for_window_actor (MetaWindowActor *window_actor,
                                                           MetaRectangle   *window_rect);
 
+GList *shell_util_get_window_thumbnails (GList *window_actors,
+                                         int    max_size);
+
 cairo_surface_t * shell_util_composite_capture_images (ClutterCapture  *captures,
                                                        int              n_captures,
                                                        int              x,
@@ -64,6 +67,9 @@ gboolean shell_util_needs_secondary_layout (const char *layouts,
                                             const char *variants,
                                             const char *options);
 
+int shell_util_create_memfd (const char *name,
+                             gsize       size);
+
 G_END_DECLS
 
 #endif /* __SHELL_UTIL_H__ */
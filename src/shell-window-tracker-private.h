@@ -8,4 +8,11 @@ void _shell_window_tracker_add_child_process_app (ShellWindowTracker *tracker,
                                                   GPid                pid,
                                                   ShellApp           *app);
 
+int _shell_window_tracker_get_n_tracked_windows (ShellWindowTracker *tracker);
+
+void _shell_window_tracker_add_app_window    (ShellApp   *app,
+                                              MetaWindow *window);
+void _shell_window_tracker_remove_app_window (ShellApp   *app,
+                                              MetaWindow *window);
+
 #endif
@@ -19,7 +19,9 @@
 
 #include "shell-window-tracker-private.h"
 #include "shell-app-private.h"
+#include "shell-app-system-private.h"
 #include "shell-global.h"
+#include "shell-perf-log.h"
 #include "st.h"
 
 /* This file includes modified code from
@@ -34,6 +36,11 @@
 
 #define BUILDER_WINDOW "org.gnome.Builder"
 
+/* Past this many window identities, we start over rather than keep
+ * those of windows that are long gone
+ */
+#define MAX_RESOLVED_APPS 256
+
 /**
  * SECTION:shell-window-tracker
  * @short_description: Associate windows with applications
@@ -53,11 +60,39 @@ struct _ShellWindowTracker
   /* <MetaWindow * window, ShellApp *app> */
   GHashTable *window_to_app;
 
+  /* <char *identity, ShellApp *app or NULL>, see get_app_from_window_identity() */
+  GHashTable *resolved_apps;
+
   MetaWindow *coding_app;
+
+  /* See begin_changes() */
+  guint changes_id;
+  gboolean windows_changed;
+
+  /* Statistics */
+  int n_resolutions;
+  int n_cache_hits;
+  int n_fallbacks;
+  gint64 resolution_time;
 };
 
 G_DEFINE_TYPE (ShellWindowTracker, shell_window_tracker, G_TYPE_OBJECT);
 
+/* The apps with windows of each process, most recent first, kept up
+ * to date by ShellApp as windows come and go, so that looking up the
+ * app of a process is a hash table lookup. Windows are assigned to
+ * apps while the tracker is being created, so this lives outside of
+ * it; there is only one tracker anyway.
+ */
+typedef struct
+{
+  ShellApp *app;
+  guint n_windows;
+} PidApp;
+
+static GHashTable *pid_to_apps; /* <int pid, GSList<PidApp *>> */
+static GHashTable *window_to_pid; /* <MetaWindow *window, int pid> */
+
 enum {
   PROP_0,
   PROP_FOCUS_APP
@@ -284,6 +319,78 @@ get_app_from_flatpak_id (MetaWindow  *window)
   return get_app_from_id (window, id);
 }
 
+static void
+unref_if_set (gpointer data)
+{
+  if (data != NULL)
+    g_object_unref (data);
+}
+
+/*
+ * get_app_from_window_identity:
+ * @tracker: a #ShellWindowTracker
+ * @window: a #MetaWindow
+ *
+ * Looks for an app by the GApplication ID of @window, then its
+ * WM_CLASS, then its Flatpak ID. What these find only depends on the
+ * installed apps, so the result is remembered for each combination of
+ * them until apps are installed or removed. So is finding none, as
+ * with the windows of window-backed apps.
+ *
+ * Return value: (transfer full): A newly-referenced #ShellApp, or %NULL
+ */
+static ShellApp *
+get_app_from_window_identity (ShellWindowTracker  *tracker,
+                              MetaWindow          *window)
+{
+  g_autofree char *identity = NULL;
+  const char *gapplication_id, *wm_instance, *wm_class, *flatpak_id;
+  ShellApp *result;
+
+  gapplication_id = meta_window_get_gtk_application_id (window);
+  wm_instance = meta_window_get_wm_class_instance (window);
+  wm_class = meta_window_get_wm_class (window);
+  flatpak_id = meta_window_get_flatpak_id (window);
+
+  identity = g_strdup_printf ("%s\n%s\n%s\n%s",
+                              gapplication_id ? gapplication_id : "",
+                              wm_instance ? wm_instance : "",
+                              wm_class ? wm_class : "",
+                              flatpak_id ? flatpak_id : "");
+
+  if (g_hash_table_lookup_extended (tracker->resolved_apps, identity,
+                                    NULL, (gpointer *) &result))
+    {
+      tracker->n_cache_hits++;
+      return result ? g_object_ref (result) : NULL;
+    }
+
+  /* Check if the window has a GApplication ID attached; this is
+   * canonical if it does
+   */
+  result = get_app_from_gapplication_id (window);
+
+  /* Check if the app's WM_CLASS specifies an app; this is
+   * canonical if it does.
+   */
+  if (result == NULL)
+    result = get_app_from_window_wmclass (window);
+
+  /* Check if the window was opened from within a Flatpak sandbox; if this
+   * is the case, a corresponding .desktop file is guaranteed to match;
+   */
+  if (result == NULL)
+    result = get_app_from_flatpak_id (window);
+
+  if (g_hash_table_size (tracker->resolved_apps) >= MAX_RESOLVED_APPS)
+    g_hash_table_remove_all (tracker->resolved_apps);
+
+  g_hash_table_insert (tracker->resolved_apps, g_steal_pointer (&identity),
+                       result ? g_object_ref (result) : NULL);
+
+  return result;
+}
+
 /*
  * get_app_from_window_group:
  * @monitor: a #ShellWindowTracker
@@ -421,26 +528,18 @@ get_app_for_window (ShellWindowTracker    *tracker,
   if (meta_window_is_remote (window))
     return _shell_app_new_for_window (window);
 
-  /* Check if the window has a GApplication ID attached; this is
-   * canonical if it does
-   */
-  result = get_app_from_gapplication_id (window);
+  result = get_app_from_window_identity (tracker, window);
   if (result != NULL)
     return result;
 
-  /* Check if the app's WM_CLASS specifies an app; this is
-   * canonical if it does.
+  /* What follows depends on other windows and processes, so isn't
+   * remembered; apps that end up here a lot are worth a look.
    */
-  result = get_app_from_window_wmclass (window);
-  if (result != NULL)
-    return result;
-
-  /* Check if the window was opened from within a Flatpak sandbox; if this
-   * is the case, a corresponding .desktop file is guaranteed to match;
-   */
-  result = get_app_from_flatpak_id (window);
-  if (result != NULL)
-    return result;
+  tracker->n_fallbacks++;
+  if (meta_window_get_wm_class (window) != NULL)
+    shell_perf_log_event_s (shell_perf_log_get_default (),
+                            "windowTracker.fallbackResolution",
+                            meta_window_get_wm_class (window));
 
   result = get_app_from_window_pid (tracker, window);
   if (result != NULL)
@@ -548,13 +647,54 @@ on_gtk_application_id_changed (MetaWindow  *window,
   tracked_window_changed (self, window);
 }
 
+static gboolean
+emit_changes (gpointer data)
+{
+  ShellWindowTracker *self = data;
+
+  self->changes_id = 0;
+  _shell_app_system_end_batch (shell_app_system_get_default ());
+
+  if (self->windows_changed)
+    {
+      self->windows_changed = FALSE;
+      g_signal_emit (self, signals[TRACKED_WINDOWS_CHANGED], 0);
+    }
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Windows are added to and removed from apps right away, but the app
+ * state changes and tracked-windows-changed that follow are sent once
+ * per main loop iteration, before the next redraw. Restoring a session
+ * with many windows would otherwise have the shell redo its layout for
+ * each of them, and a window changing its WM_CLASS would stop and
+ * start its app again.
+ */
+static void
+begin_changes (ShellWindowTracker *self)
+{
+  if (self->changes_id != 0)
+    return;
+
+  _shell_app_system_begin_batch (shell_app_system_get_default ());
+
+  self->changes_id = g_idle_add_full (G_PRIORITY_HIGH_IDLE, emit_changes, self, NULL);
+  g_source_set_name_by_id (self->changes_id, "[gnome-shell] emit_changes");
+}
+
 static void
 track_window (ShellWindowTracker *self,
               MetaWindow      *window)
 {
   ShellApp *app;
+  gint64 start;
 
+  start = g_get_monotonic_time ();
   app = get_app_for_window (self, window);
+  self->resolution_time += g_get_monotonic_time () - start;
+  self->n_resolutions++;
+
   if (!app)
     return;
 
@@ -564,9 +704,10 @@ track_window (ShellWindowTracker *self,
   g_signal_connect (window, "notify::wm-class", G_CALLBACK (on_wm_class_changed), self);
   g_signal_connect (window, "notify::gtk-application-id", G_CALLBACK (on_gtk_application_id_changed), self);
 
+  begin_changes (self);
   _shell_app_add_window (app, window);
 
-  g_signal_emit (self, signals[TRACKED_WINDOWS_CHANGED], 0);
+  self->windows_changed = TRUE;
 }
 
 static void
@@ -593,11 +734,12 @@ disassociate_window (ShellWindowTracker   *self,
 
   g_hash_table_remove (self->window_to_app, window);
 
+  begin_changes (self);
   _shell_app_remove_window (app, window);
   g_signal_handlers_disconnect_by_func (window, G_CALLBACK (on_wm_class_changed), self);
   g_signal_handlers_disconnect_by_func (window, G_CALLBACK (on_gtk_application_id_changed), self);
 
-  g_signal_emit (self, signals[TRACKED_WINDOWS_CHANGED], 0);
+  self->windows_changed = TRUE;
 
   g_object_unref (app);
 }
@@ -694,6 +836,55 @@ on_startup_sequence_changed (MetaScreen            *screen,
   g_signal_emit (G_OBJECT (self), signals[STARTUP_SEQUENCE_CHANGED], 0, sequence);
 }
 
+static void
+on_installed_changed (ShellAppSystem     *app_system,
+                      ShellWindowTracker *self)
+{
+  /* Windows may belong to the new apps, or no longer to the old ones */
+  g_hash_table_remove_all (self->resolved_apps);
+}
+
+static void
+resolution_statistics_callback (ShellPerfLog *perf_log,
+                                gpointer      data)
+{
+  ShellWindowTracker *self = data;
+
+  shell_perf_log_update_statistic_i (perf_log, "windowTracker.resolutions",
+                                     self->n_resolutions);
+  shell_perf_log_update_statistic_i (perf_log, "windowTracker.cacheHits",
+                                     self->n_cache_hits);
+  shell_perf_log_update_statistic_i (perf_log, "windowTracker.fallbacks",
+                                     self->n_fallbacks);
+  shell_perf_log_update_statistic_x (perf_log, "windowTracker.resolutionTime",
+                                     self->resolution_time);
+}
+
+static void
+define_resolution_statistics (ShellWindowTracker *self)
+{
+  ShellPerfLog *perf_log = shell_perf_log_get_default ();
+
+  shell_perf_log_define_event (perf_log,
+                               "windowTracker.fallbackResolution",
+                               "WM_CLASS of a window whose app was found from its process, "
+                               "startup notification or group",
+                               "s");
+
+  shell_perf_log_define_statistic (perf_log, "windowTracker.resolutions",
+                                   "Number of times the app of a window was looked up", "i");
+  shell_perf_log_define_statistic (perf_log, "windowTracker.cacheHits",
+                                   "Number of app lookups answered from the window identity cache", "i");
+  shell_perf_log_define_statistic (perf_log, "windowTracker.fallbacks",
+                                   "Number of app lookups that went past the window identity", "i");
+  shell_perf_log_define_statistic (perf_log, "windowTracker.resolutionTime",
+                                   "Time spent looking up the apps of windows, in microseconds", "x");
+
+  shell_perf_log_add_statistics_callback (perf_log,
+                                          resolution_statistics_callback,
+                                          self, NULL);
+}
+
 static void
 shell_window_tracker_init (ShellWindowTracker *self)
 {
@@ -701,6 +892,13 @@ shell_window_tracker_init (ShellWindowTracker *self)
 
   self->window_to_app = g_hash_table_new_full (g_direct_hash, g_direct_equal,
                                                NULL, (GDestroyNotify) g_object_unref);
+  self->resolved_apps = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                               g_free, unref_if_set);
+
+  define_resolution_statistics (self);
+
+  g_signal_connect (shell_app_system_get_default (), "installed-changed",
+                    G_CALLBACK (on_installed_changed), self);
 
   screen = shell_global_get_screen (shell_global_get ());
 
@@ -716,7 +914,16 @@ shell_window_tracker_finalize (GObject *object)
 {
   ShellWindowTracker *self = SHELL_WINDOW_TRACKER (object);
 
+  if (self->changes_id != 0)
+    {
+      g_source_remove (self->changes_id);
+      _shell_app_system_end_batch (shell_app_system_get_default ());
+    }
+
   g_hash_table_destroy (self->window_to_app);
+  g_hash_table_destroy (self->resolved_apps);
+  g_signal_handlers_disconnect_by_func (shell_app_system_get_default (),
+                                        on_installed_changed, self);
 
   G_OBJECT_CLASS (shell_window_tracker_parent_class)->finalize(object);
 }
@@ -747,7 +954,9 @@ shell_window_tracker_get_window_app (ShellWindowTracker *tracker,
  * @tracker: A #ShellAppSystem
  * @pid: A Unix process identifier
  *
- * Look up the application corresponding to a process.
+ * Look up the application corresponding to a process. If the process
+ * has windows of several applications, the one that most recently got
+ * a window of it is returned.
  *
  * Returns: (transfer none): A #ShellApp, or %NULL if none
  */
@@ -755,34 +964,117 @@ ShellApp *
 shell_window_tracker_get_app_from_pid (ShellWindowTracker *tracker,
                                        int                 pid)
 {
-  GSList *running = shell_app_system_get_running (shell_app_system_get_default());
-  GSList *iter;
-  ShellApp *result = NULL;
+  GSList *apps;
+
+  if (pid_to_apps == NULL)
+    return NULL;
 
-  for (iter = running; iter; iter = iter->next)
+  apps = g_hash_table_lookup (pid_to_apps, GINT_TO_POINTER (pid));
+  if (apps == NULL)
+    return NULL;
+
+  return ((PidApp *) apps->data)->app;
+}
+
+static PidApp *
+find_pid_app (GSList   *apps,
+              ShellApp *app)
+{
+  for (; apps; apps = apps->next)
     {
-      ShellApp *app = iter->data;
-      GSList *pids = shell_app_get_pids (app);
-      GSList *pids_iter;
+      PidApp *pid_app = apps->data;
 
-      for (pids_iter = pids; pids_iter; pids_iter = pids_iter->next)
-        {
-          int app_pid = GPOINTER_TO_INT (pids_iter->data);
-          if (app_pid == pid)
-            {
-              result = app;
-              break;
-            }
-        }
-      g_slist_free (pids);
+      if (pid_app->app == app)
+        return pid_app;
+    }
 
-      if (result != NULL)
-        break;
+  return NULL;
+}
+
+/*
+ * _shell_window_tracker_add_app_window:
+ * @app: a #ShellApp
+ * @window: a #MetaWindow that was added to @app
+ *
+ * Notes that the process of @window has a window of @app, for
+ * shell_window_tracker_get_app_from_pid().
+ */
+void
+_shell_window_tracker_add_app_window (ShellApp   *app,
+                                      MetaWindow *window)
+{
+  GSList *apps;
+  PidApp *pid_app;
+  int pid;
+
+  pid = meta_window_get_pid (window);
+  if (pid <= 0)
+    return;
+
+  if (pid_to_apps == NULL)
+    {
+      pid_to_apps = g_hash_table_new (NULL, NULL);
+      window_to_pid = g_hash_table_new (NULL, NULL);
     }
 
-  g_slist_free (running);
+  if (g_hash_table_contains (window_to_pid, window))
+    return;
 
-  return result;
+  /* The pid of a window can change; remember which one we filed it under */
+  g_hash_table_insert (window_to_pid, window, GINT_TO_POINTER (pid));
+
+  /* The app that got a window last goes first */
+  apps = g_hash_table_lookup (pid_to_apps, GINT_TO_POINTER (pid));
+  pid_app = find_pid_app (apps, app);
+  if (pid_app == NULL)
+    {
+      pid_app = g_slice_new0 (PidApp);
+      pid_app->app = app;
+    }
+  else
+    {
+      apps = g_slist_remove (apps, pid_app);
+    }
+
+  g_hash_table_insert (pid_to_apps, GINT_TO_POINTER (pid),
+                       g_slist_prepend (apps, pid_app));
+
+  pid_app->n_windows++;
+}
+
+/*
+ * _shell_window_tracker_remove_app_window:
+ * @app: a #ShellApp
+ * @window: a #MetaWindow that is being removed from @app
+ *
+ * Undoes _shell_window_tracker_add_app_window().
+ */
+void
+_shell_window_tracker_remove_app_window (ShellApp   *app,
+                                         MetaWindow *window)
+{
+  GSList *apps;
+  PidApp *pid_app;
+  gpointer pid;
+
+  if (window_to_pid == NULL ||
+      !g_hash_table_lookup_extended (window_to_pid, window, NULL, &pid))
+    return;
+
+  g_hash_table_remove (window_to_pid, window);
+
+  apps = g_hash_table_lookup (pid_to_apps, pid);
+  pid_app = find_pid_app (apps, app);
+  if (pid_app == NULL || --pid_app->n_windows > 0)
+    return;
+
+  apps = g_slist_remove (apps, pid_app);
+  g_slice_free (PidApp, pid_app);
+
+  if (apps != NULL)
+    g_hash_table_insert (pid_to_apps, pid, apps);
+  else
+    g_hash_table_remove (pid_to_apps, pid);
 }
 
 static void
@@ -1024,3 +1316,9 @@ shell_window_tracker_get_default (void)
 
   return instance;
 }
+
+int
+_shell_window_tracker_get_n_tracked_windows (ShellWindowTracker *tracker)
+{
+  return g_hash_table_size (tracker->window_to_app);
+}
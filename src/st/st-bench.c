@@ -0,0 +1,593 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * st-bench.c: micro-benchmarks for the St toolkit
+ *
+ * Copyright © 2018 Endless Mobile, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Measures the hot paths of St outside of the shell: selector matching,
+ * property lookups on theme nodes, the cairo prerendering done by
+ * st_theme_node_paint(), shadow blurs and StBoxLayout allocation, on
+ * synthetic trees of 10 up to 100 000 widgets.
+ *
+ * Nothing here needs a GPU; on a machine without one, run it on a
+ * virtual X server and pass --software so Mesa's software rasterizer is
+ * used for the few Cogl operations involved:
+ *
+ *   xvfb-run ./st-bench --software ../tests/testcommon/test.css
+ */
+
+#include "config.h"
+
+#include <clutter/clutter.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "st-box-layout.h"
+#include "st-private.h"
+#include "st-shadow.h"
+#include "st-theme.h"
+#include "st-theme-context.h"
+#include "st-theme-node.h"
+#include "st-widget.h"
+
+#define TREE_DEPTH 8
+#define PAINT_SIZE 64
+#define MIN_TIME_US (G_USEC_PER_SEC / 4)
+
+/* Allocation counting. On glibc the real allocator is reachable as
+ * __libc_malloc() and friends, so defining malloc() here interposes it
+ * for every library in the process, Cogl and cairo included.
+ */
+#ifdef __GLIBC__
+#define HAVE_ALLOCATION_COUNTS 1
+
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t nmemb, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+
+static gsize n_allocations;
+static gsize n_allocated_bytes;
+
+static inline void
+count_allocation (size_t size)
+{
+  __atomic_add_fetch (&n_allocations, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch (&n_allocated_bytes, size, __ATOMIC_RELAXED);
+}
+
+void *
+malloc (size_t size)
+{
+  count_allocation (size);
+  return __libc_malloc (size);
+}
+
+void *
+calloc (size_t nmemb, size_t size)
+{
+  count_allocation (nmemb * size);
+  return __libc_calloc (nmemb, size);
+}
+
+void *
+realloc (void *ptr,
+         size_t size)
+{
+  count_allocation (size);
+  return __libc_realloc (ptr, size);
+}
+
+static void
+get_allocation_counts (gsize *allocations,
+                       gsize *bytes)
+{
+  *allocations = __atomic_load_n (&n_allocations, __ATOMIC_RELAXED);
+  *bytes = __atomic_load_n (&n_allocated_bytes, __ATOMIC_RELAXED);
+}
+#else
+static void
+get_allocation_counts (gsize *allocations,
+                       gsize *bytes)
+{
+  *allocations = *bytes = 0;
+}
+#endif
+
+typedef struct {
+  StThemeContext *context;
+  ClutterActor *stage;
+  CoglFramebuffer *framebuffer;
+  char **classes;
+  int n_classes;
+} BenchData;
+
+typedef struct {
+  const char *name;
+  const char *unit;
+  void (*setup) (BenchData *data, int n_widgets, gpointer *state);
+  guint (*run) (BenchData *data, int n_widgets, gpointer state);
+  void (*teardown) (BenchData *data, gpointer state);
+} Benchmark;
+
+static int max_widgets = 100000;
+static gboolean use_software = FALSE;
+static char *only_benchmark = NULL;
+
+static GOptionEntry options[] = {
+  { "max-widgets", 'n', 0, G_OPTION_ARG_INT, &max_widgets,
+    "Largest number of widgets to benchmark with (default: 100000)", "N" },
+  { "software", 0, 0, G_OPTION_ARG_NONE, &use_software,
+    "Force the software GL rasterizer", NULL },
+  { "benchmark", 'b', 0, G_OPTION_ARG_STRING, &only_benchmark,
+    "Only run the benchmark with this name", "NAME" },
+  { NULL }
+};
+
+/* Collects the class names used in the stylesheet, so that the synthetic
+ * trees exercise the selectors that are actually in it.
+ */
+static char **
+collect_style_classes (const char *path,
+                       int        *n_classes)
+{
+  GHashTable *seen;
+  GPtrArray *classes;
+  GRegex *regex;
+  GMatchInfo *match_info;
+  char *contents;
+
+  classes = g_ptr_array_new ();
+
+  if (!g_file_get_contents (path, &contents, NULL, NULL))
+    contents = g_strdup ("");
+
+  seen = g_hash_table_new (g_str_hash, g_str_equal);
+  regex = g_regex_new ("\\.([A-Za-z_][A-Za-z0-9_-]*)", 0, 0, NULL);
+  g_regex_match (regex, contents, 0, &match_info);
+  while (g_match_info_matches (match_info))
+    {
+      char *name = g_match_info_fetch (match_info, 1);
+
+      /* Skip things like url('border-image.png') */
+      if (!g_hash_table_contains (seen, name) &&
+          !g_str_equal (name, "png") && !g_str_equal (name, "svg") &&
+          !g_str_equal (name, "css"))
+        {
+          g_hash_table_add (seen, name);
+          g_ptr_array_add (classes, name);
+        }
+      else
+        {
+          g_free (name);
+        }
+
+      g_match_info_next (match_info, NULL);
+    }
+
+  g_match_info_free (match_info);
+  g_regex_unref (regex);
+  g_hash_table_destroy (seen);
+  g_free (contents);
+
+  if (classes->len == 0)
+    g_ptr_array_add (classes, g_strdup ("bench"));
+
+  *n_classes = classes->len;
+  g_ptr_array_add (classes, NULL);
+
+  return (char **) g_ptr_array_free (classes, FALSE);
+}
+
+/* Builds @n_widgets theme nodes, as a forest of chains TREE_DEPTH
+ * deep so that descendant selectors have ancestors to walk. The
+ * returned array is %NULL-terminated.
+ */
+static StThemeNode **
+build_node_tree (BenchData *data,
+                 int        n_widgets)
+{
+  StThemeNode **nodes = g_new0 (StThemeNode *, n_widgets + 1);
+  StThemeNode *root = st_theme_context_get_root_node (data->context);
+  int i;
+
+  for (i = 0; i < n_widgets; i++)
+    {
+      StThemeNode *parent = (i % TREE_DEPTH) == 0 ? root : nodes[i - 1];
+      const char *element_class = data->classes[i % data->n_classes];
+      const char *pseudo_class = (i % 5) == 0 ? "hover" : NULL;
+      GType element_type;
+
+      switch (i % 3)
+        {
+        case 0:
+          element_type = ST_TYPE_BOX_LAYOUT;
+          break;
+        case 1:
+          element_type = CLUTTER_TYPE_TEXT;
+          break;
+        default:
+          element_type = ST_TYPE_WIDGET;
+          break;
+        }
+
+      nodes[i] = st_theme_node_new (data->context, parent, NULL,
+                                    element_type, NULL, element_class,
+                                    pseudo_class, NULL);
+    }
+
+  return nodes;
+}
+
+static void
+free_node_tree (StThemeNode **nodes)
+{
+  int n = 0;
+
+  while (nodes[n] != NULL)
+    n++;
+
+  /* Children first, they hold a reference on their parent */
+  while (n-- > 0)
+    g_object_unref (nodes[n]);
+  g_free (nodes);
+}
+
+static void
+setup_nothing (BenchData *data,
+               int        n_widgets,
+               gpointer  *state)
+{
+  *state = NULL;
+}
+
+static void
+teardown_nothing (BenchData *data,
+                  gpointer   state)
+{
+}
+
+/* Selector matching: creating a node and asking for any property
+ * matches all the stylesheet selectors against it. */
+static guint
+run_selector_matching (BenchData *data,
+                       int        n_widgets,
+                       gpointer   state)
+{
+  StThemeNode **nodes = build_node_tree (data, n_widgets);
+  ClutterColor color;
+  int i;
+
+  for (i = 0; i < n_widgets; i++)
+    st_theme_node_get_background_color (nodes[i], &color);
+
+  free_node_tree (nodes);
+
+  return n_widgets;
+}
+
+static void
+setup_matched_nodes (BenchData *data,
+                     int        n_widgets,
+                     gpointer  *state)
+{
+  StThemeNode **nodes = build_node_tree (data, n_widgets);
+  ClutterColor color;
+  int i;
+
+  for (i = 0; i < n_widgets; i++)
+    st_theme_node_get_background_color (nodes[i], &color);
+
+  *state = nodes;
+}
+
+static void
+teardown_matched_nodes (BenchData *data,
+                        gpointer   state)
+{
+  free_node_tree (state);
+}
+
+/* Property lookups on already matched nodes; these walk the matched
+ * declarations on every call. */
+static guint
+run_property_lookups (BenchData *data,
+                      int        n_widgets,
+                      gpointer   state)
+{
+  StThemeNode **nodes = state;
+  ClutterColor color;
+  gdouble value;
+  StShadow *shadow;
+  int i;
+
+  for (i = 0; i < n_widgets; i++)
+    {
+      st_theme_node_lookup_length (nodes[i], "spacing", TRUE, &value);
+      st_theme_node_lookup_double (nodes[i], "opacity", FALSE, &value);
+      st_theme_node_lookup_color (nodes[i], "color", TRUE, &color);
+      if (st_theme_node_lookup_shadow (nodes[i], "icon-shadow", TRUE, &shadow))
+        st_shadow_unref (shadow);
+    }
+
+  return 4 * n_widgets;
+}
+
+/* Prerendering: each node gets a fresh paint state, so the background,
+ * border and box-shadow are rendered with cairo and uploaded again. */
+static void
+setup_paint_nodes (BenchData *data,
+                   int        n_widgets,
+                   gpointer  *state)
+{
+  StThemeNode **nodes = g_new0 (StThemeNode *, n_widgets + 1);
+  StThemeNode *root = st_theme_context_get_root_node (data->context);
+  int i;
+
+  for (i = 0; i < n_widgets; i++)
+    {
+      char *style = g_strdup_printf ("background-color: #%06x;"
+                                     "border: %dpx solid black;"
+                                     "border-radius: %dpx;"
+                                     "box-shadow: 0 2px %dpx rgba(0,0,0,0.5);",
+                                     (i * 2654435761u) & 0xffffff,
+                                     1 + i % 3, 2 + i % 12, 2 + i % 8);
+      nodes[i] = st_theme_node_new (data->context, root, NULL,
+                                    ST_TYPE_WIDGET, NULL, NULL, NULL,
+                                    style);
+      g_free (style);
+    }
+
+  *state = nodes;
+}
+
+static guint
+run_paint_prerender (BenchData *data,
+                     int        n_widgets,
+                     gpointer   state)
+{
+  StThemeNode **nodes = state;
+  ClutterActorBox box = { 0, 0, PAINT_SIZE, PAINT_SIZE };
+  int i;
+
+  for (i = 0; i < n_widgets; i++)
+    {
+      StThemeNodePaintState paint_state;
+
+      st_theme_node_paint_state_init (&paint_state);
+      st_theme_node_paint (nodes[i], &paint_state, data->framebuffer, &box, 255);
+      st_theme_node_paint_state_free (&paint_state);
+    }
+
+  cogl_framebuffer_finish (data->framebuffer);
+
+  return n_widgets;
+}
+
+/* Shadow blur: the gaussian blur shared by box-shadow, text-shadow and
+ * icon-shadow, run on the CPU through the cairo path. */
+static void
+setup_shadow (BenchData *data,
+              int        n_widgets,
+              gpointer  *state)
+{
+  cairo_surface_t *surface;
+  cairo_t *cr;
+
+  surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, PAINT_SIZE, PAINT_SIZE);
+  cr = cairo_create (surface);
+  cairo_set_source_rgba (cr, 0, 0, 0, 1);
+  cairo_arc (cr, PAINT_SIZE / 2, PAINT_SIZE / 2, PAINT_SIZE / 3, 0, 2 * M_PI);
+  cairo_fill (cr);
+  cairo_destroy (cr);
+
+  *state = cairo_pattern_create_for_surface (surface);
+  cairo_surface_destroy (surface);
+}
+
+static guint
+run_shadow_blur (BenchData *data,
+                 int        n_widgets,
+                 gpointer   state)
+{
+  ClutterColor black = { 0, 0, 0, 0xff };
+  int i;
+
+  for (i = 0; i < n_widgets; i++)
+    {
+      StShadow *shadow = st_shadow_new (&black, 0, 2, 2 + i % 10, 0, FALSE);
+      cairo_pattern_t *pattern = _st_create_shadow_cairo_pattern (shadow, state);
+
+      cairo_pattern_destroy (pattern);
+      st_shadow_unref (shadow);
+    }
+
+  return n_widgets;
+}
+
+static void
+teardown_shadow (BenchData *data,
+                 gpointer   state)
+{
+  cairo_pattern_destroy (state);
+}
+
+/* StBoxLayout allocation: a box with @n_widgets children of varying
+ * natural sizes, relaid out from scratch on every run. */
+static void
+setup_box_layout (BenchData *data,
+                  int        n_widgets,
+                  gpointer  *state)
+{
+  ClutterActor *box = st_box_layout_new ();
+  int i;
+
+  st_box_layout_set_vertical (ST_BOX_LAYOUT (box), TRUE);
+  st_widget_set_style (ST_WIDGET (box), "spacing: 2px; padding: 4px;");
+
+  for (i = 0; i < n_widgets; i++)
+    {
+      ClutterActor *child = g_object_new (ST_TYPE_WIDGET, NULL);
+
+      clutter_actor_set_size (child, 10 + i % 50, 10 + i % 7);
+      clutter_actor_set_x_expand (child, (i % 3) == 0);
+      clutter_actor_add_child (box, child);
+    }
+
+  clutter_actor_add_child (data->stage, box);
+  *state = box;
+}
+
+static guint
+run_box_layout (BenchData *data,
+                int        n_widgets,
+                gpointer   state)
+{
+  ClutterActor *box = state;
+  ClutterActorBox allocation = { 0, 0, 0, 0 };
+  gfloat width, height;
+
+  clutter_actor_queue_relayout (box);
+  clutter_actor_get_preferred_size (box, NULL, NULL, &width, &height);
+  allocation.x2 = width;
+  allocation.y2 = height;
+  clutter_actor_allocate (box, &allocation, CLUTTER_ALLOCATION_NONE);
+
+  return n_widgets;
+}
+
+static void
+teardown_box_layout (BenchData *data,
+                     gpointer   state)
+{
+  clutter_actor_destroy (state);
+}
+
+static const Benchmark benchmarks[] = {
+  { "selector-matching", "nodes", setup_nothing, run_selector_matching, teardown_nothing },
+  { "property-lookups", "lookups", setup_matched_nodes, run_property_lookups, teardown_matched_nodes },
+  { "paint-prerender", "paints", setup_paint_nodes, run_paint_prerender, teardown_matched_nodes },
+  { "shadow-blur", "blurs", setup_shadow, run_shadow_blur, teardown_shadow },
+  { "box-layout-allocation", "children", setup_box_layout, run_box_layout, teardown_box_layout },
+};
+
+static void
+run_benchmark (BenchData       *data,
+               const Benchmark *benchmark,
+               int              n_widgets)
+{
+  gpointer state;
+  gint64 start, elapsed;
+  gsize allocs_before, bytes_before, allocs_after, bytes_after;
+  guint64 n_ops = 0;
+  int iterations = 0;
+
+  benchmark->setup (data, n_widgets, &state);
+
+  /* One run to warm up caches */
+  benchmark->run (data, n_widgets, state);
+
+  get_allocation_counts (&allocs_before, &bytes_before);
+  start = g_get_monotonic_time ();
+  do
+    {
+      n_ops += benchmark->run (data, n_widgets, state);
+      iterations++;
+      elapsed = g_get_monotonic_time () - start;
+    }
+  while (elapsed < MIN_TIME_US);
+  get_allocation_counts (&allocs_after, &bytes_after);
+
+  benchmark->teardown (data, state);
+
+  g_print ("%-22s %8d %6d %12.0f %s/s %10.1f us/iter",
+           benchmark->name, n_widgets, iterations,
+           n_ops / (elapsed / (double) G_USEC_PER_SEC), benchmark->unit,
+           elapsed / (double) iterations);
+#ifdef HAVE_ALLOCATION_COUNTS
+  g_print (" %10.2f allocs/op %10.1f B/op",
+           (allocs_after - allocs_before) / (double) n_ops,
+           (bytes_after - bytes_before) / (double) n_ops);
+#endif
+  g_print ("\n");
+}
+
+int
+main (int argc, char **argv)
+{
+  GOptionContext *option_context;
+  GError *error = NULL;
+  BenchData data = { 0 };
+  StTheme *theme;
+  GFile *file;
+  CoglContext *cogl_context;
+  CoglTexture2D *texture;
+  const char *stylesheet;
+  guint i;
+  int n;
+
+  option_context = g_option_context_new ("[STYLESHEET] - benchmark St");
+  g_option_context_add_main_entries (option_context, options, NULL);
+  if (!g_option_context_parse (option_context, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return 1;
+    }
+  g_option_context_free (option_context);
+
+  if (use_software)
+    g_setenv ("LIBGL_ALWAYS_SOFTWARE", "1", TRUE);
+
+  if (clutter_init (&argc, &argv) != CLUTTER_INIT_SUCCESS)
+    return 1;
+
+  stylesheet = argc > 1 ? argv[1] : "tests/testcommon/test.css";
+
+  file = g_file_new_for_path (stylesheet);
+  theme = st_theme_new (file, NULL, NULL);
+  g_object_unref (file);
+
+  data.stage = clutter_stage_new ();
+  data.context = st_theme_context_get_for_stage (CLUTTER_STAGE (data.stage));
+  st_theme_context_set_theme (data.context, theme);
+  data.classes = collect_style_classes (stylesheet, &data.n_classes);
+
+  cogl_context = clutter_backend_get_cogl_context (clutter_get_default_backend ());
+  texture = cogl_texture_2d_new_with_size (cogl_context, PAINT_SIZE * 2, PAINT_SIZE * 2);
+  data.framebuffer = COGL_FRAMEBUFFER (cogl_offscreen_new_with_texture (COGL_TEXTURE (texture)));
+
+  g_print ("%-22s %8s %6s %19s %17s\n",
+           "# benchmark", "widgets", "iters", "throughput", "time");
+
+  for (i = 0; i < G_N_ELEMENTS (benchmarks); i++)
+    {
+      if (only_benchmark && strcmp (only_benchmark, benchmarks[i].name) != 0)
+        continue;
+
+      for (n = 10; n <= max_widgets; n *= 10)
+        run_benchmark (&data, &benchmarks[i], n);
+    }
+
+  cogl_object_unref (data.framebuffer);
+  cogl_object_unref (texture);
+  g_strfreev (data.classes);
+  clutter_actor_destroy (data.stage);
+  g_object_unref (theme);
+
+  return 0;
+}
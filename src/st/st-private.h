@@ -45,6 +45,14 @@ G_END_DECLS
 
 ClutterActor *_st_widget_get_dnd_clone (StWidget *widget);
 
+#define ST_N_ALLOCATION_COUNTERS (ST_ALLOCATION_COUNTER_TEXTURE_CACHE + 1)
+
+void _st_allocation_counter_add (StAllocationCounter counter,
+                                 int                 n_objects,
+                                 int                 n_bytes);
+void _st_texture_cache_get_usage (int *n_entries,
+                                  int *n_bytes);
+
 void _st_actor_get_preferred_width  (ClutterActor *actor,
                                      gfloat        for_height,
                                      gboolean      y_fill,
@@ -1420,3 +1420,39 @@ st_texture_cache_get_default (void)
     instance = g_object_new (ST_TYPE_TEXTURE_CACHE, NULL);
   return instance;
 }
+
+void
+_st_texture_cache_get_usage (int *n_entries,
+                             int *n_bytes)
+{
+  GHashTableIter iter;
+  gpointer key, value;
+
+  *n_entries = 0;
+  *n_bytes = 0;
+
+  /* Don't create the cache just to find out it's empty */
+  if (instance == NULL || instance->priv->keyed_cache == NULL)
+    return;
+
+  g_hash_table_iter_init (&iter, instance->priv->keyed_cache);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      (*n_entries)++;
+
+      if (g_str_has_prefix (key, CACHE_PREFIX_FILE_FOR_CAIRO))
+        {
+          cairo_surface_t *surface = value;
+
+          *n_bytes += cairo_image_surface_get_stride (surface) *
+                      cairo_image_surface_get_height (surface);
+        }
+      else
+        {
+          CoglTexture *texture = value;
+
+          *n_bytes += cogl_texture_get_width (texture) *
+                      cogl_texture_get_height (texture) * 4;
+        }
+    }
+}
@@ -2702,12 +2702,23 @@ st_theme_node_paint_state_node_free_internal (StThemeNodePaintState *state,
 static void
 st_theme_node_paint_state_node_freed (StThemeNodePaintState *state)
 {
+  /* Only paint states holding a node are counted as alive */
+  _st_allocation_counter_add (ST_ALLOCATION_COUNTER_PAINT_STATES,
+                              -1, - (int) sizeof (StThemeNodePaintState));
+
   st_theme_node_paint_state_node_free_internal (state, FALSE);
 }
 
 void
 st_theme_node_paint_state_set_node (StThemeNodePaintState *state, StThemeNode *node)
 {
+  if (state->node && !node)
+    _st_allocation_counter_add (ST_ALLOCATION_COUNTER_PAINT_STATES,
+                                -1, - (int) sizeof (StThemeNodePaintState));
+  else if (!state->node && node)
+    _st_allocation_counter_add (ST_ALLOCATION_COUNTER_PAINT_STATES,
+                                1, sizeof (StThemeNodePaintState));
+
   if (state->node)
     g_object_weak_unref (G_OBJECT (state->node),
                          (GWeakNotify) st_theme_node_paint_state_node_freed,
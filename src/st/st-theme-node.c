@@ -26,6 +26,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "st-private.h"
 #include "st-theme-private.h"
 #include "st-theme-context.h"
 #include "st-theme-node-private.h"
@@ -57,6 +58,9 @@ st_theme_node_init (StThemeNode *node)
   node->color_pipeline = COGL_INVALID_HANDLE;
 
   st_theme_node_paint_state_init (&node->cached_state);
+
+  _st_allocation_counter_add (ST_ALLOCATION_COUNTER_THEME_NODES,
+                              1, sizeof (StThemeNode));
 }
 
 static void
@@ -73,6 +77,8 @@ maybe_free_properties (StThemeNode *node)
 {
   if (node->properties)
     {
+      _st_allocation_counter_add (ST_ALLOCATION_COUNTER_THEME_NODES,
+                                  0, - (int) (node->n_properties * sizeof (CRDeclaration *)));
       g_free (node->properties);
       node->properties = NULL;
       node->n_properties = 0;
@@ -142,6 +148,9 @@ st_theme_node_finalize (GObject *object)
 
   maybe_free_properties (node);
 
+  _st_allocation_counter_add (ST_ALLOCATION_COUNTER_THEME_NODES,
+                              -1, - (int) sizeof (StThemeNode));
+
   if (node->font_desc)
     {
       pango_font_description_free (node->font_desc);
@@ -500,6 +509,9 @@ ensure_properties (StThemeNode *node)
         {
           node->n_properties = properties->len;
           node->properties = (CRDeclaration **)g_ptr_array_free (properties, FALSE);
+
+          _st_allocation_counter_add (ST_ALLOCATION_COUNTER_THEME_NODES,
+                                      0, node->n_properties * sizeof (CRDeclaration *));
         }
     }
 }
@@ -47,6 +47,21 @@ typedef enum {
   ST_BACKGROUND_SIZE_FIXED
 } StBackgroundSize;
 
+/**
+ * StAllocationCounter:
+ * @ST_ALLOCATION_COUNTER_THEME_NODES: #StThemeNode objects
+ * @ST_ALLOCATION_COUNTER_PAINT_STATES: paint states holding a theme node
+ * @ST_ALLOCATION_COUNTER_TEXTURE_CACHE: entries of the default #StTextureCache
+ *
+ * The subsystems for which st_get_allocation_counter() keeps track of
+ * live objects.
+ */
+typedef enum {
+  ST_ALLOCATION_COUNTER_THEME_NODES,
+  ST_ALLOCATION_COUNTER_PAINT_STATES,
+  ST_ALLOCATION_COUNTER_TEXTURE_CACHE
+} StAllocationCounter;
+
 G_END_DECLS
 
 #endif /* __ST_TYPES_H__ */
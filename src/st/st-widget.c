@@ -129,6 +129,10 @@ static guint signals[LAST_SIGNAL] = { 0, };
 
 gfloat st_slow_down_factor = 1.0;
 
+/* Only updated from the main thread */
+static int allocation_objects[ST_N_ALLOCATION_COUNTERS];
+static int allocation_bytes[ST_N_ALLOCATION_COUNTERS];
+
 G_DEFINE_TYPE_WITH_PRIVATE (StWidget, st_widget, CLUTTER_TYPE_ACTOR);
 #define ST_WIDGET_PRIVATE(w) ((StWidgetPrivate *)st_widget_get_instance_private (w))
 
@@ -2283,6 +2287,41 @@ st_get_slow_down_factor (void)
   return st_slow_down_factor;
 }
 
+void
+_st_allocation_counter_add (StAllocationCounter counter,
+                            int                 n_objects,
+                            int                 n_bytes)
+{
+  allocation_objects[counter] += n_objects;
+  allocation_bytes[counter] += n_bytes;
+}
+
+/**
+ * st_get_allocation_counter:
+ * @counter: the subsystem to query
+ * @n_objects: (out): number of live objects
+ * @n_bytes: (out): approximate memory used by those objects, in bytes
+ *
+ * Gets how much of a subsystem is currently alive; meant for tracking
+ * down where memory goes when the shell's footprint grows.
+ */
+void
+st_get_allocation_counter (StAllocationCounter  counter,
+                           int                 *n_objects,
+                           int                 *n_bytes)
+{
+  g_return_if_fail (counter < ST_N_ALLOCATION_COUNTERS);
+
+  if (counter == ST_ALLOCATION_COUNTER_TEXTURE_CACHE)
+    {
+      _st_texture_cache_get_usage (n_objects, n_bytes);
+      return;
+    }
+
+  *n_objects = allocation_objects[counter];
+  *n_bytes = allocation_bytes[counter];
+}
+
 
 /**
  * st_widget_get_label_actor:
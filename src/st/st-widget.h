@@ -132,6 +132,9 @@ void                  st_widget_paint_background          (StWidget        *widg
 char  *st_describe_actor       (ClutterActor *actor);
 void   st_set_slow_down_factor (gfloat factor);
 gfloat st_get_slow_down_factor (void);
+void   st_get_allocation_counter (StAllocationCounter  counter,
+                                  int                 *n_objects,
+                                  int                 *n_bytes);
 
 /* accessibility methods */
 void                  st_widget_set_accessible_role      (StWidget    *widget,
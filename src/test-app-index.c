@@ -0,0 +1,362 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * test-app-index.c: checks that the app index follows installations
+ * and removals of .desktop files, and reports how long it takes to
+ * update, search and reload it for a directory of 1000 of them
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+
+#include <glib/gstdio.h>
+
+#include "shell-app-index.h"
+
+#define N_APPS 1000
+#define N_INSTALLED 50
+
+/* How long we give GIO to notice changes to the directory */
+#define GIO_TIMEOUT (10 * G_USEC_PER_SEC)
+
+static char *apps_dir;
+
+static void
+write_app (const char *name,
+           const char *display_name,
+           const char *extra)
+{
+  g_autofree char *filename = g_build_filename (apps_dir, name, NULL);
+  g_autofree char *dirname = g_path_get_dirname (filename);
+  g_autofree char *contents = NULL;
+
+  contents = g_strdup_printf ("[Desktop Entry]\n"
+                              "Type=Application\n"
+                              "Name=%s\n"
+                              "Exec=/bin/true\n"
+                              "%s",
+                              display_name, extra ? extra : "");
+
+  g_mkdir_with_parents (dirname, 0755);
+  if (!g_file_set_contents (filename, contents, -1, NULL))
+    g_error ("Can't write %s", filename);
+}
+
+/* Every tenth app has an alias and every seventh a StartupWMClass;
+ * some live in a subdirectory, and the first one is hidden.
+ */
+static void
+write_apps (void)
+{
+  int i;
+
+  for (i = 0; i < N_APPS; i++)
+    {
+      g_autofree char *name = NULL;
+      g_autofree char *display_name = g_strdup_printf ("App %d", i);
+      GString *extra = g_string_new (NULL);
+
+      if (i % 10 == 0)
+        g_string_append_printf (extra, "X-Endless-Alias=old-app-%d\n", i);
+      if (i % 7 == 0)
+        g_string_append_printf (extra, "StartupWMClass=Class%d\n", i / 7);
+      if (i == 0)
+        g_string_append (extra, "Hidden=true\n");
+
+      if (i % 5 == 0)
+        name = g_strdup_printf ("vendor/app-%d.desktop", i);
+      else
+        name = g_strdup_printf ("app-%d.desktop", i);
+
+      write_app (name, display_name, extra->str);
+      g_string_free (extra, TRUE);
+    }
+}
+
+/* Waits until GIO sees @id, or doesn't if @present is %FALSE; the
+ * index loads apps through GIO, which updates its view of the
+ * application directories from file monitors.
+ */
+static void
+wait_for_gio (const char *id,
+              gboolean    present)
+{
+  gint64 end = g_get_monotonic_time () + GIO_TIMEOUT;
+
+  while (g_get_monotonic_time () < end)
+    {
+      GDesktopAppInfo *info = g_desktop_app_info_new (id);
+      gboolean found = info != NULL;
+
+      g_clear_object (&info);
+      if (found == present)
+        return;
+
+      g_usleep (G_USEC_PER_SEC / 100);
+    }
+
+  g_error ("GIO didn't notice that %s was %s", id, present ? "added" : "removed");
+}
+
+static void
+remove_tree (const char *path)
+{
+  GDir *dir = g_dir_open (path, 0, NULL);
+  const char *name;
+
+  if (dir != NULL)
+    {
+      while ((name = g_dir_read_name (dir)) != NULL)
+        {
+          g_autofree char *child = g_build_filename (path, name, NULL);
+
+          if (g_file_test (child, G_FILE_TEST_IS_DIR))
+            remove_tree (child);
+          else
+            g_unlink (child);
+        }
+      g_dir_close (dir);
+    }
+
+  g_rmdir (path);
+}
+
+static GHashTable *
+timed_update (ShellAppIndex *index,
+              const char    *what)
+{
+  GHashTable *changes;
+  gint64 start;
+
+  start = g_get_monotonic_time ();
+  changes = shell_app_index_update (index);
+  g_print ("%s: %u changes in %" G_GINT64_FORMAT " us\n",
+           what, g_hash_table_size (changes), g_get_monotonic_time () - start);
+
+  return changes;
+}
+
+static void
+check_change (GHashTable *changes,
+              const char *id,
+              gboolean    present)
+{
+  gpointer info;
+
+  if (!g_hash_table_lookup_extended (changes, id, NULL, &info))
+    g_error ("%s is not among the changes", id);
+  if ((info != NULL) != present)
+    g_error ("%s should have been %s", id, present ? "added" : "removed");
+}
+
+static void
+check_id (const char *what,
+          const char *id,
+          const char *expected)
+{
+  if (g_strcmp0 (id, expected) != 0)
+    g_error ("%s: expected %s, got %s", what, expected ? expected : "(null)", id ? id : "(null)");
+}
+
+static gboolean
+search_finds (ShellAppIndex *index,
+              const char    *query,
+              const char    *id)
+{
+  char ***results, ***group;
+  gboolean found = FALSE;
+
+  results = shell_app_index_search (index, query);
+  for (group = results; *group != NULL; group++)
+    {
+      if (g_strv_contains ((const char * const *) *group, id))
+        found = TRUE;
+      g_strfreev (*group);
+    }
+  g_free (results);
+
+  return found;
+}
+
+static void
+check_search (ShellAppIndex *index,
+              const char    *query,
+              const char    *id,
+              gboolean       present)
+{
+  if (search_finds (index, query, id) != present)
+    g_error ("searching for '%s' should%s find %s", query, present ? "" : "n't", id);
+}
+
+static void
+time_search (ShellAppIndex *index,
+             const char    *query)
+{
+  char ***results, ***group;
+  guint n_results = 0;
+  gint64 start;
+
+  start = g_get_monotonic_time ();
+  results = g_desktop_app_info_search (query);
+  for (group = results; *group != NULL; group++)
+    {
+      n_results += g_strv_length (*group);
+      g_strfreev (*group);
+    }
+  g_free (results);
+  g_print ("g_desktop_app_info_search '%s': %u results in %" G_GINT64_FORMAT " us\n",
+           query, n_results, g_get_monotonic_time () - start);
+
+  n_results = 0;
+  start = g_get_monotonic_time ();
+  results = shell_app_index_search (index, query);
+  for (group = results; *group != NULL; group++)
+    {
+      n_results += g_strv_length (*group);
+      g_strfreev (*group);
+    }
+  g_free (results);
+  g_print ("shell_app_index_search '%s': %u results in %" G_GINT64_FORMAT " us\n",
+           query, n_results, g_get_monotonic_time () - start);
+}
+
+int
+main (int argc, char **argv)
+{
+  g_autofree char *tmpdir = NULL;
+  g_autofree char *home_dir = NULL;
+  g_autofree char *system_dir = NULL;
+  g_autofree char *removed = NULL;
+  g_autofree char *snapshot = NULL;
+  ShellAppIndex *index, *loaded;
+  GHashTable *changes;
+  GDesktopAppInfo *info;
+  GList *all;
+  gint64 start;
+  int i;
+
+  tmpdir = g_dir_make_tmp ("test-app-index-XXXXXX", NULL);
+  if (tmpdir == NULL)
+    g_error ("Can't create a temporary directory");
+
+  /* Before anything asks GLib for these */
+  home_dir = g_build_filename (tmpdir, "home", NULL);
+  system_dir = g_build_filename (tmpdir, "system", NULL);
+  g_setenv ("XDG_DATA_HOME", home_dir, TRUE);
+  g_setenv ("XDG_DATA_DIRS", system_dir, TRUE);
+
+  apps_dir = g_build_filename (system_dir, "applications", NULL);
+  write_apps ();
+
+  /* What rescanning cost before, per pass over all apps */
+  start = g_get_monotonic_time ();
+  all = g_app_info_get_all ();
+  g_print ("g_app_info_get_all: %u apps in %" G_GINT64_FORMAT " us\n",
+           g_list_length (all), g_get_monotonic_time () - start);
+  g_list_free_full (all, g_object_unref);
+
+  index = shell_app_index_new ();
+
+  changes = timed_update (index, "initial update");
+  if (g_hash_table_size (changes) != N_APPS)
+    g_error ("expected %d changes", N_APPS);
+  check_change (changes, "app-0.desktop", FALSE);
+  check_change (changes, "vendor-app-5.desktop", TRUE);
+  g_hash_table_destroy (changes);
+
+  if (shell_app_index_get_n_apps (index) != N_APPS - 1)
+    g_error ("expected %d apps, got %u", N_APPS - 1, shell_app_index_get_n_apps (index));
+
+  check_id ("alias", shell_app_index_lookup_alias (index, "old-app-20.desktop"),
+            "vendor-app-20.desktop");
+  check_id ("hidden alias", shell_app_index_lookup_alias (index, "old-app-0.desktop"), NULL);
+  check_id ("wm class", shell_app_index_lookup_startup_wm_class (index, "Class3"),
+            "app-21.desktop");
+
+  time_search (index, "app 21");
+  time_search (index, "app 213");
+  check_search (index, "APP 21", "app-21.desktop", TRUE);
+  check_search (index, "app 21", "app-212.desktop", TRUE);
+  check_search (index, "app 213", "app-212.desktop", FALSE);
+  check_search (index, "app 21", "app-212.desktop", TRUE);
+  check_search (index, "true", "app-1.desktop", TRUE);
+  check_search (index, "old 20", "vendor-app-20.desktop", TRUE);
+  check_search (index, "app 0", "app-0.desktop", FALSE);
+
+  changes = timed_update (index, "update without changes");
+  if (g_hash_table_size (changes) != 0)
+    g_error ("expected no changes");
+  g_hash_table_destroy (changes);
+
+  /* What the next session starts from */
+  snapshot = g_build_filename (tmpdir, "app-index", NULL);
+  start = g_get_monotonic_time ();
+  if (!shell_app_index_save (index, snapshot, NULL))
+    g_error ("Can't save the snapshot");
+  g_print ("save snapshot: %" G_GINT64_FORMAT " us\n", g_get_monotonic_time () - start);
+
+  loaded = shell_app_index_new ();
+  start = g_get_monotonic_time ();
+  if (!shell_app_index_load (loaded, snapshot))
+    g_error ("Can't load the snapshot");
+  g_print ("load snapshot: %" G_GINT64_FORMAT " us\n", g_get_monotonic_time () - start);
+
+  changes = timed_update (loaded, "update after loading the snapshot");
+  if (g_hash_table_size (changes) != 0)
+    g_error ("expected no changes after loading the snapshot");
+  g_hash_table_destroy (changes);
+
+  if (shell_app_index_get_n_apps (loaded) != N_APPS - 1)
+    g_error ("expected %d apps in the snapshot", N_APPS - 1);
+  check_id ("loaded alias", shell_app_index_lookup_alias (loaded, "old-app-20.desktop"),
+            "vendor-app-20.desktop");
+  check_id ("loaded wm class", shell_app_index_lookup_startup_wm_class (loaded, "Class3"),
+            "app-21.desktop");
+  check_search (loaded, "app 21", "app-212.desktop", TRUE);
+  shell_app_index_free (loaded);
+
+  /* A bulk installation, along with an update and a removal */
+  for (i = 0; i < N_INSTALLED; i++)
+    {
+      g_autofree char *name = g_strdup_printf ("new-app-%d.desktop", i);
+
+      write_app (name, name, i == 0 ? "StartupWMClass=Class3\n" : NULL);
+    }
+  write_app ("cafe.desktop", "Café Crème", "Keywords=Espresso;\n");
+  write_app ("app-21.desktop", "App 21, updated", NULL);
+  removed = g_build_filename (apps_dir, "vendor", "app-20.desktop", NULL);
+  g_unlink (removed);
+
+  wait_for_gio ("new-app-49.desktop", TRUE);
+  wait_for_gio ("cafe.desktop", TRUE);
+  wait_for_gio ("vendor-app-20.desktop", FALSE);
+
+  changes = timed_update (index, "update after installing 50 apps");
+  if (g_hash_table_size (changes) != N_INSTALLED + 3)
+    g_error ("expected %d changes", N_INSTALLED + 3);
+  check_change (changes, "new-app-0.desktop", TRUE);
+  check_change (changes, "vendor-app-20.desktop", FALSE);
+
+  info = g_hash_table_lookup (changes, "app-21.desktop");
+  if (info == NULL || g_strcmp0 (g_app_info_get_name (G_APP_INFO (info)), "App 21, updated") != 0)
+    g_error ("app-21.desktop wasn't updated");
+  g_hash_table_destroy (changes);
+
+  if (shell_app_index_get_n_apps (index) != N_APPS - 1 + N_INSTALLED)
+    g_error ("expected %d apps", N_APPS - 1 + N_INSTALLED);
+
+  check_id ("removed alias", shell_app_index_lookup_alias (index, "old-app-20.desktop"), NULL);
+  check_id ("taken over wm class", shell_app_index_lookup_startup_wm_class (index, "Class3"),
+            "new-app-0.desktop");
+
+  check_search (index, "cafe", "cafe.desktop", TRUE);
+  check_search (index, "CAFÉ crem", "cafe.desktop", TRUE);
+  check_search (index, "espr", "cafe.desktop", TRUE);
+  check_search (index, "app 2", "vendor-app-20.desktop", FALSE);
+  check_search (index, "app 21 upd", "app-21.desktop", TRUE);
+
+  shell_app_index_free (index);
+  remove_tree (tmpdir);
+
+  return EXIT_SUCCESS;
+}
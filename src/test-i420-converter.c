@@ -0,0 +1,186 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * test-i420-converter.c: compares conversion of recorder frames to
+ * I420 on the GPU with what videoconvert does on the CPU
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+
+#include <gst/video/video.h>
+
+#include "shell-i420-converter.h"
+
+#define WIDTH 64
+#define HEIGHT 48
+
+/* Largest difference allowed for a sample; the CPU and GPU round at
+ * different points, and chroma is filtered a little differently.
+ */
+#define TOLERANCE 2
+
+/* Smooth gradients in all channels; recordings are mostly flat areas
+ * and gradients, and sharp edges would mostly test the filtering.
+ */
+static void
+fill_frame (guint8 *data)
+{
+  int x, y;
+
+  for (y = 0; y < HEIGHT; y++)
+    for (x = 0; x < WIDTH; x++)
+      {
+        guint32 *pixel = (guint32 *) (data + y * WIDTH * 4 + x * 4);
+        guint r = x * 255 / (WIDTH - 1);
+        guint g = y * 255 / (HEIGHT - 1);
+        guint b = (x + y) * 255 / (WIDTH + HEIGHT - 2);
+
+        /* Native-endian xRGB, as the recorder captures */
+        *pixel = 0xff000000 | (r << 16) | (g << 8) | b;
+      }
+}
+
+static gboolean
+convert_on_gpu (const guint8 *frame,
+                guint8       *out)
+{
+  CoglContext *context;
+  CoglTexture *texture;
+  CoglFramebuffer *framebuffer;
+  ShellI420Converter *converter;
+  CoglError *error = NULL;
+
+  context = clutter_backend_get_cogl_context (clutter_get_default_backend ());
+
+  converter = shell_i420_converter_new (context, WIDTH, HEIGHT);
+  if (converter == NULL)
+    return FALSE;
+
+  texture = COGL_TEXTURE (cogl_texture_2d_new_from_data (context, WIDTH, HEIGHT,
+                                                         CLUTTER_CAIRO_FORMAT_ARGB32,
+                                                         WIDTH * 4, frame,
+                                                         &error));
+  if (texture == NULL)
+    {
+      g_printerr ("Can't create texture: %s\n", error->message);
+      cogl_error_free (error);
+      exit (1);
+    }
+
+  framebuffer = shell_i420_converter_convert (converter, texture);
+  cogl_framebuffer_read_pixels (framebuffer, 0, 0, WIDTH / 4, HEIGHT * 3 / 2,
+                                COGL_PIXEL_FORMAT_RGBA_8888, out);
+
+  cogl_object_unref (texture);
+  shell_i420_converter_free (converter);
+
+  return TRUE;
+}
+
+/* The same conversion videoconvert does for a recording without GPU
+ * conversion, with the caps the recorder uses when converting itself.
+ */
+static void
+convert_on_cpu (guint8 *frame,
+                guint8 *out)
+{
+  GstVideoInfo in_info, out_info;
+  GstVideoFrame in_frame, out_frame;
+  GstVideoConverter *converter;
+  GstBuffer *in_buffer, *out_buffer;
+
+  gst_video_info_set_format (&in_info,
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+                             GST_VIDEO_FORMAT_BGRx,
+#else
+                             GST_VIDEO_FORMAT_xRGB,
+#endif
+                             WIDTH, HEIGHT);
+  gst_video_info_set_format (&out_info, GST_VIDEO_FORMAT_I420, WIDTH, HEIGHT);
+  gst_video_colorimetry_from_string (&out_info.colorimetry, "bt709");
+  out_info.chroma_site = GST_VIDEO_CHROMA_SITE_JPEG;
+
+  g_assert_cmpuint (GST_VIDEO_INFO_SIZE (&out_info), ==, WIDTH * HEIGHT * 3 / 2);
+
+  in_buffer = gst_buffer_new_wrapped_full (0, frame, WIDTH * HEIGHT * 4,
+                                           0, WIDTH * HEIGHT * 4, NULL, NULL);
+  out_buffer = gst_buffer_new_wrapped_full (0, out, WIDTH * HEIGHT * 3 / 2,
+                                            0, WIDTH * HEIGHT * 3 / 2, NULL, NULL);
+
+  converter = gst_video_converter_new (&in_info, &out_info,
+                                       gst_structure_new ("GstVideoConverter",
+                                                          GST_VIDEO_CONVERTER_OPT_DITHER_METHOD,
+                                                          GST_TYPE_VIDEO_DITHER_METHOD,
+                                                          GST_VIDEO_DITHER_NONE,
+                                                          NULL));
+
+  gst_video_frame_map (&in_frame, &in_info, in_buffer, GST_MAP_READ);
+  gst_video_frame_map (&out_frame, &out_info, out_buffer, GST_MAP_WRITE);
+  gst_video_converter_frame (converter, &in_frame, &out_frame);
+  gst_video_frame_unmap (&out_frame);
+  gst_video_frame_unmap (&in_frame);
+
+  gst_video_converter_free (converter);
+  gst_buffer_unref (out_buffer);
+  gst_buffer_unref (in_buffer);
+}
+
+static gboolean
+compare_plane (const char   *name,
+               const guint8 *gpu,
+               const guint8 *cpu,
+               gsize         size)
+{
+  int max_difference = 0;
+  gsize i;
+
+  for (i = 0; i < size; i++)
+    max_difference = MAX (max_difference, ABS ((int) gpu[i] - (int) cpu[i]));
+
+  g_print ("%s: largest difference %d\n", name, max_difference);
+
+  return max_difference <= TOLERANCE;
+}
+
+int
+main (int argc, char **argv)
+{
+  guint8 *frame, *gpu, *cpu;
+  gsize luma_size, chroma_size;
+  gboolean success;
+
+  /* Skip if there is no display to render with */
+  if (clutter_init (&argc, &argv) != CLUTTER_INIT_SUCCESS)
+    return 77;
+
+  gst_init (&argc, &argv);
+
+  frame = g_malloc (WIDTH * HEIGHT * 4);
+  gpu = g_malloc (WIDTH * HEIGHT * 3 / 2);
+  cpu = g_malloc (WIDTH * HEIGHT * 3 / 2);
+
+  fill_frame (frame);
+
+  if (!convert_on_gpu (frame, gpu))
+    {
+      g_print ("GPU conversion not supported, skipping\n");
+      return 77;
+    }
+
+  convert_on_cpu (frame, cpu);
+
+  luma_size = WIDTH * HEIGHT;
+  chroma_size = luma_size / 4;
+
+  success = compare_plane ("Y", gpu, cpu, luma_size);
+  success &= compare_plane ("U", gpu + luma_size, cpu + luma_size, chroma_size);
+  success &= compare_plane ("V", gpu + luma_size + chroma_size,
+                            cpu + luma_size + chroma_size, chroma_size);
+
+  g_free (frame);
+  g_free (gpu);
+  g_free (cpu);
+
+  return success ? 0 : 1;
+}
@@ -0,0 +1,134 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/*
+ * test-usage-log.c: checks that replaying an app usage log cut short
+ * at any byte, as a crash while appending would, keeps exactly the
+ * complete records, and that records appended after the cut replay
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "shell-usage-log.h"
+
+#define RECORD_TYPE "(ssdx)"
+#define GENERATION 42
+
+#define N_RECORDS 20
+
+static void
+count_record (GVariant *record,
+              gpointer  user_data)
+{
+  int *n_records = user_data;
+  gint64 last_seen;
+
+  g_variant_get (record, "(&s&sdx)", NULL, NULL, NULL, &last_seen);
+  if (last_seen != *n_records)
+    g_error ("record %d replayed out of order", *n_records);
+
+  (*n_records)++;
+}
+
+static void
+append_record (GByteArray *log,
+               int         i)
+{
+  g_autoptr(GVariant) record = NULL;
+  g_autofree char *id = NULL;
+
+  /* IDs of varying length, so records need all amounts of padding */
+  id = g_strnfill (i % 11 + 1, 'a');
+  record = g_variant_ref_sink (g_variant_new (RECORD_TYPE, "", id, (gdouble) i, (gint64) i));
+  shell_usage_log_append_record (log, record);
+}
+
+static gsize
+replay (GByteArray *log,
+        gsize       length,
+        int        *n_records)
+{
+  /* A copy of just the part of the log kept, so reading past it shows
+   * up under valgrind or ASan.
+   */
+  g_autofree guint8 *contents = g_memdup (log->data, length);
+
+  *n_records = 0;
+  return shell_usage_log_replay (contents, length, GENERATION,
+                                 G_VARIANT_TYPE (RECORD_TYPE),
+                                 count_record, n_records);
+}
+
+int
+main (int argc, char **argv)
+{
+  g_autoptr(GByteArray) log = g_byte_array_new ();
+  ShellUsageLogHeader header;
+  gsize ends[N_RECORDS + 1];
+  gsize length;
+  int n_records, i;
+
+  shell_usage_log_header_init (&header, GENERATION);
+  g_byte_array_append (log, (guint8 *) &header, sizeof (header));
+
+  ends[0] = log->len;
+  for (i = 0; i < N_RECORDS; i++)
+    {
+      append_record (log, i);
+      ends[i + 1] = log->len;
+    }
+
+  if (replay (log, log->len, &n_records) != log->len || n_records != N_RECORDS)
+    g_error ("the whole log did not replay");
+
+  for (length = 0; length <= log->len; length++)
+    {
+      gsize kept = replay (log, length, &n_records);
+      int expected = 0;
+
+      if (length < sizeof (header))
+        {
+          if (kept != 0 || n_records != 0)
+            g_error ("a log cut in its header was used");
+          continue;
+        }
+
+      while (expected < N_RECORDS && ends[expected + 1] <= length)
+        expected++;
+
+      if (n_records != expected)
+        g_error ("log cut at %" G_GSIZE_FORMAT ": replayed %d records instead of %d",
+                 length, n_records, expected);
+      if (kept != ends[expected])
+        g_error ("log cut at %" G_GSIZE_FORMAT ": kept %" G_GSIZE_FORMAT " bytes instead of %" G_GSIZE_FORMAT,
+                 length, kept, ends[expected]);
+      if (kept % 8 != 0)
+        g_error ("log cut at %" G_GSIZE_FORMAT ": kept an unaligned size", length);
+    }
+
+  /* What happens after a crash: the log is truncated to what was kept
+   * and appended to. Records cut in half in the middle of the log must
+   * not hide the ones after.
+   */
+  for (i = 0; i < N_RECORDS; i++)
+    {
+      g_autoptr(GByteArray) resumed = g_byte_array_new ();
+      gsize cut = ends[i + 1] - 1;
+
+      g_byte_array_append (resumed, log->data, replay (log, cut, &n_records));
+      append_record (resumed, i);
+
+      if (replay (resumed, resumed->len, &n_records) != resumed->len ||
+          n_records != i + 1)
+        g_error ("record appended after a cut at %" G_GSIZE_FORMAT " was lost", cut);
+    }
+
+  header.generation = GENERATION + 1;
+  memcpy (log->data, &header, sizeof (header));
+  if (replay (log, log->len, &n_records) != 0 || n_records != 0)
+    g_error ("a log from another generation was used");
+
+  g_print ("usage log: replayed %u cuts\n", log->len + 1);
+
+  return 0;
+}